@@ -1,338 +1,9802 @@
-// ecommerce_system.cpp
-// Compile: g++ -std=c++17 ecommerce_system.cpp -o ecommerce_system
-
-#include <bits/stdc++.h>
-using namespace std;
-using uid_t = unsigned long long;
-
-// -------------------------
-// Interface: IDiscount
-// -------------------------
-struct IDiscount {
-    virtual double applyDiscount(double price) const = 0;
-    virtual ~IDiscount() = default;
-};
-
-// -------------------------
-// Product base class
-// -------------------------
-class Product {
-protected:
-    uid_t id;
-    string name;
-    double price;
-    string sku;
-public:
-    Product(uid_t id, string name, double price, string sku) : id(id), name(move(name)), price(price), sku(move(sku)) {}
-
-    virtual ~Product() = default;
-
-    uid_t getId() const { return id; }
-    const string& getName() const { return name; }
-    double getBasePrice() const { return price; }
-    const string& getSku() const { return sku; }
-
-    // virtual hook for final price (after product-level rules)
-    virtual double finalPrice() const { return price; }
-
-    virtual string getType() const { return "Product"; }
-
-    virtual string toString() const {
-        ostringstream oss;
-        oss << "[" << getType() << "] " << name << " (SKU:" << sku << ") : " << fixed << setprecision(2) << finalPrice();
-        return oss.str();
-    }
-
-    // allow printing with <<
-    friend ostream& operator<<(ostream& os, const Product& p) {
-        os << p.toString();
-        return os;
-    }
-};
-
-// -------------------------
-// Specialized products
-// -------------------------
-class Electronics : public Product, public IDiscount {
-    int warranty_months;
-public:
-    Electronics(uid_t id, string name, double price, string sku, int warranty_months) : Product(id, move(name), price, move(sku)), warranty_months(warranty_months) {}
-
-    string getType() const override { return "Electronics"; }
-
-    // Electronics get a flat promotional 10% discount
-    double applyDiscount(double price) const override {
-        return price * 0.90;
-    }
-
-    double finalPrice() const override {
-        return applyDiscount(price);
-    }
-};
-
-class Clothing : public Product, public IDiscount {
-    string size;
-    bool on_clearance;
-public:
-    Clothing(uid_t id, string name, double price, string sku, string size, bool clearance=false) : Product(id, move(name), price, move(sku)), size(move(size)), on_clearance(clearance) {}
-
-    string getType() const override { return "Clothing"; }
-
-    // Clothing clearance: 30% off; otherwise 5% off
-    double applyDiscount(double price) const override {
-        if (on_clearance) return price * 0.70;
-        return price * 0.95;
-    }
-
-    double finalPrice() const override {
-        return applyDiscount(price);
-    }
-
-    string toString() const override {
-        ostringstream oss;
-        oss << "[" << getType() << "] " << name << " (Size:" << size
-            << ", SKU:" << sku << ") : " << fixed << setprecision(2) << finalPrice();
-        return oss.str();
-    }
-};
-
-class Grocery : public Product {
-    string expiry_date;
-public:
-    Grocery(uid_t id, string name, double price, string sku, string expiry) : Product(id, move(name), price, move(sku)), expiry_date(move(expiry)) {}
-
-    string getType() const override { return "Grocery"; }
-
-    string toString() const override {
-        ostringstream oss;
-        oss << "[" << getType() << "] " << name << " (exp:" << expiry_date << ", SKU:" << sku << ") : " << fixed << setprecision(2) << finalPrice();
-        return oss.str();
-    }
-};
-
-// -------------------------
-// Template: GenericCatalog<T>
-// -------------------------
-template<typename T>
-class GenericCatalog {
-    vector<shared_ptr<T>> items;
-public:
-    void add(shared_ptr<T> item) { items.push_back(move(item)); }
-    const vector<shared_ptr<T>>& getItems() const { return items; }
-    size_t size() const { return items.size(); }
-};
-
-// -------------------------
-// ShoppingCart
-// -------------------------
-class ShoppingCart {
-    // map product id -> pair(product_ptr, qty)
-    unordered_map<uid_t, pair<shared_ptr<Product>, size_t>> items;
-public:
-    ShoppingCart() = default;
-
-    void addProduct(shared_ptr<Product> p, size_t qty = 1) {
-        if (!p || qty == 0) return;
-        auto it = items.find(p->getId());
-        if (it == items.end()) items.emplace(p->getId(), make_pair(p, qty));
-        else it->second.second += qty;
-    }
-
-    void removeProduct(uid_t id, size_t qty = 1) {
-        auto it = items.find(id);
-        if (it == items.end()) return;
-        if (qty >= it->second.second) items.erase(it);
-        else it->second.second -= qty;
-    }
-
-    ShoppingCart& operator+=(shared_ptr<Product> p) {
-        addProduct(move(p), 1);
-        return *this;
-    }
-
-    friend ShoppingCart operator+(ShoppingCart cart, shared_ptr<Product> p) {
-        cart.addProduct(move(p), 1);
-        return cart;
-    }
-
-    double total() const {
-        double sum = 0.0;
-        for (const auto &kv : items) {
-            const auto &p = kv.second.first;
-            size_t qty = kv.second.second;
-            if (auto disc = dynamic_cast<const IDiscount*>(p.get())) {
-                sum += disc->applyDiscount(p->getBasePrice()) * qty;
-            } else {
-                sum += p->getBasePrice() * qty;
-            }
-        }
-        return sum;
-    }
-
-    bool empty() const { return items.empty(); }
-
-    string toString() const {
-        ostringstream oss;
-        oss << "ShoppingCart:\n";
-        for (const auto &kv : items) {
-            const auto &p = kv.second.first;
-            size_t qty = kv.second.second;
-            oss << "  x" << qty << " " << p->toString() << "\n";
-        }
-        oss << "Total: " << fixed << setprecision(2) << total();
-        return oss.str();
-    }
-
-    friend ostream& operator<<(ostream& os, const ShoppingCart& c) {
-        os << c.toString();
-        return os;
-    }
-
-    unordered_map<uid_t, pair<shared_ptr<Product>, size_t>> itemsSnapshot() const {
-        return items;
-    }
-
-    void clear() { items.clear(); }
-};
-
-// -------------------------
-// Order
-// -------------------------
-enum class OrderStatus { Created, Paid, Shipped, Cancelled };
-
-class Order {
-    static atomic<uid_t> nextOrderId;
-    uid_t order_id;
-    unordered_map<uid_t, pair<shared_ptr<Product>, size_t>> items;
-    OrderStatus status;
-    time_t created_at;
-public:
-    explicit Order(const ShoppingCart& cart) : order_id(++nextOrderId), items(cart.itemsSnapshot()), status(OrderStatus::Created), created_at(time(nullptr)){}
-
-    uid_t getId() const { return order_id; }
-
-    double total() const {
-        double sum = 0.0;
-        for (const auto &kv : items) {
-            auto p = kv.second.first;
-            size_t qty = kv.second.second;
-            if (auto disc = dynamic_cast<const IDiscount*>(p.get())) {
-                sum += disc->applyDiscount(p->getBasePrice()) * qty;
-            } else {
-                sum += p->getBasePrice() * qty;
-            }
-        }
-        return sum;
-    }
-
-    void pay() { status = OrderStatus::Paid; }
-    void ship() { status = OrderStatus::Shipped; }
-    void cancel() { status = OrderStatus::Cancelled; }
-
-    string statusString() const {
-        switch (status) {
-            case OrderStatus::Created: return "Created";
-            case OrderStatus::Paid: return "Paid";
-            case OrderStatus::Shipped: return "Shipped";
-            case OrderStatus::Cancelled: return "Cancelled";
-        }
-        return "Unknown";
-    }
-
-    string toString() const {
-        ostringstream oss;
-        oss << "Order#" << order_id << " (" << statusString() << ")\n";
-        for (const auto &kv : items) {
-            auto p = kv.second.first;
-            size_t qty = kv.second.second;
-            oss << "  x" << qty << " " << p->toString() << "\n";
-        }
-        oss << "Order Total: " << fixed << setprecision(2) << total();
-        return oss.str();
-    }
-
-    friend ostream& operator<<(ostream& os, const Order& o) {
-        os << o.toString();
-        return os;
-    }
-};
-
-atomic<uid_t> Order::nextOrderId{0};
-
-// -------------------------
-// Demo / Tests (main)
-// -------------------------
-int main() {
-
-    // --- 1. Creating objects ---
-    auto e1 = make_shared<Electronics>(1, "Smartphone", 699.99, "ELEC-100", 12);
-    auto c1 = make_shared<Clothing>(2, "Leather Jacket", 250.00, "CLOTH-200", "L", false);
-    auto g1 = make_shared<Grocery>(3, "Organic Milk", 3.49, "GROC-300", "2025-12-01");
-
-    cout << *e1 << "\n";
-    cout << *c1 << "\n";
-    cout << *g1 << "\n\n";
-
-    // --- 2. Inheritance / Overridden methods ---
-    cout << "Base price of Smartphone: " << e1->getBasePrice()
-         << " | Final price (after discount): " << e1->finalPrice() << "\n";
-    cout << "Base price of Jacket: " << c1->getBasePrice()
-         << " | Final price (after discount): " << c1->finalPrice() << "\n\n";
-
-    // --- 3. Operator overloading (+= and +) ---
-    ShoppingCart cart;
-    cart += e1;   // using operator+=
-    cart = cart + c1; // using operator+
-    cart += g1;
-    cout << cart << "\n\n";
-
-    // --- 4. Interface & polymorphism ---
-    vector<shared_ptr<Product>> products = {e1, c1, g1};
-    for (auto &p : products) {
-        cout << p->getName() << " -> Final Price: ";
-        if (auto d = dynamic_cast<IDiscount*>(p.get())) {
-            cout << d->applyDiscount(p->getBasePrice());
-        } else {
-            cout << p->getBasePrice();
-        }
-        cout << "\n";
-    }
-    cout << "\n";
-
-    // --- 5. Template Class (GenericCatalog) ---
-    GenericCatalog<Product> catalog;
-    catalog.add(e1);
-    catalog.add(c1);
-    catalog.add(g1);
-    cout << "Catalog contains " << catalog.size() << " items:\n";
-    for (auto &it : catalog.getItems()) {
-        cout << "  " << *it << "\n";
-    }
-    cout << "\n";
-
-    // --- 6. Operations (cart, order, errors) ---
-    cout << "Cart total: " << cart.total() << "\n";
-
-    // Create an order from cart
-    Order order(cart);
-    cout << "Order created:\n" << order << "\n";
-
-    order.pay();
-    cout << "After payment:\n" << order << "\n";
-
-    // Remove items from cart
-    cout << "Removing product ID=2 (Jacket) from cart...\n";
-    cart.removeProduct(2, 1);
-    cout << cart << "\n";
-
-    // Try invalid operation
-    cout << "Attempting to remove invalid product ID=999...\n";
-    cart.removeProduct(999, 1); // should handle gracefully
-    cout << "Cart still contains:\n" << cart << "\n";
-
-    // Clear cart
-    cart.clear();
-    cout << "Cart cleared. Empty? " << boolalpha << cart.empty() << "\n";
-
-    return 0;
-}
+// ecommerce_system.cpp
+// Compile: g++ -std=c++20 -O2 -pthread ecommerce_system.cpp -o ecommerce_system
+//          (-std=c++17 also works; the coroutine workflow is then left out)
+// Serve HTTP (Linux): ./ecommerce_system --serve 8080 [--threads N]
+// Shared catalog (Linux): ./ecommerce_system --publish-catalog NAME, then --serve 8080 --shared-catalog NAME
+// Benchmarks: g++ -std=c++20 -O2 -pthread -DECOMMERCE_BENCH ecommerce_system.cpp -o ecommerce_bench
+
+#include <bits/stdc++.h>
+#if __has_include(<execinfo.h>)
+#include <execinfo.h>
+#endif
+#ifdef __linux__
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+using namespace std;
+using uid64_t = unsigned long long;
+
+// -------------------------
+// Metrics: per-thread counters and latency histograms
+// -------------------------
+// Each thread owns a shard written with relaxed stores only (single writer),
+// so a counter is one uncontended add. Latencies are kept in raw TSC ticks in
+// log-linear buckets (3 significant bits, HDR-style) and converted to
+// nanoseconds when a snapshot is taken; only one call in kTimerSampleEvery is
+// timed, so the timestamp reads are amortized (counters stay exact). Build with
+// -DECOMMERCE_NO_METRICS to compile all recording out.
+enum class MetricCounter : uint8_t { CartAdd, CartRemove, CartTotal, OrderCreated, OrderPaid, OrderShipped, OrderCancelled, Count };
+enum class MetricTimer : uint8_t { CartAdd, CartRemove, CartTotal, OrderCreate, Count };
+
+#ifndef ECOMMERCE_NO_METRICS
+class Metrics {
+public:
+    static constexpr size_t kBuckets = 512;
+    static constexpr uint32_t kTimerSampleEvery = 8;
+
+    static uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __builtin_ia32_rdtsc();
+#else
+        return uint64_t(chrono::steady_clock::now().time_since_epoch().count());
+#endif
+    }
+
+    static size_t bucketOf(uint64_t v) {
+        if (v < 8) return size_t(v);
+        unsigned msb = 63 - unsigned(__builtin_clzll(v));
+        return size_t(msb - 2) * 8 + size_t((v >> (msb - 3)) & 7);
+    }
+
+    static uint64_t bucketLowerBound(size_t b) {
+        if (b < 8) return b;
+        unsigned msb = unsigned(b / 8) + 2;
+        return (uint64_t(8 + b % 8)) << (msb - 3);
+    }
+
+private:
+    struct Histogram {
+        atomic<uint64_t> buckets[kBuckets] = {};
+        atomic<uint64_t> count{0}, sum{0};
+    };
+    struct Shard {
+        atomic<uint64_t> counters[size_t(MetricCounter::Count)] = {};
+        Histogram timers[size_t(MetricTimer::Count)];
+    };
+
+    // Shards are never freed: a thread's counts must survive the thread.
+    mutex registryMutex;
+    vector<unique_ptr<Shard>> shards;
+
+    static Metrics& instance() {
+        static Metrics m;
+        return m;
+    }
+
+    static Shard* registerShard() {
+        auto &m = instance();
+        lock_guard<mutex> lock(m.registryMutex);
+        m.shards.push_back(make_unique<Shard>());
+        return m.shards.back().get();
+    }
+
+    static Shard& local() {
+        static thread_local Shard* mine = nullptr;
+        if (__builtin_expect(!mine, 0)) mine = registerShard();
+        return *mine;
+    }
+
+    static void bump(atomic<uint64_t>& a, uint64_t by) { a.store(a.load(memory_order_relaxed) + by, memory_order_relaxed); }
+
+    // TSC ticks per nanosecond, measured once against steady_clock.
+    static double ticksPerNano() {
+        static const double rate = [] {
+            auto t0 = chrono::steady_clock::now();
+            uint64_t c0 = ticks();
+            this_thread::sleep_for(chrono::milliseconds(20));
+            uint64_t c1 = ticks();
+            double ns = chrono::duration<double, nano>(chrono::steady_clock::now() - t0).count();
+            return max(1e-9, double(c1 - c0) / ns);
+        }();
+        return rate;
+    }
+
+public:
+    static void count(MetricCounter c, uint64_t by = 1) { bump(local().counters[size_t(c)], by); }
+
+    // One countdown per timer, so each op is sampled 1 in kTimerSampleEvery
+    // regardless of how calls to different ops interleave on the thread.
+    static bool sampleTimer(MetricTimer t) {
+        static thread_local uint32_t countdown[size_t(MetricTimer::Count)] = {};
+        uint32_t &left = countdown[size_t(t)];
+        if (left) { --left; return false; }
+        left = kTimerSampleEvery - 1;
+        return true;
+    }
+
+    static void record(MetricTimer t, uint64_t elapsedTicks) {
+        Histogram &h = local().timers[size_t(t)];
+        bump(h.buckets[bucketOf(elapsedTicks)], 1);
+        bump(h.count, 1);
+        bump(h.sum, elapsedTicks);
+    }
+
+    // Prometheus-style text exposition of all shards summed.
+    static string snapshot() {
+        static const char* counterNames[] = {"cart_add", "cart_remove", "cart_total", "order_created", "order_paid", "order_shipped", "order_cancelled"};
+        static const char* timerNames[] = {"cart_add", "cart_remove", "cart_total", "order_create"};
+        uint64_t counters[size_t(MetricCounter::Count)] = {};
+        vector<array<uint64_t, kBuckets>> buckets(size_t(MetricTimer::Count));
+        uint64_t counts[size_t(MetricTimer::Count)] = {}, sums[size_t(MetricTimer::Count)] = {};
+        {
+            auto &m = instance();
+            lock_guard<mutex> lock(m.registryMutex);
+            for (const auto &s : m.shards) {
+                for (size_t c = 0; c < size_t(MetricCounter::Count); ++c) counters[c] += s->counters[c].load(memory_order_relaxed);
+                for (size_t t = 0; t < size_t(MetricTimer::Count); ++t) {
+                    for (size_t b = 0; b < kBuckets; ++b) buckets[t][b] += s->timers[t].buckets[b].load(memory_order_relaxed);
+                    counts[t] += s->timers[t].count.load(memory_order_relaxed);
+                    sums[t] += s->timers[t].sum.load(memory_order_relaxed);
+                }
+            }
+        }
+        double perNano = ticksPerNano();
+        ostringstream oss;
+        oss << "# TYPE ecommerce_events_total counter\n";
+        for (size_t c = 0; c < size_t(MetricCounter::Count); ++c)
+            oss << "ecommerce_events_total{event=\"" << counterNames[c] << "\"} " << counters[c] << "\n";
+        oss << "# HELP ecommerce_latency_ns Latency of 1 in " << kTimerSampleEvery << " calls\n"
+            << "# TYPE ecommerce_latency_ns summary\n" << fixed << setprecision(1);
+        for (size_t t = 0; t < size_t(MetricTimer::Count); ++t) {
+            for (const char* quantile : {"0.5", "0.9", "0.99", "0.999"}) {
+                double q = atof(quantile);
+                uint64_t target = uint64_t(ceil(q * double(counts[t]))), seen = 0;
+                size_t b = 0;
+                while (b + 1 < kBuckets && (seen += buckets[t][b]) < target) ++b;
+                oss << "ecommerce_latency_ns{op=\"" << timerNames[t] << "\",quantile=\"" << quantile << "\"} "
+                    << (counts[t] ? double(bucketLowerBound(b)) / perNano : 0.0) << "\n";
+            }
+            oss << "ecommerce_latency_ns_sum{op=\"" << timerNames[t] << "\"} " << double(sums[t]) / perNano << "\n";
+            oss << "ecommerce_latency_ns_count{op=\"" << timerNames[t] << "\"} " << counts[t] << "\n";
+        }
+        return oss.str();
+    }
+};
+
+class MetricScope {
+    MetricTimer timer;
+    uint64_t start;
+public:
+    explicit MetricScope(MetricTimer timer) : timer(timer), start(Metrics::sampleTimer(timer) ? Metrics::ticks() : 0) {}
+    ~MetricScope() { if (start) Metrics::record(timer, Metrics::ticks() - start); }
+};
+
+#define ECOM_METRIC_COUNT(c) Metrics::count(MetricCounter::c)
+#define ECOM_METRIC_TIME(t) MetricScope ecomMetricScope_##t(MetricTimer::t)
+#else
+struct Metrics {
+    static string snapshot() { return "# metrics disabled (ECOMMERCE_NO_METRICS)\n"; }
+};
+#define ECOM_METRIC_COUNT(c) ((void)0)
+#define ECOM_METRIC_TIME(t) ((void)0)
+#endif
+
+// -------------------------
+// Allocation accounting per subsystem
+// -------------------------
+// Containers of the catalog, carts and orders allocate through a
+// TrackingResource (a pmr::memory_resource) that counts live bytes, peak and
+// allocations before forwarding upstream. setCallSiteTracking(true) also
+// captures a short backtrace per allocation so report() can list the top
+// allocation sites (link with -rdynamic for symbol names); it is meant for
+// diagnosis, not for production traffic.
+enum class Subsystem : uint8_t { Catalog, Cart, Order, Count };
+
+class TrackingResource : public pmr::memory_resource {
+public:
+    struct Stats { int64_t liveBytes, peakBytes; uint64_t allocations, deallocations; };
+
+private:
+    const char* label;
+    pmr::memory_resource* upstream;
+    atomic<int64_t> live{0}, peak{0};
+    atomic<uint64_t> allocs{0}, frees{0};
+
+    struct Site { uint64_t count = 0, bytes = 0; vector<void*> frames; };
+    static constexpr int kSiteFrames = 6;
+    mutable mutex sitesMutex;
+    unordered_map<uint64_t, Site> sites;
+
+    static atomic<bool>& siteTracking() {
+        static atomic<bool> enabled{false};
+        return enabled;
+    }
+
+    void recordSite(size_t bytes) {
+#if __has_include(<execinfo.h>)
+        void* frames[kSiteFrames + 2];
+        int n = backtrace(frames, kSiteFrames + 2);
+        uint64_t key = 1469598103934665603ull;
+        for (int i = 2; i < n; ++i) key = (key ^ uint64_t(uintptr_t(frames[i]))) * 1099511628211ull;
+        lock_guard<mutex> lock(sitesMutex);
+        Site &site = sites[key];
+        if (site.frames.empty()) site.frames.assign(frames + min(n, 2), frames + n);
+        ++site.count;
+        site.bytes += bytes;
+#else
+        (void)bytes;
+#endif
+    }
+
+protected:
+    void* do_allocate(size_t bytes, size_t align) override {
+        void* p = upstream->allocate(bytes, align);
+        int64_t now = live.fetch_add(int64_t(bytes), memory_order_relaxed) + int64_t(bytes);
+        int64_t seen = peak.load(memory_order_relaxed);
+        while (now > seen && !peak.compare_exchange_weak(seen, now, memory_order_relaxed)) {}
+        allocs.fetch_add(1, memory_order_relaxed);
+        if (siteTracking().load(memory_order_relaxed)) recordSite(bytes);
+        return p;
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t align) override {
+        upstream->deallocate(p, bytes, align);
+        live.fetch_sub(int64_t(bytes), memory_order_relaxed);
+        frees.fetch_add(1, memory_order_relaxed);
+    }
+
+    bool do_is_equal(const pmr::memory_resource& other) const noexcept override { return this == &other; }
+
+public:
+    explicit TrackingResource(const char* label, pmr::memory_resource* upstream = pmr::new_delete_resource())
+        : label(label), upstream(upstream) {}
+
+    const char* name() const { return label; }
+
+    Stats stats() const {
+        return {live.load(memory_order_relaxed), peak.load(memory_order_relaxed),
+                allocs.load(memory_order_relaxed), frees.load(memory_order_relaxed)};
+    }
+
+    static void setCallSiteTracking(bool on) { siteTracking().store(on, memory_order_relaxed); }
+
+    // Top allocation sites by count, symbolized when the platform allows it.
+    string topSites(size_t limit) const {
+        vector<const Site*> ranked;
+        lock_guard<mutex> lock(sitesMutex);
+        for (const auto &kv : sites) ranked.push_back(&kv.second);
+        sort(ranked.begin(), ranked.end(), [](const Site* a, const Site* b) { return a->count > b->count; });
+        ostringstream oss;
+        for (size_t i = 0; i < min(limit, ranked.size()); ++i) {
+            oss << "    " << ranked[i]->count << " allocs, " << ranked[i]->bytes << " bytes\n";
+#if __has_include(<execinfo.h>)
+            char** symbols = backtrace_symbols(ranked[i]->frames.data(), int(ranked[i]->frames.size()));
+            for (size_t f = 0; symbols && f < ranked[i]->frames.size(); ++f) oss << "      " << symbols[f] << "\n";
+            free(symbols);
+#endif
+        }
+        return oss.str();
+    }
+};
+
+class AllocationTracker {
+public:
+    static TrackingResource& resource(Subsystem s) {
+        static TrackingResource resources[] = {TrackingResource("catalog"), TrackingResource("cart"), TrackingResource("order")};
+        return resources[size_t(s)];
+    }
+
+    static string report(size_t topSites = 0) {
+        ostringstream oss;
+        oss << "Allocations by subsystem:\n";
+        for (size_t s = 0; s < size_t(Subsystem::Count); ++s) {
+            auto &r = resource(Subsystem(s));
+            auto st = r.stats();
+            oss << "  " << left << setw(8) << r.name() << right << " live=" << st.liveBytes << "B peak=" << st.peakBytes
+                << "B allocs=" << st.allocations << " frees=" << st.deallocations << "\n";
+            if (topSites) oss << r.topSites(topSites);
+        }
+        return oss.str();
+    }
+};
+
+// -------------------------
+// Interface: IDiscount
+// -------------------------
+struct IDiscount {
+    virtual double applyDiscount(double price) const = 0;
+    virtual ~IDiscount() = default;
+};
+
+// -------------------------
+// Text helpers (stream-free formatting into any pmr::string)
+// -------------------------
+inline void appendFixed2(pmr::string& out, double value) {
+    char buf[64];
+    int n = snprintf(buf, sizeof buf, "%.2f", value);  // same digits as fixed << setprecision(2)
+    out.append(buf, size_t(max(0, min(n, int(sizeof buf) - 1))));
+}
+
+inline void appendUnsigned(pmr::string& out, unsigned long long value) {
+    char buf[24];
+    auto res = to_chars(buf, buf + sizeof buf, value);
+    out.append(buf, size_t(res.ptr - buf));
+}
+
+// -------------------------
+// Currencies
+// -------------------------
+enum class Currency : uint8_t { USD, EUR, GBP, JPY, CHF, CAD, AUD, CNY, INR, BRL, MXN, SEK, Count };
+constexpr size_t kCurrencyCount = size_t(Currency::Count);
+
+struct CurrencyInfo { const char* code; int minorDigits; };
+
+inline const CurrencyInfo& currencyInfo(Currency c) {
+    static const CurrencyInfo table[kCurrencyCount] = {
+        {"USD", 2}, {"EUR", 2}, {"GBP", 2}, {"JPY", 0}, {"CHF", 2}, {"CAD", 2},
+        {"AUD", 2}, {"CNY", 2}, {"INR", 2}, {"BRL", 2}, {"MXN", 2}, {"SEK", 2}};
+    return table[size_t(c) < kCurrencyCount ? size_t(c) : 0];
+}
+
+inline optional<Currency> parseCurrency(string_view code) {
+    for (size_t i = 0; i < kCurrencyCount; ++i)
+        if (code == currencyInfo(Currency(i)).code) return Currency(i);
+    return nullopt;
+}
+
+struct Money {
+    double amount = 0;
+    Currency currency = Currency::USD;
+
+    friend ostream& operator<<(ostream& os, const Money& m) {
+        const CurrencyInfo &info = currencyInfo(m.currency);
+        char buf[64];
+        snprintf(buf, sizeof buf, "%.*f %s", info.minorDigits, m.amount, info.code);
+        return os << buf;
+    }
+};
+
+// Shipping weight and outer dimensions of one unit; zero when unknown.
+struct Parcel {
+    float weightKg = 0, lengthCm = 0, widthCm = 0, heightCm = 0;
+
+    bool empty() const { return weightKg == 0 && lengthCm == 0 && widthCm == 0 && heightCm == 0; }
+};
+
+// -------------------------
+// Price publication
+// -------------------------
+// Price changes take effect by epoch. A change is staged on the product
+// together with the epoch it belongs to and becomes visible when that epoch is
+// published, so a repricing run over millions of products switches over in
+// one store. Readers never lock; a reader that races with a writer on the same
+// product retries its load. Writers hold writer() and publish before letting
+// go, so at most one epoch is ever staged and unpublished.
+struct PriceChange {
+    uid64_t productId;
+    double oldPrice, newPrice;  // base prices
+};
+
+class PricePublisher {
+    using Listener = function<void(const PriceChange* changes, size_t n, uint64_t epoch)>;
+    static atomic<uint64_t> current;
+
+    static vector<pair<string, Listener>>& listeners() {
+        static vector<pair<string, Listener>> all;
+        return all;
+    }
+
+public:
+    static uint64_t published() { return current.load(memory_order_acquire); }
+    static mutex& writer() {
+        static mutex m;
+        return m;
+    }
+
+    // Listeners run on the publishing thread, after the switch, with writer()
+    // held (e.g. price history, re-exporting a shared catalog).
+    static void subscribe(string name, Listener fn) {
+        lock_guard<mutex> lock(writer());
+        listeners().emplace_back(move(name), move(fn));
+    }
+    static void unsubscribe(const string& name) {
+        lock_guard<mutex> lock(writer());
+        auto &all = listeners();
+        all.erase(remove_if(all.begin(), all.end(), [&](const auto& l) { return l.first == name; }), all.end());
+    }
+
+    // Caller holds writer(); `epoch` is published() + 1.
+    static void publishLocked(uint64_t epoch, const PriceChange* changes, size_t n) {
+        current.store(epoch, memory_order_release);
+        if (n)
+            for (const auto &l : listeners()) l.second(changes, n, epoch);
+    }
+};
+
+atomic<uint64_t> PricePublisher::current{0};
+
+// -------------------------
+// Product base class
+// -------------------------
+class Product {
+    atomic<double> stagedPrice{0};
+    atomic<uint64_t> stagedEpoch{0};  // 0 = nothing staged
+    // The parcel is a sequence lock: setParcel makes parcelSeq odd, stores
+    // the fields and makes it even again; readers retry a torn copy.
+    atomic<uint32_t> parcelSeq{0};
+    array<atomic<float>, 4> parcelFields{};  // weight, length, width, height
+
+protected:
+    uid64_t id;
+    string name;
+    atomic<double> price;  // unless a published staged price overrides it
+    string sku;
+    Currency currency;  // of price
+
+    // "12.34", with the currency code after it unless the price is in USD
+    void appendPrice(pmr::string& out, double price) const {
+        appendFixed2(out, price);
+        if (currency != Currency::USD) {
+            out += ' ';
+            out += currencyInfo(currency).code;
+        }
+    }
+public:
+    Product(uid64_t id, string name, double price, string sku, Currency currency = Currency::USD)
+        : id(id), name(move(name)), price(price), sku(move(sku)), currency(currency) {}
+
+    virtual ~Product() = default;
+
+    uid64_t getId() const { return id; }
+    const string& getName() const { return name; }
+    double getBasePrice() const { return getBasePrice(PricePublisher::published()); }
+
+    // The base price as of epoch `asOf`, a value of published() taken by the
+    // caller. Exact as long as published() still equals `asOf`, so a reader
+    // summing many products pins one epoch and retries if it moved.
+    double getBasePrice(uint64_t asOf) const {
+        for (;;) {
+            uint64_t epoch = stagedEpoch.load(memory_order_acquire);
+            if (!epoch || epoch > asOf) return price.load(memory_order_acquire);
+            double staged = stagedPrice.load(memory_order_acquire);
+            if (stagedEpoch.load(memory_order_acquire) == epoch) return staged;
+        }
+    }
+
+    // Stages `newPrice` for `epoch`; the caller holds PricePublisher::writer()
+    // and publishes `epoch` afterwards. Returns the price being replaced.
+    double stagePrice(double newPrice, uint64_t epoch) {
+        double old = getBasePrice();
+        uint64_t previous = stagedEpoch.load(memory_order_relaxed);
+        if (previous && previous != epoch) {
+            // the previous change is published: fold it into price first
+            price.store(stagedPrice.load(memory_order_relaxed), memory_order_release);
+            stagedEpoch.store(0, memory_order_release);
+        }
+        stagedPrice.store(newPrice, memory_order_release);
+        stagedEpoch.store(epoch, memory_order_release);
+        return old;
+    }
+
+    // A one-product repricing in its own epoch.
+    void setPrice(double newPrice) {
+        if (!isfinite(newPrice) || newPrice < 0) throw invalid_argument("price must be finite and >= 0");
+        lock_guard<mutex> lock(PricePublisher::writer());
+        uint64_t epoch = PricePublisher::published() + 1;
+        PriceChange change{id, stagePrice(newPrice, epoch), newPrice};
+        PricePublisher::publishLocked(epoch, &change, 1);
+    }
+    const string& getSku() const { return sku; }
+    Currency getCurrency() const { return currency; }
+    Parcel getParcel() const {
+        for (;;) {
+            uint32_t seq = parcelSeq.load(memory_order_acquire);
+            if (seq & 1) continue;
+            Parcel p{parcelFields[0].load(memory_order_relaxed), parcelFields[1].load(memory_order_relaxed),
+                     parcelFields[2].load(memory_order_relaxed), parcelFields[3].load(memory_order_relaxed)};
+            atomic_thread_fence(memory_order_acquire);
+            if (parcelSeq.load(memory_order_relaxed) == seq) return p;
+        }
+    }
+
+    // Safe against concurrent readers and other setParcel calls.
+    void setParcel(const Parcel& p) {
+        for (float v : {p.weightKg, p.lengthCm, p.widthCm, p.heightCm})
+            if (!isfinite(v) || v < 0) throw invalid_argument("parcel weight and dimensions must be finite and >= 0");
+        uint32_t seq = parcelSeq.load(memory_order_relaxed);
+        for (;;) {
+            if (seq & 1) seq = parcelSeq.load(memory_order_relaxed);
+            else if (parcelSeq.compare_exchange_weak(seq, seq + 1, memory_order_acquire, memory_order_relaxed)) break;
+        }
+        atomic_thread_fence(memory_order_release);
+        parcelFields[0].store(p.weightKg, memory_order_relaxed);
+        parcelFields[1].store(p.lengthCm, memory_order_relaxed);
+        parcelFields[2].store(p.widthCm, memory_order_relaxed);
+        parcelFields[3].store(p.heightCm, memory_order_relaxed);
+        parcelSeq.store(seq + 2, memory_order_release);
+    }
+
+    // virtual hook for final price (after product-level rules)
+    virtual double finalPrice() const { return getBasePrice(); }
+
+    virtual string getType() const { return "Product"; }
+
+    // Appends the text of toString().
+    void appendTo(pmr::string& out) const { appendTo(out, finalPrice()); }
+
+    // The same text showing `price` (e.g. an order line's price at order
+    // time); subclasses override this, not toString().
+    virtual void appendTo(pmr::string& out, double price) const {
+        out += '[';
+        out += getType();
+        out += "] ";
+        out += name;
+        out += " (SKU:";
+        out += sku;
+        out += ") : ";
+        appendPrice(out, price);
+    }
+
+    virtual string toString() const {
+        pmr::string out;
+        out.reserve(96);
+        appendTo(out);
+        return string(out.data(), out.size());
+    }
+
+    // allow printing with <<
+    friend ostream& operator<<(ostream& os, const Product& p) {
+        os << p.toString();
+        return os;
+    }
+};
+
+// -------------------------
+// Specialized products
+// -------------------------
+class Electronics : public Product, public IDiscount {
+    int warranty_months;
+public:
+    Electronics(uid64_t id, string name, double price, string sku, int warranty_months, Currency currency = Currency::USD)
+        : Product(id, move(name), price, move(sku), currency), warranty_months(warranty_months) {}
+
+    int getWarrantyMonths() const { return warranty_months; }
+
+    string getType() const override { return "Electronics"; }
+
+    // Electronics get a flat promotional 10% discount
+    double applyDiscount(double price) const override {
+        return price * 0.90;
+    }
+
+    double finalPrice() const override {
+        return applyDiscount(getBasePrice());
+    }
+};
+
+class Clothing : public Product, public IDiscount {
+    string size;
+    bool on_clearance;
+public:
+    Clothing(uid64_t id, string name, double price, string sku, string size, bool clearance=false, Currency currency = Currency::USD)
+        : Product(id, move(name), price, move(sku), currency), size(move(size)), on_clearance(clearance) {}
+
+    const string& getSize() const { return size; }
+    bool isOnClearance() const { return on_clearance; }
+
+    string getType() const override { return "Clothing"; }
+
+    // Clothing clearance: 30% off; otherwise 5% off
+    double applyDiscount(double price) const override {
+        if (on_clearance) return price * 0.70;
+        return price * 0.95;
+    }
+
+    double finalPrice() const override {
+        return applyDiscount(getBasePrice());
+    }
+
+    using Product::appendTo;
+    void appendTo(pmr::string& out, double price) const override {
+        out += '[';
+        out += getType();
+        out += "] ";
+        out += name;
+        out += " (Size:";
+        out += size;
+        out += ", SKU:";
+        out += sku;
+        out += ") : ";
+        appendPrice(out, price);
+    }
+};
+
+class Grocery : public Product {
+    string expiry_date;
+public:
+    Grocery(uid64_t id, string name, double price, string sku, string expiry, Currency currency = Currency::USD)
+        : Product(id, move(name), price, move(sku), currency), expiry_date(move(expiry)) {}
+
+    const string& getExpiryDate() const { return expiry_date; }
+
+    string getType() const override { return "Grocery"; }
+
+    using Product::appendTo;
+    void appendTo(pmr::string& out, double price) const override {
+        out += '[';
+        out += getType();
+        out += "] ";
+        out += name;
+        out += " (exp:";
+        out += expiry_date;
+        out += ", SKU:";
+        out += sku;
+        out += ") : ";
+        appendPrice(out, price);
+    }
+};
+
+// Concrete type tag, for code that stores or indexes products by type.
+enum class ProductKind : uint8_t { Product, Electronics, Clothing, Grocery };
+
+inline ProductKind kindOf(const Product& p) {
+    if (dynamic_cast<const Electronics*>(&p)) return ProductKind::Electronics;
+    if (dynamic_cast<const Clothing*>(&p)) return ProductKind::Clothing;
+    if (dynamic_cast<const Grocery*>(&p)) return ProductKind::Grocery;
+    return ProductKind::Product;
+}
+
+// The getType() string of a kind.
+inline const char* kindName(ProductKind kind) {
+    switch (kind) {
+        case ProductKind::Electronics: return "Electronics";
+        case ProductKind::Clothing: return "Clothing";
+        case ProductKind::Grocery: return "Grocery";
+        default: return "Product";
+    }
+}
+
+// -------------------------
+// Template: GenericCatalog<T>
+// -------------------------
+// Backing store consulted for items a catalog does not hold in memory.
+template<typename T>
+struct ICatalogFallback {
+    virtual shared_ptr<T> findById(uid64_t id) const = 0;
+    virtual shared_ptr<T> findBySku(string_view sku) const = 0;
+    virtual ~ICatalogFallback() = default;
+};
+
+template<typename T>
+class GenericCatalog {
+    pmr::vector<shared_ptr<T>> items;
+    pmr::unordered_map<uid64_t, size_t> byId;  // id -> position in items
+    pmr::unordered_map<string_view, size_t> bySku;  // views into the items' own SKUs
+    shared_ptr<const ICatalogFallback<T>> fallback;
+public:
+    // Long-lived catalogs can pass a pool resource layered over the tracker.
+    explicit GenericCatalog(pmr::memory_resource* resource = &AllocationTracker::resource(Subsystem::Catalog)) : items(resource), byId(resource), bySku(resource) {}
+
+    pmr::memory_resource* resource() const { return items.get_allocator().resource(); }
+
+    void add(shared_ptr<T> item) {
+        if (item) {
+            byId[item->getId()] = items.size();
+            if constexpr (is_base_of_v<Product, T>) bySku[item->getSku()] = items.size();
+        }
+        items.push_back(move(item));
+    }
+
+    // Constructs the item itself through the catalog's memory resource too.
+    template<typename U, typename... Args>
+    shared_ptr<U> emplace(Args&&... args) {
+        auto item = allocate_shared<U>(pmr::polymorphic_allocator<U>(resource()), forward<Args>(args)...);
+        add(item);
+        return item;
+    }
+
+    // nullptr when the id is unknown here and to the fallback
+    shared_ptr<T> find(uid64_t id) const {
+        auto it = byId.find(id);
+        if (it != byId.end()) return items[it->second];
+        return fallback ? fallback->findById(id) : nullptr;
+    }
+
+    shared_ptr<T> findBySku(string_view sku) const {
+        auto it = bySku.find(sku);
+        if (it != bySku.end()) return items[it->second];
+        return fallback ? fallback->findBySku(sku) : nullptr;
+    }
+
+    // e.g. a ProductIndexFile over the full catalog when only hot items are loaded.
+    // find() reaches fallback items but getItems() does not, so whole-catalog
+    // passes (Repricer, PricePublisher, snapshots) cover only the held items.
+    void setFallback(shared_ptr<const ICatalogFallback<T>> store) { fallback = move(store); }
+
+    const pmr::vector<shared_ptr<T>>& getItems() const { return items; }
+    size_t size() const { return items.size(); }
+};
+
+// -------------------------
+// ShoppingCart
+// -------------------------
+// product id -> pair(product_ptr, qty)
+using LineItems = pmr::unordered_map<uid64_t, pair<shared_ptr<Product>, size_t>>;
+// product id -> unit price after discounts
+using LinePrices = pmr::unordered_map<uid64_t, double>;
+
+class ShoppingCart {
+    LineItems items;
+public:
+    // Request-scoped carts can pass a monotonic_buffer_resource; the cart must
+    // not outlive it.
+    explicit ShoppingCart(pmr::memory_resource* resource = &AllocationTracker::resource(Subsystem::Cart)) : items(resource) {}
+    // a pmr container's copy constructor would fall back to the default resource
+    ShoppingCart(const ShoppingCart& other) : items(other.items, other.items.get_allocator().resource()) {}
+    ShoppingCart(ShoppingCart&&) = default;
+    ShoppingCart& operator=(const ShoppingCart&) = default;
+    ShoppingCart& operator=(ShoppingCart&&) = default;
+
+    // A cart holds one currency, so its total is a single amount; adding a
+    // product priced in another throws invalid_argument.
+    void addProduct(shared_ptr<Product> p, size_t qty = 1) {
+        ECOM_METRIC_COUNT(CartAdd);
+        ECOM_METRIC_TIME(CartAdd);
+        if (!p || qty == 0) return;
+        if (!items.empty() && p->getCurrency() != currency())
+            throw invalid_argument(string("cart is priced in ") + currencyInfo(currency()).code + ", product " +
+                                   to_string(p->getId()) + " in " + currencyInfo(p->getCurrency()).code);
+        auto it = items.find(p->getId());
+        if (it == items.end()) items.emplace(p->getId(), make_pair(p, qty));
+        else it->second.second += qty;
+    }
+
+    void removeProduct(uid64_t id, size_t qty = 1) {
+        ECOM_METRIC_COUNT(CartRemove);
+        ECOM_METRIC_TIME(CartRemove);
+        auto it = items.find(id);
+        if (it == items.end()) return;
+        if (qty >= it->second.second) items.erase(it);
+        else it->second.second -= qty;
+    }
+
+    ShoppingCart& operator+=(shared_ptr<Product> p) {
+        addProduct(move(p), 1);
+        return *this;
+    }
+
+    friend ShoppingCart operator+(ShoppingCart cart, shared_ptr<Product> p) {
+        cart.addProduct(move(p), 1);
+        return cart;
+    }
+
+    // Unit price after discounts as of published epoch `asOf`.
+    static double unitPrice(const Product& p, uint64_t asOf) {
+        if (auto disc = dynamic_cast<const IDiscount*>(&p)) return disc->applyDiscount(p.getBasePrice(asOf));
+        return p.getBasePrice(asOf);
+    }
+
+    // Every line priced at one published epoch; a repricing that lands
+    // halfway through makes it start over.
+    double total() const {
+        ECOM_METRIC_COUNT(CartTotal);
+        ECOM_METRIC_TIME(CartTotal);
+        for (;;) {
+            uint64_t asOf = PricePublisher::published();
+            double sum = 0.0;
+            for (const auto &kv : items) sum += unitPrice(*kv.second.first, asOf) * kv.second.second;
+            if (PricePublisher::published() == asOf) return sum;
+        }
+    }
+
+    bool empty() const { return items.empty(); }
+
+    // Currency of every line; USD for an empty cart.
+    Currency currency() const { return items.empty() ? Currency::USD : items.begin()->second.first->getCurrency(); }
+
+    void appendTo(pmr::string& out) const {
+        out += "ShoppingCart:\n";
+        for (const auto &kv : items) {
+            out += "  x";
+            appendUnsigned(out, kv.second.second);
+            out += ' ';
+            kv.second.first->appendTo(out);
+            out += '\n';
+        }
+        out += "Total: ";
+        appendFixed2(out, total());
+        if (currency() != Currency::USD) {
+            out += ' ';
+            out += currencyInfo(currency()).code;
+        }
+    }
+
+    string toString() const {
+        pmr::string out;
+        appendTo(out);
+        return string(out.data(), out.size());
+    }
+
+    friend ostream& operator<<(ostream& os, const ShoppingCart& c) {
+        os << c.toString();
+        return os;
+    }
+
+    LineItems itemsSnapshot() const {
+        return items;
+    }
+
+    const LineItems& getItems() const { return items; }
+    pmr::memory_resource* resource() const { return items.get_allocator().resource(); }
+
+    void clear() { items.clear(); }
+};
+
+// -------------------------
+// KllSketch: mergeable quantile sketch
+// -------------------------
+// Levels hold samples of weight 2^level. When a level outgrows its capacity it is
+// sorted and every other sample (random offset) is promoted, so memory stays
+// O(k log n) and two sketches merge by concatenating levels and compacting.
+class KllSketch {
+    vector<vector<double>> levels;
+    size_t k;
+    uint64_t n = 0;
+    double lo = numeric_limits<double>::infinity();
+    double hi = -numeric_limits<double>::infinity();
+    uint64_t rng = 0x9E3779B97F4A7C15ull;
+
+    size_t capacity(size_t level) const {
+        size_t depth = levels.size() - 1 - level;
+        return max<size_t>(8, size_t(k * pow(2.0 / 3.0, double(depth))));
+    }
+
+    bool coin() {
+        rng ^= rng << 13; rng ^= rng >> 7; rng ^= rng << 17;
+        return rng & 1;
+    }
+
+    void compress() {
+        for (size_t h = 0; h < levels.size(); ++h) {
+            if (levels[h].size() < capacity(h)) continue;
+            if (h + 1 == levels.size()) levels.emplace_back();
+            auto &cur = levels[h];
+            sort(cur.begin(), cur.end());
+            size_t keepOdd = cur.size() % 2;  // an odd leftover stays behind
+            double leftover = keepOdd ? cur.back() : 0.0;
+            for (size_t i = coin() ? 1 : 0; i + keepOdd < cur.size(); i += 2) levels[h + 1].push_back(cur[i]);
+            cur.clear();
+            if (keepOdd) cur.push_back(leftover);
+        }
+    }
+
+public:
+    explicit KllSketch(size_t k = 200) : levels(1), k(k) {}
+
+    void add(double x) {
+        levels[0].push_back(x);
+        ++n;
+        lo = min(lo, x);
+        hi = max(hi, x);
+        if (levels[0].size() >= capacity(0)) compress();
+    }
+
+    void merge(const KllSketch& other) {
+        if (other.n == 0) return;
+        if (levels.size() < other.levels.size()) levels.resize(other.levels.size());
+        for (size_t h = 0; h < other.levels.size(); ++h)
+            levels[h].insert(levels[h].end(), other.levels[h].begin(), other.levels[h].end());
+        n += other.n;
+        lo = min(lo, other.lo);
+        hi = max(hi, other.hi);
+        compress();
+    }
+
+    uint64_t count() const { return n; }
+    double minValue() const { return lo; }
+    double maxValue() const { return hi; }
+
+    // q in [0, 1]; returns NaN for an empty sketch
+    double quantile(double q) const {
+        if (n == 0) return numeric_limits<double>::quiet_NaN();
+        if (q <= 0) return lo;
+        if (q >= 1) return hi;
+        vector<pair<double, uint64_t>> weighted;
+        for (size_t h = 0; h < levels.size(); ++h)
+            for (double v : levels[h]) weighted.emplace_back(v, uint64_t(1) << h);
+        sort(weighted.begin(), weighted.end());
+        uint64_t total = 0;
+        for (const auto &w : weighted) total += w.second;
+        double target = q * double(total);
+        uint64_t seen = 0;
+        for (const auto &w : weighted) {
+            seen += w.second;
+            if (double(seen) >= target) return w.first;
+        }
+        return hi;
+    }
+};
+
+// -------------------------
+// OrderQuantiles: windowed p50/p95/p99 of order value and checkout latency
+// -------------------------
+// Each thread records into its own shard without synchronization. Every
+// `flushEvery` samples (and at thread exit) the shard is pushed onto a lock-free
+// stack; readers take the whole stack with one exchange and merge it into the
+// aggregate. Samples become visible to readers after their shard is flushed.
+// Flushing writers also drain when the aggregate is free, and windows more
+// than `retainWindows` behind the newest one are dropped, so memory stays
+// bounded whether or not anyone reads.
+enum class OrderMetric : uint8_t { OrderValue, CheckoutLatencyMicros };
+
+class OrderQuantiles {
+public:
+    struct Summary { uint64_t count; double p50, p95, p99, max; };
+
+private:
+    struct Key {
+        int64_t window;
+        OrderMetric metric;
+        string_view type;  // a kindName() literal; empty = all product types
+        bool operator==(const Key& o) const { return window == o.window && metric == o.metric && type == o.type; }
+    };
+    struct KeyHash {
+        size_t operator()(const Key& k) const {
+            return hash<string_view>()(k.type) ^ (hash<int64_t>()(k.window) * 31 + size_t(k.metric));
+        }
+    };
+    using SketchMap = unordered_map<Key, KllSketch, KeyHash>;
+
+    struct Shard {
+        SketchMap sketches;
+        size_t samples = 0;
+        Shard* next = nullptr;
+    };
+
+    struct LocalShard {
+        OrderQuantiles* owner = nullptr;
+        unique_ptr<Shard> shard = make_unique<Shard>();
+        ~LocalShard() { if (owner && shard->samples) owner->publish(move(shard)); }
+    };
+
+    int64_t windowSeconds;
+    size_t flushEvery;
+    int64_t retainWindows;
+    atomic<Shard*> published{nullptr};
+    mutex aggregateMutex;  // readers, and flushing writers that find it free
+    SketchMap aggregate;
+    int64_t newestWindow = numeric_limits<int64_t>::min();
+
+    void publish(unique_ptr<Shard> shard) {
+        Shard* s = shard.release();
+        s->next = published.load(memory_order_relaxed);
+        while (!published.compare_exchange_weak(s->next, s, memory_order_release, memory_order_relaxed)) {}
+    }
+
+    // One process-wide instance, so a single thread_local shard per thread suffices.
+    Shard& local() {
+        thread_local LocalShard mine;
+        mine.owner = this;
+        return *mine.shard;
+    }
+
+    void add(const Key& key, double value) {
+        Shard& s = local();
+        s.sketches.try_emplace(key).first->second.add(value);
+        if (++s.samples >= flushEvery) flushThisThread();
+    }
+
+    // Caller holds aggregateMutex.
+    void drain() {
+        Shard* s = published.exchange(nullptr, memory_order_acquire);
+        int64_t newest = newestWindow;
+        while (s) {
+            unique_ptr<Shard> owned(s);
+            for (auto &kv : s->sketches) {
+                newest = max(newest, kv.first.window);
+                if (kv.first.window > newest - retainWindows) aggregate.try_emplace(kv.first).first->second.merge(kv.second);
+            }
+            s = s->next;
+        }
+        if (newest == newestWindow) return;
+        newestWindow = newest;
+        for (auto it = aggregate.begin(); it != aggregate.end();) {
+            if (it->first.window <= newest - retainWindows) it = aggregate.erase(it);
+            else ++it;
+        }
+    }
+
+    explicit OrderQuantiles(int64_t windowSeconds = 60, size_t flushEvery = 1024, int64_t retainWindows = 24 * 60)
+        : windowSeconds(windowSeconds), flushEvery(flushEvery), retainWindows(retainWindows) {}
+
+public:
+    ~OrderQuantiles() {
+        lock_guard<mutex> lock(aggregateMutex);
+        drain();
+    }
+
+    static OrderQuantiles& global() {
+        static OrderQuantiles instance;
+        return instance;
+    }
+
+    int64_t windowOf(time_t at) const { return int64_t(at) / windowSeconds; }
+
+    // Records the order value overall and the per-type share of it.
+    template<typename Items>
+    void recordOrder(time_t at, double total, const Items& items, const LinePrices& unitPrices) {
+        int64_t w = windowOf(at);
+        add({w, OrderMetric::OrderValue, string_view()}, total);
+        for (const auto &kv : items)
+            add({w, OrderMetric::OrderValue, kindName(kindOf(*kv.second.first))}, unitPrices.at(kv.first) * double(kv.second.second));
+    }
+
+    void recordCheckoutLatency(time_t at, double micros) {
+        add({windowOf(at), OrderMetric::CheckoutLatencyMicros, string_view()}, micros);
+    }
+
+    // Hands this thread's pending samples to readers.
+    void flushThisThread() {
+        Shard& s = local();
+        if (s.samples == 0) return;
+        auto fresh = make_unique<Shard>();
+        swap(s.sketches, fresh->sketches);
+        fresh->samples = s.samples;
+        s.samples = 0;
+        publish(move(fresh));
+        unique_lock<mutex> lock(aggregateMutex, try_to_lock);
+        if (lock) drain();
+    }
+
+    // Merges windows [fromWindow, toWindow] for one metric and type ("" = all).
+    KllSketch sketch(OrderMetric metric, const string& type, int64_t fromWindow, int64_t toWindow) {
+        lock_guard<mutex> lock(aggregateMutex);
+        drain();
+        KllSketch out;
+        for (const auto &kv : aggregate)
+            if (kv.first.metric == metric && kv.first.type == type && kv.first.window >= fromWindow && kv.first.window <= toWindow)
+                out.merge(kv.second);
+        return out;
+    }
+
+    Summary summary(OrderMetric metric, const string& type, int64_t fromWindow, int64_t toWindow) {
+        KllSketch s = sketch(metric, type, fromWindow, toWindow);
+        return {s.count(), s.quantile(0.50), s.quantile(0.95), s.quantile(0.99), s.maxValue()};
+    }
+};
+
+// -------------------------
+// Order event bus (bounded lock-free broadcast ring)
+// -------------------------
+// Every consumer sees every event, in sequence order, through its own cursor;
+// nothing is copied per consumer. When the slowest consumer is a full ring
+// behind, tryPublish() drops the event and counts it; publish() first waits
+// up to a time budget for the consumer to free a slot. The wait is bounded
+// because producers run inside order updates: a stuck consumer costs each
+// producer at most the budget, and the event is then dropped and reported.
+// With MultiProducer=false the claim is a plain store (one publishing thread).
+enum class OrderEventType : uint8_t { Created, Paid, Shipped, Cancelled };
+
+struct OrderEvent {
+    uid64_t orderId;
+    OrderEventType type;
+    uint32_t lines;   // Created only
+    double total;     // Created only
+    int64_t atNanos;  // steady_clock
+};
+
+template<typename T, bool MultiProducer = true>
+class EventRing {
+    static_assert(is_trivially_copyable_v<T>, "events are copied in and out of slots");
+
+    struct alignas(64) Slot {
+        atomic<uint64_t> sequence{0};  // sequence number + 1 once the slot holds it
+        T value;
+    };
+    struct alignas(64) Cursor {
+        atomic<uint64_t> next{0};  // first sequence not yet consumed
+        atomic<uint64_t> consumed{0};
+        string name;
+    };
+
+    const size_t mask;
+    unique_ptr<Slot[]> slots;
+    alignas(64) atomic<uint64_t> claim{0};
+    alignas(64) atomic<uint64_t> gate{0};  // cached minimum of the consumer cursors
+    alignas(64) atomic<uint64_t> dropped{0};
+    deque<Cursor> cursors;  // fixed once publishing starts
+
+    static size_t roundUp(size_t n) {
+        size_t p = 2;
+        while (p < n) p *= 2;
+        return p;
+    }
+
+    uint64_t slowest() const {
+        uint64_t low = UINT64_MAX;
+        for (const auto &c : cursors) low = min(low, c.next.load(memory_order_acquire));
+        return low;
+    }
+
+public:
+    // capacity is rounded up to a power of two
+    explicit EventRing(size_t capacity) : mask(roundUp(capacity) - 1), slots(new Slot[mask + 1]) {}
+
+    // Register consumers before the first publish; returns the consumer index.
+    size_t addConsumer(string name) {
+        cursors.emplace_back();
+        cursors.back().name = move(name);
+        cursors.back().next.store(claim.load(memory_order_relaxed), memory_order_relaxed);
+        return cursors.size() - 1;
+    }
+
+private:
+    // false, without counting a drop, when the ring is full
+    bool claimAndWrite(const T& value) {
+        uint64_t seq = claim.load(memory_order_relaxed);
+        while (true) {
+            if (seq - gate.load(memory_order_acquire) > mask) {
+                uint64_t low = cursors.empty() ? seq : slowest();
+                gate.store(low, memory_order_release);  // carries the consumers' acquire on to other producers
+                if (seq - low > mask) return false;
+            }
+            if constexpr (MultiProducer) {
+                if (claim.compare_exchange_weak(seq, seq + 1, memory_order_relaxed)) break;
+            } else {
+                claim.store(seq + 1, memory_order_relaxed);
+                break;
+            }
+        }
+        Slot &slot = slots[seq & mask];
+        slot.value = value;
+        slot.sequence.store(seq + 1, memory_order_release);
+        return true;
+    }
+
+public:
+    bool tryPublish(const T& value) {
+        if (claimAndWrite(value)) return true;
+        dropped.fetch_add(1, memory_order_relaxed);
+        return false;
+    }
+
+    // As tryPublish, but a full ring is retried until `maxWait` has passed.
+    bool publish(const T& value, chrono::nanoseconds maxWait) {
+        if (claimAndWrite(value)) return true;
+        const auto deadline = chrono::steady_clock::now() + maxWait;
+        do {
+            this_thread::yield();
+            if (claimAndWrite(value)) return true;
+        } while (chrono::steady_clock::now() < deadline);
+        dropped.fetch_add(1, memory_order_relaxed);
+        return false;
+    }
+
+    // Hands consumer `c` up to maxBatch contiguous events as fn(const T*, n)
+    // calls (one per contiguous run in the ring) and advances its cursor
+    // once; returns the number consumed. Each consumer is polled by one thread.
+    template<typename F>
+    size_t poll(size_t c, F&& fn, size_t maxBatch = 256) {
+        Cursor &cur = cursors[c];
+        uint64_t first = cur.next.load(memory_order_relaxed), end = first;
+        while (end - first < maxBatch && slots[end & mask].sequence.load(memory_order_acquire) == end + 1) ++end;
+        if (end == first) return 0;
+        // copy out before releasing the slots back to producers
+        T batch[64];
+        for (uint64_t at = first; at < end;) {
+            size_t n = size_t(min<uint64_t>(end - at, size(batch)));
+            for (size_t i = 0; i < n; ++i) batch[i] = slots[(at + i) & mask].value;
+            fn(static_cast<const T*>(batch), n);
+            at += n;
+        }
+        cur.next.store(end, memory_order_release);
+        cur.consumed.fetch_add(end - first, memory_order_relaxed);
+        return size_t(end - first);
+    }
+
+    size_t capacity() const { return mask + 1; }
+    size_t consumers() const { return cursors.size(); }
+    const string& consumerName(size_t c) const { return cursors[c].name; }
+    uint64_t published() const { return claim.load(memory_order_relaxed); }
+    uint64_t droppedCount() const { return dropped.load(memory_order_relaxed); }
+    uint64_t consumedBy(size_t c) const { return cursors[c].consumed.load(memory_order_relaxed); }
+    uint64_t lag(size_t c) const { return claim.load(memory_order_relaxed) - cursors[c].next.load(memory_order_relaxed); }
+};
+
+// Owns the ring and one polling thread per subscriber. Orders publish into
+// the bus installed with OrderEventBus::install(); with none installed the
+// hooks cost one relaxed load. An event that finds every slot still unread by
+// some subscriber is dropped (see dropped= in stats()) and emit() returns
+// false, so the caller can tell a consumer missed it; a bus built with a
+// non-zero maxWait first waits that long for a slot, on the checkout thread.
+// emit() runs inside a reader count on its thread's stripe, picked by the
+// epoch's parity; stop() uninstalls, flips the epoch and waits for the old
+// counts to reach zero, so no emit() is left inside a bus that is about to be
+// destroyed.
+class OrderEventBus {
+public:
+    using Handler = function<void(const OrderEvent*, size_t)>;
+
+private:
+    EventRing<OrderEvent> ring;
+    chrono::microseconds maxWait;
+    vector<Handler> handlers;
+    vector<thread> workers;
+    atomic<bool> running{false};
+    // Reader counts striped by thread, so concurrent emitters do not share a line.
+    struct alignas(64) ReaderStripe {
+        atomic<uint64_t> count[2] = {};
+    };
+    static constexpr size_t kReaderStripes = 64;
+    static atomic<OrderEventBus*> installed;
+    static atomic<uint64_t> emitEpoch;
+    static ReaderStripe emitting[kReaderStripes];
+    static atomic<size_t> nextStripe;
+    static mutex retireMutex;
+
+    static ReaderStripe& myStripe() {
+        static thread_local size_t stripe = nextStripe.fetch_add(1, memory_order_relaxed) % kReaderStripes;
+        return emitting[stripe];
+    }
+
+    // Waits out every emit() that may have loaded the bus before it was uninstalled.
+    static void retire() {
+        lock_guard<mutex> lock(retireMutex);
+        uint64_t old = emitEpoch.fetch_add(1) & 1;
+        for (auto &stripe : emitting)
+            while (stripe.count[old].load() != 0) this_thread::yield();
+    }
+
+public:
+    explicit OrderEventBus(size_t capacity = 1 << 16, chrono::microseconds maxWait = chrono::microseconds(0))
+        : ring(capacity), maxWait(maxWait) {}
+    OrderEventBus(const OrderEventBus&) = delete;
+    OrderEventBus& operator=(const OrderEventBus&) = delete;
+    ~OrderEventBus() { stop(); }
+
+    // Before start() only.
+    void subscribe(string name, Handler handler) {
+        ring.addConsumer(move(name));
+        handlers.push_back(move(handler));
+    }
+
+    void start() {
+        running.store(true);
+        for (size_t c = 0; c < handlers.size(); ++c)
+            workers.emplace_back([this, c] {
+                unsigned idle = 0;
+                while (true) {
+                    if (ring.poll(c, handlers[c])) { idle = 0; continue; }
+                    if (!running.load(memory_order_acquire)) {
+                        if (!ring.poll(c, handlers[c])) break;  // drain what was published before stop()
+                        continue;
+                    }
+                    if (++idle < 64) this_thread::yield();
+                    else this_thread::sleep_for(chrono::microseconds(50));
+                }
+            });
+    }
+
+    // Uninstalls the bus if needed, waits for emitters still inside it, drains
+    // the ring and joins the consumers.
+    void stop() {
+        OrderEventBus* self = this;
+        installed.compare_exchange_strong(self, nullptr);
+        retire();
+        running.store(false, memory_order_release);
+        for (auto &w : workers) w.join();
+        workers.clear();
+    }
+
+    bool publish(const OrderEvent& e) { return maxWait.count() ? ring.publish(e, maxWait) : ring.tryPublish(e); }
+
+    static void install(OrderEventBus* bus) { installed.store(bus, memory_order_release); }
+
+    // false when the installed bus dropped the event; true without a bus.
+    static bool emit(OrderEventType type, uid64_t orderId, uint32_t lines = 0, double total = 0.0) {
+        if (!installed.load(memory_order_relaxed)) return true;
+        auto &readers = myStripe().count[emitEpoch.load() & 1];
+        readers.fetch_add(1);
+        bool delivered = true;
+        if (OrderEventBus* bus = installed.load())
+            delivered = bus->publish({orderId, type, lines, total, chrono::steady_clock::now().time_since_epoch().count()});
+        readers.fetch_sub(1, memory_order_release);
+        return delivered;
+    }
+
+    string stats() const {
+        ostringstream oss;
+        oss << "published=" << ring.published() << " dropped=" << ring.droppedCount();
+        for (size_t c = 0; c < ring.consumers(); ++c)
+            oss << " " << ring.consumerName(c) << "=" << ring.consumedBy(c) << "(lag " << ring.lag(c) << ")";
+        return oss.str();
+    }
+};
+
+atomic<OrderEventBus*> OrderEventBus::installed{nullptr};
+atomic<uint64_t> OrderEventBus::emitEpoch{0};
+OrderEventBus::ReaderStripe OrderEventBus::emitting[kReaderStripes];
+atomic<size_t> OrderEventBus::nextStripe{0};
+mutex OrderEventBus::retireMutex;
+
+// -------------------------
+// CoPurchaseIndex ("frequently bought together")
+// -------------------------
+// Orders are recorded as pairwise edges into a delta buffer; rebuild() folds the
+// delta into a CSR matrix of co-occurrence counts (rows split across threads) and
+// derives a per-product top-N neighbor list. Queries read an immutable snapshot,
+// so they never wait on recording or rebuilding. Rows are numbered from one
+// counter under deltaMutex and a pending row is only forgotten once the snapshot
+// holding it is published, so recording during a rebuild cannot reuse a row.
+class CoPurchaseIndex {
+public:
+    struct Neighbor { uid64_t id; uint32_t count; };
+
+    struct NeighborRange {
+        const Neighbor* first = nullptr;
+        const Neighbor* last = nullptr;
+        const Neighbor* begin() const { return first; }
+        const Neighbor* end() const { return last; }
+        size_t size() const { return size_t(last - first); }
+        bool empty() const { return first == last; }
+    };
+
+private:
+    struct Snapshot {
+        unordered_map<uid64_t, uint32_t> rowOf;  // product id -> dense row
+        vector<uid64_t> idOf;                      // dense row -> product id
+        vector<uint64_t> rowStart;               // CSR offsets (rows + 1)
+        vector<uint32_t> col;                    // neighbor rows, sorted per row
+        vector<uint32_t> cnt;                    // co-occurrence counts
+        vector<uint64_t> topStart;               // top-N offsets (rows + 1)
+        vector<Neighbor> top;                    // top-N neighbors, best first
+    };
+
+    size_t topN;
+    size_t maxItemsPerOrder;
+    mutable mutex deltaMutex;
+    unordered_map<uid64_t, uint32_t> pendingRows;  // rows not yet in a published snapshot
+    vector<uid64_t> pendingIds;                    // rows assigned since the last rebuild began
+    uint32_t nextRow = 0;
+    vector<pair<uint32_t, uint32_t>> delta;      // (row, col) edges, both directions
+    shared_ptr<const Snapshot> current = make_shared<Snapshot>();
+    mutex rebuildMutex;
+    atomic<bool> recording{false};
+
+    uint32_t rowFor(uid64_t id, const Snapshot& snap) {
+        auto it = snap.rowOf.find(id);
+        if (it != snap.rowOf.end()) return it->second;
+        auto pit = pendingRows.find(id);
+        if (pit != pendingRows.end()) return pit->second;
+        uint32_t row = nextRow++;
+        pendingRows.emplace(id, row);
+        pendingIds.push_back(id);
+        return row;
+    }
+
+public:
+    explicit CoPurchaseIndex(size_t topN = 10, size_t maxItemsPerOrder = 64)
+        : topN(topN), maxItemsPerOrder(maxItemsPerOrder) {}
+
+    // The process-wide index new orders feed while recording is switched on;
+    // it lives as long as the process, like the order id counter.
+    static CoPurchaseIndex& global() {
+        static CoPurchaseIndex* index = new CoPurchaseIndex();
+        return *index;
+    }
+    void setRecording(bool on) { recording.store(on, memory_order_relaxed); }
+    bool isRecording() const { return recording.load(memory_order_relaxed); }
+
+    // Adds every distinct product pair of an order's lines. Large orders are
+    // capped so a single bulk order cannot add a quadratic number of edges.
+    void record(const LineItems& items) {
+        if (items.size() < 2) return;
+        vector<uid64_t> ids;
+        ids.reserve(min(items.size(), maxItemsPerOrder));
+        for (const auto &kv : items) {
+            if (ids.size() == maxItemsPerOrder) break;
+            ids.push_back(kv.first);
+        }
+        lock_guard<mutex> lock(deltaMutex);
+        auto snap = atomic_load(&current);
+        vector<uint32_t> rows;
+        rows.reserve(ids.size());
+        for (uid64_t id : ids) rows.push_back(rowFor(id, *snap));
+        for (size_t i = 0; i < rows.size(); ++i)
+            for (size_t j = i + 1; j < rows.size(); ++j) {
+                delta.emplace_back(rows[i], rows[j]);
+                delta.emplace_back(rows[j], rows[i]);
+            }
+    }
+
+    size_t pendingEdges() const {
+        lock_guard<mutex> lock(deltaMutex);
+        return delta.size();
+    }
+
+    // Merges pending edges into a fresh snapshot using up to `threads` workers.
+    void rebuild(unsigned threads = thread::hardware_concurrency()) {
+        lock_guard<mutex> rebuildLock(rebuildMutex);
+        auto old = atomic_load(&current);
+        vector<pair<uint32_t, uint32_t>> edges;
+        vector<uid64_t> newIds;
+        {
+            lock_guard<mutex> lock(deltaMutex);
+            edges.swap(delta);
+            newIds.swap(pendingIds);
+        }
+        if (edges.empty() && newIds.empty()) return;
+
+        auto next = make_shared<Snapshot>();
+        next->idOf = old->idOf;
+        next->idOf.insert(next->idOf.end(), newIds.begin(), newIds.end());
+        next->rowOf = old->rowOf;
+        for (size_t r = old->idOf.size(); r < next->idOf.size(); ++r) next->rowOf.emplace(next->idOf[r], uint32_t(r));
+        const size_t rows = next->idOf.size();
+        const size_t oldRows = old->idOf.size();
+
+        threads = max(1u, min<unsigned>(threads, unsigned((rows + 1023) / 1024)));
+        auto shardOf = [&](uint32_t row) { return size_t(row) * threads / rows; };
+
+        // bucket edges by row shard so each worker owns a contiguous row range
+        vector<vector<pair<uint32_t, uint32_t>>> buckets(threads);
+        for (const auto &e : edges) buckets[shardOf(e.first)].push_back(e);
+        edges.clear();
+        edges.shrink_to_fit();
+
+        struct Part { vector<uint64_t> rowLen, topLen; vector<uint32_t> col, cnt; vector<Neighbor> top; };
+        vector<Part> parts(threads);
+        auto work = [&](size_t t) {
+            size_t lo = (rows * t + threads - 1) / threads, hi = (rows * (t + 1) + threads - 1) / threads;
+            auto &bucket = buckets[t];
+            sort(bucket.begin(), bucket.end());
+            Part &part = parts[t];
+            size_t b = 0;
+            vector<Neighbor> scratch;
+            for (size_t r = lo; r < hi; ++r) {
+                size_t before = part.col.size();
+                // merge the old sorted row with the sorted delta for this row
+                uint64_t o = r < oldRows ? old->rowStart[r] : 0, oe = r < oldRows ? old->rowStart[r + 1] : 0;
+                while (o < oe || (b < bucket.size() && bucket[b].first == r)) {
+                    bool takeDelta = b < bucket.size() && bucket[b].first == r && (o == oe || bucket[b].second <= old->col[o]);
+                    uint32_t c = takeDelta ? bucket[b].second : old->col[o];
+                    uint32_t n = takeDelta ? 1 : old->cnt[o++];
+                    if (takeDelta) ++b;
+                    if (part.col.size() > before && part.col.back() == c) part.cnt.back() += n;
+                    else { part.col.push_back(c); part.cnt.push_back(n); }
+                }
+                part.rowLen.push_back(part.col.size() - before);
+
+                scratch.clear();
+                for (size_t i = before; i < part.col.size(); ++i) scratch.push_back({next->idOf[part.col[i]], part.cnt[i]});
+                size_t keep = min(topN, scratch.size());
+                partial_sort(scratch.begin(), scratch.begin() + keep, scratch.end(),
+                             [](const Neighbor& a, const Neighbor& b) { return a.count != b.count ? a.count > b.count : a.id < b.id; });
+                part.top.insert(part.top.end(), scratch.begin(), scratch.begin() + keep);
+                part.topLen.push_back(keep);
+            }
+            vector<pair<uint32_t, uint32_t>>().swap(bucket);
+        };
+        vector<thread> pool;
+        for (size_t t = 1; t < threads; ++t) pool.emplace_back(work, t);
+        work(0);
+        for (auto &th : pool) th.join();
+
+        // stitch the per-thread fragments together
+        next->rowStart.reserve(rows + 1);
+        next->topStart.reserve(rows + 1);
+        next->rowStart.push_back(0);
+        next->topStart.push_back(0);
+        for (auto &part : parts) {
+            for (auto len : part.rowLen) next->rowStart.push_back(next->rowStart.back() + len);
+            for (auto len : part.topLen) next->topStart.push_back(next->topStart.back() + len);
+            next->col.insert(next->col.end(), part.col.begin(), part.col.end());
+            next->cnt.insert(next->cnt.end(), part.cnt.begin(), part.cnt.end());
+            next->top.insert(next->top.end(), part.top.begin(), part.top.end());
+            part = Part{};
+        }
+        lock_guard<mutex> lock(deltaMutex);
+        atomic_store(&current, shared_ptr<const Snapshot>(move(next)));
+        for (uid64_t id : newIds) pendingRows.erase(id);
+    }
+
+    // Top neighbors for a product as of the last rebuild. The range stays valid
+    // only while `holder` is kept alive.
+    NeighborRange alsoBought(uid64_t id, size_t k, shared_ptr<const void>& holder) const {
+        auto snap = atomic_load(&current);
+        holder = snap;
+        auto it = snap->rowOf.find(id);
+        if (it == snap->rowOf.end()) return {};
+        const Neighbor* first = snap->top.data() + snap->topStart[it->second];
+        const Neighbor* last = snap->top.data() + snap->topStart[it->second + 1];
+        if (size_t(last - first) > k) last = first + k;
+        return {first, last};
+    }
+
+    vector<Neighbor> alsoBought(uid64_t id, size_t k) const {
+        shared_ptr<const void> holder;
+        auto range = alsoBought(id, k, holder);
+        return vector<Neighbor>(range.begin(), range.end());
+    }
+
+    size_t productCount() const { return atomic_load(&current)->idOf.size(); }
+    size_t pairCount() const { return atomic_load(&current)->col.size(); }
+};
+
+// -------------------------
+// Order
+// -------------------------
+enum class OrderStatus { Created, Paid, Shipped, Cancelled };
+
+// An order keeps the unit price of every line as of its creation, so
+// repricing a product later changes neither its total nor its invoice.
+class Order {
+    static atomic<uid64_t> nextOrderId;
+    uid64_t order_id;
+    LineItems items;
+    LinePrices unitPrices;
+    OrderStatus status;
+    time_t created_at;
+
+    struct RestoreTag { explicit RestoreTag() = default; };  // only restore() can name it
+public:
+    Order(RestoreTag, uid64_t id, OrderStatus status, time_t createdAt, LineItems&& lines, LinePrices&& prices)
+        : order_id(id), items(move(lines)), unitPrices(move(prices), items.get_allocator().resource()), status(status), created_at(createdAt) {}
+
+    explicit Order(const ShoppingCart& cart, pmr::memory_resource* resource = &AllocationTracker::resource(Subsystem::Order))
+        : order_id(++nextOrderId), items(resource), unitPrices(resource), status(OrderStatus::Created), created_at(time(nullptr)){
+        ECOM_METRIC_COUNT(OrderCreated);
+        ECOM_METRIC_TIME(OrderCreate);
+        items = cart.getItems();  // copy-assign keeps the order's resource
+        unitPrices.reserve(items.size());
+        for (uint64_t asOf = PricePublisher::published();; asOf = PricePublisher::published()) {  // as ShoppingCart::total()
+            for (const auto &kv : items) unitPrices[kv.first] = ShoppingCart::unitPrice(*kv.second.first, asOf);
+            if (PricePublisher::published() == asOf) break;
+        }
+        double sum = total();
+        OrderQuantiles::global().recordOrder(created_at, sum, items, unitPrices);
+        if (CoPurchaseIndex::global().isRecording()) CoPurchaseIndex::global().record(items);
+        OrderEventBus::emit(OrderEventType::Created, order_id, uint32_t(items.size()), sum);
+    }
+
+    // Copies keep the source's resource; moves take it along with the lines.
+    // Assignment keeps the target's resource, as the pmr containers do.
+    Order(const Order& other) : order_id(other.order_id), items(other.items, other.items.get_allocator().resource()),
+                                unitPrices(other.unitPrices, other.items.get_allocator().resource()),
+                                status(other.status), created_at(other.created_at) {}
+    Order(Order&&) = default;
+    Order& operator=(const Order&) = default;
+    Order& operator=(Order&&) = default;
+
+    // Rebuilds a persisted order as it was; no metrics, quantiles or events.
+    // The order keeps the resource `lines` was built with. A line missing from
+    // `prices` (files written before prices were kept) takes its product's
+    // current price.
+    static shared_ptr<Order> restore(uid64_t id, OrderStatus status, time_t createdAt, LineItems&& lines, LinePrices&& prices) {
+        for (const auto &kv : lines) prices.try_emplace(kv.first, kv.second.first->finalPrice());
+        reserveIds(id);
+        return make_shared<Order>(RestoreTag{}, id, status, createdAt, move(lines), move(prices));
+    }
+
+    // Makes sure new orders are numbered after `id`.
+    static void reserveIds(uid64_t id) {
+        uid64_t seen = nextOrderId.load();
+        while (seen < id && !nextOrderId.compare_exchange_weak(seen, id)) {}
+    }
+    static uid64_t lastIssuedId() { return nextOrderId.load(); }
+
+    uid64_t getId() const { return order_id; }
+    const LineItems& getItems() const { return items; }
+    OrderStatus getStatus() const { return status; }
+    time_t createdAt() const { return created_at; }
+    pmr::memory_resource* resource() const { return items.get_allocator().resource(); }
+    // Orders come from single-currency carts.
+    Currency currency() const { return items.empty() ? Currency::USD : items.begin()->second.first->getCurrency(); }
+    // The line's unit price after discounts when the order was placed.
+    double unitPrice(uid64_t productId) const { return unitPrices.at(productId); }
+    const LinePrices& getUnitPrices() const { return unitPrices; }
+
+    double total() const {
+        double sum = 0.0;
+        for (const auto &kv : items) sum += unitPrices.at(kv.first) * kv.second.second;
+        return sum;
+    }
+
+    // Each returns false when the event bus dropped the status event.
+    bool pay() { status = OrderStatus::Paid; ECOM_METRIC_COUNT(OrderPaid); return OrderEventBus::emit(OrderEventType::Paid, order_id); }
+    bool ship() { status = OrderStatus::Shipped; ECOM_METRIC_COUNT(OrderShipped); return OrderEventBus::emit(OrderEventType::Shipped, order_id); }
+    bool cancel() { status = OrderStatus::Cancelled; ECOM_METRIC_COUNT(OrderCancelled); return OrderEventBus::emit(OrderEventType::Cancelled, order_id); }
+
+    const char* statusName() const {
+        switch (status) {
+            case OrderStatus::Created: return "Created";
+            case OrderStatus::Paid: return "Paid";
+            case OrderStatus::Shipped: return "Shipped";
+            case OrderStatus::Cancelled: return "Cancelled";
+        }
+        return "Unknown";
+    }
+
+    string statusString() const { return statusName(); }
+
+    void appendTo(pmr::string& out) const {
+        out += "Order#";
+        appendUnsigned(out, order_id);
+        out += " (";
+        out += statusName();
+        out += ")\n";
+        for (const auto &kv : items) {
+            out += "  x";
+            appendUnsigned(out, kv.second.second);
+            out += ' ';
+            kv.second.first->appendTo(out, unitPrices.at(kv.first));
+            out += '\n';
+        }
+        out += "Order Total: ";
+        appendFixed2(out, total());
+        if (currency() != Currency::USD) {
+            out += ' ';
+            out += currencyInfo(currency()).code;
+        }
+    }
+
+    string toString() const {
+        pmr::string out;
+        appendTo(out);
+        return string(out.data(), out.size());
+    }
+
+    friend ostream& operator<<(ostream& os, const Order& o) {
+        os << o.toString();
+        return os;
+    }
+};
+
+atomic<uid64_t> Order::nextOrderId{0};
+
+// -------------------------
+// Exchange rates and currency conversion
+// -------------------------
+// A RateTable never changes once published. ExchangeRates swaps in a new one
+// with the next version number (atomic_load/atomic_store on the shared_ptr,
+// as CoPurchaseIndex does), so a conversion sees one consistent set of rates
+// and readers never wait for a publisher.
+struct RateTable {
+    uint64_t version = 0;
+    array<double, kCurrencyCount> perUsd{};  // units of each currency per USD; 0 = no rate
+
+    bool has(Currency c) const { return perUsd[size_t(c)] > 0; }
+
+    double factor(Currency from, Currency to) const {
+        if (!has(from) || !has(to)) throw domain_error(string("no exchange rate for ") + currencyInfo(has(from) ? to : from).code);
+        return perUsd[size_t(to)] / perUsd[size_t(from)];
+    }
+};
+
+class ExchangeRates {
+    shared_ptr<const RateTable> current;
+    mutex publishMutex;  // publishers only
+
+    uint64_t publishLocked(const array<double, kCurrencyCount>& perUsd) {
+        for (double rate : perUsd)
+            if (!isfinite(rate) || rate < 0) throw invalid_argument("exchange rate must be finite and >= 0");
+        auto next = make_shared<RateTable>();
+        next->version = atomic_load(&current)->version + 1;
+        next->perUsd = perUsd;
+        next->perUsd[size_t(Currency::USD)] = 1;
+        uint64_t version = next->version;
+        atomic_store(&current, shared_ptr<const RateTable>(move(next)));
+        return version;
+    }
+
+public:
+    ExchangeRates() {
+        auto usdOnly = make_shared<RateTable>();
+        usdOnly->perUsd[size_t(Currency::USD)] = 1;
+        current = move(usdOnly);
+    }
+
+    shared_ptr<const RateTable> snapshot() const { return atomic_load(&current); }
+    uint64_t version() const { return snapshot()->version; }
+
+    // Replaces every rate; returns the new version.
+    uint64_t publish(const array<double, kCurrencyCount>& perUsd) {
+        lock_guard<mutex> lock(publishMutex);
+        return publishLocked(perUsd);
+    }
+
+    // Changes one rate and keeps the rest.
+    uint64_t set(Currency c, double perUsd) {
+        lock_guard<mutex> lock(publishMutex);
+        auto rates = atomic_load(&current)->perUsd;
+        rates[size_t(c)] = perUsd;
+        return publishLocked(rates);
+    }
+};
+
+namespace fx {
+// Half away from zero to 1/scale (scale 100 = cents), as for prices.
+inline double roundTo(double v, double scale) { return copysign(floor(fabs(v * scale) + 0.5), v) / scale; }
+
+inline double minorScale(Currency c) {
+    static const auto scales = [] {
+        array<double, kCurrencyCount> s{};
+        for (size_t i = 0; i < kCurrencyCount; ++i) s[i] = pow(10.0, currencyInfo(Currency(i)).minorDigits);
+        return s;
+    }();
+    return scales[size_t(c)];
+}
+
+// out[i] = roundTo(a[i] * f[i], scale)
+inline void scaleRoundPortable(const double* a, const double* f, size_t n, double scale, double* out) {
+    for (size_t i = 0; i < n; ++i) out[i] = roundTo(a[i] * f[i], scale);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2"))) inline void scaleRoundAvx2(const double* a, const double* f, size_t n, double scale, double* out) {
+    const __m256d s = _mm256_set1_pd(scale), half = _mm256_set1_pd(0.5), sign = _mm256_set1_pd(-0.0);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m256d x = _mm256_mul_pd(_mm256_mul_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(f + i)), s);
+        __m256d magnitude = _mm256_floor_pd(_mm256_add_pd(_mm256_andnot_pd(sign, x), half));
+        _mm256_storeu_pd(out + i, _mm256_div_pd(_mm256_or_pd(magnitude, _mm256_and_pd(sign, x)), s));
+    }
+    scaleRoundPortable(a + i, f + i, n - i, scale, out + i);
+}
+#endif
+
+inline void scaleRound(const double* a, const double* f, size_t n, double scale, double* out) {
+#if defined(__x86_64__)
+    static const bool avx2 = __builtin_cpu_supports("avx2");
+    if (avx2) return scaleRoundAvx2(a, f, n, scale, out);
+#endif
+    scaleRoundPortable(a, f, n, scale, out);
+}
+
+// out[i] = amounts[i] converted from from[i] into `to`, rounded to the
+// target's minor unit. Works in tiles: a scalar gather of the per-currency
+// factor, then one vector multiply-and-round pass over the tile.
+inline void convert(const double* amounts, const Currency* from, size_t n, const RateTable& rates, Currency to, double* out) {
+    array<double, kCurrencyCount> factor;
+    for (size_t c = 0; c < kCurrencyCount; ++c) factor[c] = rates.has(Currency(c)) ? rates.factor(Currency(c), to) : 0;
+    const double scale = minorScale(to);
+    constexpr size_t kTile = 256;
+    double f[kTile];
+    for (size_t base = 0; base < n; base += kTile) {
+        size_t m = min(kTile, n - base);
+        bool missing = false;
+        for (size_t i = 0; i < m; ++i) {
+            f[i] = factor[size_t(from[base + i])];
+            missing |= f[i] == 0;
+        }
+        if (missing)
+            for (size_t i = 0; i < m; ++i) rates.factor(from[base + i], to);  // throws for the first one without a rate
+        scaleRound(amounts + base, f, m, scale, out + base);
+    }
+}
+} // namespace fx
+
+// Product prices, carts and orders in a display currency. Converted unit
+// prices are cached per (rate version, product, target currency) along with
+// the price they were converted from; an entry from an older rate version or
+// for a since-repriced product is recomputed when next used, so neither new
+// rates nor repricing need an invalidation pass. Batches visit each cache shard once and
+// convert all misses in one fx::convert call.
+class PriceConverter {
+    // direct-mapped: a colliding key simply replaces the slot
+    struct Slot { uint64_t key = UINT64_MAX, version = 0; double source = 0, price = 0; };
+    struct alignas(64) Shard {
+        mutex m;
+        vector<Slot> slots;
+    };
+    static constexpr size_t kShards = 16;
+
+    const ExchangeRates& rates;
+    size_t slotMask;
+    array<Shard, kShards> shards;
+    atomic<uint64_t> hits{0}, misses{0};
+
+    static uint64_t keyOf(uid64_t id, Currency to) { return uint64_t(id) * kCurrencyCount + size_t(to); }
+    static uint64_t hashOf(uint64_t key) { return key * 0x9E3779B97F4A7C15ull; }
+    static size_t shardOf(uint64_t hash) { return size_t(hash >> 60); }
+    static_assert(kShards == 16, "shardOf takes the top 4 bits");
+    Slot& slotOf(uint64_t hash) { return shards[shardOf(hash)].slots[size_t(hash) & slotMask]; }
+
+public:
+    explicit PriceConverter(const ExchangeRates& rates, size_t capacity = 1 << 20) : rates(rates) {
+        size_t perShard = 1;
+        while (perShard < capacity / kShards) perShard <<= 1;
+        slotMask = perShard - 1;
+        for (auto &shard : shards) shard.slots.resize(perShard);
+    }
+
+    // out[i] = products[i]'s final price in `to`; returns the rate version used.
+    uint64_t convert(const Product* const* products, size_t n, Currency to, double* out) {
+        vector<double> source(n);
+        for (size_t i = 0; i < n; ++i) source[i] = products[i]->finalPrice();
+        return convert(products, source.data(), n, to, out);
+    }
+
+    // As above but converting source[i], an amount in products[i]'s currency
+    // (e.g. the unit price an order was placed at), instead of the live price.
+    uint64_t convert(const Product* const* products, const double* source, size_t n, Currency to, double* out) {
+        auto table = rates.snapshot();
+        // visit the shards in order, locking each once
+        vector<uint64_t> hash(n);
+        vector<uint32_t> order(n);
+        array<uint32_t, kShards + 1> start{};
+        for (size_t i = 0; i < n; ++i) {
+            hash[i] = hashOf(keyOf(products[i]->getId(), to));
+            ++start[shardOf(hash[i]) + 1];
+        }
+        for (size_t s = 0; s < kShards; ++s) start[s + 1] += start[s];
+        auto fill = start;
+        for (size_t i = 0; i < n; ++i) order[fill[shardOf(hash[i])]++] = uint32_t(i);
+
+        vector<uint32_t> missed;
+        for (size_t s = 0; s < kShards; ++s) {
+            if (start[s] == start[s + 1]) continue;
+            lock_guard<mutex> lock(shards[s].m);
+            for (uint32_t k = start[s]; k < start[s + 1]; ++k) {
+                uint32_t i = order[k];
+                const Slot &slot = slotOf(hash[i]);
+                if (slot.key == keyOf(products[i]->getId(), to) && slot.version == table->version && slot.source == source[i]) out[i] = slot.price;
+                else missed.push_back(i);
+            }
+        }
+        hits += n - missed.size();
+        misses += missed.size();
+        if (missed.empty()) return table->version;
+
+        vector<double> amounts(missed.size()), converted(missed.size());
+        vector<Currency> from(missed.size());
+        for (size_t j = 0; j < missed.size(); ++j) {
+            amounts[j] = source[missed[j]];
+            from[j] = products[missed[j]]->getCurrency();
+        }
+        fx::convert(amounts.data(), from.data(), missed.size(), *table, to, converted.data());
+        // missed is in shard order too
+        for (size_t j = 0; j < missed.size();) {
+            size_t s = shardOf(hash[missed[j]]);
+            lock_guard<mutex> lock(shards[s].m);
+            for (; j < missed.size() && shardOf(hash[missed[j]]) == s; ++j) {
+                out[missed[j]] = converted[j];
+                Slot &slot = slotOf(hash[missed[j]]);
+                if (slot.version <= table->version) slot = {keyOf(products[missed[j]]->getId(), to), table->version, amounts[j], converted[j]};
+            }
+        }
+        return table->version;
+    }
+
+    uint64_t convert(const vector<shared_ptr<Product>>& products, Currency to, vector<double>& out) {
+        vector<const Product*> raw(products.size());
+        for (size_t i = 0; i < products.size(); ++i) raw[i] = products[i].get();
+        out.resize(products.size());
+        return convert(raw.data(), raw.size(), to, out.data());
+    }
+
+    Money price(const Product& p, Currency to) {
+        const Product* one = &p;
+        double amount;
+        convert(&one, 1, to, &amount);
+        return {amount, to};
+    }
+
+    // Totals of many carts (their line items) in one batch: each unit price
+    // converted and rounded, times quantity, summed per set.
+    void totals(const vector<const LineItems*>& lineSets, Currency to, vector<double>& out) {
+        totals(lineSets, {}, to, out);
+    }
+
+    // Same, but set s is priced from unitPrices[s] (an order's prices at
+    // order time, in its own currency) rather than the products' live prices.
+    void totals(const vector<const LineItems*>& lineSets, const vector<const LinePrices*>& unitPrices, Currency to, vector<double>& out) {
+        if (!unitPrices.empty() && unitPrices.size() != lineSets.size()) throw invalid_argument("one unit price list per line set");
+        vector<const Product*> products;
+        vector<double> qty, source, unit;
+        for (size_t s = 0; s < lineSets.size(); ++s)
+            for (const auto &kv : *lineSets[s]) {
+                products.push_back(kv.second.first.get());
+                qty.push_back(double(kv.second.second));
+                source.push_back(unitPrices.empty() ? kv.second.first->finalPrice() : unitPrices[s]->at(kv.first));
+            }
+        unit.resize(products.size());
+        convert(products.data(), source.data(), products.size(), to, unit.data());
+        out.assign(lineSets.size(), 0.0);
+        const double scale = fx::minorScale(to);
+        size_t k = 0;
+        for (size_t s = 0; s < lineSets.size(); ++s) {
+            double sum = 0;
+            for (size_t end = k + lineSets[s]->size(); k < end; ++k) sum += unit[k] * qty[k];
+            out[s] = fx::roundTo(sum, scale);
+        }
+    }
+
+    Money cartTotal(const ShoppingCart& cart, Currency to) {
+        vector<double> out;
+        totals({&cart.getItems()}, to, out);
+        return {out[0], to};
+    }
+
+    // What the order was placed at, in `to`; later repricing doesn't move it.
+    Money orderTotal(const Order& order, Currency to) {
+        vector<double> out;
+        totals({&order.getItems()}, {&order.getUnitPrices()}, to, out);
+        return {out[0], to};
+    }
+
+    string stats() const { return "hits=" + to_string(hits.load()) + " misses=" + to_string(misses.load()); }
+};
+
+// -------------------------
+// Sales tax
+// -------------------------
+// TaxRules is the editable form: per region a standard rate plus overrides by
+// product kind (reduced Grocery, exempt Clothing, ...). compile() flattens it
+// into a TaxTable, a dense region x kind array, so a line's rate is one index.
+using RegionId = uint16_t;
+constexpr size_t kProductKinds = size_t(ProductKind::Grocery) + 1;
+
+class TaxTable {
+    friend class TaxRules;
+    vector<string> names;
+    vector<double> rates;  // [region * kProductKinds + kind]
+
+public:
+    size_t regions() const { return names.size(); }
+    const string& name(RegionId region) const { return names.at(region); }
+
+    optional<RegionId> find(string_view name) const {
+        for (size_t r = 0; r < names.size(); ++r)
+            if (names[r] == name) return RegionId(r);
+        return nullopt;
+    }
+
+    const double* row(RegionId region) const {
+        if (region >= names.size()) throw out_of_range("unknown tax region " + to_string(region));
+        return rates.data() + size_t(region) * kProductKinds;
+    }
+    double rate(RegionId region, ProductKind kind) const { return row(region)[size_t(kind)]; }
+};
+
+class TaxRules {
+    struct Region {
+        string name;
+        double standard;
+        array<optional<double>, kProductKinds> byKind;
+    };
+    vector<Region> regions;
+
+    static double checked(double rate) {
+        if (!isfinite(rate) || rate < 0 || rate > 1) throw invalid_argument("tax rate must be in [0, 1]");
+        return rate;
+    }
+
+public:
+    RegionId addRegion(string name, double standardRate) {
+        for (const auto &r : regions)
+            if (r.name == name) throw invalid_argument("duplicate tax region " + name);
+        if (regions.size() > numeric_limits<RegionId>::max()) throw length_error("too many tax regions");
+        regions.push_back({move(name), checked(standardRate), {}});
+        return RegionId(regions.size() - 1);
+    }
+
+    TaxRules& setRate(RegionId region, ProductKind kind, double rate) {
+        regions.at(region).byKind[size_t(kind)] = checked(rate);
+        return *this;
+    }
+
+    TaxTable compile() const {
+        TaxTable table;
+        table.rates.reserve(regions.size() * kProductKinds);
+        for (const auto &r : regions) {
+            table.names.push_back(r.name);
+            for (const auto &rate : r.byKind) table.rates.push_back(rate.value_or(r.standard));
+        }
+        return table;
+    }
+};
+
+struct InvoiceLine {
+    uid64_t productId;
+    size_t quantity;
+    double net, rate, tax;
+};
+
+struct InvoiceTotals {
+    double net = 0, tax = 0, gross = 0;
+};
+
+struct Invoice {
+    uid64_t orderId;
+    RegionId region;
+    Currency currency;
+    vector<InvoiceLine> lines;
+    InvoiceTotals totals;
+};
+
+// Taxes orders line by line: net = the order's unit price x quantity and
+// tax = net x rate, each rounded half away from zero to the order currency's
+// minor unit (cents, whole yen, ...), and the invoice totals are sums of the
+// rounded lines. An order must be in one currency; gather() throws
+// invalid_argument otherwise.
+// A batch is flattened into column arrays first so both roundings run as two
+// passes of the fx vector kernel, one per run of orders sharing a scale. Not
+// thread-safe; the column buffers are reused between calls.
+class Invoicer {
+    const TaxTable& table;
+    vector<double> unit, qty, rate, net, tax;
+    vector<uint32_t> firstLine;
+    vector<double> scale;  // per order
+
+    void gather(const Order* const* orders, const RegionId* regions, size_t n) {
+        unit.clear();
+        qty.clear();
+        rate.clear();
+        scale.clear();
+        firstLine.assign(1, 0);
+        for (size_t o = 0; o < n; ++o) {
+            const double* rates = table.row(regions[o]);
+            const Currency currency = orders[o]->currency();
+            for (const auto &kv : orders[o]->getItems()) {
+                const Product &p = *kv.second.first;
+                if (p.getCurrency() != currency)
+                    throw invalid_argument("order " + to_string(orders[o]->getId()) + " mixes currencies");
+                unit.push_back(orders[o]->unitPrice(kv.first));
+                qty.push_back(double(kv.second.second));
+                rate.push_back(rates[size_t(kindOf(p))]);
+            }
+            firstLine.push_back(uint32_t(unit.size()));
+            scale.push_back(fx::minorScale(currency));
+        }
+        net.resize(unit.size());
+        tax.resize(unit.size());
+        for (size_t o = 0; o < n;) {
+            size_t end = o + 1;
+            while (end < n && scale[end] == scale[o]) ++end;
+            const size_t first = firstLine[o], count = firstLine[end] - first;
+            fx::scaleRound(unit.data() + first, qty.data() + first, count, scale[o], net.data() + first);
+            fx::scaleRound(net.data() + first, rate.data() + first, count, scale[o], tax.data() + first);
+            o = end;
+        }
+    }
+
+    InvoiceTotals sum(size_t o) const {
+        InvoiceTotals t;
+        for (size_t i = firstLine[o]; i < firstLine[o + 1]; ++i) {
+            t.net += net[i];
+            t.tax += tax[i];
+        }
+        t.net = fx::roundTo(t.net, scale[o]);  // drop float noise from the sum
+        t.tax = fx::roundTo(t.tax, scale[o]);
+        t.gross = fx::roundTo(t.net + t.tax, scale[o]);
+        return t;
+    }
+
+public:
+    explicit Invoicer(const TaxTable& table) : table(table) {}
+
+    Invoice invoice(const Order& order, RegionId region) {
+        const Order* one = &order;
+        gather(&one, &region, 1);
+        Invoice inv{order.getId(), region, order.currency(), {}, sum(0)};
+        size_t i = 0;
+        for (const auto &kv : order.getItems()) {
+            inv.lines.push_back({kv.first, kv.second.second, net[i], rate[i], tax[i]});
+            ++i;
+        }
+        return inv;
+    }
+
+    // Totals only, for batch invoicing: out[i] for orders[i] taxed in regions[i].
+    void totals(const Order* const* orders, const RegionId* regions, size_t n, InvoiceTotals* out) {
+        gather(orders, regions, n);
+        for (size_t o = 0; o < n; ++o) out[o] = sum(o);
+    }
+
+    void totals(const vector<const Order*>& orders, const vector<RegionId>& regions, vector<InvoiceTotals>& out) {
+        if (orders.size() != regions.size()) throw invalid_argument("one region per order");
+        out.resize(orders.size());
+        totals(orders.data(), regions.data(), orders.size(), out.data());
+    }
+};
+
+// -------------------------
+// Shipping rates
+// -------------------------
+// ShippingRules is the editable form: per service (Standard, Express, ...)
+// and destination zone a list of weight brackets. compile() samples them at
+// every weight step into a dense service x zone x step array, so quoting a
+// cart is its billable weight, one step index and one load per service.
+// Billable weight is per unit the larger of actual and volumetric weight
+// (length x width x height / divisor), as carriers charge.
+using ZoneId = uint16_t;
+
+class ShippingTable {
+    friend class ShippingRules;
+    vector<string> zoneNames, serviceNames;
+    double stepKg = 0.5, divisor = 5000;
+    size_t steps = 0;
+    vector<double> prices;  // [(service * zones + zone) * steps + step]; infinity = not offered
+
+public:
+    static constexpr double kUnavailable = numeric_limits<double>::infinity();
+
+    size_t zones() const { return zoneNames.size(); }
+    size_t services() const { return serviceNames.size(); }
+    const string& zone(ZoneId z) const { return zoneNames.at(z); }
+    const string& service(size_t s) const { return serviceNames.at(s); }
+    double maxWeightKg() const { return double(steps - 1) * stepKg; }
+
+    double billableKg(const Parcel& p) const { return max(double(p.weightKg), double(p.lengthCm) * p.widthCm * p.heightCm / divisor); }
+
+    double billableKg(const LineItems& lines) const {
+        double kg = 0;
+        for (const auto &kv : lines) kg += billableKg(kv.second.first->getParcel()) * double(kv.second.second);
+        return kg;
+    }
+
+    // out[s] = cost of service s for a parcel of `kg` to zone `z`.
+    void quote(double kg, ZoneId z, double* out) const {
+        if (z >= zones()) throw out_of_range("unknown shipping zone " + to_string(z));
+        double step = ceil(kg / stepKg - 1e-9);
+        if (!(step < double(steps))) {
+            fill(out, out + services(), kUnavailable);
+            return;
+        }
+        const double* p = prices.data() + size_t(z) * steps + size_t(max(step, 0.0));
+        for (size_t s = 0; s < services(); ++s) out[s] = p[s * zones() * steps];
+    }
+
+    vector<double> quote(const LineItems& lines, ZoneId z) const {
+        vector<double> out(services());
+        quote(billableKg(lines), z, out.data());
+        return out;
+    }
+
+    // Every service for many carts at once: out[c * services() + s].
+    void quote(const vector<const LineItems*>& carts, const vector<ZoneId>& zoneOf, vector<double>& out) const {
+        if (carts.size() != zoneOf.size()) throw invalid_argument("one zone per cart");
+        out.resize(carts.size() * services());
+        for (size_t c = 0; c < carts.size(); ++c) quote(billableKg(*carts[c]), zoneOf[c], out.data() + c * services());
+    }
+};
+
+class ShippingRules {
+public:
+    struct Bracket { double upToKg, price; };
+
+private:
+    vector<string> zoneNames;
+    vector<pair<string, map<ZoneId, vector<Bracket>>>> serviceRates;
+    double divisor;
+
+public:
+    explicit ShippingRules(double volumetricDivisor = 5000) : divisor(volumetricDivisor) {
+        if (!(divisor > 0)) throw invalid_argument("volumetric divisor must be > 0");
+    }
+
+    ZoneId addZone(string name) {
+        if (find(zoneNames.begin(), zoneNames.end(), name) != zoneNames.end()) throw invalid_argument("duplicate shipping zone " + name);
+        if (zoneNames.size() > numeric_limits<ZoneId>::max()) throw length_error("too many shipping zones");
+        zoneNames.push_back(move(name));
+        return ZoneId(zoneNames.size() - 1);
+    }
+
+    size_t addService(string name) {
+        for (const auto &s : serviceRates)
+            if (s.first == name) throw invalid_argument("duplicate shipping service " + name);
+        serviceRates.emplace_back(move(name), map<ZoneId, vector<Bracket>>{});
+        return serviceRates.size() - 1;
+    }
+
+    // Brackets in increasing weight; a zone without brackets is not served.
+    ShippingRules& setRates(size_t service, ZoneId zone, vector<Bracket> brackets) {
+        if (zone >= zoneNames.size()) throw out_of_range("unknown shipping zone " + to_string(zone));
+        for (size_t i = 0; i < brackets.size(); ++i)
+            if (!(brackets[i].upToKg > (i ? brackets[i - 1].upToKg : 0)) || !isfinite(brackets[i].price) || brackets[i].price < 0)
+                throw invalid_argument("shipping brackets must have increasing weights and prices >= 0");
+        serviceRates.at(service).second[zone] = move(brackets);
+        return *this;
+    }
+
+    // Bracket limits must be multiples of stepKg so that sampling is exact.
+    ShippingTable compile(double stepKg = 0.5) const {
+        if (!(stepKg > 0)) throw invalid_argument("weight step must be > 0");
+        ShippingTable t;
+        t.zoneNames = zoneNames;
+        t.stepKg = stepKg;
+        t.divisor = divisor;
+        double maxKg = 0;
+        for (const auto &s : serviceRates) {
+            t.serviceNames.push_back(s.first);
+            for (const auto &z : s.second)
+                for (const auto &b : z.second) {
+                    double steps = b.upToKg / stepKg;
+                    if (fabs(steps - round(steps)) > 1e-9) throw invalid_argument("bracket limit " + to_string(b.upToKg) + " kg is not a multiple of the weight step");
+                    maxKg = max(maxKg, b.upToKg);
+                }
+        }
+        t.steps = size_t(llround(maxKg / stepKg)) + 1;
+        t.prices.assign(serviceRates.size() * zoneNames.size() * t.steps, ShippingTable::kUnavailable);
+        for (size_t s = 0; s < serviceRates.size(); ++s)
+            for (const auto &z : serviceRates[s].second) {
+                double* row = t.prices.data() + (s * zoneNames.size() + z.first) * t.steps;
+                size_t b = 0;
+                for (size_t k = 0; k < t.steps && b < z.second.size(); ++k) {
+                    while (b < z.second.size() && z.second[b].upToKg < double(k) * stepKg - 1e-9) ++b;
+                    if (b < z.second.size()) row[k] = z.second[b].price;
+                }
+            }
+        return t;
+    }
+};
+
+// -------------------------
+// CheckoutContext: per-request arena
+// -------------------------
+// Owns a monotonic arena (first kInlineBytes on the stack, then chunks from the
+// order subsystem's tracker) holding the request's cart, order and receipt text.
+// Everything is released in one shot when the context goes away, so nothing
+// obtained from it may outlive the request.
+class CheckoutContext {
+public:
+    static constexpr size_t kInlineBytes = 16 * 1024;
+
+private:
+    alignas(max_align_t) byte inlineBuffer[kInlineBytes];
+    pmr::monotonic_buffer_resource arena;
+    ShoppingCart requestCart;
+    optional<Order> order;
+
+public:
+    CheckoutContext()
+        : arena(inlineBuffer, sizeof inlineBuffer, &AllocationTracker::resource(Subsystem::Order)), requestCart(&arena) {}
+    CheckoutContext(const CheckoutContext&) = delete;
+    CheckoutContext& operator=(const CheckoutContext&) = delete;
+
+    pmr::memory_resource* resource() { return &arena; }
+    ShoppingCart& cart() { return requestCart; }
+
+    // Snapshots `source` (or the request's own cart) into an arena-backed order.
+    Order& placeOrder(const ShoppingCart& source) {
+        order.emplace(source, &arena);
+        return *order;
+    }
+    Order& placeOrder() { return placeOrder(requestCart); }
+
+    // Receipt text for the placed order, formatted straight into the arena.
+    pmr::string receipt() {
+        pmr::string out(&arena);
+        if (!order) return out;
+        out.reserve(64 + order->getItems().size() * 96);
+        out += "Receipt\n";
+        order->appendTo(out);
+        out += '\n';
+        return out;
+    }
+};
+
+// -------------------------
+// Similar items: IVF index over product embeddings
+// -------------------------
+// Embeddings are computed offline and loaded with EmbeddingSet::load(). The
+// index keeps them column-wise, one block per inverted list, rather than on
+// each Product. Construction runs k-means for `lists` centroids on a sample
+// and files every vector under its nearest centroid, both as floats and as
+// 8-bit codes. A query scores the centroids, scans the codes in the lists of
+// the `probes` nearest ones with the SIMD kernels (a quarter of the memory
+// traffic of floats, which is what bounds the scan), and re-ranks the best
+// candidates on the floats. Lists are grouped by ProductKind, so a getType()
+// filter scans only matching members; when the probed lists hold fewer than
+// k of them, further lists are scanned in centroid order.
+namespace vec {
+inline float dotPortable(const float* a, const float* b, size_t n) {
+    float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        s0 += a[i] * b[i];
+        s1 += a[i + 1] * b[i + 1];
+        s2 += a[i + 2] * b[i + 2];
+        s3 += a[i + 3] * b[i + 3];
+    }
+    for (; i < n; ++i) s0 += a[i] * b[i];
+    return (s0 + s1) + (s2 + s3);
+}
+
+inline float l2Portable(const float* a, const float* b, size_t n) {
+    float s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        float d0 = a[i] - b[i], d1 = a[i + 1] - b[i + 1], d2 = a[i + 2] - b[i + 2], d3 = a[i + 3] - b[i + 3];
+        s0 += d0 * d0;
+        s1 += d1 * d1;
+        s2 += d2 * d2;
+        s3 += d3 * d3;
+    }
+    for (; i < n; ++i) s0 += (a[i] - b[i]) * (a[i] - b[i]);
+    return (s0 + s1) + (s2 + s3);
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2,fma"))) inline float horizontalSum(__m256 v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+
+__attribute__((target("avx2,fma"))) inline float dotAvx2(const float* a, const float* b, size_t n) {
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), s0);
+        s1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8), s1);
+    }
+    if (i + 8 <= n) {
+        s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i), s0);
+        i += 8;
+    }
+    return horizontalSum(_mm256_add_ps(s0, s1)) + dotPortable(a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2,fma"))) inline float l2Avx2(const float* a, const float* b, size_t n) {
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + 8), _mm256_loadu_ps(b + i + 8));
+        s0 = _mm256_fmadd_ps(d0, d0, s0);
+        s1 = _mm256_fmadd_ps(d1, d1, s1);
+    }
+    if (i + 8 <= n) {
+        __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+        s0 = _mm256_fmadd_ps(d0, d0, s0);
+        i += 8;
+    }
+    return horizontalSum(_mm256_add_ps(s0, s1)) + l2Portable(a + i, b + i, n - i);
+}
+#endif
+
+// Scalar-quantized vectors (value[d] = lo[d] + step[d] * code[d]) against a
+// query folded once per search: L2 takes residual = query - lo and computes
+// sum((residual - step * code)^2); the dot product takes weight = query * step
+// and computes sum(weight * code), to which the caller adds sum(query * lo).
+inline float sq8L2Portable(const float* residual, const float* step, const uint8_t* code, size_t n) {
+    float s = 0;
+    for (size_t i = 0; i < n; ++i) {
+        float d = residual[i] - step[i] * float(code[i]);
+        s += d * d;
+    }
+    return s;
+}
+
+inline float sq8DotPortable(const float* weight, const uint8_t* code, size_t n) {
+    float s = 0;
+    for (size_t i = 0; i < n; ++i) s += weight[i] * float(code[i]);
+    return s;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2,fma"))) inline __m256 sq8Load(const uint8_t* code) {
+    return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(code))));
+}
+
+__attribute__((target("avx2,fma"))) inline float sq8L2Avx2(const float* residual, const float* step, const uint8_t* code, size_t n) {
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m256 d0 = _mm256_fnmadd_ps(_mm256_loadu_ps(step + i), sq8Load(code + i), _mm256_loadu_ps(residual + i));
+        __m256 d1 = _mm256_fnmadd_ps(_mm256_loadu_ps(step + i + 8), sq8Load(code + i + 8), _mm256_loadu_ps(residual + i + 8));
+        s0 = _mm256_fmadd_ps(d0, d0, s0);
+        s1 = _mm256_fmadd_ps(d1, d1, s1);
+    }
+    if (i + 8 <= n) {
+        __m256 d0 = _mm256_fnmadd_ps(_mm256_loadu_ps(step + i), sq8Load(code + i), _mm256_loadu_ps(residual + i));
+        s0 = _mm256_fmadd_ps(d0, d0, s0);
+        i += 8;
+    }
+    return horizontalSum(_mm256_add_ps(s0, s1)) + sq8L2Portable(residual + i, step + i, code + i, n - i);
+}
+
+__attribute__((target("avx2,fma"))) inline float sq8DotAvx2(const float* weight, const uint8_t* code, size_t n) {
+    __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        s0 = _mm256_fmadd_ps(_mm256_loadu_ps(weight + i), sq8Load(code + i), s0);
+        s1 = _mm256_fmadd_ps(_mm256_loadu_ps(weight + i + 8), sq8Load(code + i + 8), s1);
+    }
+    if (i + 8 <= n) {
+        s0 = _mm256_fmadd_ps(_mm256_loadu_ps(weight + i), sq8Load(code + i), s0);
+        i += 8;
+    }
+    return horizontalSum(_mm256_add_ps(s0, s1)) + sq8DotPortable(weight + i, code + i, n - i);
+}
+#endif
+
+using Sq8L2Kernel = float (*)(const float*, const float*, const uint8_t*, size_t);
+using Sq8DotKernel = float (*)(const float*, const uint8_t*, size_t);
+
+using Kernel = float (*)(const float*, const float*, size_t);
+
+inline bool haveAvx2() {
+#if defined(__x86_64__)
+    static const bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    return avx2;
+#else
+    return false;
+#endif
+}
+
+inline Kernel dot() {
+#if defined(__x86_64__)
+    if (haveAvx2()) return dotAvx2;
+#endif
+    return dotPortable;
+}
+
+inline Kernel l2() {
+#if defined(__x86_64__)
+    if (haveAvx2()) return l2Avx2;
+#endif
+    return l2Portable;
+}
+
+inline Sq8DotKernel sq8Dot() {
+#if defined(__x86_64__)
+    if (haveAvx2()) return sq8DotAvx2;
+#endif
+    return sq8DotPortable;
+}
+
+inline Sq8L2Kernel sq8L2() {
+#if defined(__x86_64__)
+    if (haveAvx2()) return sq8L2Avx2;
+#endif
+    return sq8L2Portable;
+}
+} // namespace vec
+
+// (product id, vector) pairs of one dimension. An id may appear more than
+// once; indexes use its last vector.
+// File: "ECEMB001" | u32 dim | u64 count | count x (u64 id | dim x f32)
+struct EmbeddingSet {
+    static constexpr char kMagic[8] = {'E', 'C', 'E', 'M', 'B', '0', '0', '1'};
+
+    size_t dim = 0;
+    vector<uid64_t> ids;
+    vector<float> values;  // ids.size() x dim
+
+    explicit EmbeddingSet(size_t dim = 0) : dim(dim) {}
+
+    size_t size() const { return ids.size(); }
+    const float* at(size_t i) const { return values.data() + i * dim; }
+
+    void add(uid64_t id, const float* v) {
+        ids.push_back(id);
+        values.insert(values.end(), v, v + dim);
+    }
+
+    void save(const string& path) const {
+        ofstream out(path, ios::binary | ios::trunc);
+        if (!out) throw runtime_error("cannot write " + path);
+        uint32_t d = uint32_t(dim);
+        uint64_t n = ids.size();
+        out.write(kMagic, sizeof kMagic);
+        out.write(reinterpret_cast<const char*>(&d), sizeof d);
+        out.write(reinterpret_cast<const char*>(&n), sizeof n);
+        for (size_t i = 0; i < ids.size(); ++i) {
+            uint64_t id = ids[i];
+            out.write(reinterpret_cast<const char*>(&id), sizeof id);
+            out.write(reinterpret_cast<const char*>(at(i)), streamsize(dim * sizeof(float)));
+        }
+        if (!out) throw runtime_error("short write to " + path);
+    }
+
+    static EmbeddingSet load(const string& path) {
+        ifstream in(path, ios::binary);
+        if (!in) throw runtime_error("cannot read " + path);
+        char magic[sizeof kMagic];
+        uint32_t d = 0;
+        uint64_t n = 0;
+        in.read(magic, sizeof magic);
+        in.read(reinterpret_cast<char*>(&d), sizeof d);
+        in.read(reinterpret_cast<char*>(&n), sizeof n);
+        if (!in || memcmp(magic, kMagic, sizeof kMagic) != 0 || d == 0 || d > 65536) throw runtime_error(path + ": not an embedding file");
+        EmbeddingSet set(d);
+        vector<float> v(d);
+        for (uint64_t i = 0; i < n; ++i) {
+            uint64_t id;
+            in.read(reinterpret_cast<char*>(&id), sizeof id);
+            in.read(reinterpret_cast<char*>(v.data()), streamsize(d * sizeof(float)));
+            if (!in) throw runtime_error(path + ": truncated embedding file");
+            set.add(uid64_t(id), v.data());
+        }
+        return set;
+    }
+};
+
+struct SimilarityOptions {
+    size_t lists = 0;  // 0: about sqrt(n)
+    size_t probes = 8;
+    size_t trainingSample = 65536;
+    unsigned iterations = 10;
+    unsigned threads = thread::hardware_concurrency();
+    uint64_t seed = 42;
+};
+
+class SimilarityIndex {
+public:
+    enum class Metric { L2, InnerProduct };  // inner product: use normalized vectors for cosine
+    struct Neighbor { uid64_t id; float score; };  // L2: squared distance; inner product: dot
+
+private:
+    // Members grouped by kind: those of kind k are [kindStart[k], kindStart[k + 1]).
+    struct List {
+        vector<float> values;   // members x dim, for re-ranking
+        vector<uint8_t> codes;  // members x dim, scanned
+        vector<uid64_t> ids;
+        array<uint32_t, kProductKinds + 1> kindStart{};
+    };
+
+    size_t dim = 0;
+    Metric metric;
+    vec::Kernel kernel;
+    vec::Sq8L2Kernel sq8L2 = vec::sq8L2();
+    vec::Sq8DotKernel sq8Dot = vec::sq8Dot();
+    size_t probes = 8;
+    vector<float> centroids;  // lists x dim
+    vector<float> lo, step;   // per-dimension quantizer
+    vector<List> lists;
+    unordered_map<uid64_t, pair<uint32_t, uint32_t>> where;  // id -> (list, slot)
+
+    // smaller is closer
+    float distance(const float* a, const float* b) const { return metric == Metric::L2 ? kernel(a, b, dim) : -kernel(a, b, dim); }
+
+    // The query folded for the 8-bit kernels (see vec::sq8L2Portable).
+    struct Folded {
+        vector<float> v;
+        float bias = 0;
+    };
+    Folded fold(const float* query) const {
+        Folded f;
+        f.v.resize(dim);
+        for (size_t d = 0; d < dim; ++d) {
+            if (metric == Metric::L2) f.v[d] = query[d] - lo[d];
+            else {
+                f.v[d] = query[d] * step[d];
+                f.bias += query[d] * lo[d];
+            }
+        }
+        return f;
+    }
+    float approximate(const Folded& f, const uint8_t* code) const {
+        return metric == Metric::L2 ? sq8L2(f.v.data(), step.data(), code, dim) : -(sq8Dot(f.v.data(), code, dim) + f.bias);
+    }
+
+    size_t nearestCentroid(const float* v) const {
+        size_t best = 0;
+        float bestDistance = numeric_limits<float>::infinity();
+        for (size_t c = 0; c < lists.size(); ++c) {
+            float d = distance(v, centroids.data() + c * dim);
+            if (d < bestDistance) {
+                bestDistance = d;
+                best = c;
+            }
+        }
+        return best;
+    }
+
+    // assign[i] = nearest centroid of vector i, on `threads` workers
+    template<typename Vec>
+    void assignAll(size_t n, Vec&& vectorAt, vector<uint32_t>& assign, unsigned threads) const {
+        assign.resize(n);
+        threads = max(1u, min<unsigned>(threads, unsigned((n + 4095) / 4096)));
+        auto work = [&](size_t t) {
+            for (size_t i = n * t / threads; i < n * (t + 1) / threads; ++i) assign[i] = uint32_t(nearestCentroid(vectorAt(i)));
+        };
+        vector<thread> pool;
+        for (size_t t = 1; t < threads; ++t) pool.emplace_back(work, t);
+        work(0);
+        for (auto &th : pool) th.join();
+    }
+
+    // fn(list, slot) for the members of `list` whose kind is in `mask`
+    template<typename F>
+    static void forMembers(const List& list, uint8_t mask, F&& fn) {
+        for (size_t k = 0; k < kProductKinds; ++k)
+            if (mask & (1u << k))
+                for (uint32_t j = list.kindStart[k]; j < list.kindStart[k + 1]; ++j) fn(j);
+    }
+
+public:
+    static uint8_t kindMaskFor(string_view type) {
+        if (type.empty()) return 0xFF;
+        for (ProductKind k : {ProductKind::Product, ProductKind::Electronics, ProductKind::Clothing, ProductKind::Grocery})
+            if (type == kindName(k)) return uint8_t(1u << unsigned(k));
+        throw invalid_argument("unknown product type " + string(type));
+    }
+
+    // Indexes the embeddings of products that `catalog` knows; others are
+    // skipped, as are all but the last vector of a repeated id.
+    SimilarityIndex(const EmbeddingSet& set, const GenericCatalog<Product>& catalog, Metric metric = Metric::L2, SimilarityOptions options = {})
+        : dim(set.dim), metric(metric), kernel(metric == Metric::L2 ? vec::l2() : vec::dot()), probes(max<size_t>(1, options.probes)) {
+        if (!dim) throw invalid_argument("embeddings have no dimension");
+        unordered_map<uid64_t, uint32_t> lastRow;
+        lastRow.reserve(set.size());
+        for (size_t i = 0; i < set.size(); ++i) lastRow[set.ids[i]] = uint32_t(i);
+        vector<uint32_t> rows;
+        vector<ProductKind> kindOfRow;
+        for (size_t i = 0; i < set.size(); ++i)
+            if (auto p = lastRow[set.ids[i]] == i ? catalog.find(set.ids[i]) : nullptr) {
+                rows.push_back(uint32_t(i));
+                kindOfRow.push_back(kindOf(*p));
+            }
+        const size_t n = rows.size();
+        if (!n) return;
+        size_t listCount = options.lists ? options.lists : size_t(sqrt(double(n)));
+        listCount = max<size_t>(1, min(listCount, n));
+
+        // k-means on a sample, seeded with distinct random members
+        mt19937_64 rng(options.seed);
+        vector<uint32_t> sample(rows);
+        shuffle(sample.begin(), sample.end(), rng);
+        sample.resize(min(sample.size(), max(options.trainingSample, listCount)));
+        centroids.resize(listCount * dim);
+        for (size_t c = 0; c < listCount; ++c) copy_n(set.at(sample[c]), dim, centroids.data() + c * dim);
+        lists.resize(listCount);
+        vector<uint32_t> assign;
+        vector<double> sums(listCount * dim);
+        vector<size_t> counts(listCount);
+        for (unsigned it = 0; it < options.iterations; ++it) {
+            assignAll(sample.size(), [&](size_t i) { return set.at(sample[i]); }, assign, options.threads);
+            fill(sums.begin(), sums.end(), 0.0);
+            fill(counts.begin(), counts.end(), 0);
+            for (size_t i = 0; i < sample.size(); ++i) {
+                const float* v = set.at(sample[i]);
+                double* s = sums.data() + size_t(assign[i]) * dim;
+                for (size_t d = 0; d < dim; ++d) s[d] += v[d];
+                ++counts[assign[i]];
+            }
+            for (size_t c = 0; c < listCount; ++c) {
+                float* centroid = centroids.data() + c * dim;
+                if (!counts[c]) {  // empty cluster: restart it on a random sample point
+                    copy_n(set.at(sample[rng() % sample.size()]), dim, centroid);
+                    continue;
+                }
+                for (size_t d = 0; d < dim; ++d) centroid[d] = float(sums[c * dim + d] / double(counts[c]));
+            }
+        }
+
+        // 8-bit codes over each dimension's observed range
+        lo.assign(dim, numeric_limits<float>::infinity());
+        vector<float> hi(dim, -numeric_limits<float>::infinity());
+        for (uint32_t r : rows) {
+            const float* v = set.at(r);
+            for (size_t d = 0; d < dim; ++d) {
+                lo[d] = min(lo[d], v[d]);
+                hi[d] = max(hi[d], v[d]);
+            }
+        }
+        step.resize(dim);
+        for (size_t d = 0; d < dim; ++d) step[d] = hi[d] > lo[d] ? (hi[d] - lo[d]) / 255 : 1;
+
+        // file every vector under its nearest centroid, grouped by kind
+        assignAll(n, [&](size_t i) { return set.at(rows[i]); }, assign, options.threads);
+        vector<array<uint32_t, kProductKinds>> kindCounts(listCount);
+        for (size_t i = 0; i < n; ++i) ++kindCounts[assign[i]][size_t(kindOfRow[i])];
+        for (size_t c = 0; c < listCount; ++c) {
+            List &list = lists[c];
+            for (size_t k = 0; k < kProductKinds; ++k) list.kindStart[k + 1] = list.kindStart[k] + kindCounts[c][k];
+            size_t members = list.kindStart[kProductKinds];
+            list.values.resize(members * dim);
+            list.codes.resize(members * dim);
+            list.ids.resize(members);
+        }
+        auto fill = lists;  // reuse kindStart as per-kind insert cursors
+        where.reserve(n);
+        for (size_t i = 0; i < n; ++i) {
+            List &list = lists[assign[i]];
+            uint32_t slot = fill[assign[i]].kindStart[size_t(kindOfRow[i])]++;
+            const float* v = set.at(rows[i]);
+            list.ids[slot] = set.ids[rows[i]];
+            copy_n(v, dim, list.values.data() + size_t(slot) * dim);
+            uint8_t* code = list.codes.data() + size_t(slot) * dim;
+            for (size_t d = 0; d < dim; ++d) code[d] = uint8_t(min(255.0f, max(0.0f, nearbyintf((v[d] - lo[d]) / step[d]))));
+            where[list.ids[slot]] = {assign[i], slot};
+        }
+    }
+
+    size_t size() const { return where.size(); }
+    size_t dimension() const { return dim; }
+    size_t listCount() const { return lists.size(); }
+    void setProbes(size_t p) { probes = max<size_t>(1, p); }
+
+    // Best k products for `query`, best first; `type` as in getType(), empty = any.
+    // Lists are scanned on the 8-bit codes; the best 4k are then re-ranked on
+    // the full vectors.
+    vector<Neighbor> search(const float* query, size_t k, string_view type = {}, uid64_t exclude = UINT64_MAX) const {
+        vector<Neighbor> out;
+        if (!k || lists.empty()) return out;
+        const uint8_t mask = kindMaskFor(type);
+        vector<pair<float, uint32_t>> order(lists.size());
+        for (size_t c = 0; c < lists.size(); ++c) order[c] = {distance(query, centroids.data() + c * dim), uint32_t(c)};
+        size_t probe = min(probes, order.size());
+        partial_sort(order.begin(), order.begin() + ptrdiff_t(probe), order.end());
+
+        const Folded folded = fold(query);
+        const size_t shortlist = max<size_t>(4 * k, k + 16);
+        struct Candidate {
+            float distance;
+            uint32_t list, slot;
+            bool operator<(const Candidate& o) const { return distance < o.distance; }
+        };
+        vector<Candidate> heap;  // max-heap of the best `shortlist` so far
+        heap.reserve(shortlist + 1);
+        for (size_t o = 0; o < order.size() && (o < probe || heap.size() < k); ++o) {
+            if (o == probe) sort(order.begin() + ptrdiff_t(probe), order.end());  // widening: rest in centroid order
+            const uint32_t c = order[o].second;
+            const List &list = lists[c];
+            forMembers(list, mask, [&](uint32_t j) {
+                if (list.ids[j] == exclude) return;
+                float d = approximate(folded, list.codes.data() + size_t(j) * dim);
+                if (heap.size() < shortlist) {
+                    heap.push_back({d, c, j});
+                    push_heap(heap.begin(), heap.end());
+                } else if (d < heap.front().distance) {
+                    pop_heap(heap.begin(), heap.end());
+                    heap.back() = {d, c, j};
+                    push_heap(heap.begin(), heap.end());
+                }
+            });
+        }
+        for (auto &cand : heap) cand.distance = distance(query, lists[cand.list].values.data() + size_t(cand.slot) * dim);
+        size_t keep = min(k, heap.size());
+        partial_sort(heap.begin(), heap.begin() + ptrdiff_t(keep), heap.end());
+        for (size_t i = 0; i < keep; ++i)
+            out.push_back({lists[heap[i].list].ids[heap[i].slot], metric == Metric::L2 ? heap[i].distance : -heap[i].distance});
+        return out;
+    }
+
+    // Products like `id` (itself excluded); empty when it has no embedding.
+    vector<Neighbor> similarTo(uid64_t id, size_t k, string_view type = {}) const {
+        auto it = where.find(id);
+        if (it == where.end()) return {};
+        const float* v = lists[it->second.first].values.data() + size_t(it->second.second) * dim;
+        vector<float> query(v, v + dim);
+        return search(query.data(), k, type, id);
+    }
+
+    // Exact top-k by scanning every full vector, to measure recall against.
+    vector<Neighbor> exhaustive(const float* query, size_t k, string_view type = {}) const {
+        vector<Neighbor> all;
+        const uint8_t mask = kindMaskFor(type);
+        for (const auto &list : lists)
+            forMembers(list, mask, [&](uint32_t j) { all.push_back({list.ids[j], distance(query, list.values.data() + size_t(j) * dim)}); });
+        size_t keep = min(k, all.size());
+        partial_sort(all.begin(), all.begin() + ptrdiff_t(keep), all.end(), [](const Neighbor& a, const Neighbor& b) { return a.score < b.score; });
+        all.resize(keep);
+        if (metric == Metric::InnerProduct)
+            for (auto &nb : all) nb.score = -nb.score;
+        return all;
+    }
+};
+
+// -------------------------
+// WorkStealingPool
+// -------------------------
+// One deque per worker: the owner pushes/pops at the back (LIFO, cache-warm),
+// idle workers steal from the front of a victim's deque. Tasks submitted from
+// outside the pool are spread round-robin. Workers park on a condition variable
+// only when every deque is empty. A task that throws is counted and dropped;
+// it neither kills its worker nor keeps waitIdle() waiting.
+class WorkStealingPool {
+    struct Worker {
+        mutex m;
+        deque<function<void()>> tasks;
+    };
+
+    vector<unique_ptr<Worker>> workers;
+    vector<thread> threads;
+    atomic<bool> stopping{false};
+    atomic<size_t> queued{0};     // tasks sitting in deques
+    atomic<size_t> inFlight{0};   // submitted and not yet finished
+    atomic<size_t> sleepers{0};
+    atomic<size_t> nextVictim{0};
+    atomic<uint64_t> failed{0};   // tasks that threw
+    mutex sleepMutex;
+    condition_variable wake, idle;
+
+    static thread_local WorkStealingPool* currentPool;
+    static thread_local size_t currentIndex;
+
+    bool popOwn(size_t i, function<void()>& task) {
+        Worker &w = *workers[i];
+        lock_guard<mutex> lock(w.m);
+        if (w.tasks.empty()) return false;
+        task = move(w.tasks.back());
+        w.tasks.pop_back();
+        return true;
+    }
+
+    bool steal(size_t thief, function<void()>& task) {
+        for (size_t k = 1; k < workers.size(); ++k) {
+            Worker &w = *workers[(thief + k) % workers.size()];
+            lock_guard<mutex> lock(w.m);
+            if (w.tasks.empty()) continue;
+            task = move(w.tasks.front());
+            w.tasks.pop_front();
+            return true;
+        }
+        return false;
+    }
+
+    void run(size_t i) {
+        currentPool = this;
+        currentIndex = i;
+        function<void()> task;
+        while (true) {
+            if (popOwn(i, task) || steal(i, task)) {
+                queued.fetch_sub(1);
+                try {
+                    task();
+                } catch (...) {
+                    failed.fetch_add(1, memory_order_relaxed);
+                }
+                task = nullptr;
+                if (inFlight.fetch_sub(1) == 1) {
+                    lock_guard<mutex> lock(sleepMutex);
+                    idle.notify_all();
+                }
+                continue;
+            }
+            unique_lock<mutex> lock(sleepMutex);
+            sleepers.fetch_add(1);
+            wake.wait(lock, [&] { return stopping.load() || queued.load() > 0; });
+            sleepers.fetch_sub(1);
+            if (stopping.load() && queued.load() == 0) return;
+        }
+    }
+
+public:
+    explicit WorkStealingPool(unsigned threadCount = max(1u, thread::hardware_concurrency())) {
+        for (unsigned i = 0; i < threadCount; ++i) workers.push_back(make_unique<Worker>());
+        for (unsigned i = 0; i < threadCount; ++i) threads.emplace_back(&WorkStealingPool::run, this, size_t(i));
+    }
+
+    ~WorkStealingPool() {
+        waitIdle();
+        {
+            lock_guard<mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &t : threads) t.join();
+    }
+
+    size_t size() const { return workers.size(); }
+    uint64_t failedCount() const { return failed.load(memory_order_relaxed); }
+
+    void submit(function<void()> task) {
+        size_t target = currentPool == this ? currentIndex : nextVictim.fetch_add(1, memory_order_relaxed) % workers.size();
+        inFlight.fetch_add(1);
+        {
+            Worker &w = *workers[target];
+            lock_guard<mutex> lock(w.m);
+            w.tasks.push_back(move(task));
+        }
+        queued.fetch_add(1);
+        if (sleepers.load() > 0) {
+            { lock_guard<mutex> lock(sleepMutex); }
+            wake.notify_one();
+        }
+    }
+
+    // Blocks until every submitted task (including ones they submit) finished.
+    void waitIdle() {
+        unique_lock<mutex> lock(sleepMutex);
+        idle.wait(lock, [&] { return inFlight.load() == 0; });
+    }
+};
+
+thread_local WorkStealingPool* WorkStealingPool::currentPool = nullptr;
+thread_local size_t WorkStealingPool::currentIndex = 0;
+
+// -------------------------
+// OrderPipeline: post-checkout stages on the pool
+// -------------------------
+// Each stage of an order runs as its own task and schedules the next stage when
+// done, so different orders occupy different stages at the same time. A stage
+// returning false or throwing (payment declined, out of stock) stops that
+// order's pipeline: the order is cancelled and counted as aborted.
+class OrderPipeline {
+public:
+    using Stage = function<bool(Order&)>;
+
+private:
+    struct StageInfo {
+        string name;
+        Stage fn;
+        unique_ptr<atomic<uint64_t>> completed = make_unique<atomic<uint64_t>>(0);
+    };
+    WorkStealingPool& pool;
+    vector<StageInfo> stages;
+    atomic<uint64_t> finished{0}, aborted{0};
+
+    void runStage(shared_ptr<Order> order, size_t i) {
+        if (i == stages.size()) {
+            finished.fetch_add(1, memory_order_relaxed);
+            return;
+        }
+        bool passed;
+        try {
+            passed = stages[i].fn(*order);
+        } catch (...) {
+            passed = false;
+        }
+        if (!passed) {
+            order->cancel();
+            aborted.fetch_add(1, memory_order_relaxed);
+            return;
+        }
+        stages[i].completed->fetch_add(1, memory_order_relaxed);
+        pool.submit([this, order = move(order), i]() mutable { runStage(move(order), i + 1); });
+    }
+
+public:
+    explicit OrderPipeline(WorkStealingPool& pool) : pool(pool) {}
+
+    OrderPipeline& then(string name, Stage fn) {
+        stages.push_back({move(name), move(fn)});
+        return *this;
+    }
+
+    void submit(shared_ptr<Order> order) {
+        pool.submit([this, order = move(order)]() mutable { runStage(move(order), 0); });
+    }
+
+    void wait() { pool.waitIdle(); }
+
+    uint64_t finishedCount() const { return finished.load(); }
+    uint64_t abortedCount() const { return aborted.load(); }
+
+    string summary() const {
+        ostringstream oss;
+        for (const auto &s : stages) oss << s.name << "=" << s.completed->load() << " ";
+        oss << "finished=" << finished.load() << " aborted=" << aborted.load();
+        return oss.str();
+    }
+};
+
+// -------------------------
+// Repricer: bulk price updates on the pool
+// -------------------------
+// Rules run in order; each one whose filter accepts the product rewrites the
+// running price (rule-based markdowns, demand formulas, floors and caps).
+// Results are rounded to the product currency's minor unit. A run computes
+// all new prices in parallel first, so a rule that throws or produces an
+// invalid price leaves the catalog untouched, then stages the changes in
+// parallel and publishes them as one epoch: every cart, order and converter
+// sees either none or all of the run. The first pass runs without the
+// writer lock; under it, products whose price moved meanwhile (a setPrice()
+// from another thread) are computed again from their current price, so no
+// change is overwritten with a price derived from the one it replaced.
+struct PriceRule {
+    string name;
+    function<bool(const Product&)> applies;  // empty: every product
+    function<double(const Product&, double price)> formula;
+
+    static PriceRule scale(string name, ProductKind kind, double factor) {
+        return {move(name), [kind](const Product& p) { return kindOf(p) == kind; }, [factor](const Product&, double price) { return price * factor; }};
+    }
+};
+
+struct RepriceStats {
+    size_t products = 0, changed = 0;
+    uint64_t epoch = 0;
+    double computeMs = 0, publishMs = 0;
+};
+
+class Repricer {
+    WorkStealingPool& pool;
+    vector<PriceRule> rules;
+    size_t chunk;
+
+    struct ChunkJob {
+        atomic<size_t> next{0}, done{0};
+        mutex m;
+        condition_variable finished;
+        exception_ptr failure;
+    };
+
+    // fn(begin, end) for consecutive ranges; rethrows the first failure. The
+    // caller claims chunks itself and pool workers help as they come free, so
+    // it waits only for chunks already running, never for the pool to go
+    // idle: run() holds PricePublisher::writer() here, and other pool tasks
+    // may be waiting for it (setPrice) or the caller may be a pool worker.
+    // A helper that starts after every chunk is claimed returns at once.
+    template<typename F>
+    void forChunks(size_t n, F&& fn) {
+        const size_t count = (n + chunk - 1) / chunk;
+        if (!count) return;
+        auto job = make_shared<ChunkJob>();
+        auto work = [job, count, n, step = chunk, &fn] {
+            for (size_t c; (c = job->next.fetch_add(1)) < count;) {
+                try {
+                    fn(c * step, min(n, (c + 1) * step));
+                } catch (...) {
+                    lock_guard<mutex> lock(job->m);
+                    if (!job->failure) job->failure = current_exception();
+                }
+                if (job->done.fetch_add(1) + 1 == count) {
+                    lock_guard<mutex> lock(job->m);
+                    job->finished.notify_all();
+                }
+            }
+        };
+        for (size_t h = 1; h < min(count, pool.size() + 1); ++h) pool.submit(work);
+        work();
+        unique_lock<mutex> lock(job->m);
+        job->finished.wait(lock, [&] { return job->done.load() == count; });
+        if (job->failure) rethrow_exception(job->failure);
+    }
+
+public:
+    explicit Repricer(WorkStealingPool& pool, size_t chunk = 16384) : pool(pool), chunk(max<size_t>(1, chunk)) {}
+
+    Repricer& add(PriceRule rule) {
+        if (!rule.formula) throw invalid_argument("price rule " + rule.name + " has no formula");
+        rules.push_back(move(rule));
+        return *this;
+    }
+
+    // The price `p` would get from the rules (no side effects).
+    double priceFor(const Product& p) const { return priceFrom(p, p.getBasePrice()); }
+
+    // The same, starting from base price `price`.
+    double priceFrom(const Product& p, double price) const {
+        for (const auto &rule : rules)
+            if (!rule.applies || rule.applies(p)) price = rule.formula(p, price);
+        price = fx::roundTo(price, fx::minorScale(p.getCurrency()));
+        if (!isfinite(price) || price < 0) throw domain_error("repricing product " + to_string(p.getId()) + " gave an invalid price");
+        return price;
+    }
+
+    RepriceStats run(Product* const* products, size_t n) {
+        RepriceStats stats;
+        stats.products = n;
+        auto start = chrono::steady_clock::now();
+        vector<double> from(n), next(n);
+        forChunks(n, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                from[i] = products[i]->getBasePrice();
+                next[i] = priceFrom(*products[i], from[i]);
+            }
+        });
+        auto computed = chrono::steady_clock::now();
+
+        lock_guard<mutex> lock(PricePublisher::writer());
+        // prices are stable now; redo the ones that changed since, before
+        // staging anything, so a throwing rule still leaves no trace
+        forChunks(n, [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                double now = products[i]->getBasePrice();
+                if (now != from[i]) {
+                    from[i] = now;
+                    next[i] = priceFrom(*products[i], now);
+                }
+            }
+        });
+        stats.epoch = PricePublisher::published() + 1;
+        vector<vector<PriceChange>> changes((n + chunk - 1) / chunk);
+        forChunks(n, [&](size_t begin, size_t end) {
+            auto &out = changes[begin / chunk];
+            for (size_t i = begin; i < end; ++i)
+                if (next[i] != from[i]) out.push_back({products[i]->getId(), products[i]->stagePrice(next[i], stats.epoch), next[i]});
+        });
+        vector<PriceChange> all;
+        for (auto &c : changes) all.insert(all.end(), c.begin(), c.end());
+        stats.changed = all.size();
+        PricePublisher::publishLocked(stats.epoch, all.data(), all.size());
+        auto published = chrono::steady_clock::now();
+        stats.computeMs = chrono::duration<double, milli>(computed - start).count();
+        stats.publishMs = chrono::duration<double, milli>(published - computed).count();
+        return stats;
+    }
+
+    RepriceStats run(const GenericCatalog<Product>& catalog) {
+        vector<Product*> products;
+        products.reserve(catalog.size());
+        for (const auto &p : catalog.getItems()) products.push_back(p.get());
+        return run(products.data(), products.size());
+    }
+};
+
+// -------------------------
+// Price history (Gorilla-compressed time series)
+// -------------------------
+// Per product, (unix seconds, base price) points in blocks of up to
+// kBlockPoints. Inside a block timestamps are stored as delta-of-delta and
+// prices as the XOR with the previous price, with the bucket layout of the
+// Gorilla paper: an unchanged price costs one bit and a repeated change
+// interval one bit. Prices that are whole cents are XORed as cents (999.0
+// rather than 9.99), whose mantissas end in long runs of zeros; a block falls
+// back to plain doubles at the first price that is not. Blocks record their
+// first and last time, so a range query decodes only the blocks it overlaps.
+namespace gorilla {
+struct Point {
+    int64_t time;
+    double value;
+};
+
+// MSB-first bit stream in 64-bit words.
+class BitWriter {
+    vector<uint64_t> words;
+    size_t bits = 0;
+
+public:
+    void put(uint64_t v, unsigned n) {  // n <= 64
+        if (!n) return;
+        if (n < 64) v &= (uint64_t(1) << n) - 1;
+        unsigned used = unsigned(bits & 63);
+        if (!used) words.push_back(0);
+        unsigned room = 64 - used;
+        if (n <= room) words.back() |= v << (room - n);
+        else {
+            words.back() |= v >> (n - room);
+            words.push_back(v << (64 - (n - room)));
+        }
+        bits += n;
+    }
+    size_t size() const { return bits; }
+    const uint64_t* data() const { return words.data(); }
+    void shrink() { words.shrink_to_fit(); }
+};
+
+class BitReader {
+    const uint64_t* words;
+    size_t pos = 0;
+
+public:
+    explicit BitReader(const uint64_t* words) : words(words) {}
+    uint64_t get(unsigned n) {
+        if (!n) return 0;
+        unsigned off = unsigned(pos & 63);
+        uint64_t v = words[pos >> 6] << off;
+        if (off + n > 64) v |= words[(pos >> 6) + 1] >> (64 - off);
+        pos += n;
+        return n == 64 ? v : v >> (64 - n);
+    }
+    int64_t getSigned(unsigned n) {
+        uint64_t v = get(n);
+        return n == 64 ? int64_t(v) : int64_t(v << (64 - n)) >> (64 - n);
+    }
+};
+
+class Block {
+    BitWriter bits;
+    int64_t first = 0, last = 0, prevDelta = 0;
+    uint64_t prevValue = 0;
+    unsigned prevLead = 0, prevTrail = 0;
+    bool window = false;  // prevLead/prevTrail set
+    bool cents = true;    // values are stored x100
+    uint32_t n = 0;
+
+    static bool fits(int64_t v, unsigned n) { return v >= -(int64_t(1) << (n - 1)) && v < (int64_t(1) << (n - 1)); }
+
+    static bool wholeCents(double price) {
+        double c = price * 100;
+        if (c != nearbyint(c)) return false;
+        double back = c / 100;
+        return memcmp(&back, &price, sizeof price) == 0;
+    }
+
+public:
+    int64_t firstTime() const { return first; }
+    int64_t lastTime() const { return last; }
+    uint32_t size() const { return n; }
+    size_t bytes() const { return (bits.size() + 7) / 8 + sizeof(first) + sizeof(last) + sizeof(n) + 1; }
+    void seal() { bits.shrink(); }
+
+    void append(int64_t t, double price) {
+        if (cents && !wholeCents(price)) {
+            Block plain;
+            plain.cents = false;
+            forEach([&](const Point& p) { plain.append(p.time, p.value); return true; });
+            *this = move(plain);
+        }
+        double stored = cents ? price * 100 : price;
+        uint64_t v;
+        memcpy(&v, &stored, sizeof v);
+        if (n++ == 0) {
+            first = last = t;
+            bits.put(v, 64);
+            prevValue = v;
+            return;
+        }
+        // timestamp: '0' | '10' 7 bits | '110' 9 | '1110' 12 | '11110' 32 | '11111' 64
+        int64_t delta = t - last, dod = delta - prevDelta;
+        if (dod == 0) bits.put(0, 1);
+        else if (fits(dod, 7)) { bits.put(0b10, 2); bits.put(uint64_t(dod), 7); }
+        else if (fits(dod, 9)) { bits.put(0b110, 3); bits.put(uint64_t(dod), 9); }
+        else if (fits(dod, 12)) { bits.put(0b1110, 4); bits.put(uint64_t(dod), 12); }
+        else if (fits(dod, 32)) { bits.put(0b11110, 5); bits.put(uint64_t(dod), 32); }
+        else { bits.put(0b11111, 5); bits.put(uint64_t(dod), 64); }
+        last = t;
+        prevDelta = delta;
+        // price: '0' same | '10' bits inside the previous window | '11' 5-bit lead, 6-bit length-1, bits
+        uint64_t x = v ^ prevValue;
+        prevValue = v;
+        if (!x) {
+            bits.put(0, 1);
+            return;
+        }
+        unsigned lead = min(unsigned(__builtin_clzll(x)), 31u), trail = unsigned(__builtin_ctzll(x));
+        if (window && lead >= prevLead && trail >= prevTrail) {
+            bits.put(0b10, 2);
+            bits.put(x >> prevTrail, 64 - prevLead - prevTrail);
+            return;
+        }
+        bits.put(0b11, 2);
+        bits.put(lead, 5);
+        bits.put(63 - lead - trail, 6);
+        bits.put(x >> trail, 64 - lead - trail);
+        prevLead = lead;
+        prevTrail = trail;
+        window = true;
+    }
+
+    // fn(Point) for the points in time order until it returns false
+    template<typename F>
+    void forEach(F&& fn) const {
+        if (!n) return;
+        BitReader r(bits.data());
+        uint64_t v = r.get(64);
+        int64_t t = first, delta = 0;
+        unsigned lead = 0, trail = 0;
+        for (uint32_t i = 0;;) {
+            double price;
+            memcpy(&price, &v, sizeof price);
+            if (!fn(Point{t, cents ? price / 100 : price}) || ++i == n) return;
+            int64_t dod = 0;
+            if (r.get(1)) {
+                if (!r.get(1)) dod = r.getSigned(7);
+                else if (!r.get(1)) dod = r.getSigned(9);
+                else if (!r.get(1)) dod = r.getSigned(12);
+                else dod = r.getSigned(r.get(1) ? 64 : 32);
+            }
+            delta += dod;
+            t += delta;
+            if (r.get(1)) {
+                if (r.get(1)) {
+                    lead = unsigned(r.get(5));
+                    trail = 63 - lead - unsigned(r.get(6));
+                }
+                v ^= r.get(64 - lead - trail) << trail;
+            }
+        }
+    }
+};
+} // namespace gorilla
+
+// Records every published price change (see PricePublisher) for as long as
+// it lives; record() adds points directly, e.g. for a backfill. A point older
+// than the product's last one is inserted in time order, after any points
+// with the same time, by re-encoding the block it falls into.
+//
+// The publisher listener runs under PricePublisher::writer(), so it only
+// queues the changes; a recorder thread appends them in batches, taking each
+// shard lock once per batch. Readers drain the queue first and so see every
+// change published before the call.
+class PriceHistory {
+    static constexpr size_t kShards = 64;
+    static constexpr uint32_t kBlockPoints = 256;
+    struct Shard {
+        mutex m;
+        unordered_map<uid64_t, vector<gorilla::Block>> series;
+    };
+    struct Pending { uid64_t id; int64_t time; double price; };
+
+    array<Shard, kShards> shards;
+    string listenerName;
+    mutex queueMutex, drainMutex;
+    condition_variable queued;
+    vector<Pending> queue;
+    atomic<size_t> unrecorded{0};  // queued or in a batch still being appended
+    bool stopping = false;
+    thread recorder;
+
+    Shard& shardOf(uid64_t id) { return shards[id % kShards]; }
+
+    static void appendLocked(vector<gorilla::Block>& blocks, int64_t t, double price) {
+        if (!blocks.empty() && t < blocks.back().lastTime()) {
+            insertLocked(blocks, t, price);
+            return;
+        }
+        if (blocks.empty() || blocks.back().size() == kBlockPoints) {
+            if (!blocks.empty()) blocks.back().seal();
+            blocks.emplace_back();
+        }
+        blocks.back().append(t, price);
+    }
+
+    // t is older than the last point: re-encode the first block ending after
+    // t with the point added, split in two halves when it would overflow.
+    static void insertLocked(vector<gorilla::Block>& blocks, int64_t t, double price) {
+        auto b = partition_point(blocks.begin(), blocks.end(), [&](const gorilla::Block& blk) { return blk.lastTime() <= t; });
+        vector<gorilla::Point> points;
+        points.reserve(b->size() + 1);
+        b->forEach([&](const gorilla::Point& p) { points.push_back(p); return true; });
+        auto at = upper_bound(points.begin(), points.end(), t, [](int64_t time, const gorilla::Point& p) { return time < p.time; });
+        points.insert(at, gorilla::Point{t, price});
+        const bool last = next(b) == blocks.end();
+        size_t split = points.size() > kBlockPoints ? points.size() / 2 : points.size();
+        gorilla::Block head, tail;
+        for (size_t i = 0; i < split; ++i) head.append(points[i].time, points[i].value);
+        for (size_t i = split; i < points.size(); ++i) tail.append(points[i].time, points[i].value);
+        if (tail.size() || !last) head.seal();
+        *b = move(head);
+        if (tail.size()) {
+            if (!last) tail.seal();
+            blocks.insert(next(b), move(tail));
+        }
+    }
+
+    // Records the queued changes; batches go in publication order. A batch
+    // stays counted in `unrecorded` until appended, so a reader skips the
+    // locks only when nothing published is still on its way; otherwise it
+    // waits on drainMutex for the batch the recorder already took.
+    void drain() {
+        if (unrecorded.load(memory_order_acquire) == 0) return;
+        lock_guard<mutex> order(drainMutex);
+        vector<Pending> batch;
+        {
+            lock_guard<mutex> lock(queueMutex);
+            batch.swap(queue);
+        }
+        stable_sort(batch.begin(), batch.end(), [](const Pending& a, const Pending& b) { return a.id % kShards < b.id % kShards; });
+        for (size_t i = 0; i < batch.size();) {
+            auto &shard = shardOf(batch[i].id);
+            lock_guard<mutex> lock(shard.m);
+            for (const size_t s = batch[i].id % kShards; i < batch.size() && batch[i].id % kShards == s; ++i)
+                appendLocked(shard.series[batch[i].id], batch[i].time, batch[i].price);
+        }
+        unrecorded.fetch_sub(batch.size(), memory_order_release);
+    }
+
+    // fn(block) for each block that may hold points in [from, to]
+    template<typename F>
+    void overlapping(uid64_t id, int64_t from, int64_t to, F&& fn) {
+        auto &shard = shardOf(id);
+        lock_guard<mutex> lock(shard.m);
+        auto it = shard.series.find(id);
+        if (it == shard.series.end()) return;
+        const auto &blocks = it->second;
+        auto b = partition_point(blocks.begin(), blocks.end(), [&](const gorilla::Block& blk) { return blk.lastTime() < from; });
+        for (; b != blocks.end() && b->firstTime() <= to; ++b) fn(*b);
+    }
+
+public:
+    using Point = gorilla::Point;
+
+    explicit PriceHistory(bool subscribe = true) {
+        if (!subscribe) return;
+        recorder = thread([this] {
+            unique_lock<mutex> lock(queueMutex);
+            for (;;) {
+                queued.wait(lock, [&] { return stopping || !queue.empty(); });
+                if (queue.empty()) return;
+                lock.unlock();
+                drain();
+                lock.lock();
+            }
+        });
+        listenerName = "price-history@" + to_string(uintptr_t(this));
+        PricePublisher::subscribe(listenerName, [this](const PriceChange* changes, size_t n, uint64_t) {
+            int64_t now = int64_t(time(nullptr));
+            {
+                lock_guard<mutex> lock(queueMutex);
+                for (size_t i = 0; i < n; ++i) queue.push_back({changes[i].productId, now, changes[i].newPrice});
+                unrecorded.fetch_add(n, memory_order_release);
+            }
+            queued.notify_one();
+        });
+    }
+    ~PriceHistory() {
+        if (listenerName.empty()) return;
+        PricePublisher::unsubscribe(listenerName);
+        {
+            lock_guard<mutex> lock(queueMutex);
+            stopping = true;
+        }
+        queued.notify_one();
+        recorder.join();
+    }
+    PriceHistory(const PriceHistory&) = delete;
+    PriceHistory& operator=(const PriceHistory&) = delete;
+
+    void record(uid64_t id, int64_t t, double price) {
+        drain();  // keep the queued changes ahead of this point
+        auto &shard = shardOf(id);
+        lock_guard<mutex> lock(shard.m);
+        appendLocked(shard.series[id], t, price);
+    }
+
+    // Points with from <= time <= to, in time order.
+    vector<Point> range(uid64_t id, int64_t from, int64_t to) {
+        drain();
+        vector<Point> out;
+        overlapping(id, from, to, [&](const gorilla::Block& b) {
+            b.forEach([&](const Point& p) {
+                if (p.time > to) return false;
+                if (p.time >= from) out.push_back(p);
+                return true;
+            });
+        });
+        return out;
+    }
+
+    // The price recorded last at or before `t`.
+    optional<double> priceAt(uid64_t id, int64_t t) {
+        drain();
+        auto &shard = shardOf(id);
+        lock_guard<mutex> lock(shard.m);
+        auto it = shard.series.find(id);
+        if (it == shard.series.end()) return nullopt;
+        const auto &blocks = it->second;
+        auto b = partition_point(blocks.begin(), blocks.end(), [&](const gorilla::Block& blk) { return blk.firstTime() <= t; });
+        if (b == blocks.begin()) return nullopt;
+        optional<double> price;
+        prev(b)->forEach([&](const Point& p) {
+            if (p.time > t) return false;
+            price = p.value;
+            return true;
+        });
+        return price;
+    }
+
+    // Lowest recorded price in [from, to], e.g. for "lowest in 30 days" badges.
+    optional<double> lowest(uid64_t id, int64_t from, int64_t to) {
+        optional<double> low;
+        for (const auto &p : range(id, from, to)) low = min(low.value_or(p.value), p.value);
+        return low;
+    }
+
+    string stats() {
+        drain();
+        size_t products = 0, points = 0, bytes = 0;
+        for (auto &shard : shards) {
+            lock_guard<mutex> lock(shard.m);
+            products += shard.series.size();
+            for (const auto &kv : shard.series)
+                for (const auto &b : kv.second) {
+                    points += b.size();
+                    bytes += b.bytes();
+                }
+        }
+        ostringstream oss;
+        oss << "products=" << products << " points=" << points << " bytes=" << bytes << fixed << setprecision(2)
+            << " bytes_per_point=" << (points ? double(bytes) / double(points) : 0.0);
+        return oss.str();
+    }
+};
+
+// -------------------------
+// Catalog queries
+// -------------------------
+// A small filter language for merchandising, compiled into a plan over the
+// catalog's indexes, e.g.
+//   Clothing, size M, clearance, price < 50, sort by price
+//   type in (Electronics, Grocery) and name ~ "organic milk" order by price desc limit 10
+// Clauses are joined by ',' or AND, which may be left out before sort/order by
+// and limit. A bare type name stands for type = ..., a bare `clearance` for
+// clearance = true and `field value` for field = value.
+// Fields: id, sku, name, type, price (final price), size, clearance, currency,
+// warranty (months), expiry (date). Operators: = != < <= > >= in (...) and ~
+// (name has all the words, sku contains the text).
+namespace cq {
+enum class Field : uint8_t { Id, Sku, Name, Type, Price, Size, Clearance, Currency, Warranty, Expiry };
+enum class Op : uint8_t { Eq, Ne, Lt, Le, Gt, Ge, In, Contains };
+
+inline const char* fieldName(Field f) {
+    static const char* const names[] = {"id", "sku", "name", "type", "price", "size", "clearance", "currency", "warranty", "expiry"};
+    return names[size_t(f)];
+}
+
+inline const char* opName(Op op) {
+    static const char* const names[] = {"=", "!=", "<", "<=", ">", ">=", "in", "~"};
+    return names[size_t(op)];
+}
+
+inline bool isNumeric(Field f) { return f == Field::Id || f == Field::Price || f == Field::Warranty; }
+inline bool isFacet(Field f) { return f == Field::Type || f == Field::Size || f == Field::Clearance || f == Field::Currency; }
+inline bool isRange(Op op) { return op == Op::Lt || op == Op::Le || op == Op::Gt || op == Op::Ge; }
+
+// `v` as a product id; nullopt unless it is a whole number below 2^64
+// (converting anything else to an integer is undefined).
+inline optional<uid64_t> asId(double v) {
+    if (!(v >= 0 && v < 18446744073709551616.0) || v != floor(v)) return nullopt;
+    return uid64_t(v);
+}
+
+// An id literal as written: plain digits are read as an integer, so ids past
+// 2^53 that share a double stay apart; other spellings (1e6) go through asId.
+inline optional<uid64_t> asId(const string& literal, double parsed) {
+    uint64_t n;
+    auto [end, ec] = from_chars(literal.data(), literal.data() + literal.size(), n);
+    if (!literal.empty() && end == literal.data() + literal.size()) return ec == errc() ? optional<uid64_t>(n) : nullopt;
+    return asId(parsed);
+}
+
+inline string lower(string_view s) {
+    string out(s);
+    for (auto &c : out) c = char(tolower((unsigned char)c));
+    return out;
+}
+
+// Lower-cased alphanumeric words of `text`, as the name index stores them.
+inline vector<string> words(string_view text) {
+    vector<string> out;
+    string w;
+    for (char c : text) {
+        if (isalnum((unsigned char)c)) w += char(tolower((unsigned char)c));
+        else if (!w.empty()) {
+            out.push_back(move(w));
+            w.clear();
+        }
+    }
+    if (!w.empty()) out.push_back(move(w));
+    return out;
+}
+
+struct Predicate {
+    Field field;
+    Op op;
+    vector<string> values;   // type, currency and clearance in canonical form
+    vector<double> numbers;  // numeric fields: the values parsed
+
+    string text() const {
+        auto quoted = [&](const string& v) { return v.find_first_of(" ,()=<>!~") == string::npos && !v.empty() ? v : '"' + v + '"'; };
+        string out = string(fieldName(field)) + ' ' + opName(op) + ' ';
+        if (op != Op::In) return out + quoted(values[0]);
+        out += '(';
+        for (size_t i = 0; i < values.size(); ++i) out += (i ? ", " : "") + quoted(values[i]);
+        return out + ')';
+    }
+};
+
+struct Query {
+    vector<Predicate> where;  // all must hold
+    optional<Field> orderBy;  // id, sku, name or price
+    bool descending = false;
+    size_t limit = SIZE_MAX;
+};
+
+// Throws invalid_argument naming the column of the offending token.
+class Parser {
+    struct Token {
+        enum Kind { Word, Text, Symbol, End } kind;
+        string text;
+        size_t at;
+    };
+    vector<Token> tokens;
+    size_t pos = 0;
+
+    static bool isSymbol(char c) { return c && strchr("=<>!~,()", c); }
+
+    static vector<Token> tokenize(string_view s) {
+        vector<Token> out;
+        for (size_t i = 0; i < s.size();) {
+            char c = s[i];
+            if (isspace((unsigned char)c)) ++i;
+            else if (c == '"' || c == '\'') {
+                size_t end = s.find(c, i + 1);
+                if (end == string_view::npos) throw invalid_argument("query: unterminated string at column " + to_string(i + 1));
+                out.push_back({Token::Text, string(s.substr(i + 1, end - i - 1)), i});
+                i = end + 1;
+            } else if (isSymbol(c)) {
+                size_t len = (c == '<' || c == '>' || c == '!') && i + 1 < s.size() && s[i + 1] == '=' ? 2 : 1;
+                if (c == '!' && len == 1) throw invalid_argument("query: expected != at column " + to_string(i + 1));
+                out.push_back({Token::Symbol, string(s.substr(i, len)), i});
+                i += len;
+            } else {
+                size_t start = i;
+                while (i < s.size() && !isspace((unsigned char)s[i]) && !isSymbol(s[i]) && s[i] != '"' && s[i] != '\'') ++i;
+                out.push_back({Token::Word, string(s.substr(start, i - start)), start});
+            }
+        }
+        out.push_back({Token::End, "", s.size()});
+        return out;
+    }
+
+    [[noreturn]] static void fail(const string& what, const Token& t) {
+        throw invalid_argument("query: " + what + " at column " + to_string(t.at + 1));
+    }
+
+    const Token& peek() const { return tokens[pos]; }
+    static bool keyword(const Token& t, const char* k) { return t.kind == Token::Word && lower(t.text) == k; }
+    bool acceptWord(const char* k) { return keyword(peek(), k) ? (++pos, true) : false; }
+    bool acceptSymbol(const char* s) { return peek().kind == Token::Symbol && peek().text == s ? (++pos, true) : false; }
+    bool atClauseEnd() const { return peek().kind == Token::End || (peek().kind == Token::Symbol && peek().text == ",") || keyword(peek(), "and"); }
+
+    string value() {
+        const Token &t = peek();
+        if (t.kind != Token::Word && t.kind != Token::Text) fail("expected a value", t);
+        ++pos;
+        return t.text;
+    }
+
+    static optional<Field> fieldOf(string_view w) {
+        string l = lower(w);
+        for (size_t f = 0; f <= size_t(Field::Expiry); ++f)
+            if (l == fieldName(Field(f))) return Field(f);
+        return nullopt;
+    }
+
+    static optional<ProductKind> kindNamed(string_view w) {
+        string l = lower(w);
+        for (ProductKind k : {ProductKind::Product, ProductKind::Electronics, ProductKind::Clothing, ProductKind::Grocery})
+            if (l == lower(kindName(k))) return k;
+        return nullopt;
+    }
+
+    // Validates the operator for the field and puts the values in canonical form.
+    static void check(Predicate& p, const Token& at) {
+        const string field = fieldName(p.field);
+        if (isRange(p.op) && (isFacet(p.field) || p.field == Field::Sku || p.field == Field::Name))
+            fail(field + " takes = != in, not " + opName(p.op), at);
+        if (p.op == Op::Contains && p.field != Field::Name && p.field != Field::Sku) fail("~ applies to name and sku only", at);
+        for (auto &v : p.values) {
+            if (isNumeric(p.field)) {
+                char* end = nullptr;
+                double d = strtod(v.c_str(), &end);
+                if (v.empty() || *end || !isfinite(d)) fail(field + " needs a number, got '" + v + "'", at);
+                p.numbers.push_back(d);
+            } else if (p.field == Field::Type) {
+                auto kind = kindNamed(v);
+                if (!kind) fail("unknown product type '" + v + "'", at);
+                v = kindName(*kind);
+            } else if (p.field == Field::Currency) {
+                string code = v;
+                for (auto &c : code) c = char(toupper((unsigned char)c));
+                auto currency = parseCurrency(code);
+                if (!currency) fail("unknown currency '" + v + "'", at);
+                v = currencyInfo(*currency).code;
+            } else if (p.field == Field::Clearance) {
+                string l = lower(v);
+                if (l == "true" || l == "yes") v = "true";
+                else if (l == "false" || l == "no") v = "false";
+                else fail("clearance is true or false, got '" + v + "'", at);
+            }
+        }
+        if (p.op == Op::Contains && p.field == Field::Name && words(p.values[0]).empty()) fail("~ needs at least one word", at);
+    }
+
+    void clause(Query& q) {
+        const Token &t = peek();
+        if (t.kind != Token::Word) fail("expected a field", t);
+        const string w = lower(t.text);
+        ++pos;
+        if (w == "sort" || w == "order") {
+            if (!acceptWord("by")) fail("expected 'by'", peek());
+            const Token &f = peek();
+            auto field = f.kind == Token::Word ? fieldOf(f.text) : nullopt;
+            if (!field || !(*field == Field::Id || *field == Field::Sku || *field == Field::Name || *field == Field::Price))
+                fail("can only sort by id, sku, name or price", f);
+            ++pos;
+            q.orderBy = *field;
+            q.descending = acceptWord("desc");
+            if (!q.descending) acceptWord("asc");
+            return;
+        }
+        if (w == "limit") {
+            const Token &n = peek();
+            size_t rows = 0;
+            auto r = from_chars(n.text.data(), n.text.data() + n.text.size(), rows);
+            if (n.kind != Token::Word || r.ec != errc() || r.ptr != n.text.data() + n.text.size()) fail("expected a row count", n);
+            ++pos;
+            q.limit = rows;
+            return;
+        }
+        Predicate p{Field::Type, Op::Eq, {}, {}};
+        auto field = fieldOf(w);
+        if (!field) {
+            if (!kindNamed(w)) fail("unknown field or type '" + t.text + "'", t);
+            p.values.push_back(t.text);
+        } else {
+            p.field = *field;
+            const Token &o = peek();
+            static const char* const ops[] = {"=", "!=", "<", "<=", ">", ">="};
+            auto op = find_if(begin(ops), end(ops), [&](const char* s) { return o.kind == Token::Symbol && o.text == s; });
+            if (op != end(ops) || (o.kind == Token::Symbol && o.text == "~")) {
+                ++pos;
+                p.op = op != end(ops) ? Op(op - begin(ops)) : Op::Contains;
+                p.values.push_back(value());
+            } else if (acceptWord("in")) {
+                if (!acceptSymbol("(")) fail("expected '('", peek());
+                do p.values.push_back(value());
+                while (acceptSymbol(","));
+                if (!acceptSymbol(")")) fail("expected ')'", peek());
+                p.op = Op::In;
+            } else if (p.field == Field::Clearance && atClauseEnd()) {
+                p.values.push_back("true");
+            } else {
+                p.values.push_back(value());
+            }
+        }
+        check(p, t);
+        q.where.push_back(move(p));
+    }
+
+public:
+    explicit Parser(string_view text) : tokens(tokenize(text)) {}
+
+    Query parse() {
+        Query q;
+        if (peek().kind == Token::End) fail("empty query", peek());
+        clause(q);
+        while (peek().kind != Token::End) {
+            const bool tail = keyword(peek(), "sort") || keyword(peek(), "order") || keyword(peek(), "limit");
+            if (!acceptSymbol(",") && !acceptWord("and") && !tail) fail("expected ',' or 'and'", peek());
+            clause(q);
+        }
+        return q;
+    }
+};
+
+inline Query parse(string_view text) { return Parser(text).parse(); }
+} // namespace cq
+
+// Indexes over a catalog for cq queries: id and SKU hashes, the products
+// sorted by final price, per-value bitmaps over the low-cardinality facets
+// (type, size, clearance, currency) and an index of name words. For each
+// query the planner costs every index that applies, drives the query from the
+// cheapest and checks the remaining predicates per row, cheapest per row
+// rejected first. Queries read an immutable snapshot; refresh() swaps in a new
+// one after products are added. A published price change leaves the price
+// index stale: until refresh() it only feeds estimates, price predicates are
+// checked on live prices, and plans built on it are planned again when run.
+class CatalogQueryEngine {
+    struct Bitmap {
+        vector<uint64_t> words;
+        size_t count = 0;
+        bool test(uint32_t row) const { return words[row >> 6] >> (row & 63) & 1; }
+    };
+
+    static constexpr size_t kFacets = 4;
+    static size_t facetSlot(cq::Field f) {
+        switch (f) {
+            case cq::Field::Type: return 0;
+            case cq::Field::Size: return 1;
+            case cq::Field::Clearance: return 2;
+            default: return 3;
+        }
+    }
+
+    struct Snapshot {
+        vector<shared_ptr<Product>> rows;
+        unordered_map<uid64_t, uint32_t> rowOfId;
+        unordered_map<string_view, uint32_t> rowOfSku;         // views into the rows' own SKUs
+        vector<pair<double, uint32_t>> byPrice;                // final price at priceEpoch, ascending
+        uint64_t priceEpoch = 0;                               // PricePublisher::published() when built
+        array<unordered_map<string, Bitmap>, kFacets> facets;  // lower-cased value -> rows
+        unordered_map<string, vector<uint32_t>> postings;      // name word -> rows, ascending
+        vector<int> warranty;                                  // months; -1 unless Electronics
+        vector<string_view> expiry;                            // empty unless Grocery
+    };
+
+    const GenericCatalog<Product>& catalog;
+    shared_ptr<const Snapshot> current;
+
+    // Estimated cost units (about one bitmap probe each) of the work a plan does.
+    static constexpr double kVisit = 0.25, kHashProbe = 4, kSortCompare = 1;
+
+    static double checkCost(const cq::Predicate& p) {
+        switch (p.field) {
+            case cq::Field::Price: return 2;  // virtual finalPrice()
+            case cq::Field::Name: return p.op == cq::Op::Contains ? 2.0 * double(cq::words(p.values[0]).size()) : 3;
+            case cq::Field::Sku: return p.op == cq::Op::Contains ? 3 : 1;
+            case cq::Field::Expiry: return 0.5;
+            default: return 0.25;
+        }
+    }
+
+public:
+    enum class Access : uint8_t { Scan, Hash, PriceIndex, Facets, Words };
+
+    class Plan {
+        friend class CatalogQueryEngine;
+        shared_ptr<const Snapshot> snapshot;
+        cq::Query query;
+        Access access = Access::Scan;
+        vector<size_t> driving;       // predicates the access path answers
+        vector<size_t> filters;       // checked per row, in this order
+        vector<double> selectivity;   // per predicate
+        vector<vector<const Bitmap*>> bitmaps;              // facet predicates: per value, null if absent
+        vector<vector<const vector<uint32_t>*>> postings;   // name ~: per word, null if absent
+        size_t priceFirst = 0, priceLast = 0;               // byPrice range for PriceIndex
+        vector<uint64_t> facetRows;   // Facets over several predicates: the rows passing all, from planning
+        bool ordered = false;         // rows come out in query.orderBy order
+        bool priceIndexStale = false; // left out of the plan
+        double rows = 0, cost = 0;    // estimated rows from the access path, total cost
+        vector<pair<string, double>> considered;  // access path, estimated cost
+
+        static const char* accessName(Access a) {
+            static const char* const names[] = {"full scan", "id/sku hash", "price index", "facet bitmaps", "name word index"};
+            return names[size_t(a)];
+        }
+
+    public:
+        double estimatedCost() const { return cost; }
+        Access accessPath() const { return access; }
+
+        // The chosen plan, step by step, with the estimates behind it.
+        string explain() const {
+            auto num = [](double v) {
+                ostringstream o;
+                if (v >= 10) o << fixed << setprecision(0);
+                else o << setprecision(2);
+                o << v;
+                return o.str();
+            };
+            ostringstream out;
+            out << "Access: " << accessName(access);
+            for (size_t i = 0; i < driving.size(); ++i) out << (i ? " AND " : " [") << query.where[driving[i]].text() << (i + 1 == driving.size() ? "]" : "");
+            if (access == Access::PriceIndex && ordered) out << (query.descending ? " descending" : " ascending");
+            out << " -> ~" << num(rows) << " rows\n";
+            for (size_t f : filters)
+                out << "Filter: " << query.where[f].text() << " (selectivity " << num(selectivity[f]) << ", cost " << num(checkCost(query.where[f])) << "/row)\n";
+            if (query.orderBy)
+                out << "Sort: " << cq::fieldName(*query.orderBy) << (query.descending ? " desc" : " asc")
+                    << (ordered ? " (from the index, no sort)" : query.limit != SIZE_MAX ? " (top " + to_string(query.limit) + ")" : "") << "\n";
+            if (query.limit != SIZE_MAX) out << "Limit: " << query.limit << (ordered ? " (stops early)" : "") << "\n";
+            out << "Estimated cost: " << num(cost) << "\nConsidered:";
+            for (const auto &c : considered) out << " " << c.first << " " << num(c.second) << (c.first == accessName(access) ? " (chosen)" : "") << ";";
+            if (priceIndexStale) out << " price index stale until refresh();";
+            string s = out.str();
+            s.back() = '\n';
+            return s;
+        }
+    };
+
+private:
+    static bool compare(double v, const cq::Predicate& p) {
+        const double x = p.numbers[0];
+        switch (p.op) {
+            case cq::Op::Eq: return v == x;
+            case cq::Op::Ne: return v != x;
+            case cq::Op::Lt: return v < x;
+            case cq::Op::Le: return v <= x;
+            case cq::Op::Gt: return v > x;
+            case cq::Op::Ge: return v >= x;
+            case cq::Op::In: return find(p.numbers.begin(), p.numbers.end(), v) != p.numbers.end();
+            default: return false;
+        }
+    }
+    static bool compare(string_view v, const cq::Predicate& p) {
+        const string_view x = p.values[0];
+        switch (p.op) {
+            case cq::Op::Eq: return v == x;
+            case cq::Op::Ne: return v != x;
+            case cq::Op::Lt: return v < x;
+            case cq::Op::Le: return v <= x;
+            case cq::Op::Gt: return v > x;
+            case cq::Op::Ge: return v >= x;
+            case cq::Op::In: return find(p.values.begin(), p.values.end(), v) != p.values.end();
+            default: return false;
+        }
+    }
+
+    // Ids compare as integers; a double would merge neighbours past 2^53.
+    static bool compareId(uid64_t id, const cq::Predicate& p) {
+        if (!cq::isRange(p.op)) {
+            bool in = false;
+            for (size_t v = 0; v < p.values.size(); ++v) {
+                auto x = cq::asId(p.values[v], p.numbers[v]);
+                in = in || (x && *x == id);
+            }
+            return p.op == cq::Op::Ne ? !in : in;
+        }
+        const bool below = p.op == cq::Op::Lt || p.op == cq::Op::Le;
+        if (auto x = cq::asId(p.values[0], p.numbers[0])) {
+            switch (p.op) {
+                case cq::Op::Lt: return id < *x;
+                case cq::Op::Le: return id <= *x;
+                case cq::Op::Gt: return id > *x;
+                default: return id >= *x;
+            }
+        }
+        // a fraction or outside [0, 2^64): < and <= both mean <= floor, > and >= mean > floor
+        const double f = floor(p.numbers[0]);
+        if (f < 0) return !below;
+        if (f >= 18446744073709551616.0) return below;
+        return below ? id <= uid64_t(f) : id > uid64_t(f);
+    }
+
+    static bool matches(const Plan& plan, uint32_t row, size_t i) {
+        const Snapshot &s = *plan.snapshot;
+        const cq::Predicate &p = plan.query.where[i];
+        const Product &product = *s.rows[row];
+        switch (p.field) {
+            case cq::Field::Id: return compareId(product.getId(), p);
+            case cq::Field::Price: return compare(product.finalPrice(), p);
+            case cq::Field::Warranty: return s.warranty[row] >= 0 && compare(double(s.warranty[row]), p);
+            case cq::Field::Expiry: return !s.expiry[row].empty() && compare(s.expiry[row], p);
+            case cq::Field::Sku:
+                if (p.op == cq::Op::Contains) return cq::lower(product.getSku()).find(cq::lower(p.values[0])) != string::npos;
+                return compare(product.getSku(), p);
+            case cq::Field::Name:
+                if (p.op == cq::Op::Contains) {
+                    for (const auto *list : plan.postings[i])
+                        if (!list || !binary_search(list->begin(), list->end(), row)) return false;
+                    return true;
+                } else {
+                    bool equal = false;
+                    for (const auto &v : p.values) equal = equal || cq::lower(product.getName()) == cq::lower(v);
+                    return p.op == cq::Op::Ne ? !equal : equal;
+                }
+            default: {  // facets
+                bool in = false;
+                for (const Bitmap *b : plan.bitmaps[i]) in = in || (b && b->test(row));
+                return p.op == cq::Op::Ne ? !in : in;
+            }
+        }
+    }
+
+    // byPrice positions [first, last) that satisfy a price predicate
+    static pair<size_t, size_t> priceRange(const Snapshot& s, const cq::Predicate& p) {
+        auto below = [&](double x) { return size_t(partition_point(s.byPrice.begin(), s.byPrice.end(), [&](const auto& e) { return e.first < x; }) - s.byPrice.begin()); };
+        auto atMost = [&](double x) { return size_t(partition_point(s.byPrice.begin(), s.byPrice.end(), [&](const auto& e) { return e.first <= x; }) - s.byPrice.begin()); };
+        const double x = p.numbers[0];
+        switch (p.op) {
+            case cq::Op::Eq: return {below(x), atMost(x)};
+            case cq::Op::Lt: return {0, below(x)};
+            case cq::Op::Le: return {0, atMost(x)};
+            case cq::Op::Gt: return {atMost(x), s.byPrice.size()};
+            case cq::Op::Ge: return {below(x), s.byPrice.size()};
+            default: return {0, s.byPrice.size()};
+        }
+    }
+
+    // Fraction of rows expected to pass predicate i.
+    static double estimate(const Plan& plan, size_t i) {
+        const Snapshot &s = *plan.snapshot;
+        const cq::Predicate &p = plan.query.where[i];
+        const double n = double(max<size_t>(1, s.rows.size()));
+        auto finish = [&](double matching) { return clamp(p.op == cq::Op::Ne ? 1 - matching / n : matching / n, 0.0, 1.0); };
+        switch (p.field) {
+            case cq::Field::Id:
+            case cq::Field::Sku:
+                if (p.op == cq::Op::Contains) return 0.1;
+                if (isRange(p.op)) return 1.0 / 3;
+                return finish(double(count_if(p.values.begin(), p.values.end(), [&](const string& v) {
+                    if (p.field == cq::Field::Sku) return s.rowOfSku.count(v) > 0;
+                    auto id = cq::asId(v, strtod(v.c_str(), nullptr));
+                    return id && s.rowOfId.count(*id) > 0;
+                })));
+            case cq::Field::Name: {
+                if (p.op != cq::Op::Contains) return finish(double(p.values.size()));
+                size_t fewest = s.rows.size();
+                for (const auto *list : plan.postings[i]) fewest = min(fewest, list ? list->size() : 0);
+                return finish(double(fewest));
+            }
+            case cq::Field::Price: {
+                if (p.op == cq::Op::In || p.op == cq::Op::Ne) {
+                    double matching = 0;
+                    for (double x : p.numbers) {
+                        auto r = priceRange(s, {p.field, cq::Op::Eq, {}, {x}});
+                        matching += double(r.second - r.first);
+                    }
+                    return finish(matching);
+                }
+                auto r = priceRange(s, p);
+                return finish(double(r.second - r.first));
+            }
+            case cq::Field::Warranty:
+            case cq::Field::Expiry:
+                if (isRange(p.op)) return 1.0 / 3;
+                return finish(0.1 * n * double(p.values.size()));
+            default: {  // facets: exact counts
+                double matching = 0;
+                for (const Bitmap *b : plan.bitmaps[i]) matching += b ? double(b->count) : 0;
+                return finish(matching);
+            }
+        }
+    }
+
+    // Orders the predicates outside `plan.driving` for checking and returns
+    // (expected check cost per candidate row, fraction of candidates passing).
+    static pair<double, double> orderFilters(Plan& plan) {
+        plan.filters.clear();
+        for (size_t i = 0; i < plan.query.where.size(); ++i)
+            if (find(plan.driving.begin(), plan.driving.end(), i) == plan.driving.end()) plan.filters.push_back(i);
+        // cheapest cost per rejected row first: c / (1 - s)
+        auto rank = [&](size_t i) {
+            double reject = 1 - plan.selectivity[i];
+            return reject > 0 ? checkCost(plan.query.where[i]) / reject : numeric_limits<double>::infinity();
+        };
+        stable_sort(plan.filters.begin(), plan.filters.end(), [&](size_t a, size_t b) { return rank(a) < rank(b); });
+        double perRow = 0, passing = 1;
+        for (size_t f : plan.filters) {
+            perRow += passing * checkCost(plan.query.where[f]);
+            passing *= plan.selectivity[f];
+        }
+        return {perRow, passing};
+    }
+
+    // Fills in filters, rows and cost of `plan` for access path `a` over
+    // `driving`: `setup` up front, then kVisit per candidate row produced.
+    static void cost(Plan& plan, Access a, vector<size_t> driving, double rows, double setup, bool ordered) {
+        plan.access = a;
+        plan.driving = move(driving);
+        plan.ordered = ordered;
+        plan.rows = rows;
+        auto [perRow, passing] = orderFilters(plan);
+        const size_t limit = plan.query.limit;
+        double visited = rows;
+        if (ordered && limit != SIZE_MAX) visited = min(rows, double(limit) / max(passing, 1e-9));
+        const double out = rows * passing;
+        double sortCost = 0;
+        if (plan.query.orderBy && !ordered && out > 1) sortCost = kSortCompare * out * log2(max(2.0, min(out, double(limit))));
+        plan.cost = setup + visited * (kVisit + perRow) + sortCost;
+    }
+
+    Plan planFor(cq::Query query) const {
+        Plan plan;
+        plan.snapshot = atomic_load(&current);
+        plan.query = move(query);
+        const Snapshot &s = *plan.snapshot;
+        const auto &where = plan.query.where;
+        const double n = double(s.rows.size());
+        plan.bitmaps.resize(where.size());
+        plan.postings.resize(where.size());
+        for (size_t i = 0; i < where.size(); ++i) {
+            const cq::Predicate &p = where[i];
+            if (cq::isFacet(p.field)) {
+                const auto &facet = s.facets[facetSlot(p.field)];
+                for (const auto &v : p.values) {
+                    auto it = facet.find(cq::lower(v));
+                    plan.bitmaps[i].push_back(it == facet.end() ? nullptr : &it->second);
+                }
+            } else if (p.field == cq::Field::Name && p.op == cq::Op::Contains) {
+                for (const auto &w : cq::words(p.values[0])) {
+                    auto it = s.postings.find(w);
+                    plan.postings[i].push_back(it == s.postings.end() ? nullptr : &it->second);
+                }
+            }
+        }
+        plan.selectivity.resize(where.size());
+        for (size_t i = 0; i < where.size(); ++i) plan.selectivity[i] = estimate(plan, i);
+        plan.priceIndexStale = s.priceEpoch != PricePublisher::published();
+
+        // every access path that applies, each with the filters it leaves
+        vector<Plan> options;
+        auto consider = [&](Access a, vector<size_t> driving, double rows, double setup, bool ordered) {
+            Plan p = plan;
+            cost(p, a, move(driving), rows, setup, ordered);
+            options.push_back(move(p));
+        };
+        consider(Access::Scan, {}, n, 0, false);
+
+        optional<size_t> lookup;  // the id/sku equality with the fewest values
+        for (size_t i = 0; i < where.size(); ++i)
+            if ((where[i].field == cq::Field::Id || where[i].field == cq::Field::Sku) && (where[i].op == cq::Op::Eq || where[i].op == cq::Op::In))
+                if (!lookup || where[i].values.size() < where[*lookup].values.size()) lookup = i;
+        if (lookup) consider(Access::Hash, {*lookup}, plan.selectivity[*lookup] * n, double(where[*lookup].values.size()) * kHashProbe, false);
+
+        if (!plan.priceIndexStale) {
+            vector<size_t> bounds;
+            size_t first = 0, last = s.byPrice.size();
+            for (size_t i = 0; i < where.size(); ++i)
+                if (where[i].field == cq::Field::Price && (where[i].op == cq::Op::Eq || cq::isRange(where[i].op))) {
+                    auto r = priceRange(s, where[i]);
+                    first = max(first, r.first);
+                    last = min(last, r.second);
+                    bounds.push_back(i);
+                }
+            last = max(first, last);
+            const bool ordered = plan.query.orderBy == cq::Field::Price;
+            if (!bounds.empty() || ordered) {
+                consider(Access::PriceIndex, bounds, double(last - first), 2 * log2(n + 2), ordered);
+                options.back().priceFirst = first;
+                options.back().priceLast = last;
+            }
+        }
+
+        vector<size_t> facets;
+        double facetRows = n, facetCost = 0;
+        for (size_t i = 0; i < where.size(); ++i)
+            if (cq::isFacet(where[i].field)) {
+                facets.push_back(i);
+                facetRows *= plan.selectivity[i];
+                facetCost += double(where[i].values.size()) * (n / 64);
+            }
+        if (facets.size() > 1) {  // facets correlate (size implies Clothing): count the intersection exactly
+            vector<uint64_t> rows = facetMask(plan, facets);
+            facetRows = 0;
+            for (uint64_t w : rows) facetRows += double(__builtin_popcountll(w));
+            consider(Access::Facets, facets, facetRows, facetCost, false);
+            options.back().facetRows = move(rows);
+        } else if (!facets.empty()) consider(Access::Facets, facets, facetRows, facetCost, false);
+
+        // the shortest word list, probed into the others by binary search
+        vector<size_t> named;
+        vector<double> lengths;
+        for (size_t i = 0; i < where.size(); ++i)
+            if (where[i].field == cq::Field::Name && where[i].op == cq::Op::Contains) {
+                named.push_back(i);
+                for (const auto *list : plan.postings[i]) lengths.push_back(list ? double(list->size()) : 0);
+            }
+        if (!named.empty()) {
+            sort(lengths.begin(), lengths.end());
+            double probes = 0;
+            for (size_t l = 1; l < lengths.size(); ++l) probes += lengths[0] * log2(lengths[l] + 1);
+            consider(Access::Words, named, lengths[0], probes * kVisit, false);
+        }
+
+        size_t best = 0;
+        for (size_t o = 1; o < options.size(); ++o)
+            if (options[o].cost < options[best].cost) best = o;
+        Plan chosen = move(options[best]);
+        for (const auto &o : options) chosen.considered.emplace_back(Plan::accessName(o.access), o.cost);
+        return chosen;
+    }
+
+    // Bitmap of the rows that pass every facet predicate in `preds`.
+    static vector<uint64_t> facetMask(const Plan& plan, const vector<size_t>& preds) {
+        const size_t n = plan.snapshot->rows.size();
+        vector<uint64_t> rows((n + 63) / 64, ~0ull);
+        if (n % 64) rows.back() = (1ull << (n % 64)) - 1;
+        for (size_t i : preds) {
+            const bool negate = plan.query.where[i].op == cq::Op::Ne;
+            for (size_t w = 0; w < rows.size(); ++w) {
+                uint64_t any = 0;
+                for (const Bitmap *b : plan.bitmaps[i]) any |= b ? b->words[w] : 0;
+                rows[w] &= negate ? ~any : any;
+            }
+        }
+        return rows;
+    }
+
+    // Candidate rows from the plan's access path, filtered; at most `stopAt`.
+    vector<uint32_t> collect(const Plan& plan, size_t stopAt) const {
+        const Snapshot &s = *plan.snapshot;
+        const auto &where = plan.query.where;
+        vector<uint32_t> hits;
+        if (!stopAt) return hits;
+        auto offer = [&](uint32_t row) {
+            for (size_t f : plan.filters)
+                if (!matches(plan, row, f)) return true;
+            hits.push_back(row);
+            return hits.size() < stopAt;
+        };
+        switch (plan.access) {
+            case Access::Scan:
+                for (uint32_t r = 0; r < s.rows.size(); ++r)
+                    if (!offer(r)) break;
+                break;
+            case Access::Hash: {
+                const cq::Predicate &p = where[plan.driving[0]];
+                vector<uint32_t> rows;
+                for (size_t v = 0; v < p.values.size(); ++v) {
+                    if (p.field == cq::Field::Sku) {
+                        auto it = s.rowOfSku.find(p.values[v]);
+                        if (it != s.rowOfSku.end()) rows.push_back(it->second);
+                    } else if (auto id = cq::asId(p.values[v], p.numbers[v])) {
+                        auto it = s.rowOfId.find(*id);
+                        if (it != s.rowOfId.end()) rows.push_back(it->second);
+                    }
+                }
+                sort(rows.begin(), rows.end());
+                rows.erase(unique(rows.begin(), rows.end()), rows.end());
+                for (uint32_t r : rows)
+                    if (!offer(r)) break;
+                break;
+            }
+            case Access::PriceIndex:
+                if (plan.ordered && plan.query.descending) {
+                    for (size_t k = plan.priceLast; k-- > plan.priceFirst;)
+                        if (!offer(s.byPrice[k].second)) break;
+                } else {
+                    for (size_t k = plan.priceFirst; k < plan.priceLast; ++k)
+                        if (!offer(s.byPrice[k].second)) break;
+                }
+                break;
+            case Access::Facets: {
+                const vector<uint64_t> rows = plan.facetRows.empty() ? facetMask(plan, plan.driving) : plan.facetRows;
+                bool more = true;
+                for (size_t w = 0; w < rows.size() && more; ++w)
+                    for (uint64_t bits = rows[w]; bits && more; bits &= bits - 1) more = offer(uint32_t(w * 64 + size_t(__builtin_ctzll(bits))));
+                break;
+            }
+            case Access::Words: {
+                vector<const vector<uint32_t>*> lists;
+                for (size_t i : plan.driving)
+                    for (const auto *list : plan.postings[i]) lists.push_back(list);
+                if (any_of(lists.begin(), lists.end(), [](const auto* l) { return !l; })) break;
+                sort(lists.begin(), lists.end(), [](const auto* a, const auto* b) { return a->size() < b->size(); });
+                for (uint32_t r : *lists[0]) {
+                    bool all = true;
+                    for (size_t l = 1; l < lists.size() && all; ++l) all = binary_search(lists[l]->begin(), lists[l]->end(), r);
+                    if (all && !offer(r)) break;
+                }
+                break;
+            }
+        }
+        return hits;
+    }
+
+public:
+    explicit CatalogQueryEngine(const GenericCatalog<Product>& catalog) : catalog(catalog) { refresh(); }
+    CatalogQueryEngine(const CatalogQueryEngine&) = delete;
+    CatalogQueryEngine& operator=(const CatalogQueryEngine&) = delete;
+
+    // Rebuilds every index from the catalog as it is now. Prices are read as
+    // of one published epoch; once another is published, plans stop using the
+    // price index until the next refresh.
+    void refresh() {
+        auto next = make_shared<Snapshot>();
+        Snapshot &s = *next;
+        s.priceEpoch = PricePublisher::published();
+        for (const auto &p : catalog.getItems())
+            if (p) s.rows.push_back(p);
+        const size_t n = s.rows.size();
+        s.rowOfId.reserve(n);
+        s.rowOfSku.reserve(n);
+        s.byPrice.reserve(n);
+        s.warranty.assign(n, -1);
+        s.expiry.resize(n);
+        auto facet = [&](cq::Field f, string value, uint32_t row) {
+            Bitmap &b = s.facets[facetSlot(f)][cq::lower(value)];
+            if (b.words.empty()) b.words.resize((n + 63) / 64);
+            b.words[row >> 6] |= 1ull << (row & 63);
+            ++b.count;
+        };
+        for (uint32_t r = 0; r < n; ++r) {
+            const Product &p = *s.rows[r];
+            s.rowOfId[p.getId()] = r;
+            s.rowOfSku[p.getSku()] = r;
+            s.byPrice.emplace_back(ShoppingCart::unitPrice(p, s.priceEpoch), r);
+            const ProductKind kind = kindOf(p);
+            facet(cq::Field::Type, kindName(kind), r);
+            facet(cq::Field::Currency, currencyInfo(p.getCurrency()).code, r);
+            if (auto c = dynamic_cast<const Clothing*>(&p)) {
+                facet(cq::Field::Size, c->getSize(), r);
+                facet(cq::Field::Clearance, c->isOnClearance() ? "true" : "false", r);
+            } else facet(cq::Field::Clearance, "false", r);
+            if (auto e = dynamic_cast<const Electronics*>(&p)) s.warranty[r] = e->getWarrantyMonths();
+            if (auto g = dynamic_cast<const Grocery*>(&p)) s.expiry[r] = g->getExpiryDate();
+            for (auto &w : cq::words(p.getName())) {
+                auto &list = s.postings[move(w)];
+                if (list.empty() || list.back() != r) list.push_back(r);
+            }
+        }
+        sort(s.byPrice.begin(), s.byPrice.end());
+        atomic_store(&current, shared_ptr<const Snapshot>(move(next)));
+    }
+
+    bool priceIndexStale() const { return atomic_load(&current)->priceEpoch != PricePublisher::published(); }
+
+    // Throws invalid_argument on a malformed query.
+    Plan plan(string_view text) const { return planFor(cq::parse(text)); }
+    string explain(string_view text) const { return plan(text).explain(); }
+
+    // A plan driven by the price index holds byPrice positions for the epoch
+    // its snapshot was built at and has dropped the price predicates those
+    // answer. If a price is published before or while it runs, the query is
+    // planned again, which then checks the predicates on live prices.
+    vector<shared_ptr<Product>> run(const Plan& plan) const {
+        if (plan.access != Access::PriceIndex) return execute(plan);
+        const uint64_t epoch = plan.snapshot->priceEpoch;
+        if (PricePublisher::published() == epoch) {
+            auto out = execute(plan);
+            if (PricePublisher::published() == epoch) return out;
+        }
+        return run(planFor(plan.query));
+    }
+    vector<shared_ptr<Product>> run(string_view text) const { return run(plan(text)); }
+
+private:
+    vector<shared_ptr<Product>> execute(const Plan& plan) const {
+        const cq::Query &q = plan.query;
+        const Snapshot &s = *plan.snapshot;
+        vector<uint32_t> hits = collect(plan, !q.orderBy || plan.ordered ? q.limit : SIZE_MAX);
+        if (q.orderBy && !plan.ordered) {
+            const size_t keep = min(q.limit, hits.size());
+            auto top = [&](auto&& less) { partial_sort(hits.begin(), hits.begin() + ptrdiff_t(keep), hits.end(), less); };
+            const bool desc = q.descending;
+            switch (*q.orderBy) {
+                case cq::Field::Price: {  // finalPrice() once per hit
+                    vector<pair<double, uint32_t>> keyed;
+                    keyed.reserve(hits.size());
+                    for (uint32_t r : hits) keyed.emplace_back(s.rows[r]->finalPrice(), r);
+                    partial_sort(keyed.begin(), keyed.begin() + ptrdiff_t(keep), keyed.end(), [&](const auto& a, const auto& b) { return desc ? a > b : a < b; });
+                    for (size_t i = 0; i < keep; ++i) hits[i] = keyed[i].second;
+                    break;
+                }
+                case cq::Field::Id:
+                    top([&](uint32_t a, uint32_t b) { return desc ? s.rows[a]->getId() > s.rows[b]->getId() : s.rows[a]->getId() < s.rows[b]->getId(); });
+                    break;
+                case cq::Field::Sku:
+                    top([&](uint32_t a, uint32_t b) { return desc ? s.rows[a]->getSku() > s.rows[b]->getSku() : s.rows[a]->getSku() < s.rows[b]->getSku(); });
+                    break;
+                default:
+                    top([&](uint32_t a, uint32_t b) { return desc ? s.rows[a]->getName() > s.rows[b]->getName() : s.rows[a]->getName() < s.rows[b]->getName(); });
+                    break;
+            }
+            hits.resize(keep);
+        }
+        vector<shared_ptr<Product>> out;
+        out.reserve(hits.size());
+        for (uint32_t r : hits) out.push_back(s.rows[r]);
+        return out;
+    }
+};
+
+#ifdef __cpp_impl_coroutine
+// -------------------------
+// Async order workflow (C++20 coroutines)
+// -------------------------
+// Task<T> is a lazy coroutine that resumes its awaiter by symmetric transfer.
+// EventLoop is a single-threaded executor with a ready queue and a timer heap;
+// spawn() detaches a Task onto it. With stub services that "wait on I/O" via
+// timers, one thread can keep tens of thousands of orders in flight.
+template<typename T = void>
+class Task;
+
+namespace detail {
+struct TaskPromiseBase {
+    coroutine_handle<> continuation = noop_coroutine();
+    exception_ptr error;
+
+    suspend_always initial_suspend() noexcept { return {}; }
+
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template<typename P>
+        coroutine_handle<> await_suspend(coroutine_handle<P> h) noexcept { return h.promise().continuation; }
+        void await_resume() noexcept {}
+    };
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { error = current_exception(); }
+};
+
+template<typename T>
+struct TaskPromise : TaskPromiseBase {
+    optional<T> value;
+    Task<T> get_return_object();
+    void return_value(T v) { value = move(v); }
+    T result() {
+        if (error) rethrow_exception(error);
+        return move(*value);
+    }
+};
+
+template<>
+struct TaskPromise<void> : TaskPromiseBase {
+    Task<void> get_return_object();
+    void return_void() {}
+    void result() { if (error) rethrow_exception(error); }
+};
+} // namespace detail
+
+template<typename T>
+class Task {
+public:
+    using promise_type = detail::TaskPromise<T>;
+
+    explicit Task(coroutine_handle<promise_type> h) : handle(h) {}
+    Task(Task&& other) noexcept : handle(exchange(other.handle, {})) {}
+    Task(const Task&) = delete;
+    ~Task() { if (handle) handle.destroy(); }
+
+    bool await_ready() const noexcept { return false; }
+    coroutine_handle<> await_suspend(coroutine_handle<> awaiting) noexcept {
+        handle.promise().continuation = awaiting;
+        return handle;
+    }
+    T await_resume() { return handle.promise().result(); }
+
+private:
+    coroutine_handle<promise_type> handle;
+};
+
+namespace detail {
+template<typename T>
+Task<T> TaskPromise<T>::get_return_object() { return Task<T>(coroutine_handle<TaskPromise<T>>::from_promise(*this)); }
+inline Task<void> TaskPromise<void>::get_return_object() { return Task<void>(coroutine_handle<TaskPromise<void>>::from_promise(*this)); }
+} // namespace detail
+
+class EventLoop {
+    using Clock = chrono::steady_clock;
+    struct Timer {
+        Clock::time_point due;
+        uint64_t seq;
+        coroutine_handle<> h;
+        bool operator>(const Timer& o) const { return due != o.due ? due > o.due : seq > o.seq; }
+    };
+
+    vector<coroutine_handle<>> ready, running;
+    priority_queue<Timer, vector<Timer>, greater<Timer>> timers;
+    uint64_t timerSeq = 0;
+    size_t live = 0;
+
+    // Self-destroying frame that owns a spawned Task until it completes.
+    struct Detached {
+        struct promise_type {
+            Detached get_return_object() { return {}; }
+            suspend_never initial_suspend() noexcept { return {}; }
+            suspend_never final_suspend() noexcept { return {}; }
+            void return_void() {}
+            void unhandled_exception() { terminate(); }
+        };
+    };
+
+    struct Yield {
+        EventLoop& loop;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(coroutine_handle<> h) { loop.post(h); }
+        void await_resume() const noexcept {}
+    };
+
+    static Detached runDetached(EventLoop& loop, Task<void> task) {
+        co_await Yield{loop};  // start on the loop, not inside spawn()
+        co_await task;
+        --loop.live;
+    }
+
+public:
+    struct SleepAwaiter {
+        EventLoop& loop;
+        Clock::time_point due;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(coroutine_handle<> h) { loop.timers.push({due, loop.timerSeq++, h}); }
+        void await_resume() const noexcept {}
+    };
+
+    void post(coroutine_handle<> h) { ready.push_back(h); }
+
+    SleepAwaiter sleepFor(Clock::duration d) { return {*this, Clock::now() + d}; }
+
+    void spawn(Task<void> task) {
+        ++live;
+        runDetached(*this, move(task));
+    }
+
+    size_t inFlight() const { return live; }
+
+    // Runs until no task is ready or waiting on a timer.
+    void run() {
+        while (!ready.empty() || !timers.empty()) {
+            if (ready.empty()) this_thread::sleep_until(timers.top().due);
+            auto now = Clock::now();
+            while (!timers.empty() && timers.top().due <= now) {
+                ready.push_back(timers.top().h);
+                timers.pop();
+            }
+            running.swap(ready);
+            for (auto h : running) h.resume();
+            running.clear();
+        }
+    }
+};
+
+// Local stand-ins for the remote payment and shipping services.
+class StubPaymentService {
+    EventLoop& loop;
+    chrono::microseconds latency;
+    unsigned declineEvery;  // 0 = never decline
+    uint64_t calls = 0;
+public:
+    StubPaymentService(EventLoop& loop, chrono::microseconds latency, unsigned declineEvery = 0)
+        : loop(loop), latency(latency), declineEvery(declineEvery) {}
+
+    Task<bool> charge(const Order& order) {
+        uint64_t call = ++calls;
+        co_await loop.sleepFor(latency);
+        co_return order.total() > 0 && (declineEvery == 0 || call % declineEvery != 0);
+    }
+};
+
+class StubShippingService {
+    EventLoop& loop;
+    chrono::microseconds latency;
+public:
+    StubShippingService(EventLoop& loop, chrono::microseconds latency) : loop(loop), latency(latency) {}
+
+    Task<void> dispatch(const Order&) { co_await loop.sleepFor(latency); }
+};
+
+inline Task<void> orderWorkflow(StubPaymentService& payment, StubShippingService& shipping, shared_ptr<Order> order) {
+    bool paid = co_await payment.charge(*order);
+    if (!paid) {
+        order->cancel();
+        co_return;
+    }
+    order->pay();
+    co_await shipping.dispatch(*order);
+    order->ship();
+}
+#endif // __cpp_impl_coroutine
+
+// -------------------------
+// Synthetic catalog (benchmarks, load tests, demo server)
+// -------------------------
+struct TypeMix { unsigned electronics = 40, clothing = 40, grocery = 20; };
+
+// Deterministic synthetic catalog; ids are 1..size.
+void fillCatalog(GenericCatalog<Product>& catalog, size_t size, TypeMix mix, uint64_t seed = 42) {
+    mt19937_64 rng(seed);
+    unsigned total = max(1u, mix.electronics + mix.clothing + mix.grocery);
+    static const char* sizes[] = {"XS", "S", "M", "L", "XL"};
+    for (size_t i = 1; i <= size; ++i) {
+        unsigned pick = unsigned(rng() % total);
+        double price = 1.0 + double(rng() % 100000) / 100.0;
+        string id = to_string(i);
+        if (pick < mix.electronics)
+            catalog.emplace<Electronics>(i, "Device " + id, price, "ELEC-" + id, int(rng() % 36));
+        else if (pick < mix.electronics + mix.clothing)
+            catalog.emplace<Clothing>(i, "Garment " + id, price, "CLOTH-" + id, sizes[rng() % 5], rng() % 4 == 0);
+        else
+            catalog.emplace<Grocery>(i, "Food " + id, price, "GROC-" + id, "2026-01-01");
+    }
+}
+
+GenericCatalog<Product> makeCatalog(size_t size, TypeMix mix, uint64_t seed = 42) {
+    GenericCatalog<Product> catalog;
+    fillCatalog(catalog, size, mix, seed);
+    return catalog;
+}
+
+// -------------------------
+// Block compression: LZ codec, trained dictionaries, checksummed blocks
+// -------------------------
+// Persisted data (snapshot chunks, order-store runs) is written as independent
+// blocks, each framed as
+//   u8 method | u32 raw bytes | u32 stored bytes | u32 crc32c(first 9 bytes + stored) | stored
+// so a block found through its file's index can be verified, sizes included,
+// before anything is allocated for it, and decoded on its own. Blocks
+// written before the checksum covered the header have the method's top bit
+// clear; their raw size is only trusted up to what `stored` could expand to. The codec is byte-oriented LZ77 in the LZ4 mould: a token byte
+// with literal and match lengths (15 = more length bytes follow), the
+// literals, then a 2-byte match offset. A dictionary is history placed before
+// every block, so short blocks can match strings they never contain. The
+// decoder copies in 8- and 16-byte steps into a buffer with kSlack spare
+// bytes; it runs at several GB/s on one core.
+namespace lz {
+constexpr size_t kBlockHeader = 13;
+constexpr size_t kSlack = 32;
+constexpr size_t kMinMatch = 4;
+constexpr size_t kMaxOffset = 65535;
+constexpr size_t kLastLiterals = 5;   // a block always ends in literals
+constexpr size_t kMatchSafety = 12;   // and no match starts in its last 12 bytes
+constexpr int kHashLog = 12;
+constexpr size_t kMaxDictionary = 32 * 1024;
+
+enum class Method : uint8_t { Stored = 0, Lz = 1, LzDict = 2 };
+constexpr uint8_t kHeaderChecked = 0x80;  // or'ed into the method byte
+constexpr size_t kMaxExpansion = 256;     // raw bytes per stored byte, at most
+
+inline uint32_t crc32cPortable(const char* p, size_t n, uint32_t crc) {
+    // slicing-by-8 over the Castagnoli polynomial
+    static const auto t = [] {
+        array<array<uint32_t, 256>, 8> t{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = c & 1 ? (c >> 1) ^ 0x82F63B78u : c >> 1;
+            t[0][i] = c;
+        }
+        for (size_t s = 1; s < 8; ++s)
+            for (uint32_t i = 0; i < 256; ++i) t[s][i] = (t[s - 1][i] >> 8) ^ t[0][t[s - 1][i] & 0xFF];
+        return t;
+    }();
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        v ^= crc;
+        crc = t[7][v & 0xFF] ^ t[6][(v >> 8) & 0xFF] ^ t[5][(v >> 16) & 0xFF] ^ t[4][(v >> 24) & 0xFF] ^
+              t[3][(v >> 32) & 0xFF] ^ t[2][(v >> 40) & 0xFF] ^ t[1][(v >> 48) & 0xFF] ^ t[0][v >> 56];
+    }
+    while (n--) crc = (crc >> 8) ^ t[0][(crc ^ uint8_t(*p++)) & 0xFF];
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) inline uint32_t crc32cHardware(const char* p, size_t n, uint32_t crc) {
+    uint64_t c = crc;
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = __builtin_ia32_crc32di(c, v);
+    }
+    crc = uint32_t(c);
+    while (n--) crc = __builtin_ia32_crc32qi(crc, uint8_t(*p++));
+    return crc;
+}
+#endif
+
+// CRC-32C, using the SSE4.2 instruction when the CPU has it. Pass the CRC of
+// preceding bytes as `prev` to extend it.
+inline uint32_t crc32c(const void* data, size_t n, uint32_t prev = 0) {
+    auto p = static_cast<const char*>(data);
+#if defined(__x86_64__)
+    static const bool hardware = __builtin_cpu_supports("sse4.2");
+    if (hardware) return ~crc32cHardware(p, n, ~prev);
+#endif
+    return ~crc32cPortable(p, n, ~prev);
+}
+
+inline uint32_t read32(const char* p) { uint32_t v; memcpy(&v, p, 4); return v; }
+inline uint32_t hash4(uint32_t v) { return (v * 2654435761u) >> (32 - kHashLog); }
+
+class Dictionary {
+    string content;
+    vector<uint32_t> table;  // match-finder hash table primed with the content
+    uint64_t id = 0;         // distinguishes dictionaries in the decoders' windows
+
+public:
+    Dictionary() = default;
+    explicit Dictionary(string bytes) : content(move(bytes)) {
+        static atomic<uint64_t> nextId{1};
+        if (content.size() > kMaxDictionary) content.erase(0, content.size() - kMaxDictionary);
+        table.assign(size_t(1) << kHashLog, 0);
+        for (size_t i = 0; i + 4 <= content.size(); ++i) table[hash4(read32(content.data() + i))] = uint32_t(i);
+        id = nextId.fetch_add(1);
+    }
+
+    const string& bytes() const { return content; }
+    size_t size() const { return content.size(); }
+    uint64_t serial() const { return id; }
+    const vector<uint32_t>& primed() const { return table; }
+
+    // Picks samples whose 6-byte substrings recur most across all samples
+    // (a simplified COVER): the candidates are split into one epoch per
+    // dictionary slot and the best of each epoch is taken; substrings it
+    // covers stop counting. The highest-scoring picks end up last, nearest
+    // the data.
+    static Dictionary train(const vector<string_view>& samples, size_t capacity = 16 * 1024) {
+        constexpr size_t k = 6;
+        capacity = min(capacity, kMaxDictionary);
+        auto gram = [](const char* p) { uint64_t v = 0; memcpy(&v, p, k); return v; };
+        unordered_map<uint64_t, uint32_t> frequency;
+        vector<string_view> candidates;
+        unordered_set<string_view> seen;
+        size_t candidateBytes = 0;
+        for (string_view s : samples) {
+            for (size_t i = 0; i + k <= s.size(); ++i) ++frequency[gram(s.data() + i)];
+            if (s.size() >= k && s.size() <= capacity && seen.insert(s).second) {
+                candidates.push_back(s);
+                candidateBytes += s.size();
+            }
+        }
+        if (candidates.empty()) return Dictionary();
+        auto score = [&](string_view s) {
+            uint64_t total = 0;
+            for (size_t i = 0; i + k <= s.size(); ++i) {
+                auto it = frequency.find(gram(s.data() + i));
+                if (it != frequency.end()) total += it->second;
+            }
+            return total;
+        };
+        size_t epochs = max<size_t>(1, capacity / max<size_t>(1, candidateBytes / candidates.size()));
+        size_t perEpoch = (candidates.size() + epochs - 1) / epochs;
+        vector<pair<uint64_t, string_view>> picked;
+        size_t used = 0;
+        for (size_t first = 0; first < candidates.size(); first += perEpoch) {
+            uint64_t bestScore = 1;  // a substring seen once is no use
+            string_view best;
+            for (size_t i = first; i < min(candidates.size(), first + perEpoch); ++i) {
+                uint64_t now = score(candidates[i]);
+                if (now > bestScore && used + candidates[i].size() <= capacity) {
+                    bestScore = now;
+                    best = candidates[i];
+                }
+            }
+            if (best.empty()) continue;
+            for (size_t g = 0; g + k <= best.size(); ++g) frequency.erase(gram(best.data() + g));
+            picked.push_back({bestScore, best});
+            used += best.size();
+        }
+        sort(picked.begin(), picked.end());
+        string bytes;
+        bytes.reserve(used);
+        for (const auto &p : picked) bytes.append(p.second.data(), p.second.size());
+        return Dictionary(move(bytes));
+    }
+};
+
+inline size_t compressBound(size_t n) { return n + n / 255 + 16; }
+
+// Appends the compressed form of src to out.
+inline void compress(string_view src, string& out, const Dictionary* dict = nullptr) {
+    thread_local string window;
+    thread_local vector<uint32_t> table;
+    size_t d = dict ? dict->size() : 0;
+    const char* base = src.data();
+    if (d) {
+        window.assign(dict->bytes());
+        window.append(src.data(), src.size());
+        base = window.data();
+        table = dict->primed();
+    } else {
+        table.assign(size_t(1) << kHashLog, 0);
+    }
+    size_t start = out.size();
+    out.resize(start + compressBound(src.size()));
+    char* op = &out[start];
+    const char* anchor = base + d;
+    const char* const iend = base + d + src.size();
+
+    auto putLength = [&](size_t n) {
+        for (; n >= 255; n -= 255) *op++ = char(255);
+        *op++ = char(n);
+    };
+    auto putLiterals = [&](const char* from, size_t n, unsigned matchNibble) {
+        *op++ = char((min<size_t>(n, 15) << 4) | matchNibble);
+        if (n >= 15) putLength(n - 15);
+        memcpy(op, from, n);
+        op += n;
+    };
+
+    // end of the match between p and q, compared 8 bytes at a time
+    auto extend = [](const char* p, const char* q, const char* limit) {
+        for (; p + 8 <= limit; p += 8, q += 8) {
+            uint64_t a, b;
+            memcpy(&a, p, 8);
+            memcpy(&b, q, 8);
+            if (a != b) return p + __builtin_ctzll(a ^ b) / 8;
+        }
+        while (p < limit && *p == *q) { ++p; ++q; }
+        return p;
+    };
+
+    if (src.size() > kMatchSafety) {
+        const char* const mflimit = iend - kMatchSafety;
+        const char* const matchLimit = iend - kLastLiterals;
+        const char* ip = anchor;
+        while (ip < mflimit) {
+            // find a match, stepping faster through incompressible input
+            const char* ref = nullptr;
+            for (unsigned attempts = 1 << 6; ip < mflimit; ip += attempts++ >> 6) {
+                uint32_t h = hash4(read32(ip));
+                const char* candidate = base + table[h];
+                table[h] = uint32_t(ip - base);
+                if (candidate < ip && size_t(ip - candidate) <= kMaxOffset && read32(candidate) == read32(ip)) {
+                    ref = candidate;
+                    break;
+                }
+            }
+            if (!ref) break;
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) { --ip; --ref; }
+            const char* p = extend(ip + kMinMatch, ref + kMinMatch, matchLimit);
+            size_t matchLen = size_t(p - ip) - kMinMatch;
+            putLiterals(anchor, size_t(ip - anchor), unsigned(min<size_t>(matchLen, 15)));
+            uint16_t offset = uint16_t(ip - ref);
+            memcpy(op, &offset, 2);
+            op += 2;
+            if (matchLen >= 15) putLength(matchLen - 15);
+            anchor = ip = p;
+            if (ip < mflimit) table[hash4(read32(ip - 2))] = uint32_t(ip - 2 - base);
+        }
+    }
+    putLiterals(anchor, size_t(iend - anchor), 0);
+    out.resize(size_t(op - out.data()));
+}
+
+// Decodes exactly rawSize bytes to [ostart, ostart + rawSize); matches may
+// reach back to history (the dictionary placed right before ostart). The
+// buffer must have kSlack writable bytes past the end.
+inline void decodeInto(const char* src, size_t n, const char* history, char* ostart, size_t rawSize) {
+    char* const oend = ostart + rawSize;
+    char* op = ostart;
+    const char* ip = src;
+    const char* const iend = src + n;
+    auto fail = [] { throw runtime_error("lz: corrupt block"); };
+    auto length = [&](size_t len) {
+        for (uint8_t more = 255; more == 255; len += more) {
+            if (ip >= iend) fail();
+            more = uint8_t(*ip++);
+        }
+        return len;
+    };
+    auto read16 = [](const char* p) { uint16_t v; memcpy(&v, p, 2); return size_t(v); };
+    while (true) {
+        if (ip >= iend) fail();
+        unsigned token = uint8_t(*ip++);
+        size_t literals = token >> 4, matchLen = token & 15, offset;
+        if (literals != 15 && matchLen != 15 && iend - ip >= 18) {
+            // common case: both lengths in the token, fixed-size copies
+            if (literals > size_t(oend - op)) fail();
+            memcpy(op, ip, 16);
+            op += literals;
+            ip += literals;
+            offset = read16(ip);
+            ip += 2;
+            matchLen += kMinMatch;
+            if (offset == 0 || offset > size_t(op - history) || matchLen > size_t(oend - op)) fail();
+            if (offset >= 8) {
+                const char* match = op - offset;
+                memcpy(op, match, 8);
+                memcpy(op + 8, match + 8, 8);
+                memcpy(op + 16, match + 16, 2);
+                op += matchLen;
+                continue;
+            }
+        } else {
+            if (literals == 15) literals = length(literals);
+            if (literals > size_t(iend - ip) || literals > size_t(oend - op)) fail();
+            if (literals <= 16 && iend - ip >= 16) memcpy(op, ip, 16);
+            else memcpy(op, ip, literals);
+            op += literals;
+            ip += literals;
+            if (ip == iend) break;
+            if (iend - ip < 2) fail();
+            offset = read16(ip);
+            ip += 2;
+            if (matchLen == 15) matchLen = length(matchLen);
+            matchLen += kMinMatch;
+            if (offset == 0 || offset > size_t(op - history) || matchLen > size_t(oend - op)) fail();
+        }
+        const char* match = op - offset;
+        char* const end = op + matchLen;
+        if (offset >= 16) {
+            for (; op < end; op += 16, match += 16) memcpy(op, match, 16);
+        } else if (offset >= 8) {
+            for (; op < end; op += 8, match += 8) memcpy(op, match, 8);
+        } else {
+            for (; op < end; ++op, ++match) *op = *match;
+        }
+        op = end;
+    }
+    if (op != oend) fail();
+}
+
+// Decodes exactly rawSize bytes into out; throws on malformed input. With a
+// dictionary, decoding runs in a per-thread window that keeps the last
+// dictionary in place in front of the output, so matches into it are plain
+// back-references.
+inline void decompress(const char* src, size_t n, size_t rawSize, string& out, const Dictionary* dict = nullptr) {
+    if (!dict || !dict->size()) {
+        out.resize(rawSize + kSlack);
+        decodeInto(src, n, out.data(), &out[0], rawSize);
+        out.resize(rawSize);
+        return;
+    }
+    thread_local string window;
+    thread_local uint64_t windowSerial = 0;
+    size_t d = dict->size();
+    if (windowSerial != dict->serial()) {
+        window.assign(dict->bytes());
+        windowSerial = dict->serial();
+    }
+    window.resize(d + rawSize + kSlack);
+    decodeInto(src, n, window.data(), &window[d], rawSize);
+    out.assign(window.data() + d, rawSize);
+}
+
+// Appends one framed block, stored raw when compression does not pay.
+inline void encodeBlock(string_view raw, string& out, const Dictionary* dict = nullptr) {
+    size_t at = out.size();
+    out.resize(at + kBlockHeader);
+    compress(raw, out, dict && dict->size() ? dict : nullptr);
+    size_t stored = out.size() - at - kBlockHeader;
+    Method method = dict && dict->size() ? Method::LzDict : Method::Lz;
+    if (stored >= raw.size()) {
+        out.resize(at + kBlockHeader);
+        out.append(raw.data(), raw.size());
+        stored = raw.size();
+        method = Method::Stored;
+    }
+    uint32_t rawBytes = uint32_t(raw.size()), storedBytes = uint32_t(stored);
+    out[at] = char(uint8_t(method) | kHeaderChecked);
+    memcpy(&out[at + 1], &rawBytes, 4);
+    memcpy(&out[at + 5], &storedBytes, 4);
+    uint32_t crc = crc32c(out.data() + at + kBlockHeader, stored, crc32c(out.data() + at, 9));
+    memcpy(&out[at + 9], &crc, 4);
+}
+
+// Verifies and decodes the framed block occupying [p, p + n).
+inline void decodeBlock(const char* p, size_t n, string& out, const Dictionary* dict = nullptr) {
+    uint32_t raw, stored, crc;
+    if (n < kBlockHeader) throw runtime_error("lz: truncated block");
+    memcpy(&raw, p + 1, 4);
+    memcpy(&stored, p + 5, 4);
+    memcpy(&crc, p + 9, 4);
+    if (stored != n - kBlockHeader) throw runtime_error("lz: truncated block");
+    bool headerChecked = uint8_t(p[0]) & kHeaderChecked;
+    if (crc32c(p + kBlockHeader, stored, headerChecked ? crc32c(p, 9) : 0) != crc) throw runtime_error("lz: block checksum mismatch");
+    if (!headerChecked && raw > uint64_t(stored) * kMaxExpansion + 64) throw runtime_error("lz: corrupt block");
+    switch (Method(uint8_t(p[0]) & ~kHeaderChecked)) {
+    case Method::Stored:
+        if (raw != stored) throw runtime_error("lz: corrupt block");
+        out.assign(p + kBlockHeader, stored);
+        break;
+    case Method::Lz:
+        decompress(p + kBlockHeader, stored, raw, out);
+        break;
+    case Method::LzDict:
+        if (!dict || !dict->size()) throw runtime_error("lz: block needs a dictionary");
+        decompress(p + kBlockHeader, stored, raw, out, dict);
+        break;
+    default:
+        throw runtime_error("lz: unknown block method");
+    }
+}
+} // namespace lz
+
+#ifdef __linux__
+// -------------------------
+// SharedCatalog: one catalog image shared by many worker processes
+// -------------------------
+// A loader process writes the catalog into a POSIX shared-memory segment
+// "/<name>.<version>" and then bumps the version in a small control segment
+// "/<name>". Workers map segments read-only and pick up a new version on the
+// next current() call; a snapshot they already hold stays mapped until its
+// last reference goes away, even after the loader has unlinked it.
+//
+// Everything inside a segment is addressed by offsets from its base:
+//   ShmHeader | ShmRecord[count] | u32 buckets[bucketCount] | string bytes
+// buckets is an open-addressing id index holding record index + 1 (0 = empty).
+// Version 1 segments have 48-byte records without the parcel; they are still
+// read, with empty parcels.
+namespace shm {
+constexpr char kMagic[8] = {'E', 'C', 'A', 'T', 'S', 'H', 'M', '2'};
+constexpr char kMagicV1[8] = {'E', 'C', 'A', 'T', 'S', 'H', 'M', '1'};
+constexpr size_t kRecordBytesV1 = 48;
+
+struct ShmHeader {
+    char magic[8];
+    uint64_t version;
+    uint64_t count;
+    uint64_t bucketCount;   // power of two
+    uint64_t recordsOff;
+    uint64_t bucketsOff;
+    uint64_t stringsOff;
+    uint64_t bytes;
+};
+
+struct ShmRecord {
+    uint64_t id;
+    double price;
+    uint32_t name, nameLen;       // offsets into the string area
+    uint32_t sku, skuLen;
+    uint32_t detail, detailLen;   // Clothing size or Grocery expiry date
+    int32_t warrantyMonths;
+    ProductKind kind;
+    uint8_t clearance;
+    Currency currency;  // 0 (USD) in segments written before currencies existed
+    uint8_t pad;
+    Parcel parcel;      // version 2
+};
+static_assert(is_trivially_copyable_v<ShmRecord> && sizeof(ShmRecord) == 64, "ShmRecord is a wire format");
+
+struct ShmControl {
+    atomic<uint64_t> version;
+};
+static_assert(atomic<uint64_t>::is_always_lock_free, "the control word is shared between processes");
+
+inline size_t bucketOf(uint64_t id, uint64_t bucketCount) {
+    return size_t((id * 0x9E3779B97F4A7C15ull) >> 32) & size_t(bucketCount - 1);
+}
+
+inline string segmentName(const string& name, uint64_t version) { return "/" + name + "." + to_string(version); }
+
+// Maps a whole shm object; nullptr (errno set) when it cannot be opened.
+inline void* mapSegment(const string& path, bool writable, size_t& bytes) {
+    int fd = shm_open(path.c_str(), writable ? O_RDWR : O_RDONLY, 0);
+    if (fd < 0) return nullptr;
+    struct stat st{};
+    void* base = nullptr;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        bytes = size_t(st.st_size);
+        base = mmap(nullptr, bytes, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED) base = nullptr;
+    }
+    close(fd);
+    return base;
+}
+} // namespace shm
+
+// A product as stored in shared memory; string_views point into the mapping.
+struct SharedProduct {
+    uid64_t id;
+    ProductKind kind;
+    string_view name, sku, detail;
+    double price;
+    int warrantyMonths;
+    bool clearance;
+    Currency currency;
+    Parcel parcel;
+
+    // Builds a regular Product (e.g. to put into a ShoppingCart).
+    shared_ptr<Product> materialize(pmr::memory_resource* resource = &AllocationTracker::resource(Subsystem::Catalog)) const {
+        string n(name), s(sku), d(detail);
+        shared_ptr<Product> p;
+        switch (kind) {
+            case ProductKind::Electronics: p = allocate_shared<Electronics>(pmr::polymorphic_allocator<Electronics>(resource), id, move(n), price, move(s), warrantyMonths, currency); break;
+            case ProductKind::Clothing: p = allocate_shared<Clothing>(pmr::polymorphic_allocator<Clothing>(resource), id, move(n), price, move(s), move(d), clearance, currency); break;
+            case ProductKind::Grocery: p = allocate_shared<Grocery>(pmr::polymorphic_allocator<Grocery>(resource), id, move(n), price, move(s), move(d), currency); break;
+            default: p = allocate_shared<Product>(pmr::polymorphic_allocator<Product>(resource), id, move(n), price, move(s), currency); break;
+        }
+        if (!parcel.empty()) p->setParcel(parcel);
+        return p;
+    }
+};
+
+// One mapped, immutable catalog version. Products handed out as Product
+// objects are materialized once per version and shared by later lookups.
+class SharedCatalogSnapshot {
+    const char* base;
+    size_t bytes;
+    const shm::ShmHeader* header;
+    size_t recordBytes = sizeof(shm::ShmRecord);  // shm::kRecordBytesV1 for a version 1 segment
+    unique_ptr<atomic<shared_ptr<Product>*>[]> products;  // by record index, filled on first lookup
+
+    string_view str(uint32_t off, uint32_t len) const { return string_view(base + header->stringsOff + off, len); }
+    const char* recordAt(size_t i) const { return base + header->recordsOff + i * recordBytes; }
+
+    // record index of `id`, or SIZE_MAX
+    size_t indexOf(uid64_t id) const {
+        const auto *buckets = reinterpret_cast<const uint32_t*>(base + header->bucketsOff);
+        for (size_t b = shm::bucketOf(id, header->bucketCount);; b = (b + 1) & size_t(header->bucketCount - 1)) {
+            uint32_t slot = buckets[b];
+            if (slot == 0) return SIZE_MAX;
+            uint64_t recordId;
+            memcpy(&recordId, recordAt(slot - 1), sizeof recordId);
+            if (recordId == id) return slot - 1;
+        }
+    }
+
+public:
+    SharedCatalogSnapshot(const void* mapping, size_t bytes) : base(static_cast<const char*>(mapping)), bytes(bytes), header(static_cast<const shm::ShmHeader*>(mapping)) {
+        bool known = bytes >= sizeof(shm::ShmHeader) && memcmp(header->magic, shm::kMagic, sizeof shm::kMagic) == 0;
+        if (!known && bytes >= sizeof(shm::ShmHeader) && memcmp(header->magic, shm::kMagicV1, sizeof shm::kMagicV1) == 0) {
+            known = true;
+            recordBytes = shm::kRecordBytesV1;
+        }
+        if (!known || header->bytes != bytes || header->recordsOff + header->count * recordBytes > bytes) {
+            munmap(const_cast<char*>(base), bytes);
+            throw runtime_error("not a shared catalog segment");
+        }
+        products.reset(new atomic<shared_ptr<Product>*>[size_t(header->count)]());
+    }
+    SharedCatalogSnapshot(const SharedCatalogSnapshot&) = delete;
+    SharedCatalogSnapshot& operator=(const SharedCatalogSnapshot&) = delete;
+    ~SharedCatalogSnapshot() {
+        for (size_t i = 0; i < size(); ++i) delete products[i].load(memory_order_relaxed);
+        munmap(const_cast<char*>(base), bytes);
+    }
+
+    uint64_t version() const { return header->version; }
+    size_t size() const { return size_t(header->count); }
+    size_t mappedBytes() const { return bytes; }
+
+    SharedProduct at(size_t i) const {
+        shm::ShmRecord r{};
+        memcpy(&r, recordAt(i), recordBytes);
+        return {r.id, r.kind, str(r.name, r.nameLen), str(r.sku, r.skuLen), str(r.detail, r.detailLen), r.price, r.warrantyMonths, r.clearance != 0, r.currency, r.parcel};
+    }
+
+    optional<SharedProduct> find(uid64_t id) const {
+        size_t i = indexOf(id);
+        if (i == SIZE_MAX) return nullopt;
+        return at(i);
+    }
+
+    // The product as a regular Product; the first lookup materializes it and
+    // the racing losers drop their copy.
+    shared_ptr<Product> product(uid64_t id) const {
+        size_t i = indexOf(id);
+        if (i == SIZE_MAX) return nullptr;
+        auto &slot = products[i];
+        if (auto *made = slot.load(memory_order_acquire)) return *made;
+        auto *made = new shared_ptr<Product>(at(i).materialize());
+        shared_ptr<Product>* expected = nullptr;
+        if (!slot.compare_exchange_strong(expected, made, memory_order_acq_rel, memory_order_acquire)) {
+            delete made;
+            return *expected;
+        }
+        return *made;
+    }
+};
+
+// Loader side: builds new versions and retires the previous one.
+class SharedCatalogPublisher {
+    string name;
+    int controlFd = -1;
+    shm::ShmControl* control = nullptr;
+
+public:
+    explicit SharedCatalogPublisher(string name) : name(move(name)) {
+        controlFd = shm_open(("/" + this->name).c_str(), O_RDWR | O_CREAT, 0644);
+        if (controlFd < 0 || ftruncate(controlFd, sizeof(shm::ShmControl)) != 0)
+            throw runtime_error("shm_open " + this->name + ": " + strerror(errno));
+        void* p = mmap(nullptr, sizeof(shm::ShmControl), PROT_READ | PROT_WRITE, MAP_SHARED, controlFd, 0);
+        if (p == MAP_FAILED) throw runtime_error("mmap control segment: " + string(strerror(errno)));
+        control = static_cast<shm::ShmControl*>(p);  // a fresh object is zero-filled, i.e. version 0
+    }
+    SharedCatalogPublisher(const SharedCatalogPublisher&) = delete;
+    SharedCatalogPublisher& operator=(const SharedCatalogPublisher&) = delete;
+    ~SharedCatalogPublisher() {
+        munmap(control, sizeof(shm::ShmControl));
+        close(controlFd);
+    }
+
+    // Writes the catalog as a new version and makes it current; returns the version.
+    uint64_t publish(const GenericCatalog<Product>& catalog) {
+        const auto &items = catalog.getItems();
+        uint64_t count = 0, stringBytes = 0;
+        for (const auto &p : items) {
+            if (!p) continue;
+            ++count;
+            stringBytes += p->getName().size() + p->getSku().size();
+            if (auto c = dynamic_cast<const Clothing*>(p.get())) stringBytes += c->getSize().size();
+            else if (auto g = dynamic_cast<const Grocery*>(p.get())) stringBytes += g->getExpiryDate().size();
+        }
+        if (stringBytes > UINT32_MAX || count >= UINT32_MAX) throw length_error("catalog too large for a shared segment");
+        uint64_t bucketCount = 16;
+        while (bucketCount < count * 2) bucketCount *= 2;
+
+        shm::ShmHeader h{};
+        memcpy(h.magic, shm::kMagic, sizeof h.magic);
+        h.version = control->version.load(memory_order_relaxed) + 1;
+        h.count = count;
+        h.bucketCount = bucketCount;
+        h.recordsOff = sizeof h;
+        h.bucketsOff = h.recordsOff + count * sizeof(shm::ShmRecord);
+        h.stringsOff = h.bucketsOff + bucketCount * sizeof(uint32_t);
+        h.bytes = h.stringsOff + stringBytes;
+
+        string path = shm::segmentName(name, h.version);
+        shm_unlink(path.c_str());  // leftover from a crashed loader
+        int fd = shm_open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (fd < 0 || ftruncate(fd, off_t(h.bytes)) != 0) throw runtime_error("shm_open " + path + ": " + strerror(errno));
+        void* mapping = mmap(nullptr, h.bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED) throw runtime_error("mmap " + path + ": " + strerror(errno));
+
+        char* base = static_cast<char*>(mapping);
+        auto *records = reinterpret_cast<shm::ShmRecord*>(base + h.recordsOff);
+        auto *buckets = reinterpret_cast<uint32_t*>(base + h.bucketsOff);  // zero-filled by ftruncate
+        char* strings = base + h.stringsOff;
+        uint32_t cursor = 0;
+        auto put = [&](string_view s, uint32_t& off, uint32_t& len) {
+            memcpy(strings + cursor, s.data(), s.size());
+            off = cursor;
+            len = uint32_t(s.size());
+            cursor += len;
+        };
+        uint32_t index = 0;
+        for (const auto &p : items) {
+            if (!p) continue;
+            shm::ShmRecord r{};
+            r.id = p->getId();
+            r.price = p->getBasePrice();
+            r.kind = kindOf(*p);
+            r.currency = p->getCurrency();
+            r.parcel = p->getParcel();
+            put(p->getName(), r.name, r.nameLen);
+            put(p->getSku(), r.sku, r.skuLen);
+            if (auto e = dynamic_cast<const Electronics*>(p.get())) r.warrantyMonths = e->getWarrantyMonths();
+            else if (auto c = dynamic_cast<const Clothing*>(p.get())) {
+                put(c->getSize(), r.detail, r.detailLen);
+                r.clearance = c->isOnClearance();
+            } else if (auto g = dynamic_cast<const Grocery*>(p.get())) put(g->getExpiryDate(), r.detail, r.detailLen);
+            records[index] = r;
+            size_t b = shm::bucketOf(r.id, bucketCount);
+            while (buckets[b] != 0 && records[buckets[b] - 1].id != r.id) b = (b + 1) & size_t(bucketCount - 1);
+            buckets[b] = ++index;  // a duplicate id keeps the later product, as GenericCatalog::find does
+        }
+        memcpy(base, &h, sizeof h);
+        munmap(mapping, h.bytes);
+
+        uint64_t previous = control->version.exchange(h.version, memory_order_acq_rel);
+        if (previous) shm_unlink(shm::segmentName(name, previous).c_str());
+        return h.version;
+    }
+
+    // Removes the control segment and the current version.
+    static void unpublish(const string& name) {
+        size_t bytes = 0;
+        if (void* p = shm::mapSegment("/" + name, false, bytes)) {
+            uint64_t version = static_cast<shm::ShmControl*>(p)->version.load(memory_order_acquire);
+            munmap(p, bytes);
+            if (version) shm_unlink(shm::segmentName(name, version).c_str());
+        }
+        shm_unlink(("/" + name).c_str());
+    }
+};
+
+// Worker side: maps the control segment once and follows version bumps.
+// Each thread caches the snapshot it last used and checks it against the
+// control word, so a lookup takes no lock unless the version has moved on.
+// A thread keeps an old version mapped until its next lookup.
+class SharedCatalog {
+    static atomic<uint64_t> nextInstance;
+    const uint64_t instance = ++nextInstance;  // tells per-thread caches of different catalogs apart
+    string name;
+    const shm::ShmControl* control = nullptr;
+    mutex m;  // remapping only
+    shared_ptr<const SharedCatalogSnapshot> snapshot;
+
+    struct ThreadCache { uint64_t instance = 0; shared_ptr<const SharedCatalogSnapshot> snapshot; };
+
+    // This thread's snapshot, refreshed when the published version changes;
+    // valid until the thread's next call.
+    const shared_ptr<const SharedCatalogSnapshot>& cached() {
+        thread_local ThreadCache cache;
+        uint64_t version = control->version.load(memory_order_acquire);
+        if (cache.instance != instance || !cache.snapshot || (version != 0 && cache.snapshot->version() != version))
+            cache = {instance, remap()};
+        return cache.snapshot;
+    }
+
+    shared_ptr<const SharedCatalogSnapshot> remap() {
+        lock_guard<mutex> lock(m);
+        while (true) {
+            uint64_t version = control->version.load(memory_order_acquire);
+            if (version == 0 || (snapshot && snapshot->version() == version)) return snapshot;
+            size_t bytes = 0;
+            void* p = shm::mapSegment(shm::segmentName(name, version), false, bytes);
+            if (!p) {
+                if (errno == ENOENT) continue;  // superseded between the load and the open
+                throw runtime_error("map shared catalog: " + string(strerror(errno)));
+            }
+            snapshot = make_shared<const SharedCatalogSnapshot>(p, bytes);
+        }
+    }
+
+public:
+    explicit SharedCatalog(string name) : name(move(name)) {
+        size_t bytes = 0;
+        void* p = shm::mapSegment("/" + this->name, false, bytes);
+        if (!p || bytes < sizeof(shm::ShmControl)) throw runtime_error("no shared catalog named " + this->name);
+        control = static_cast<const shm::ShmControl*>(p);
+        if (!current()) throw runtime_error("shared catalog " + this->name + " has no published version");
+    }
+    SharedCatalog(const SharedCatalog&) = delete;
+    SharedCatalog& operator=(const SharedCatalog&) = delete;
+    ~SharedCatalog() { munmap(const_cast<shm::ShmControl*>(control), sizeof(shm::ShmControl)); }
+
+    // Latest published version; hold the result for the duration of a request
+    // to see one consistent catalog.
+    shared_ptr<const SharedCatalogSnapshot> current() { return cached(); }
+
+    shared_ptr<Product> find(uid64_t id) {
+        const auto &snap = cached();
+        return snap ? snap->product(id) : nullptr;
+    }
+};
+
+atomic<uint64_t> SharedCatalog::nextInstance{0};
+
+// -------------------------
+// CommerceService: shared state behind the network front-ends
+// -------------------------
+// Carts and orders are spread over mutex-protected shards keyed by id, so
+// requests for different carts/orders rarely contend. Products come from a
+// lookup function: a local GenericCatalog (read-only once the service is
+// constructed) or a SharedCatalog published by a loader process.
+class CommerceService {
+    static constexpr size_t kShards = 64;
+    struct CartShard { mutex m; unordered_map<uint64_t, ShoppingCart> carts; };
+    struct OrderShard { mutex m; unordered_map<uid64_t, shared_ptr<Order>> orders; };
+
+    function<shared_ptr<Product>(uid64_t)> lookup;
+    function<void(const Order&)> orderChanged;  // e.g. OrderStore::put
+    array<CartShard, kShards> cartShards;
+    array<OrderShard, kShards> orderShards;
+    atomic<uint64_t> undelivered{0};  // status events the event bus dropped
+
+    CartShard& cartShard(uint64_t cart) { return cartShards[cart % kShards]; }
+    OrderShard& orderShard(uid64_t order) { return orderShards[order % kShards]; }
+
+    void delivered(bool ok) {
+        if (!ok) undelivered.fetch_add(1, memory_order_relaxed);
+    }
+
+    template<typename F>
+    bool withOrder(uid64_t id, F fn) {
+        auto &shard = orderShard(id);
+        lock_guard<mutex> lock(shard.m);
+        auto it = shard.orders.find(id);
+        if (it == shard.orders.end()) return false;
+        fn(*it->second);
+        return true;
+    }
+
+public:
+    explicit CommerceService(const GenericCatalog<Product>& catalog) : lookup([&catalog](uid64_t id) { return catalog.find(id); }) {}
+    explicit CommerceService(SharedCatalog& catalog) : lookup([&catalog](uid64_t id) { return catalog.find(id); }) {}
+
+    shared_ptr<Product> product(uid64_t id) const { return lookup(id); }
+
+    // false when the product is unknown; throws invalid_argument when its
+    // currency differs from the cart's
+    bool addToCart(uint64_t cart, uid64_t productId, size_t qty) {
+        auto p = lookup(productId);
+        if (!p) return false;
+        auto &shard = cartShard(cart);
+        lock_guard<mutex> lock(shard.m);
+        shard.carts[cart].addProduct(move(p), qty);
+        return true;
+    }
+
+    void removeFromCart(uint64_t cart, uid64_t productId, size_t qty) {
+        auto &shard = cartShard(cart);
+        lock_guard<mutex> lock(shard.m);
+        auto it = shard.carts.find(cart);
+        if (it != shard.carts.end()) it->second.removeProduct(productId, qty);
+    }
+
+    double cartTotal(uint64_t cart) {
+        auto &shard = cartShard(cart);
+        lock_guard<mutex> lock(shard.m);
+        auto it = shard.carts.find(cart);
+        return it == shard.carts.end() ? 0.0 : it->second.total();
+    }
+
+    // Turns the cart into an order and empties it; nullptr for an empty cart.
+    shared_ptr<Order> checkout(uint64_t cart) {
+        shared_ptr<Order> order;
+        {
+            auto &shard = cartShard(cart);
+            lock_guard<mutex> lock(shard.m);
+            auto it = shard.carts.find(cart);
+            if (it == shard.carts.end() || it->second.empty()) return nullptr;
+            order = make_shared<Order>(it->second);
+            shard.carts.erase(it);
+        }
+        auto &shard = orderShard(order->getId());
+        lock_guard<mutex> lock(shard.m);
+        shard.orders.emplace(order->getId(), order);
+        if (orderChanged) orderChanged(*order);
+        return order;
+    }
+
+    bool pay(uid64_t id) { return withOrder(id, [&](Order& o) { delivered(o.pay()); if (orderChanged) orderChanged(o); }); }
+    bool ship(uid64_t id) { return withOrder(id, [&](Order& o) { delivered(o.ship()); if (orderChanged) orderChanged(o); }); }
+    bool cancel(uid64_t id) { return withOrder(id, [&](Order& o) { delivered(o.cancel()); if (orderChanged) orderChanged(o); }); }
+
+    // Status changes whose event a bus consumer never saw; the order store
+    // still has them, so a non-zero count means consumers must reconcile.
+    uint64_t undeliveredEvents() const { return undelivered.load(memory_order_relaxed); }
+
+    // Called under the order's shard lock after checkout and each status
+    // change, so one order's calls arrive in order. Set before serving.
+    void onOrderChanged(function<void(const Order&)> fn) { orderChanged = move(fn); }
+
+    // Runs fn on the order under its shard lock; false when unknown.
+    template<typename F>
+    bool inspectOrder(uid64_t id, F fn) { return withOrder(id, [&](Order& o) { fn(static_cast<const Order&>(o)); }); }
+
+    // Point-in-time copy for snapshots. Orders are shared, not copied: only
+    // their status changes after construction, and that is captured here.
+    struct OrderImage { shared_ptr<const Order> order; OrderStatus status; };
+    struct State {
+        vector<pair<uint64_t, ShoppingCart>> carts;
+        vector<OrderImage> orders;
+        uid64_t orderIdHighWater = 0;
+    };
+
+    // Holds every shard lock at once, for as long as it takes to copy pointers.
+    State capture() {
+        State state;
+        vector<unique_lock<mutex>> locks;
+        locks.reserve(2 * kShards);
+        for (auto &shard : cartShards) locks.emplace_back(shard.m);
+        for (auto &shard : orderShards) locks.emplace_back(shard.m);
+        size_t carts = 0, orders = 0;
+        for (auto &shard : cartShards) carts += shard.carts.size();
+        for (auto &shard : orderShards) orders += shard.orders.size();
+        state.carts.reserve(carts);
+        state.orders.reserve(orders);
+        for (auto &shard : cartShards)
+            for (const auto &kv : shard.carts)
+                if (!kv.second.empty()) state.carts.emplace_back(kv.first, kv.second);
+        for (auto &shard : orderShards)
+            for (const auto &kv : shard.orders) state.orders.push_back({kv.second, kv.second->getStatus()});
+        state.orderIdHighWater = Order::lastIssuedId();
+        return state;
+    }
+
+    void restoreCart(uint64_t cart, ShoppingCart contents) {
+        auto &shard = cartShard(cart);
+        lock_guard<mutex> lock(shard.m);
+        shard.carts.insert_or_assign(cart, move(contents));
+    }
+
+    // Takes one lock per shard for the whole batch.
+    void restoreOrders(vector<shared_ptr<Order>>&& batch) {
+        sort(batch.begin(), batch.end(), [](const auto& a, const auto& b) { return a->getId() % kShards < b->getId() % kShards; });
+        for (size_t i = 0; i < batch.size();) {
+            auto &shard = orderShard(batch[i]->getId());
+            lock_guard<mutex> lock(shard.m);
+            for (; i < batch.size() && &orderShard(batch[i]->getId()) == &shard; ++i) {
+                uid64_t id = batch[i]->getId();
+                shard.orders.insert_or_assign(id, move(batch[i]));
+            }
+        }
+    }
+};
+
+// -------------------------
+// Snapshots: catalog, live carts and orders in one file
+// -------------------------
+// capture() takes every shard lock once and copies pointers (orders are
+// immutable apart from their status, which is copied), then captureProducts()
+// copies every product's price under PricePublisher::writer(), so the image
+// is a consistent point in time that costs the service only a brief pause;
+// encoding and I/O then run on a background thread.
+//
+// File: header | chunk... | index | footer
+//   header: "ECSNAP03" | u64 createdAt | u64 order id high-water mark | u32 dict bytes | dict
+//   chunk:  u8 section | u32 records | u64 payload bytes | payload
+//   index:  u64 chunk count | u64 chunk offset...
+//   footer: u64 index offset | "ECSNAPIX"
+// A payload is one lz block; Products chunks are compressed against the
+// dictionary, trained on the product records being written. Order lines carry
+// their unit price. ECSNAP02 files (order lines without prices) and ECSNAP01
+// files (raw payloads, no dictionary) still restore; their orders take the
+// restored products' prices.
+// Chunks are independent, so restore decodes them on all cores. Cart and
+// order lines refer to products by id; every referenced product is written
+// to a Products chunk, including ones no longer in the catalog.
+namespace snap {
+constexpr char kMagic[8] = {'E', 'C', 'S', 'N', 'A', 'P', '0', '3'};
+constexpr char kMagicV2[8] = {'E', 'C', 'S', 'N', 'A', 'P', '0', '2'};
+constexpr char kMagicV1[8] = {'E', 'C', 'S', 'N', 'A', 'P', '0', '1'};
+constexpr char kIndexMagic[8] = {'E', 'C', 'S', 'N', 'A', 'P', 'I', 'X'};
+constexpr size_t kChunkRecords = 16384;
+constexpr size_t kChunkHeader = 13;
+
+enum class Section : uint8_t { Products = 1, Carts = 2, Orders = 3 };
+
+struct Writer {
+    string& out;
+    template<typename T>
+    void put(T v) { out.append(reinterpret_cast<const char*>(&v), sizeof v); }
+    void putString(string_view s) {
+        put(uint32_t(s.size()));
+        out.append(s.data(), s.size());
+    }
+};
+
+// Bounds-checked reads; throws on a truncated or corrupt snapshot.
+class Reader {
+    const char* p;
+    const char* end;
+    void need(size_t n) const { if (size_t(end - p) < n) throw runtime_error("snapshot truncated"); }
+public:
+    Reader(const char* data, size_t size) : p(data), end(data + size) {}
+    template<typename T>
+    T get() {
+        need(sizeof(T));
+        T v;
+        memcpy(&v, p, sizeof v);
+        p += sizeof v;
+        return v;
+    }
+    string_view getString() {
+        uint32_t n = get<uint32_t>();
+        need(n);
+        string_view s(p, n);
+        p += n;
+        return s;
+    }
+};
+
+// The kind byte carries the currency in its high nibble (0 = USD in older
+// files) and kParcelBit when weight and dimensions follow the SKU.
+constexpr uint8_t kParcelBit = 0x8;
+
+// Writes `p` with `price` as its base price (a price copied at capture time).
+inline void putProduct(Writer& w, const Product& p, double price) {
+    ProductKind kind = kindOf(p);
+    const Parcel parcel = p.getParcel();
+    w.put(uint64_t(p.getId()));
+    w.put(uint8_t(uint8_t(kind) | (parcel.empty() ? 0 : kParcelBit) | uint8_t(p.getCurrency()) << 4));
+    w.put(price);
+    w.putString(p.getName());
+    w.putString(p.getSku());
+    if (!parcel.empty())
+        for (float v : {parcel.weightKg, parcel.lengthCm, parcel.widthCm, parcel.heightCm}) w.put(v);
+    if (kind == ProductKind::Electronics) w.put(int32_t(static_cast<const Electronics&>(p).getWarrantyMonths()));
+    else if (kind == ProductKind::Clothing) {
+        w.putString(static_cast<const Clothing&>(p).getSize());
+        w.put(uint8_t(static_cast<const Clothing&>(p).isOnClearance()));
+    } else if (kind == ProductKind::Grocery) w.putString(static_cast<const Grocery&>(p).getExpiryDate());
+}
+
+inline void putProduct(Writer& w, const Product& p) { putProduct(w, p, p.getBasePrice()); }
+
+inline shared_ptr<Product> getProduct(Reader& r, pmr::memory_resource* resource) {
+    SharedProduct p{};
+    p.id = r.get<uint64_t>();
+    uint8_t tag = r.get<uint8_t>();
+    p.kind = ProductKind(tag & 0x7);
+    p.currency = Currency(tag >> 4);
+    if (size_t(p.currency) >= kCurrencyCount) throw runtime_error("snapshot: unknown currency");
+    p.price = r.get<double>();
+    p.name = r.getString();
+    p.sku = r.getString();
+    if (tag & kParcelBit)
+        for (float* v : {&p.parcel.weightKg, &p.parcel.lengthCm, &p.parcel.widthCm, &p.parcel.heightCm}) *v = r.get<float>();
+    if (p.kind == ProductKind::Electronics) p.warrantyMonths = r.get<int32_t>();
+    else if (p.kind == ProductKind::Clothing) {
+        p.detail = r.getString();
+        p.clearance = r.get<uint8_t>() != 0;
+    } else if (p.kind == ProductKind::Grocery) p.detail = r.getString();
+    else if (p.kind != ProductKind::Product) throw runtime_error("snapshot: unknown product kind");
+    return p.materialize(resource);
+}
+
+inline void putLines(Writer& w, const LineItems& items) {
+    w.put(uint32_t(items.size()));
+    for (const auto &kv : items) {
+        w.put(uint64_t(kv.first));
+        w.put(uint64_t(kv.second.second));
+    }
+}
+
+// As putLines, with each line's unit price from the order.
+inline void putOrderLines(Writer& w, const Order& order) {
+    w.put(uint32_t(order.getItems().size()));
+    for (const auto &kv : order.getItems()) {
+        w.put(uint64_t(kv.first));
+        w.put(uint64_t(kv.second.second));
+        w.put(order.unitPrice(kv.first));
+    }
+}
+
+// A product to write and its base price when the state was captured.
+struct ProductImage { shared_ptr<const Product> product; double price; };
+
+// The catalog plus every product a captured cart or order refers to that is
+// no longer in it, with prices read in one go so no repricing lands halfway.
+template<typename Items>
+vector<ProductImage> captureProducts(const Items& catalogItems, const CommerceService::State& state) {
+    unordered_set<uid64_t> seen;
+    seen.reserve(catalogItems.size());
+    vector<shared_ptr<const Product>> products;
+    products.reserve(catalogItems.size());
+    for (const auto &p : catalogItems)
+        if (p && seen.insert(p->getId()).second) products.push_back(p);
+    auto collect = [&](const LineItems& items) {
+        for (const auto &kv : items)
+            if (seen.insert(kv.first).second) products.push_back(kv.second.first);
+    };
+    for (const auto &c : state.carts) collect(c.second.getItems());
+    for (const auto &o : state.orders) collect(o.order->getItems());
+    vector<ProductImage> images;
+    images.reserve(products.size());
+    lock_guard<mutex> lock(PricePublisher::writer());
+    for (auto &p : products) {
+        double price = p->getBasePrice();
+        images.push_back({move(p), price});
+    }
+    return images;
+}
+
+// fn(product, qty) per line
+template<typename F>
+void getLines(Reader& r, const GenericCatalog<Product>& catalog, F&& fn) {
+    for (uint32_t n = r.get<uint32_t>(); n > 0; --n) {
+        uid64_t id = r.get<uint64_t>();
+        size_t qty = size_t(r.get<uint64_t>());
+        auto p = catalog.find(id);
+        if (!p) throw runtime_error("snapshot: line refers to unknown product " + to_string(id));
+        fn(move(p), qty);
+    }
+}
+
+// fn(product, qty, unit price) per line written by putOrderLines
+template<typename F>
+void getOrderLines(Reader& r, const GenericCatalog<Product>& catalog, F&& fn) {
+    for (uint32_t n = r.get<uint32_t>(); n > 0; --n) {
+        uid64_t id = r.get<uint64_t>();
+        size_t qty = size_t(r.get<uint64_t>());
+        double price = r.get<double>();
+        auto p = catalog.find(id);
+        if (!p) throw runtime_error("snapshot: line refers to unknown product " + to_string(id));
+        fn(move(p), qty, price);
+    }
+}
+} // namespace snap
+
+struct SnapshotStats {
+    size_t products = 0, carts = 0, orders = 0, chunks = 0;
+    uint64_t bytes = 0, rawBytes = 0;  // file size, and chunk payloads before compression
+    double seconds = 0;
+};
+
+// fsync()s a file or directory by name.
+static void syncPath(const string& path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    bool ok = fd >= 0 && fsync(fd) == 0;
+    if (fd >= 0) close(fd);
+    if (!ok) throw runtime_error("cannot sync " + path + ": " + strerror(errno));
+}
+
+// Encodes a captured state and writes it to path via path + ".tmp" and rename().
+// The data is synced before the rename and the directory after it, so a power
+// loss leaves either the previous snapshot or the complete new one.
+// `products` comes from snap::captureProducts() for the same state.
+SnapshotStats writeSnapshot(const string& path, const vector<snap::ProductImage>& products, const CommerceService::State& state) {
+    auto start = chrono::steady_clock::now();
+    SnapshotStats stats;
+
+    // dictionary from up to ~20k product records spread over the catalog
+    string sampleBytes, raw;
+    snap::Writer rec{raw};
+    vector<size_t> sampleEnds;
+    for (size_t i = 0, stride = max<size_t>(1, products.size() / 20000); i < products.size(); i += stride) {
+        snap::Writer sw{sampleBytes};
+        snap::putProduct(sw, *products[i].product, products[i].price);
+        sampleEnds.push_back(sampleBytes.size());
+    }
+    vector<string_view> samples;
+    for (size_t i = 0; i < sampleEnds.size(); ++i) {
+        size_t from = i ? sampleEnds[i - 1] : 0;
+        samples.push_back(string_view(sampleBytes).substr(from, sampleEnds[i] - from));
+    }
+    auto dict = lz::Dictionary::train(samples);
+
+    string tmp = path + ".tmp";
+    ofstream file(tmp, ios::binary | ios::trunc);
+    if (!file) throw runtime_error("cannot write " + tmp);
+    string buf;
+    snap::Writer w{buf};
+    buf.append(snap::kMagic, sizeof snap::kMagic);
+    w.put(uint64_t(time(nullptr)));
+    w.put(uint64_t(state.orderIdHighWater));
+    w.put(uint32_t(dict.size()));
+    buf += dict.bytes();
+    uint64_t offset = 0;
+    vector<uint64_t> index;
+    auto flush = [&] {
+        file.write(buf.data(), streamsize(buf.size()));
+        offset += buf.size();
+        buf.clear();
+    };
+    flush();
+    // one chunk per kChunkRecords records of a section
+    auto emit = [&](snap::Section section, size_t count, auto&& encode) {
+        for (size_t first = 0; first < count; first += snap::kChunkRecords) {
+            size_t n = min(snap::kChunkRecords, count - first);
+            raw.clear();
+            for (size_t i = first; i < first + n; ++i) encode(i);
+            stats.rawBytes += raw.size();
+            w.put(uint8_t(section));
+            w.put(uint32_t(n));
+            w.put(uint64_t(0));  // payload size, patched below
+            lz::encodeBlock(raw, buf, section == snap::Section::Products ? &dict : nullptr);
+            uint64_t payload = buf.size() - snap::kChunkHeader;
+            memcpy(&buf[5], &payload, sizeof payload);
+            index.push_back(offset);
+            flush();
+        }
+    };
+    emit(snap::Section::Products, products.size(), [&](size_t i) { snap::putProduct(rec, *products[i].product, products[i].price); });
+    emit(snap::Section::Carts, state.carts.size(), [&](size_t i) {
+        rec.put(uint64_t(state.carts[i].first));
+        snap::putLines(rec, state.carts[i].second.getItems());
+    });
+    emit(snap::Section::Orders, state.orders.size(), [&](size_t i) {
+        const auto &o = state.orders[i];
+        rec.put(uint64_t(o.order->getId()));
+        rec.put(uint8_t(o.status));
+        rec.put(int64_t(o.order->createdAt()));
+        snap::putOrderLines(rec, *o.order);
+    });
+    uint64_t indexOffset = offset;
+    w.put(uint64_t(index.size()));
+    for (uint64_t at : index) w.put(at);
+    w.put(indexOffset);
+    buf.append(snap::kIndexMagic, sizeof snap::kIndexMagic);
+    flush();
+    file.close();
+    if (!file) throw runtime_error("cannot write " + tmp);
+    syncPath(tmp);
+    if (rename(tmp.c_str(), path.c_str()) != 0) throw runtime_error("cannot write " + path);
+    size_t slash = path.find_last_of('/');
+    syncPath(slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash));
+
+    stats.products = products.size();
+    stats.carts = state.carts.size();
+    stats.orders = state.orders.size();
+    stats.chunks = index.size();
+    stats.bytes = offset;
+    stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return stats;
+}
+
+// Loads a snapshot into an empty catalog and the service built on it,
+// decoding chunks on `threads` threads.
+SnapshotStats restoreSnapshot(const string& path, GenericCatalog<Product>& catalog, CommerceService& service,
+                              unsigned threads = max(1u, thread::hardware_concurrency())) {
+    auto start = chrono::steady_clock::now();
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st{};
+    if (fd < 0 || fstat(fd, &st) != 0) throw runtime_error("cannot open " + path);
+    size_t bytes = size_t(st.st_size);
+    void* mapping = bytes ? mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (mapping == MAP_FAILED) throw runtime_error("cannot map " + path);
+    unique_ptr<void, function<void(void*)>> unmap(mapping, [bytes](void* p) { munmap(p, bytes); });
+    const char* base = static_cast<const char*>(mapping);
+    madvise(mapping, bytes, MADV_SEQUENTIAL);
+
+    constexpr size_t kHeader = sizeof snap::kMagic + 16, kFooter = 8 + sizeof snap::kIndexMagic;
+    bool pricedLines = bytes >= kHeader && memcmp(base, snap::kMagic, sizeof snap::kMagic) == 0;
+    bool compressed = pricedLines || (bytes >= kHeader && memcmp(base, snap::kMagicV2, sizeof snap::kMagicV2) == 0);
+    if (bytes < kHeader + kFooter || (!compressed && memcmp(base, snap::kMagicV1, sizeof snap::kMagicV1) != 0) ||
+        memcmp(base + bytes - sizeof snap::kIndexMagic, snap::kIndexMagic, sizeof snap::kIndexMagic) != 0)
+        throw runtime_error(path + " is not a complete snapshot");
+    uint64_t indexOffset;
+    memcpy(&indexOffset, base + bytes - kFooter, sizeof indexOffset);
+    if (indexOffset < kHeader + (compressed ? 4 : 0) || indexOffset > bytes - kFooter) throw runtime_error("snapshot: bad index offset");
+    snap::Reader header(base + sizeof snap::kMagic, size_t(indexOffset) - sizeof snap::kMagic);
+    header.get<uint64_t>();
+    uint64_t highWater = header.get<uint64_t>();
+    lz::Dictionary dict;
+    if (compressed) {
+        uint32_t dictBytes = header.get<uint32_t>();
+        if (dictBytes > indexOffset - kHeader - 4) throw runtime_error("snapshot: bad dictionary size");
+        dict = lz::Dictionary(string(base + kHeader + 4, dictBytes));
+    }
+    snap::Reader indexReader(base + indexOffset, bytes - kFooter - indexOffset);
+    uint64_t chunkCount = indexReader.get<uint64_t>();
+    if (chunkCount > (bytes - kFooter - indexOffset - 8) / 8) throw runtime_error("snapshot: bad chunk count");
+    vector<uint64_t> chunks(static_cast<size_t>(chunkCount));
+    for (auto &at : chunks) at = indexReader.get<uint64_t>();
+
+    struct Chunk { snap::Section section; uint32_t records; const char* payload; size_t bytes; };
+    vector<Chunk> decoded;
+    decoded.reserve(chunks.size());
+    for (uint64_t at : chunks) {
+        if (at > indexOffset || indexOffset - at < snap::kChunkHeader) throw runtime_error("snapshot: bad chunk offset");
+        snap::Reader r(base + at, snap::kChunkHeader);
+        auto section = snap::Section(r.get<uint8_t>());
+        uint32_t records = r.get<uint32_t>();
+        uint64_t payload = r.get<uint64_t>();
+        if (payload > indexOffset - at - snap::kChunkHeader) throw runtime_error("snapshot: chunk overruns the file");
+        decoded.push_back({section, records, base + at + snap::kChunkHeader, size_t(payload)});
+    }
+    // compressed payloads are decompressed by whichever thread takes the chunk
+    auto unpack = [&](const Chunk& chunk, string& plain) {
+        if (!compressed) return snap::Reader(chunk.payload, chunk.bytes);
+        lz::decodeBlock(chunk.payload, chunk.bytes, plain, &dict);
+        return snap::Reader(plain.data(), plain.size());
+    };
+
+    // Runs fn(chunk index) for every chunk of one section, spread over the threads.
+    auto parallel = [&](snap::Section section, auto&& fn) {
+        atomic<size_t> next{0};
+        exception_ptr failure;
+        mutex failureMutex;
+        auto worker = [&] {
+            try {
+                for (size_t i; (i = next.fetch_add(1)) < decoded.size();)
+                    if (decoded[i].section == section) fn(i);
+            } catch (...) {
+                lock_guard<mutex> lock(failureMutex);
+                if (!failure) failure = current_exception();
+            }
+        };
+        vector<thread> pool;
+        for (unsigned t = 1; t < threads; ++t) pool.emplace_back(worker);
+        worker();
+        for (auto &t : pool) t.join();
+        if (failure) rethrow_exception(failure);
+    };
+
+    SnapshotStats stats;
+    stats.chunks = decoded.size();
+    stats.bytes = bytes;
+    // Products decode in parallel; the catalog index is then filled in file order.
+    vector<vector<shared_ptr<Product>>> products(decoded.size());
+    parallel(snap::Section::Products, [&](size_t i) {
+        auto &chunk = decoded[i];
+        string plain;
+        auto payload = unpack(chunk, plain);
+        products[i].reserve(chunk.records);
+        for (uint32_t n = 0; n < chunk.records; ++n) products[i].push_back(snap::getProduct(payload, catalog.resource()));
+    });
+    for (auto &batch : products) {
+        stats.products += batch.size();
+        for (auto &p : batch) catalog.add(move(p));
+    }
+    atomic<size_t> carts{0}, orders{0};
+    parallel(snap::Section::Carts, [&](size_t i) {
+        auto &chunk = decoded[i];
+        string plain;
+        auto payload = unpack(chunk, plain);
+        for (uint32_t n = 0; n < chunk.records; ++n) {
+            uint64_t id = payload.get<uint64_t>();
+            ShoppingCart cart;
+            snap::getLines(payload, catalog, [&](shared_ptr<Product> p, size_t qty) { cart.addProduct(move(p), qty); });
+            service.restoreCart(id, move(cart));
+        }
+        carts += chunk.records;
+    });
+    parallel(snap::Section::Orders, [&](size_t i) {
+        auto &chunk = decoded[i];
+        string plain;
+        auto payload = unpack(chunk, plain);
+        vector<shared_ptr<Order>> batch;
+        batch.reserve(chunk.records);
+        for (uint32_t n = 0; n < chunk.records; ++n) {
+            uid64_t id = payload.get<uint64_t>();
+            auto status = OrderStatus(payload.get<uint8_t>());
+            auto createdAt = time_t(payload.get<int64_t>());
+            LineItems lines(&AllocationTracker::resource(Subsystem::Order));
+            LinePrices prices(&AllocationTracker::resource(Subsystem::Order));
+            auto addLine = [&](shared_ptr<Product> p, size_t qty) {
+                uid64_t pid = p->getId();
+                auto &line = lines[pid];
+                line.first = move(p);
+                line.second += qty;
+            };
+            if (pricedLines) {
+                snap::getOrderLines(payload, catalog, [&](shared_ptr<Product> p, size_t qty, double price) {
+                    prices[p->getId()] = price;
+                    addLine(move(p), qty);
+                });
+            } else {
+                snap::getLines(payload, catalog, addLine);
+            }
+            batch.push_back(Order::restore(id, status, createdAt, move(lines), move(prices)));
+        }
+        service.restoreOrders(move(batch));
+        orders += chunk.records;
+    });
+    Order::reserveIds(highWater);
+    stats.carts = carts;
+    stats.orders = orders;
+    stats.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return stats;
+}
+
+// Captures on the calling thread, encodes and writes on a background one.
+class SnapshotWriter {
+    thread worker;
+    atomic<bool> busy{false};
+    mutex m;
+    SnapshotStats lastStats;
+    string lastError;
+
+public:
+    ~SnapshotWriter() { wait(); }
+
+    // false when the previous snapshot is still being written, or when the
+    // capture failed (its error is then reported by last())
+    bool start(const string& path, const GenericCatalog<Product>& catalog, CommerceService& service) {
+        if (busy.exchange(true)) return false;
+        if (worker.joinable()) worker.join();
+        try {
+            auto state = make_shared<CommerceService::State>(service.capture());
+            auto products = snap::captureProducts(catalog.getItems(), *state);
+            worker = thread([this, path, products = move(products), state] {
+                SnapshotStats stats;
+                string error;
+                try { stats = writeSnapshot(path, products, *state); }
+                catch (const exception& e) { error = e.what(); }
+                lock_guard<mutex> lock(m);
+                lastStats = stats;
+                lastError = move(error);
+                busy.store(false);
+            });
+        } catch (const exception& e) {
+            // a failed capture must not block every later snapshot
+            lock_guard<mutex> lock(m);
+            lastStats = SnapshotStats{};
+            lastError = e.what();
+            busy.store(false);
+            return false;
+        }
+        return true;
+    }
+
+    void wait() { if (worker.joinable()) worker.join(); }
+
+    // stats of the last finished snapshot; error is empty on success
+    SnapshotStats last(string* error = nullptr) {
+        lock_guard<mutex> lock(m);
+        if (error) *error = lastError;
+        return lastStats;
+    }
+};
+
+// -------------------------
+// OrderStore: log-structured merge store for orders, keyed by order id
+// -------------------------
+// put() appends to a write-ahead log and inserts into the memtable. A full
+// memtable is frozen and a background thread flushes it into a sorted run in
+// level 0; runs there may overlap. When level 0 holds kL0Trigger runs they
+// are merged into level 1, and a level over its byte budget (10x the one
+// above) pushes one run's key range down a level. Levels >= 1 never overlap.
+// The newest version of an id wins: memtable, frozen memtables, L0 newest
+// first, then L1, L2, ...
+//
+// Run file: block... | index | bloom filter | footer
+//   block:  lz block of (u64 id | i64 createdAt | u32 len | bytes)..., about 4 KiB raw
+//   index:  per block u64 firstId | u64 lastId | i64 minTime | i64 maxTime | u64 offset | u32 bytes
+//   bloom:  u32 hashes | u64 words | u64 bits...
+//   footer: u64 indexOffset | u64 blocks | u64 bloomOffset | u64 records | "ECLSMRN2"
+// Runs written before compression ("ECLSMRN1") hold raw blocks and stay readable.
+// The MANIFEST lists the runs of every level and the last flushed log.
+//
+// Log file: "ECLSMWL2" | record...
+//   record: u64 id | i64 createdAt | u32 len | bytes | u32 crc32c(all before it)
+// Replay stops at the first short or failing record. Logs without the magic
+// predate the checksum and are replayed as plain records.
+struct StoredLine { uid64_t product; uint32_t qty; double unitPrice; };
+
+// The persisted form of an Order: prices are frozen at order time.
+struct StoredOrder {
+    uid64_t id = 0;
+    OrderStatus status = OrderStatus::Created;
+    int64_t createdAt = 0;
+    double total = 0;
+    vector<StoredLine> lines;
+
+    static StoredOrder from(const Order& o) {
+        StoredOrder s;
+        s.id = o.getId();
+        s.status = o.getStatus();
+        s.createdAt = int64_t(o.createdAt());
+        s.total = o.total();
+        s.lines.reserve(o.getItems().size());
+        for (const auto &kv : o.getItems())
+            s.lines.push_back({kv.first, uint32_t(kv.second.second), o.unitPrice(kv.first)});
+        return s;
+    }
+
+    void encode(string& out) const {
+        snap::Writer w{out};
+        w.put(uint8_t(status));
+        w.put(total);
+        w.put(uint32_t(lines.size()));
+        for (const auto &l : lines) {
+            w.put(uint64_t(l.product));
+            w.put(l.qty);
+            w.put(l.unitPrice);
+        }
+    }
+
+    static StoredOrder decode(uid64_t id, int64_t createdAt, string_view bytes) {
+        snap::Reader r(bytes.data(), bytes.size());
+        StoredOrder s;
+        s.id = id;
+        s.createdAt = createdAt;
+        s.status = OrderStatus(r.get<uint8_t>());
+        s.total = r.get<double>();
+        s.lines.resize(r.get<uint32_t>());
+        for (auto &l : s.lines) {
+            l.product = r.get<uint64_t>();
+            l.qty = r.get<uint32_t>();
+            l.unitPrice = r.get<double>();
+        }
+        return s;
+    }
+};
+
+namespace lsm {
+constexpr char kRunMagic[8] = {'E', 'C', 'L', 'S', 'M', 'R', 'N', '2'};
+constexpr char kRunMagicV1[8] = {'E', 'C', 'L', 'S', 'M', 'R', 'N', '1'};
+constexpr size_t kBlockBytes = 4096;
+constexpr size_t kRecordHeader = 20;  // id + createdAt + len
+constexpr char kWalMagic[8] = {'E', 'C', 'L', 'S', 'M', 'W', 'L', '2'};
+constexpr size_t kWalTrailer = 4;      // crc32c of the log record
+constexpr size_t kIndexEntry = 44;
+constexpr size_t kFooter = 40;
+constexpr int kBloomHashes = 7;        // ~1% false positives at 10 bits per key
+constexpr size_t kBloomBitsPerKey = 10;
+
+struct Value { int64_t createdAt; string bytes; };
+
+struct BlockMeta { uint64_t firstId, lastId; int64_t minTime, maxTime; uint64_t offset; uint32_t bytes; };
+
+class Bloom {
+    vector<uint64_t> bits;
+    int hashes = kBloomHashes;
+    // double hashing from one 64-bit mix of the id
+    template<typename F>
+    void probe(uint64_t id, F&& fn) const {
+        uint64_t h = (id ^ (id >> 31)) * 0x9E3779B97F4A7C15ull;
+        uint64_t h1 = h ^ (h >> 29), h2 = (h >> 32) | 1;
+        for (int i = 0; i < hashes; ++i) fn((h1 + uint64_t(i) * h2) % (bits.size() * 64));
+    }
+public:
+    Bloom() = default;
+    explicit Bloom(size_t keys) : bits(max<size_t>(1, (keys * kBloomBitsPerKey + 63) / 64)) {}
+    void add(uint64_t id) { probe(id, [&](uint64_t b) { bits[b / 64] |= 1ull << (b % 64); }); }
+    bool mayContain(uint64_t id) const {
+        bool all = true;
+        probe(id, [&](uint64_t b) { all = all && (bits[b / 64] >> (b % 64) & 1); });
+        return all;
+    }
+    void write(snap::Writer& w) const {
+        w.put(uint32_t(hashes));
+        w.put(uint64_t(bits.size()));
+        for (uint64_t word : bits) w.put(word);
+    }
+    static Bloom read(snap::Reader& r) {
+        Bloom b;
+        b.hashes = int(r.get<uint32_t>());
+        b.bits.resize(r.get<uint64_t>());
+        for (auto &word : b.bits) word = r.get<uint64_t>();
+        if (b.bits.empty()) b.bits.resize(1);
+        return b;
+    }
+};
+
+inline void check(bool ok, const string& what) {
+    if (!ok) throw runtime_error(what + ": " + strerror(errno));
+}
+
+inline void writeAll(int fd, const string& bytes, const string& what) {
+    for (size_t off = 0; off < bytes.size();) {
+        ssize_t n = ::write(fd, bytes.data() + off, bytes.size() - off);
+        check(n > 0, what);
+        off += size_t(n);
+    }
+}
+
+// Appends one log record for `value`.
+inline void appendWalRecord(string& out, uint64_t id, int64_t createdAt, string_view value) {
+    size_t at = out.size();
+    snap::Writer w{out};
+    w.put(id);
+    w.put(createdAt);
+    w.put(uint32_t(value.size()));
+    out.append(value.data(), value.size());
+    w.put(lz::crc32c(out.data() + at, out.size() - at));
+}
+
+inline string fileName(const string& dir, uint64_t number, const char* ext) {
+    char buf[32];
+    snprintf(buf, sizeof buf, "/%06llu.%s", static_cast<unsigned long long>(number), ext);
+    return dir + buf;
+}
+
+// An immutable sorted run on disk; index and bloom filter stay in memory.
+class Run {
+    string path;
+    int fd = -1;
+    vector<BlockMeta> blocks;
+    Bloom bloom;
+    atomic<bool> obsolete{false};
+    bool compressed = true;  // false for ECLSMRN1 runs
+
+public:
+    const uint64_t number;
+    uint64_t records = 0, bytes = 0;
+
+    Run(string path, uint64_t number) : path(move(path)), number(number) {
+        fd = open(this->path.c_str(), O_RDONLY | O_CLOEXEC);
+        check(fd >= 0, "open " + this->path);
+        struct stat st{};
+        check(fstat(fd, &st) == 0, "stat " + this->path);
+        bytes = uint64_t(st.st_size);
+        if (bytes < kFooter) throw runtime_error(this->path + ": not a run file");
+        string tail = readAt(bytes - kFooter, kFooter);
+        compressed = memcmp(tail.data() + kFooter - 8, kRunMagic, 8) == 0;
+        if (!compressed && memcmp(tail.data() + kFooter - 8, kRunMagicV1, 8) != 0) throw runtime_error(this->path + ": not a run file");
+        snap::Reader f(tail.data(), kFooter);
+        uint64_t indexOffset = f.get<uint64_t>(), blockCount = f.get<uint64_t>(), bloomOffset = f.get<uint64_t>();
+        records = f.get<uint64_t>();
+        if (indexOffset > bloomOffset || bloomOffset > bytes - kFooter) throw runtime_error(this->path + ": bad footer");
+        string meta = readAt(indexOffset, size_t(bytes - kFooter - indexOffset));
+        snap::Reader r(meta.data(), meta.size());
+        blocks.resize(size_t(blockCount));
+        for (auto &b : blocks) {
+            b.firstId = r.get<uint64_t>();
+            b.lastId = r.get<uint64_t>();
+            b.minTime = r.get<int64_t>();
+            b.maxTime = r.get<int64_t>();
+            b.offset = r.get<uint64_t>();
+            b.bytes = r.get<uint32_t>();
+        }
+        bloom = Bloom::read(r);
+    }
+    Run(const Run&) = delete;
+    Run& operator=(const Run&) = delete;
+    ~Run() {
+        close(fd);
+        if (obsolete) unlink(path.c_str());
+    }
+
+    // The file goes away once the last reader drops the run.
+    void retire() { obsolete = true; }
+
+    uint64_t minId() const { return blocks.empty() ? UINT64_MAX : blocks.front().firstId; }
+    uint64_t maxId() const { return blocks.empty() ? 0 : blocks.back().lastId; }
+    const vector<BlockMeta>& index() const { return blocks; }
+
+    string readAt(uint64_t offset, size_t n) const {
+        string buf(n, '\0');
+        for (size_t done = 0; done < n;) {
+            ssize_t got = pread(fd, &buf[done], n - done, off_t(offset + done));
+            check(got > 0, "read " + path);
+            done += size_t(got);
+        }
+        return buf;
+    }
+
+    string readBlock(size_t i) const {
+        string stored = readAt(blocks[i].offset, blocks[i].bytes);
+        if (!compressed) return stored;
+        string block;
+        lz::decodeBlock(stored.data(), stored.size(), block);
+        return block;
+    }
+
+    // Bloom filter, then one block read.
+    bool get(uint64_t id, Value& out) const {
+        if (blocks.empty() || id < minId() || id > maxId() || !bloom.mayContain(id)) return false;
+        auto it = upper_bound(blocks.begin(), blocks.end(), id, [](uint64_t k, const BlockMeta& b) { return k < b.firstId; });
+        if (it == blocks.begin()) return false;
+        --it;
+        if (id > it->lastId) return false;
+        string block = readBlock(size_t(it - blocks.begin()));
+        for (size_t pos = 0; pos + kRecordHeader <= block.size();) {
+            snap::Reader r(block.data() + pos, block.size() - pos);
+            uint64_t key = r.get<uint64_t>();
+            int64_t at = r.get<int64_t>();
+            uint32_t len = r.get<uint32_t>();
+            if (key == id) {
+                out.createdAt = at;
+                out.bytes.assign(block.data() + pos + kRecordHeader, len);
+                return true;
+            }
+            if (key > id) return false;
+            pos += kRecordHeader + len;
+        }
+        return false;
+    }
+};
+
+// Streams sorted records into a new run file.
+class RunBuilder {
+    string path;
+    int fd;
+    string block, stored, meta;
+    vector<BlockMeta> blocks;
+    vector<uint64_t> ids;
+    uint64_t offset = 0;
+    BlockMeta current{};
+
+    void finishBlock() {
+        if (block.empty()) return;
+        stored.clear();
+        lz::encodeBlock(block, stored);
+        current.offset = offset;
+        current.bytes = uint32_t(stored.size());
+        blocks.push_back(current);
+        writeAll(fd, stored, "write " + path);
+        offset += stored.size();
+        block.clear();
+    }
+
+public:
+    explicit RunBuilder(string path) : path(move(path)) {
+        fd = open(this->path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        check(fd >= 0, "create " + this->path);
+    }
+    RunBuilder(const RunBuilder&) = delete;
+    RunBuilder& operator=(const RunBuilder&) = delete;
+    ~RunBuilder() { if (fd >= 0) { close(fd); unlink(path.c_str()); } }
+
+    void add(uint64_t id, int64_t createdAt, string_view value) {
+        if (block.empty()) current = {id, id, createdAt, createdAt, 0, 0};
+        current.lastId = id;
+        current.minTime = min(current.minTime, createdAt);
+        current.maxTime = max(current.maxTime, createdAt);
+        snap::Writer w{block};
+        w.put(id);
+        w.put(createdAt);
+        w.put(uint32_t(value.size()));
+        block.append(value.data(), value.size());
+        ids.push_back(id);
+        if (block.size() >= kBlockBytes) finishBlock();
+    }
+
+    uint64_t bytesSoFar() const { return offset + block.size(); }
+    bool empty() const { return ids.empty(); }
+
+    // Writes index, bloom filter and footer and syncs the file.
+    void finish() {
+        finishBlock();
+        Bloom bloom(ids.size());
+        for (uint64_t id : ids) bloom.add(id);
+        string tail;
+        snap::Writer w{tail};
+        for (const auto &b : blocks) {
+            w.put(b.firstId);
+            w.put(b.lastId);
+            w.put(b.minTime);
+            w.put(b.maxTime);
+            w.put(b.offset);
+            w.put(b.bytes);
+        }
+        uint64_t bloomOffset = offset + tail.size();
+        bloom.write(w);
+        w.put(offset);
+        w.put(uint64_t(blocks.size()));
+        w.put(bloomOffset);
+        w.put(uint64_t(ids.size()));
+        tail.append(kRunMagic, sizeof kRunMagic);
+        writeAll(fd, tail, "write " + path);
+        check(fdatasync(fd) == 0, "sync " + path);
+        close(fd);
+        fd = -1;
+    }
+};
+
+// Sorted input for merges and scans; lower rank = newer data.
+class Cursor {
+public:
+    virtual ~Cursor() = default;
+    virtual bool valid() const = 0;
+    virtual uint64_t id() const = 0;
+    virtual int64_t createdAt() const = 0;
+    virtual string_view value() const = 0;
+    virtual void next() = 0;
+};
+
+class MapCursor : public Cursor {
+    map<uint64_t, Value>::const_iterator it, end;
+public:
+    MapCursor(const map<uint64_t, Value>& m, uint64_t from, uint64_t to) : it(m.lower_bound(from)), end(m.upper_bound(to)) {}
+    bool valid() const override { return it != end; }
+    uint64_t id() const override { return it->first; }
+    int64_t createdAt() const override { return it->second.createdAt; }
+    string_view value() const override { return it->second.bytes; }
+    void next() override { ++it; }
+};
+
+// Reads one block at a time; blocks outside [from, to] or rejected by the
+// block filter are skipped without being read.
+class RunCursor : public Cursor {
+    shared_ptr<const Run> run;
+    uint64_t from, to;
+    function<bool(const BlockMeta&)> keep;
+    size_t blockIndex;
+    string block;
+    size_t pos = 0;
+    uint64_t curId = 0;
+    int64_t curTime = 0;
+    string_view curValue;
+    bool ok = false;
+
+    bool loadNextBlock() {
+        const auto &index = run->index();
+        while (blockIndex < index.size() && index[blockIndex].firstId <= to) {
+            size_t i = blockIndex++;
+            if (index[i].lastId < from || (keep && !keep(index[i]))) continue;
+            block = run->readBlock(i);
+            pos = 0;
+            return true;
+        }
+        return false;
+    }
+
+    void advance() {
+        while (true) {
+            if (pos + kRecordHeader > block.size() && !loadNextBlock()) { ok = false; return; }
+            if (pos + kRecordHeader > block.size()) continue;
+            snap::Reader r(block.data() + pos, block.size() - pos);
+            curId = r.get<uint64_t>();
+            curTime = r.get<int64_t>();
+            uint32_t len = r.get<uint32_t>();
+            curValue = string_view(block.data() + pos + kRecordHeader, len);
+            pos += kRecordHeader + len;
+            if (curId > to) { ok = false; return; }
+            if (curId >= from) { ok = true; return; }
+        }
+    }
+
+public:
+    RunCursor(shared_ptr<const Run> run, uint64_t from, uint64_t to, function<bool(const BlockMeta&)> keep = nullptr)
+        : run(move(run)), from(from), to(to), keep(move(keep)) {
+        const auto &index = this->run->index();
+        auto it = upper_bound(index.begin(), index.end(), from, [](uint64_t k, const BlockMeta& b) { return k < b.firstId; });
+        blockIndex = it == index.begin() ? 0 : size_t(it - index.begin() - 1);
+        advance();
+    }
+    bool valid() const override { return ok; }
+    uint64_t id() const override { return curId; }
+    int64_t createdAt() const override { return curTime; }
+    string_view value() const override { return curValue; }
+    void next() override { advance(); }
+};
+
+// K-way merge; for equal ids only the lowest-ranked (newest) cursor's record
+// is produced.
+class MergeCursor {
+    vector<unique_ptr<Cursor>> inputs;  // index = rank
+    using Head = pair<uint64_t, size_t>;
+    priority_queue<Head, vector<Head>, greater<Head>> heap;
+    size_t top = 0;
+    bool ok = false;
+
+    void settle() {
+        ok = !heap.empty();
+        if (!ok) return;
+        top = heap.top().second;
+        uint64_t id = heap.top().first;
+        // drop older versions of the same id
+        heap.pop();
+        while (!heap.empty() && heap.top().first == id) {
+            size_t older = heap.top().second;
+            heap.pop();
+            inputs[older]->next();
+            if (inputs[older]->valid()) heap.push({inputs[older]->id(), older});
+        }
+    }
+
+public:
+    explicit MergeCursor(vector<unique_ptr<Cursor>> cursors) : inputs(move(cursors)) {
+        for (size_t i = 0; i < inputs.size(); ++i)
+            if (inputs[i]->valid()) heap.push({inputs[i]->id(), i});
+        settle();
+    }
+    bool valid() const { return ok; }
+    uint64_t id() const { return inputs[top]->id(); }
+    int64_t createdAt() const { return inputs[top]->createdAt(); }
+    string_view value() const { return inputs[top]->value(); }
+    void next() {
+        inputs[top]->next();
+        if (inputs[top]->valid()) heap.push({inputs[top]->id(), top});
+        settle();
+    }
+};
+
+struct Memtable {
+    map<uint64_t, Value> entries;
+    size_t bytes = 0;
+    uint64_t walNumber = 0;
+    int walFd = -1;
+};
+
+// levels[0] newest first; levels[1..] sorted by minId and disjoint.
+struct Version {
+    vector<vector<shared_ptr<Run>>> levels;
+};
+} // namespace lsm
+
+class OrderStore {
+public:
+    struct Options {
+        size_t memtableBytes = 4 << 20;
+        size_t runBytes = 8 << 20;        // target size of compaction output
+        size_t level1Bytes = 32 << 20;    // budget of level 1; x10 per level below
+        size_t l0Trigger = 4;
+        size_t maxFrozen = 2;             // writers wait when this many memtables await flushing
+        bool syncWrites = false;          // a put returns once its log record is synced
+    };
+
+private:
+    // A put waiting in line. The writer at the front of the line logs the
+    // records of everyone queued behind it with one write (and one sync), so
+    // concurrent writers share the cost of the log.
+    struct PendingWrite {
+        uint64_t id;
+        int64_t createdAt;
+        string value, rec;
+        bool done = false, ok = false;
+    };
+    static constexpr size_t kMaxBatchBytes = 1 << 20;
+
+    string dir;
+    Options opt;
+    mutable mutex m;
+    mutex manifestMutex;                      // orders manifest writes; never held with m while syncing
+    condition_variable work, flushed, writerTurn;
+    shared_ptr<lsm::Memtable> active;
+    deque<shared_ptr<lsm::Memtable>> frozen;  // oldest first
+    shared_ptr<const lsm::Version> version;
+    uint64_t nextFile = 1, flushedWal = 0;
+    vector<uint64_t> compactCursor;           // per level: where the next pick starts
+    deque<PendingWrite*> writers;
+    bool logging = false;                     // the front writer is appending to active's log
+    exception_ptr failed;                     // first I/O error; the store takes no writes after it
+    bool stopping = false, busy = true;  // busy until the first background pass is done
+    thread background;
+
+    static constexpr size_t kMaxLevels = 7;
+
+    void openWal(lsm::Memtable& mem) {
+        mem.walNumber = nextFile++;
+        string path = lsm::fileName(dir, mem.walNumber, "wal");
+        mem.walFd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        lsm::check(mem.walFd >= 0, "create " + path);
+        lsm::writeAll(mem.walFd, string(lsm::kWalMagic, sizeof lsm::kWalMagic), "write " + path);
+    }
+
+    void replayWal(const string& path, lsm::Memtable& mem) {
+        ifstream in(path, ios::binary);
+        string data((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+        bool checked = data.size() >= sizeof lsm::kWalMagic && memcmp(data.data(), lsm::kWalMagic, sizeof lsm::kWalMagic) == 0;
+        size_t trailer = checked ? lsm::kWalTrailer : 0;
+        for (size_t pos = checked ? sizeof lsm::kWalMagic : 0; pos + lsm::kRecordHeader + trailer <= data.size();) {
+            snap::Reader r(data.data() + pos, data.size() - pos);
+            uint64_t id = r.get<uint64_t>();
+            int64_t at = r.get<int64_t>();
+            uint32_t len = r.get<uint32_t>();
+            if (data.size() - pos - lsm::kRecordHeader - trailer < len) break;  // torn tail write
+            if (checked && lz::crc32c(data.data() + pos, lsm::kRecordHeader + len) != lz::read32(data.data() + pos + lsm::kRecordHeader + len))
+                break;  // torn or corrupt: nothing after it can be trusted
+            insert(mem, id, at, string_view(data.data() + pos + lsm::kRecordHeader, len));
+            pos += lsm::kRecordHeader + len + trailer;
+        }
+    }
+
+    // Memtable bytes count each entry's value plus one record header.
+    static void insert(lsm::Memtable& mem, uint64_t id, int64_t at, string_view bytes) {
+        auto [it, fresh] = mem.entries.try_emplace(id);
+        auto &slot = it->second;
+        mem.bytes = mem.bytes + bytes.size() + (fresh ? lsm::kRecordHeader : 0) - slot.bytes.size();
+        slot.createdAt = at;
+        slot.bytes.assign(bytes.data(), bytes.size());
+    }
+
+    // Caller holds m.
+    string manifestText(const lsm::Version& v) const {
+        ostringstream text;
+        text << "next " << nextFile << "\nflushed-wal " << flushedWal << "\n";
+        for (size_t level = 0; level < v.levels.size(); ++level)
+            for (const auto &run : v.levels[level]) text << "run " << level << " " << run->number << "\n";
+        return text.str();
+    }
+
+    // Caller holds manifestMutex but not m, so reads and writes go on while it syncs.
+    void writeManifest(const string& text) {
+        string tmp = dir + "/MANIFEST.tmp";
+        int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        lsm::check(fd >= 0, "create " + tmp);
+        try {
+            lsm::writeAll(fd, text, "write " + tmp);
+            lsm::check(fdatasync(fd) == 0, "sync " + tmp);
+        } catch (...) {
+            close(fd);
+            throw;
+        }
+        close(fd);
+        lsm::check(rename(tmp.c_str(), (dir + "/MANIFEST").c_str()) == 0, "rename MANIFEST");
+    }
+
+    static uint64_t levelBytes(const vector<shared_ptr<lsm::Run>>& runs) {
+        uint64_t sum = 0;
+        for (const auto &r : runs) sum += r->bytes;
+        return sum;
+    }
+
+    uint64_t levelBudget(size_t level) const {
+        uint64_t budget = opt.level1Bytes;
+        for (size_t i = 1; i < level; ++i) budget *= 10;
+        return budget;
+    }
+
+    // Merges cursors (rank order) into runs of about opt.runBytes each.
+    vector<shared_ptr<lsm::Run>> writeRuns(vector<unique_ptr<lsm::Cursor>> inputs, size_t splitBytes) {
+        vector<shared_ptr<lsm::Run>> out;
+        lsm::MergeCursor merged(move(inputs));
+        unique_ptr<lsm::RunBuilder> builder;
+        uint64_t number = 0;
+        auto seal = [&] {
+            if (!builder) return;
+            builder->finish();
+            builder.reset();
+            out.push_back(make_shared<lsm::Run>(lsm::fileName(dir, number, "run"), number));
+        };
+        for (; merged.valid(); merged.next()) {
+            if (!builder) {
+                {
+                    lock_guard<mutex> lock(m);
+                    number = nextFile++;
+                }
+                builder = make_unique<lsm::RunBuilder>(lsm::fileName(dir, number, "run"));
+            }
+            builder->add(merged.id(), merged.createdAt(), merged.value());
+            if (builder->bytesSoFar() >= splitBytes) seal();
+        }
+        seal();
+        return out;
+    }
+
+    void flushOne(shared_ptr<lsm::Memtable> mem) {
+        vector<unique_ptr<lsm::Cursor>> in;
+        in.push_back(make_unique<lsm::MapCursor>(mem->entries, 0, UINT64_MAX));
+        auto runs = writeRuns(move(in), SIZE_MAX);
+        lock_guard<mutex> manifestLock(manifestMutex);
+        string text;
+        {
+            lock_guard<mutex> lock(m);
+            auto next = make_shared<lsm::Version>(*version);
+            for (auto &run : runs) next->levels[0].insert(next->levels[0].begin(), run);
+            flushedWal = mem->walNumber;
+            text = manifestText(*next);
+            version = next;
+            frozen.pop_front();
+            flushed.notify_all();
+        }
+        // the log goes only once the manifest naming its run is durable
+        writeManifest(text);
+        close(mem->walFd);
+        unlink(lsm::fileName(dir, mem->walNumber, "wal").c_str());
+    }
+
+    // Returns false when no level needs compaction.
+    bool compactOnce() {
+        shared_ptr<const lsm::Version> v;
+        {
+            lock_guard<mutex> lock(m);
+            v = version;
+        }
+        size_t level = SIZE_MAX;
+        if (v->levels[0].size() >= opt.l0Trigger) level = 0;
+        else
+            for (size_t i = 1; i + 1 < kMaxLevels && level == SIZE_MAX; ++i)
+                if (levelBytes(v->levels[i]) > levelBudget(i)) level = i;
+        if (level == SIZE_MAX) return false;
+
+        vector<shared_ptr<lsm::Run>> upper;
+        if (level == 0) upper = v->levels[0];
+        else {
+            // round-robin through the key space of the level
+            const auto &runs = v->levels[level];
+            auto it = find_if(runs.begin(), runs.end(), [&](const auto& r) { return r->minId() >= compactCursor[level]; });
+            if (it == runs.end()) it = runs.begin();
+            upper.push_back(*it);
+            compactCursor[level] = (*it)->maxId() + 1;
+        }
+        uint64_t lo = UINT64_MAX, hi = 0;
+        for (const auto &r : upper) lo = min(lo, r->minId()), hi = max(hi, r->maxId());
+        vector<shared_ptr<lsm::Run>> lower;
+        for (const auto &r : v->levels[level + 1])
+            if (r->maxId() >= lo && r->minId() <= hi) lower.push_back(r);
+
+        vector<unique_ptr<lsm::Cursor>> in;
+        for (const auto &r : upper) in.push_back(make_unique<lsm::RunCursor>(r, 0, UINT64_MAX));
+        for (const auto &r : lower) in.push_back(make_unique<lsm::RunCursor>(r, 0, UINT64_MAX));
+        auto outputs = writeRuns(move(in), opt.runBytes);
+
+        lock_guard<mutex> manifestLock(manifestMutex);
+        string text;
+        {
+            lock_guard<mutex> lock(m);
+            auto next = make_shared<lsm::Version>(*version);  // flushes may have added L0 runs meanwhile
+            auto drop = [](vector<shared_ptr<lsm::Run>>& runs, const vector<shared_ptr<lsm::Run>>& gone) {
+                runs.erase(remove_if(runs.begin(), runs.end(), [&](const auto& r) { return find(gone.begin(), gone.end(), r) != gone.end(); }), runs.end());
+            };
+            drop(next->levels[level], upper);
+            drop(next->levels[level + 1], lower);
+            auto &target = next->levels[level + 1];
+            target.insert(target.end(), outputs.begin(), outputs.end());
+            sort(target.begin(), target.end(), [](const auto& a, const auto& b) { return a->minId() < b->minId(); });
+            text = manifestText(*next);
+            version = next;
+        }
+        // inputs are deleted only once no durable manifest names them
+        writeManifest(text);
+        for (auto &r : upper) r->retire();
+        for (auto &r : lower) r->retire();
+        return true;
+    }
+
+    // Caller holds m.
+    void fail(exception_ptr error) {
+        if (!failed) failed = error;
+        flushed.notify_all();
+        writerTurn.notify_all();
+    }
+
+    // An I/O error (a full disk, EIO) stops flushing and compaction and
+    // fails every later write; it must not take the process down.
+    void backgroundLoop() {
+        unique_lock<mutex> lock(m);
+        auto guarded = [&](auto&& step) {
+            lock.unlock();
+            exception_ptr error;
+            try {
+                step();
+            } catch (...) {
+                error = current_exception();
+            }
+            lock.lock();
+            if (error) fail(error);
+        };
+        while (true) {
+            if (!failed && !frozen.empty()) {
+                auto mem = frozen.front();
+                busy = true;
+                guarded([&] { flushOne(mem); });
+                continue;
+            }
+            bool compacted = false;
+            if (!failed) guarded([&] { compacted = compactOnce(); });
+            if (compacted) continue;
+            busy = false;
+            flushed.notify_all();
+            if (stopping) return;
+            work.wait(lock);
+            busy = true;
+        }
+    }
+
+    // Caller holds m and no writer is logging.
+    void freezeActive() {
+        if (active->entries.empty()) return;
+        auto next = make_shared<lsm::Memtable>();
+        openWal(*next);
+        frozen.push_back(active);
+        active = move(next);
+        work.notify_one();
+    }
+
+    void throwIfFailed() const {
+        if (failed) rethrow_exception(failed);
+    }
+
+public:
+    explicit OrderStore(string directory) : OrderStore(move(directory), Options{}) {}
+    OrderStore(string directory, Options options) : dir(move(directory)), opt(options), compactCursor(kMaxLevels, 0) {
+        mkdir(dir.c_str(), 0755);
+        auto v = make_shared<lsm::Version>();
+        v->levels.resize(kMaxLevels);
+        ifstream manifest(dir + "/MANIFEST");
+        unordered_set<uint64_t> listed;
+        string word;
+        while (manifest >> word) {
+            if (word == "next") manifest >> nextFile;
+            else if (word == "flushed-wal") manifest >> flushedWal;
+            else if (word == "run") {
+                size_t level;
+                uint64_t number;
+                manifest >> level >> number;
+                if (level >= kMaxLevels) throw runtime_error(dir + "/MANIFEST: bad level");
+                listed.insert(number);
+                v->levels[level].push_back(make_shared<lsm::Run>(lsm::fileName(dir, number, "run"), number));
+            }
+        }
+        // Unflushed logs, oldest first, become one memtable. Runs the manifest
+        // does not list were written by a flush or compaction that crashed
+        // before its manifest, or retired but not yet deleted: they go.
+        active = make_shared<lsm::Memtable>();
+        vector<uint64_t> logs;
+        if (DIR* d = opendir(dir.c_str())) {
+            while (dirent* e = readdir(d)) {
+                string name = e->d_name;
+                size_t digits = name.find_first_not_of("0123456789");
+                if (digits < 6 || digits == string::npos || name.size() != digits + 4) continue;
+                uint64_t number = stoull(name.substr(0, digits));
+                nextFile = max(nextFile, number + 1);
+                if (name.compare(digits, 4, ".wal") == 0) logs.push_back(number);
+                else if (name.compare(digits, 4, ".run") == 0 && !listed.count(number)) unlink((dir + "/" + name).c_str());
+            }
+            closedir(d);
+        }
+        sort(logs.begin(), logs.end());
+        for (uint64_t n : logs) {
+            string path = lsm::fileName(dir, n, "wal");
+            if (n > flushedWal) replayWal(path, *active);
+        }
+        openWal(*active);
+        // replayed entries now live in the new log too
+        for (const auto &kv : active->entries) {
+            string rec;
+            lsm::appendWalRecord(rec, kv.first, kv.second.createdAt, kv.second.bytes);
+            lsm::writeAll(active->walFd, rec, "write log");
+        }
+        if (!active->entries.empty()) lsm::check(fdatasync(active->walFd) == 0, "sync log");
+        for (uint64_t n : logs) unlink(lsm::fileName(dir, n, "wal").c_str());
+        version = v;
+        background = thread([this] { backgroundLoop(); });
+    }
+
+    OrderStore(const OrderStore&) = delete;
+    OrderStore& operator=(const OrderStore&) = delete;
+
+    ~OrderStore() {
+        {
+            lock_guard<mutex> lock(m);
+            stopping = true;
+            work.notify_one();
+        }
+        background.join();
+        for (auto &mem : frozen) close(mem->walFd);
+        close(active->walFd);
+    }
+
+    // May block while flushing is behind; callers that must not block go
+    // through an OrderStoreWriter. Throws the store's I/O error once it has
+    // failed. The log is written (and synced) outside m, one batch at a time.
+    void put(const StoredOrder& order) {
+        PendingWrite w;
+        w.id = order.id;
+        w.createdAt = order.createdAt;
+        w.value.reserve(16 + order.lines.size() * 20);
+        order.encode(w.value);
+        w.rec.reserve(lsm::kRecordHeader + w.value.size() + lsm::kWalTrailer);
+        lsm::appendWalRecord(w.rec, w.id, w.createdAt, w.value);
+
+        unique_lock<mutex> lock(m);
+        writers.push_back(&w);
+        writerTurn.wait(lock, [&] { return w.done || writers.front() == &w; });
+        if (w.done) {
+            if (!w.ok) throwIfFailed();
+            return;
+        }
+        flushed.wait(lock, [&] { return failed || frozen.size() < opt.maxFrozen; });  // stall rather than grow without bound
+        if (failed) {
+            writers.pop_front();
+            writerTurn.notify_all();
+            throwIfFailed();
+        }
+        vector<PendingWrite*> batch;
+        string buf;
+        for (PendingWrite* p : writers) {
+            if (!batch.empty() && buf.size() + p->rec.size() > kMaxBatchBytes) break;
+            batch.push_back(p);
+            buf += p->rec;
+        }
+        int fd = active->walFd;  // flush() does not freeze while logging
+        logging = true;
+        lock.unlock();
+        exception_ptr error;
+        try {
+            lsm::writeAll(fd, buf, "write log");
+            if (opt.syncWrites) lsm::check(fdatasync(fd) == 0, "sync log");
+        } catch (...) {
+            error = current_exception();
+        }
+        lock.lock();
+        logging = false;
+        if (!error)
+            for (PendingWrite* p : batch) insert(*active, p->id, p->createdAt, p->value);
+        for (PendingWrite* p : batch) {
+            writers.pop_front();
+            p->done = true;
+            p->ok = !error;
+        }
+        writerTurn.notify_all();
+        if (error) {
+            fail(error);
+            rethrow_exception(error);
+        }
+        if (active->bytes >= opt.memtableBytes) {
+            try {
+                freezeActive();
+            } catch (...) {
+                fail(current_exception());  // this batch is logged; later puts see the error
+            }
+        }
+    }
+
+    void put(const Order& order) { put(StoredOrder::from(order)); }
+
+    optional<StoredOrder> get(uid64_t id) const {
+        shared_ptr<const lsm::Version> v;
+        vector<shared_ptr<lsm::Memtable>> mems;
+        {
+            lock_guard<mutex> lock(m);
+            auto it = active->entries.find(id);
+            if (it != active->entries.end()) return StoredOrder::decode(id, it->second.createdAt, it->second.bytes);
+            mems.assign(frozen.rbegin(), frozen.rend());
+            v = version;
+        }
+        for (const auto &mem : mems) {  // frozen memtables are read-only
+            auto it = mem->entries.find(id);
+            if (it != mem->entries.end()) return StoredOrder::decode(id, it->second.createdAt, it->second.bytes);
+        }
+        lsm::Value value;
+        for (const auto &run : v->levels[0])
+            if (run->get(id, value)) return StoredOrder::decode(id, value.createdAt, value.bytes);
+        for (size_t level = 1; level < v->levels.size(); ++level) {
+            const auto &runs = v->levels[level];
+            auto it = upper_bound(runs.begin(), runs.end(), id, [](uint64_t k, const auto& r) { return k < r->minId(); });
+            if (it != runs.begin() && (*--it)->get(id, value)) return StoredOrder::decode(id, value.createdAt, value.bytes);
+        }
+        return nullopt;
+    }
+
+private:
+    // Orders with fromId <= id <= toId (and, when given, a time window), in id order.
+    template<typename F>
+    void scanImpl(uint64_t fromId, uint64_t toId, optional<pair<int64_t, int64_t>> window, F&& fn) const {
+        vector<unique_ptr<lsm::Cursor>> in;
+        shared_ptr<const lsm::Version> v;
+        // the active memtable changes under writers, so its range is copied
+        auto snapshot = make_shared<lsm::Memtable>();
+        vector<shared_ptr<lsm::Memtable>> mems;
+        {
+            lock_guard<mutex> lock(m);
+            snapshot->entries.insert(active->entries.lower_bound(fromId), active->entries.upper_bound(toId));
+            mems.assign(frozen.rbegin(), frozen.rend());
+            v = version;
+        }
+        function<bool(const lsm::BlockMeta&)> keep;
+        if (window) keep = [w = *window](const lsm::BlockMeta& b) { return b.maxTime >= w.first && b.minTime <= w.second; };
+        in.push_back(make_unique<lsm::MapCursor>(snapshot->entries, fromId, toId));
+        for (const auto &mem : mems) in.push_back(make_unique<lsm::MapCursor>(mem->entries, fromId, toId));
+        for (size_t level = 0; level < v->levels.size(); ++level)
+            for (const auto &run : v->levels[level])
+                if (run->maxId() >= fromId && run->minId() <= toId) in.push_back(make_unique<lsm::RunCursor>(run, fromId, toId, keep));
+        for (lsm::MergeCursor c(move(in)); c.valid(); c.next())
+            if (!window || (c.createdAt() >= window->first && c.createdAt() <= window->second))
+                fn(StoredOrder::decode(c.id(), c.createdAt(), c.value()));
+    }
+
+public:
+    template<typename F>
+    void scan(uid64_t fromId, uid64_t toId, F&& fn) const { scanImpl(fromId, toId, nullopt, fn); }
+
+    // createdAt in [from, to]; blocks whose time range misses are not read.
+    template<typename F>
+    void scanTime(time_t from, time_t to, F&& fn) const { scanImpl(0, UINT64_MAX, make_pair(int64_t(from), int64_t(to)), fn); }
+
+    // Freezes the memtable and waits for flushes and compactions to finish.
+    // Throws the store's I/O error if it has failed.
+    void flush() {
+        unique_lock<mutex> lock(m);
+        writerTurn.wait(lock, [&] { return !logging; });
+        throwIfFailed();
+        try {
+            freezeActive();
+        } catch (...) {
+            fail(current_exception());
+            throw;
+        }
+        work.notify_one();
+        flushed.wait(lock, [&] { return failed || (frozen.empty() && !busy); });
+        throwIfFailed();
+    }
+
+    string stats() const {
+        lock_guard<mutex> lock(m);
+        throwIfFailed();
+        ostringstream oss;
+        oss << "memtable=" << active->entries.size() << " frozen=" << frozen.size();
+        for (size_t level = 0; level < version->levels.size(); ++level)
+            if (!version->levels[level].empty())
+                oss << " L" << level << "=" << version->levels[level].size() << " runs/" << levelBytes(version->levels[level]) << "B";
+        return oss.str();
+    }
+};
+
+// Feeds an OrderStore from threads that must not block (reactors holding an
+// order shard lock): put() copies the order and queues it, and one writer
+// thread applies the queue in order. When the store stalls on flushing, the
+// queue grows instead. Once the store fails, the writer stops and later
+// orders are dropped and counted; error() says why.
+class OrderStoreWriter {
+    OrderStore& store;
+    mutable mutex m;
+    condition_variable ready;
+    deque<StoredOrder> queue;
+    string failure;
+    uint64_t dropped = 0;
+    bool stopping = false;
+    thread writer;
+
+public:
+    explicit OrderStoreWriter(OrderStore& store) : store(store) {
+        writer = thread([this] {
+            unique_lock<mutex> lock(m);
+            while (true) {
+                ready.wait(lock, [&] { return stopping || !queue.empty(); });
+                if (queue.empty()) return;
+                StoredOrder next = move(queue.front());
+                queue.pop_front();
+                lock.unlock();
+                string error;
+                try {
+                    this->store.put(next);
+                } catch (const exception& e) {
+                    error = e.what();
+                }
+                lock.lock();
+                if (!error.empty()) {
+                    failure = error;
+                    dropped += 1 + queue.size();
+                    queue.clear();
+                    return;
+                }
+            }
+        });
+    }
+    OrderStoreWriter(const OrderStoreWriter&) = delete;
+    OrderStoreWriter& operator=(const OrderStoreWriter&) = delete;
+    // Writes whatever is still queued.
+    ~OrderStoreWriter() {
+        {
+            lock_guard<mutex> lock(m);
+            stopping = true;
+        }
+        ready.notify_one();
+        writer.join();
+    }
+
+    void put(const Order& order) {
+        StoredOrder copy = StoredOrder::from(order);
+        lock_guard<mutex> lock(m);
+        if (!failure.empty()) {
+            ++dropped;
+            return;
+        }
+        queue.push_back(move(copy));
+        ready.notify_one();
+    }
+
+    size_t backlog() const {
+        lock_guard<mutex> lock(m);
+        return queue.size();
+    }
+
+    // Empty while the store is healthy; otherwise its error and the orders dropped.
+    string error(uint64_t* droppedOrders = nullptr) const {
+        lock_guard<mutex> lock(m);
+        if (droppedOrders) *droppedOrders = dropped;
+        return failure;
+    }
+};
+
+// -------------------------
+// ProductIndexFile: on-disk B+trees by product id and by SKU
+// -------------------------
+// Built once (bulk-loaded bottom-up from sorted keys), then read through a
+// small buffer pool, so lookups cost a bounded number of 4 KiB page reads
+// even when the catalog is far larger than memory. Implements
+// ICatalogFallback, so a GenericCatalog holding only the hot products can
+// fall through to it. Each product is materialized once and kept, so lookups
+// return the same object and price changes stick; the file itself is never
+// rewritten.
+//
+// Page 0: header. Pages 1..: product records (u32 length + snap::putProduct),
+// packed back to back. Then tree nodes, one per page:
+//   u8 leaf | u8 0 | u16 count | u16 prefixLen | u64 link | prefix | u16 slot[count] | entries
+//   entry: u8 suffixLen | suffix | u64 value
+// Every key in a node starts with the node's prefix, which is stored once.
+// Leaf values are record offsets and link is the next leaf. Internal values
+// are child pages; link is the leftmost child and key i is the first key
+// under child i. Id keys are 8-byte big-endian, so byte order = numeric order.
+namespace btree {
+constexpr size_t kPage = 4096;
+constexpr size_t kNodeHeader = 14;
+constexpr size_t kMaxKey = 255;
+constexpr char kMagic[8] = {'E', 'C', 'P', 'I', 'D', 'X', '0', '1'};
+
+struct Header {
+    char magic[8];
+    uint64_t idRoot, skuRoot, products, pages;
+};
+
+inline string idKey(uint64_t id) {
+    string k(8, '\0');
+    for (int i = 0; i < 8; ++i) k[size_t(i)] = char(id >> (56 - 8 * i));
+    return k;
+}
+
+inline size_t commonPrefix(string_view a, string_view b) {
+    size_t n = 0;
+    while (n < a.size() && n < b.size() && a[n] == b[n]) ++n;
+    return n;
+}
+
+// Read-only view of one node page.
+class Node {
+    const char* page;
+    template<typename T>
+    T at(size_t off) const { T v; memcpy(&v, page + off, sizeof v); return v; }
+    string_view prefix() const { return string_view(page + kNodeHeader, at<uint16_t>(4)); }
+    size_t entry(size_t i) const { return at<uint16_t>(kNodeHeader + prefix().size() + 2 * i); }
+
+public:
+    explicit Node(const char* page) : page(page) {}
+    bool leaf() const { return page[0] != 0; }
+    size_t count() const { return at<uint16_t>(2); }
+    uint64_t link() const { return at<uint64_t>(6); }
+    string_view suffix(size_t i) const { return string_view(page + entry(i) + 1, uint8_t(page[entry(i)])); }
+    uint64_t value(size_t i) const { return at<uint64_t>(entry(i) + 1 + uint8_t(page[entry(i)])); }
+
+    // Number of keys <= key; compares the prefix once, then only suffixes.
+    size_t upperBound(string_view key) const {
+        string_view p = prefix();
+        size_t shared = min(key.size(), p.size());
+        int c = memcmp(key.data(), p.data(), shared);
+        if (c < 0 || (c == 0 && key.size() < p.size())) return 0;
+        if (c > 0) return count();
+        string_view rest = key.substr(p.size());
+        size_t lo = 0, hi = count();
+        while (lo < hi) {
+            size_t mid = (lo + hi) / 2;
+            if (suffix(mid) <= rest) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo;
+    }
+
+    bool matches(size_t i, string_view key) const {
+        string_view p = prefix();
+        return key.size() == p.size() + suffix(i).size() && key.substr(0, p.size()) == p && key.substr(p.size()) == suffix(i);
+    }
+};
+
+inline size_t nodeBytes(size_t count, size_t keyBytes, size_t prefixLen) {
+    return kNodeHeader + prefixLen + count * (2 + 1 + 8) + keyBytes - count * prefixLen;
+}
+
+inline void encodeNode(char* page, bool leaf, uint64_t link, const vector<pair<string, uint64_t>>& entries, size_t first, size_t last) {
+    memset(page, 0, kPage);
+    size_t prefixLen = first < last ? entries[first].first.size() : 0;
+    for (size_t i = first + 1; i < last; ++i) prefixLen = min(prefixLen, commonPrefix(entries[first].first, entries[i].first));
+    uint16_t count = uint16_t(last - first), plen = uint16_t(prefixLen);
+    page[0] = char(leaf);
+    memcpy(page + 2, &count, 2);
+    memcpy(page + 4, &plen, 2);
+    memcpy(page + 6, &link, 8);
+    if (prefixLen) memcpy(page + kNodeHeader, entries[first].first.data(), prefixLen);
+    size_t slots = kNodeHeader + prefixLen, pos = slots + 2 * count;
+    for (size_t i = first; i < last; ++i) {
+        uint16_t off = uint16_t(pos);
+        memcpy(page + slots + 2 * (i - first), &off, 2);
+        const string &k = entries[i].first;
+        page[pos++] = char(k.size() - prefixLen);
+        memcpy(page + pos, k.data() + prefixLen, k.size() - prefixLen);
+        pos += k.size() - prefixLen;
+        memcpy(page + pos, &entries[i].second, 8);
+        pos += 8;
+    }
+}
+} // namespace btree
+
+// Fixed set of page frames with CLOCK replacement. A miss reads the page
+// outside the pool lock; concurrent fetches of that page wait for the read.
+class BufferPool {
+    struct Frame {
+        uint64_t page = UINT64_MAX;
+        uint32_t pins = 0;
+        bool referenced = false;
+        bool loading = false;
+    };
+    int fd;
+    unique_ptr<char[]> memory;
+    vector<Frame> frames;
+    unordered_map<uint64_t, size_t> table;
+    size_t hand = 0;
+    mutex m;
+    condition_variable loaded;    // a load finished or, with waiting > 0, a frame was unpinned
+    size_t waiting = 0;           // fetches waiting for a frame to come free
+    uint64_t hits = 0, misses = 0, evictions = 0;
+
+    // SIZE_MAX when every frame is pinned or loading.
+    size_t victim() {
+        for (size_t scanned = 0; scanned < 2 * frames.size() + 1; ++scanned) {
+            size_t f = hand;
+            hand = (hand + 1) % frames.size();
+            if (frames[f].pins || frames[f].loading) continue;
+            if (frames[f].referenced) { frames[f].referenced = false; continue; }
+            return f;
+        }
+        return SIZE_MAX;
+    }
+
+    void unpin(size_t f) {
+        lock_guard<mutex> lock(m);
+        if (--frames[f].pins == 0 && waiting) loaded.notify_all();
+    }
+
+public:
+    class Pin {
+        BufferPool* pool;
+        size_t frame;
+    public:
+        Pin(BufferPool* pool, size_t frame) : pool(pool), frame(frame) {}
+        Pin(Pin&& o) noexcept : pool(exchange(o.pool, nullptr)), frame(o.frame) {}
+        Pin(const Pin&) = delete;
+        ~Pin() { if (pool) pool->unpin(frame); }
+        const char* data() const { return pool->memory.get() + frame * btree::kPage; }
+    };
+
+    BufferPool(int fd, size_t frameCount) : fd(fd), memory(new char[max<size_t>(frameCount, 4) * btree::kPage]), frames(max<size_t>(frameCount, 4)) {}
+
+    // With more concurrent readers than frames, waits for a frame to be
+    // unpinned; callers hold at most one pin while fetching, so one frees up.
+    Pin fetch(uint64_t page) {
+        unique_lock<mutex> lock(m);
+        size_t f;
+        while (true) {
+            auto it = table.find(page);
+            if (it != table.end()) {
+                Frame &frame = frames[it->second];
+                if (frame.loading) { loaded.wait(lock); continue; }
+                ++frame.pins;
+                frame.referenced = true;
+                ++hits;
+                return Pin(this, it->second);
+            }
+            if ((f = victim()) != SIZE_MAX) break;
+            ++waiting;
+            loaded.wait(lock);  // the page may have been loaded meanwhile, so look again
+            --waiting;
+        }
+        ++misses;
+        if (frames[f].page != UINT64_MAX) {
+            table.erase(frames[f].page);
+            ++evictions;
+        }
+        frames[f] = {page, 1, true, true};
+        table[page] = f;
+        lock.unlock();
+        ssize_t got = pread(fd, memory.get() + f * btree::kPage, btree::kPage, off_t(page * btree::kPage));
+        lock.lock();
+        frames[f].loading = false;
+        loaded.notify_all();
+        if (got != ssize_t(btree::kPage)) {
+            table.erase(page);
+            frames[f] = Frame();
+            throw runtime_error("buffer pool: short read of page " + to_string(page));
+        }
+        return Pin(this, f);
+    }
+
+    string stats() {
+        lock_guard<mutex> lock(m);
+        return "frames=" + to_string(frames.size()) + " hits=" + to_string(hits) + " misses=" + to_string(misses) + " evictions=" + to_string(evictions);
+    }
+};
+
+class ProductIndexFile : public ICatalogFallback<Product> {
+    int fd = -1;
+    btree::Header header{};
+    unique_ptr<BufferPool> pool;
+    mutable mutex materializedLock;
+    mutable unordered_map<uint64_t, shared_ptr<Product>> materialized;  // by record offset
+
+    // value of the exact key, or UINT64_MAX
+    uint64_t lookup(uint64_t root, string_view key) const {
+        uint64_t page = root;
+        while (true) {
+            auto pin = pool->fetch(page);
+            btree::Node node(pin.data());
+            size_t i = node.upperBound(key);
+            if (node.leaf()) return i > 0 && node.matches(i - 1, key) ? node.value(i - 1) : UINT64_MAX;
+            page = i == 0 ? node.link() : node.value(i - 1);
+        }
+    }
+
+    // records may straddle pages
+    string readBytes(uint64_t offset, size_t n) const {
+        string out;
+        out.reserve(n);
+        while (out.size() < n) {
+            uint64_t at = offset + out.size();
+            auto pin = pool->fetch(at / btree::kPage);
+            size_t inPage = size_t(at % btree::kPage), take = min(n - out.size(), btree::kPage - inPage);
+            out.append(pin.data() + inPage, take);
+        }
+        return out;
+    }
+
+    // One Product per record, made on first lookup, so a setPrice on it is
+    // what later lookups by id or SKU return.
+    shared_ptr<Product> load(uint64_t offset) const {
+        if (offset == UINT64_MAX) return nullptr;
+        {
+            lock_guard<mutex> lock(materializedLock);
+            auto it = materialized.find(offset);
+            if (it != materialized.end()) return it->second;
+        }
+        string len = readBytes(offset, 4);
+        uint32_t n;
+        memcpy(&n, len.data(), 4);
+        string record = readBytes(offset + 4, n);
+        snap::Reader r(record.data(), record.size());
+        auto made = snap::getProduct(r, &AllocationTracker::resource(Subsystem::Catalog));
+        lock_guard<mutex> lock(materializedLock);
+        return materialized.emplace(offset, move(made)).first->second;  // a racing loser drops its copy
+    }
+
+    // Packs sorted entries into nodes level by level; returns the root page.
+    static uint64_t bulkLoad(int fd, uint64_t& nextPage, vector<pair<string, uint64_t>> level) {
+        vector<char> page(btree::kPage);
+        bool leaf = true;
+        while (true) {
+            // A leaf keys all of its entries; an internal node's first child is its link.
+            vector<pair<size_t, size_t>> spans;
+            for (size_t first = 0; first < level.size() || spans.empty();) {
+                size_t keyed = leaf ? first : first + 1, last = keyed, keyBytes = 0, prefixLen = 0;
+                while (last < level.size()) {
+                    size_t p = last == keyed ? level[last].first.size() : min(prefixLen, btree::commonPrefix(level[keyed].first, level[last].first));
+                    if (btree::nodeBytes(last - keyed + 1, keyBytes + level[last].first.size(), p) > btree::kPage) break;
+                    prefixLen = p;
+                    keyBytes += level[last].first.size();
+                    ++last;
+                }
+                spans.push_back({first, min(last, level.size())});
+                if (level.empty()) break;
+                first = last;
+            }
+            uint64_t base = nextPage;
+            vector<pair<string, uint64_t>> parents;
+            for (size_t s = 0; s < spans.size(); ++s) {
+                auto [first, last] = spans[s];
+                size_t keyed = leaf ? first : first + 1;
+                uint64_t link = leaf ? (s + 1 < spans.size() ? base + s + 1 : 0) : level[first].second;
+                btree::encodeNode(page.data(), leaf, link, level, keyed, last);
+                if (pwrite(fd, page.data(), page.size(), off_t((base + s) * btree::kPage)) != ssize_t(page.size()))
+                    throw runtime_error("write index page: " + string(strerror(errno)));
+                parents.push_back({level.empty() ? string() : level[first].first, base + s});
+            }
+            nextPage += spans.size();
+            if (spans.size() == 1) return base;
+            level = move(parents);
+            leaf = false;
+        }
+    }
+
+public:
+    explicit ProductIndexFile(const string& path, size_t cachePages = 1024) {
+        fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || pread(fd, &header, sizeof header, 0) != ssize_t(sizeof header) || memcmp(header.magic, btree::kMagic, 8) != 0)
+            throw runtime_error(path + ": not a product index file");
+        pool = make_unique<BufferPool>(fd, cachePages);
+    }
+    ProductIndexFile(const ProductIndexFile&) = delete;
+    ProductIndexFile& operator=(const ProductIndexFile&) = delete;
+    ~ProductIndexFile() override { close(fd); }
+
+    // Writes products (any iterable of shared_ptr<Product>) to a new file.
+    template<typename Range>
+    static void build(const string& path, const Range& products) {
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) throw runtime_error("create " + path + ": " + strerror(errno));
+        unique_ptr<int, void(*)(int*)> closer(&fd, [](int* f) { close(*f); });
+        vector<pair<string, uint64_t>> byId, bySku;
+        uint64_t offset = btree::kPage;
+        string chunk, record;
+        for (const auto &p : products) {
+            if (!p) continue;
+            if (p->getSku().size() > btree::kMaxKey) throw length_error("SKU longer than 255 bytes: " + p->getSku());
+            record.clear();
+            snap::Writer w{record};
+            snap::putProduct(w, *p);
+            snap::Writer{chunk}.put(uint32_t(record.size()));
+            byId.push_back({btree::idKey(p->getId()), offset + chunk.size() - 4});
+            bySku.push_back({p->getSku(), offset + chunk.size() - 4});
+            chunk += record;
+            if (chunk.size() >= (1 << 20)) {
+                if (pwrite(fd, chunk.data(), chunk.size(), off_t(offset)) != ssize_t(chunk.size())) throw runtime_error("write " + path);
+                offset += chunk.size();
+                chunk.clear();
+            }
+        }
+        if (pwrite(fd, chunk.data(), chunk.size(), off_t(offset)) != ssize_t(chunk.size())) throw runtime_error("write " + path);
+        offset += chunk.size();
+        uint64_t nextPage = (offset + btree::kPage - 1) / btree::kPage;
+        auto byKey = [](const auto& a, const auto& b) { return a.first < b.first; };
+        stable_sort(byId.begin(), byId.end(), byKey);
+        stable_sort(bySku.begin(), bySku.end(), byKey);
+        // duplicate keys: the product added last wins, as in GenericCatalog
+        auto dedupe = [](vector<pair<string, uint64_t>>& v) {
+            size_t out = 0;
+            for (size_t i = 0; i < v.size(); ++i) {
+                if (i + 1 < v.size() && v[i + 1].first == v[i].first) continue;
+                if (out != i) v[out] = move(v[i]);
+                ++out;
+            }
+            v.resize(out);
+        };
+        dedupe(byId);
+        dedupe(bySku);
+        btree::Header h{};
+        memcpy(h.magic, btree::kMagic, 8);
+        h.products = byId.size();
+        h.idRoot = bulkLoad(fd, nextPage, move(byId));
+        h.skuRoot = bulkLoad(fd, nextPage, move(bySku));
+        h.pages = nextPage;
+        vector<char> page0(btree::kPage, '\0');
+        memcpy(page0.data(), &h, sizeof h);
+        if (pwrite(fd, page0.data(), page0.size(), 0) != ssize_t(page0.size()) || fdatasync(fd) != 0)
+            throw runtime_error("write " + path + ": " + strerror(errno));
+    }
+
+    shared_ptr<Product> findById(uid64_t id) const override { return load(lookup(header.idRoot, btree::idKey(id))); }
+    shared_ptr<Product> findBySku(string_view sku) const override { return sku.size() > btree::kMaxKey ? nullptr : load(lookup(header.skuRoot, sku)); }
+
+    size_t size() const { return size_t(header.products); }
+    uint64_t pages() const { return header.pages; }
+    string cacheStats() const { return pool->stats(); }
+};
+
+// -------------------------
+// Reactor: epoll event loops, one per thread
+// -------------------------
+// Each loop owns its epoll set and connections; TCP listeners are opened once
+// per loop with SO_REUSEPORT so the kernel spreads accepts across cores. The
+// protocol lives in the Handler, which consumes whole requests from the input
+// buffer and queues reply chunks; chunks are written with one sendmsg (iovec
+// gather) instead of being concatenated. A client that sends faster than it
+// reads replies is paused: once kMaxQueuedOut bytes of replies are waiting,
+// handlers stop taking requests and the loop stops reading the socket until
+// the replies drain. Input is read up to kMaxBufferedIn per pass, which must
+// hold the largest request any handler accepts (each front-end asserts so):
+// a connection whose handler takes nothing from a full buffer is closed. A
+// handler that throws closes its connection.
+class Reactor {
+public:
+    struct Connection {
+        static constexpr size_t kMaxQueuedOut = 1 << 20;
+        static constexpr size_t kMaxBufferedIn = 2 << 20;  // per read pass; epoll reports the rest again
+        int fd = -1;
+        string in;
+        deque<string> out;
+        size_t outOffset = 0;
+        size_t outBytes = 0;    // queued and not yet sent
+        bool closeAfterFlush = false;
+        bool wantWrite = false;
+        bool readShut = false;  // peer sent EOF; finish writing, then close
+        bool readPaused = false;
+        void queue(string chunk) {
+            if (chunk.empty()) return;
+            outBytes += chunk.size();
+            out.push_back(move(chunk));
+        }
+        // Handlers stop consuming requests while this holds.
+        bool backlogged() const { return outBytes >= kMaxQueuedOut; }
+    };
+    // Returns the number of bytes of `data` consumed.
+    using Handler = function<size_t(Connection&, string_view data)>;
+
+private:
+    struct Loop {
+        int epfd = -1;
+        int wakeFd = -1;
+        vector<int> listeners;
+        unordered_map<int, unique_ptr<Connection>> conns;
+        thread worker;
+    };
+
+    Handler handler;
+    vector<unique_ptr<Loop>> loops;
+    vector<string> unixPaths;
+    vector<int> ownedFds;  // listeners shared between loops
+    atomic<bool> stopping{false};
+
+    static void check(bool ok, const char* what) {
+        if (!ok) throw runtime_error(string(what) + ": " + strerror(errno));
+    }
+
+    static void setInterest(Loop& loop, Connection& c, bool write, bool force = false) {
+        if (c.wantWrite == write && !force) return;
+        c.wantWrite = write;
+        epoll_event ev{};
+        ev.events = (c.readShut || c.readPaused ? 0u : EPOLLIN | EPOLLRDHUP) | (write ? EPOLLOUT : 0u);
+        ev.data.fd = c.fd;
+        epoll_ctl(loop.epfd, EPOLL_CTL_MOD, c.fd, &ev);
+    }
+
+    static void closeConnection(Loop& loop, int fd) {
+        epoll_ctl(loop.epfd, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+        loop.conns.erase(fd);
+    }
+
+    // false when the connection was closed
+    static bool flush(Loop& loop, Connection& c) {
+        while (!c.out.empty()) {
+            iovec iov[16];
+            size_t n = 0;
+            for (auto it = c.out.begin(); it != c.out.end() && n < 16; ++it, ++n) {
+                size_t skip = n == 0 ? c.outOffset : 0;
+                iov[n].iov_base = const_cast<char*>(it->data()) + skip;
+                iov[n].iov_len = it->size() - skip;
+            }
+            msghdr msg{};
+            msg.msg_iov = iov;
+            msg.msg_iovlen = n;
+            ssize_t sent = sendmsg(c.fd, &msg, MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                closeConnection(loop, c.fd);
+                return false;
+            }
+            size_t left = size_t(sent);
+            c.outBytes -= left;
+            while (left > 0) {
+                size_t avail = c.out.front().size() - c.outOffset;
+                if (left < avail) { c.outOffset += left; break; }
+                left -= avail;
+                c.out.pop_front();
+                c.outOffset = 0;
+            }
+        }
+        if (c.out.empty() && c.closeAfterFlush) {
+            closeConnection(loop, c.fd);
+            return false;
+        }
+        bool pause = c.backlogged(), changed = pause != c.readPaused;
+        c.readPaused = pause;
+        setInterest(loop, c, !c.out.empty(), changed);
+        return true;
+    }
+
+    void accept(Loop& loop, int listener) {
+        while (true) {
+            int fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) return;
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);  // fails harmlessly on unix sockets
+            auto conn = make_unique<Connection>();
+            conn->fd = fd;
+            epoll_event ev{};
+            ev.events = EPOLLIN | EPOLLRDHUP;
+            ev.data.fd = fd;
+            epoll_ctl(loop.epfd, EPOLL_CTL_ADD, fd, &ev);
+            loop.conns.emplace(fd, move(conn));
+        }
+    }
+
+    // On EOF the requests already received are still answered: reads stop and
+    // the connection closes once its replies are written.
+    void readable(Loop& loop, Connection& c) {
+        if (c.readPaused) return;
+        char buf[64 * 1024];
+        bool eof = c.readShut;
+        while (!eof && c.in.size() < Connection::kMaxBufferedIn) {
+            ssize_t n = recv(c.fd, buf, sizeof buf, 0);
+            if (n > 0) { c.in.append(buf, size_t(n)); continue; }
+            if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) { closeConnection(loop, c.fd); return; }
+            eof = n == 0;
+            break;
+        }
+        size_t used;
+        try {
+            used = handler(c, c.in);
+        } catch (...) {
+            closeConnection(loop, c.fd);
+            return;
+        }
+        if (used) c.in.erase(0, used);
+        else if (c.in.size() >= Connection::kMaxBufferedIn && !c.backlogged()) {
+            closeConnection(loop, c.fd);  // no request that large is accepted; waiting would spin
+            return;
+        }
+        if (eof && !c.readShut) {
+            c.readShut = true;
+            setInterest(loop, c, c.wantWrite, true);
+        }
+        // requests held back by a full reply queue are answered before closing
+        bool heldBack = c.backlogged();
+        if (c.readShut && !heldBack) c.closeAfterFlush = true;
+        if (!flush(loop, c) || !heldBack || c.readPaused) return;
+        // the queue drained at once; come back through EPOLLOUT for the rest
+        // of c.in rather than starving the loop's other connections
+        c.readPaused = true;
+        setInterest(loop, c, true, true);
+    }
+
+    void run(Loop& loop) {
+        epoll_event events[256];
+        while (!stopping.load(memory_order_relaxed)) {
+            int n = epoll_wait(loop.epfd, events, 256, -1);
+            for (int i = 0; i < n; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == loop.wakeFd) continue;
+                if (find(loop.listeners.begin(), loop.listeners.end(), fd) != loop.listeners.end()) {
+                    accept(loop, fd);
+                    continue;
+                }
+                auto it = loop.conns.find(fd);
+                if (it == loop.conns.end()) continue;
+                Connection &c = *it->second;
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) { closeConnection(loop, fd); continue; }
+                bool resumed = false;
+                if (events[i].events & EPOLLOUT) {
+                    bool paused = c.readPaused;
+                    if (!flush(loop, c)) continue;
+                    resumed = paused && !c.readPaused;  // pick up requests left in c.in
+                }
+                if (resumed || events[i].events & (EPOLLIN | EPOLLRDHUP)) readable(loop, c);
+            }
+        }
+    }
+
+    void addListener(Loop& loop, int fd, bool exclusive) {
+        epoll_event ev{};
+        ev.events = EPOLLIN | (exclusive ? EPOLLEXCLUSIVE : 0u);
+        ev.data.fd = fd;
+        check(epoll_ctl(loop.epfd, EPOLL_CTL_ADD, fd, &ev) == 0, "epoll_ctl");
+        loop.listeners.push_back(fd);
+    }
+
+public:
+    Reactor(Handler handler, unsigned threads) : handler(move(handler)) {
+        for (unsigned i = 0; i < max(1u, threads); ++i) {
+            auto loop = make_unique<Loop>();
+            loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+            loop->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            check(loop->epfd >= 0 && loop->wakeFd >= 0, "epoll/eventfd");
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.fd = loop->wakeFd;
+            epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakeFd, &ev);
+            loops.push_back(move(loop));
+        }
+    }
+
+    ~Reactor() {
+        stop();
+        for (auto &loop : loops) {
+            for (auto &kv : loop->conns) close(kv.first);
+            for (int fd : loop->listeners)
+                if (find(ownedFds.begin(), ownedFds.end(), fd) == ownedFds.end()) close(fd);
+            close(loop->wakeFd);
+            close(loop->epfd);
+        }
+        for (int fd : ownedFds) close(fd);
+        for (const auto &path : unixPaths) unlink(path.c_str());
+    }
+
+    // A single unix-domain listener shared by all loops (EPOLLEXCLUSIVE).
+    void listenUnix(const string& path) {
+        unlink(path.c_str());
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        check(fd >= 0, "socket");
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path.c_str(), sizeof addr.sun_path - 1);
+        check(bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof addr) == 0, "bind");
+        check(listen(fd, 1024) == 0, "listen");
+        unixPaths.push_back(path);
+        for (auto &loop : loops) addListener(*loop, fd, true);
+        ownedFds.push_back(fd);
+    }
+
+    // One SO_REUSEPORT listener per loop.
+    void listenTcp(uint16_t port, const char* address = "0.0.0.0") {
+        for (auto &loop : loops) {
+            int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            check(fd >= 0, "socket");
+            int one = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+            setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof one);
+            sockaddr_in addr{};
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(port);
+            inet_pton(AF_INET, address, &addr.sin_addr);
+            check(bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof addr) == 0, "bind");
+            check(listen(fd, 1024) == 0, "listen");
+            addListener(*loop, fd, false);
+        }
+    }
+
+    void start() {
+        for (auto &loop : loops) loop->worker = thread(&Reactor::run, this, ref(*loop));
+    }
+
+    void stop() {
+        if (stopping.exchange(true)) return;
+        for (auto &loop : loops) {
+            uint64_t one = 1;
+            (void)!write(loop->wakeFd, &one, sizeof one);
+        }
+        for (auto &loop : loops)
+            if (loop->worker.joinable()) loop->worker.join();
+    }
+};
+
+inline void appendJsonString(string& out, string_view s) {
+    out += '"';
+    for (char ch : s) {
+        switch (ch) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            default:
+                if (static_cast<unsigned char>(ch) < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof buf, "\\u%04x", ch);
+                    out += buf;
+                } else {
+                    out += ch;
+                }
+        }
+    }
+    out += '"';
+}
+
+// -------------------------
+// HttpFrontend: HTTP/1.1 + JSON routes over CommerceService
+// -------------------------
+//   GET    /products/{id}
+//   GET    /products/{id}/also-bought?k=N
+//   POST   /carts/{cart}/items/{product}?qty=N
+//   DELETE /carts/{cart}/items/{product}?qty=N
+//   GET    /carts/{cart}/total
+//   POST   /orders?cart={cart}
+//   GET    /orders/{id}
+//   POST   /orders/{id}/pay | /orders/{id}/ship
+// Connections are keep-alive unless the client sends "Connection: close";
+// pipelined requests are answered in order.
+class HttpFrontend {
+    CommerceService& service;
+
+    static bool parseUint(string_view s, uint64_t& out) {
+        if (s.empty()) return false;
+        auto res = from_chars(s.data(), s.data() + s.size(), out);
+        return res.ec == errc() && res.ptr == s.data() + s.size();
+    }
+
+    static string_view queryParam(string_view query, string_view key) {
+        while (!query.empty()) {
+            size_t amp = query.find('&');
+            string_view pair = query.substr(0, amp);
+            size_t eq = pair.find('=');
+            if (pair.substr(0, eq) == key) return eq == string_view::npos ? string_view() : pair.substr(eq + 1);
+            if (amp == string_view::npos) break;
+            query.remove_prefix(amp + 1);
+        }
+        return {};
+    }
+
+    static bool headerIs(string_view headers, string_view name, string_view value) {
+        // case-insensitive "name: value" search, good enough for Connection/Content-Length
+        auto lower = [](string_view s) { string r(s); for (auto &ch : r) ch = char(tolower(static_cast<unsigned char>(ch))); return r; };
+        string h = lower(headers);
+        return h.find("\r\n" + lower(name) + ": " + lower(value)) != string::npos;
+    }
+
+    // Sets `length` from Content-Length and returns 0, or the status to refuse
+    // the request with: 400 for a malformed or repeated length, 413 past
+    // kMaxBody, 501 for Transfer-Encoding, which is not decoded here. A length
+    // the server misreads would desync it from a proxy in front of it.
+    static int contentLength(string_view headers, size_t& length) {
+        string h(headers);
+        for (auto &ch : h) ch = char(tolower(static_cast<unsigned char>(ch)));
+        length = 0;
+        if (h.find("\r\ntransfer-encoding:") != string::npos) return 501;
+        size_t pos = h.find("\r\ncontent-length:");
+        if (pos == string::npos) return 0;
+        if (h.find("\r\ncontent-length:", pos + 2) != string::npos) return 400;
+        size_t begin = pos + 17, end = h.find("\r\n", begin);
+        while (begin < end && (h[begin] == ' ' || h[begin] == '\t')) ++begin;
+        while (end > begin && (h[end - 1] == ' ' || h[end - 1] == '\t')) --end;
+        uint64_t n = 0;
+        auto res = from_chars(h.data() + begin, h.data() + end, n);
+        if (begin == end || res.ptr != h.data() + end) return 400;
+        if (res.ec == errc::result_out_of_range || n > kMaxBody) return 413;
+        if (res.ec != errc()) return 400;
+        length = size_t(n);
+        return 0;
+    }
+
+    static void productJson(string& body, const Product& p) {
+        body += "{\"id\":";
+        body += to_string(p.getId());
+        body += ",\"name\":";
+        appendJsonString(body, p.getName());
+        body += ",\"sku\":";
+        appendJsonString(body, p.getSku());
+        body += ",\"type\":";
+        appendJsonString(body, p.getType());
+        char buf[96];
+        snprintf(buf, sizeof buf, ",\"price\":%.2f,\"final_price\":%.2f}", p.getBasePrice(), p.finalPrice());
+        body += buf;
+    }
+
+    static void orderJson(string& body, const Order& o) {
+        char buf[64];
+        snprintf(buf, sizeof buf, "%.2f", o.total());
+        body += "{\"id\":" + to_string(o.getId()) + ",\"status\":\"" + o.statusName() + "\",\"lines\":" +
+                to_string(o.getItems().size()) + ",\"total\":" + buf + "}";
+    }
+
+    // Fills status and body for one request.
+    int route(string_view method, string_view target, string& body) {
+        size_t q = target.find('?');
+        string_view path = target.substr(0, q), query = q == string_view::npos ? string_view() : target.substr(q + 1);
+        vector<string_view> parts;
+        for (size_t pos = 1; pos <= path.size();) {
+            size_t slash = path.find('/', pos);
+            if (slash == string_view::npos) slash = path.size();
+            parts.push_back(path.substr(pos, slash - pos));
+            pos = slash + 1;
+        }
+        uint64_t a = 0, b = 0, qty = 1;
+        if (auto qs = queryParam(query, "qty"); !qs.empty() && !parseUint(qs, qty)) return 400;
+
+        if (method == "GET" && parts.size() == 2 && parts[0] == "products" && parseUint(parts[1], a)) {
+            auto p = service.product(a);
+            if (!p) return 404;
+            productJson(body, *p);
+            return 200;
+        }
+        if (method == "GET" && parts.size() == 3 && parts[0] == "products" && parts[2] == "also-bought" && parseUint(parts[1], a)) {
+            uint64_t k = 5;
+            if (auto ks = queryParam(query, "k"); !ks.empty() && (!parseUint(ks, k) || k == 0 || k > 100)) return 400;
+            shared_ptr<const void> holder;
+            body = "{\"id\":" + to_string(a) + ",\"also_bought\":[";
+            bool first = true;
+            for (const auto &n : CoPurchaseIndex::global().alsoBought(a, size_t(k), holder)) {
+                body += first ? "{\"id\":" : ",{\"id\":";
+                body += to_string(n.id) + ",\"orders\":" + to_string(n.count) + "}";
+                first = false;
+            }
+            body += "]}";
+            return 200;
+        }
+        if (parts.size() == 4 && parts[0] == "carts" && parts[2] == "items" && parseUint(parts[1], a) && parseUint(parts[3], b)) {
+            if (method == "POST") {
+                try {
+                    if (!service.addToCart(a, b, qty)) return 404;
+                } catch (const invalid_argument&) {
+                    return 409;  // currency differs from the cart's
+                }
+            } else if (method == "DELETE") {
+                service.removeFromCart(a, b, qty);
+            } else {
+                return 405;
+            }
+            body = "{\"ok\":true}";
+            return 200;
+        }
+        if (method == "GET" && parts.size() == 3 && parts[0] == "carts" && parts[2] == "total" && parseUint(parts[1], a)) {
+            char buf[64];
+            snprintf(buf, sizeof buf, "{\"total\":%.2f}", service.cartTotal(a));
+            body = buf;
+            return 200;
+        }
+        if (method == "POST" && parts.size() == 1 && parts[0] == "orders") {
+            if (!parseUint(queryParam(query, "cart"), a)) return 400;
+            auto order = service.checkout(a);
+            if (!order) return 409;
+            service.inspectOrder(order->getId(), [&](const Order& o) { orderJson(body, o); });
+            return 201;
+        }
+        if (parts.size() >= 2 && parts[0] == "orders" && parseUint(parts[1], a)) {
+            bool found;
+            if (method == "GET" && parts.size() == 2) found = true;
+            else if (method == "POST" && parts.size() == 3 && parts[2] == "pay") found = service.pay(a);
+            else if (method == "POST" && parts.size() == 3 && parts[2] == "ship") found = service.ship(a);
+            else return 404;
+            if (!found || !service.inspectOrder(a, [&](const Order& o) { orderJson(body, o); })) return 404;
+            return 200;
+        }
+        return 404;
+    }
+
+    static const char* reason(int status) {
+        switch (status) {
+            case 200: return "OK";
+            case 201: return "Created";
+            case 400: return "Bad Request";
+            case 404: return "Not Found";
+            case 405: return "Method Not Allowed";
+            case 409: return "Conflict";
+            case 413: return "Payload Too Large";
+            case 500: return "Internal Server Error";
+            case 501: return "Not Implemented";
+        }
+        return "Error";
+    }
+
+public:
+    static constexpr size_t kMaxHeader = 64 * 1024, kMaxBody = 1 << 20;
+
+    explicit HttpFrontend(CommerceService& service) : service(service) {}
+
+    size_t operator()(Reactor::Connection& c, string_view data) {
+        size_t consumed = 0;
+        while (!c.closeAfterFlush && !c.backlogged()) {
+            string_view rest = data.substr(consumed);
+            size_t headerEnd = rest.find("\r\n\r\n");
+            if (headerEnd == string_view::npos) {
+                if (rest.size() > kMaxHeader) c.closeAfterFlush = true;  // oversized header
+                break;
+            }
+            string_view head = rest.substr(0, headerEnd + 2);
+            size_t length = 0;
+            int refused = contentLength(head, length);
+            size_t total = headerEnd + 4 + length;
+            if (!refused && rest.size() < total) break;
+
+            size_t sp1 = head.find(' '), sp2 = head.find(' ', sp1 + 1);
+            size_t lineEnd = head.find("\r\n");
+            string body;
+            int status = 400;
+            if (refused) status = refused;  // the body cannot be framed, so the connection ends here
+            else if (sp1 != string_view::npos && sp2 != string_view::npos && sp2 < lineEnd) {
+                try {
+                    status = route(head.substr(0, sp1), head.substr(sp1 + 1, sp2 - sp1 - 1), body);
+                } catch (const exception&) {
+                    status = 500;  // e.g. the fallback index failed a read
+                    body.clear();
+                }
+            }
+            if (status >= 400 && body.empty()) body = "{\"error\":\"" + string(reason(status)) + "\"}";
+            bool close = refused || headerIs(head, "Connection", "close") || head.substr(sp2 + 1, 8) == "HTTP/1.0";
+
+            string header = "HTTP/1.1 " + to_string(status) + " " + reason(status) +
+                            "\r\nContent-Type: application/json\r\nContent-Length: " + to_string(body.size()) +
+                            (close ? "\r\nConnection: close\r\n\r\n" : "\r\n\r\n");
+            c.queue(move(header));
+            c.queue(move(body));
+            if (close) c.closeAfterFlush = true;
+            consumed += total;
+        }
+        return consumed;
+    }
+};
+static_assert(HttpFrontend::kMaxHeader + 4 + HttpFrontend::kMaxBody <= Reactor::Connection::kMaxBufferedIn,
+              "the reactor must buffer the largest request HttpFrontend accepts");
+
+// -------------------------
+// Binary RPC protocol for internal callers
+// -------------------------
+// Little-endian, length-prefixed frames; one frame carries a batch of ops and
+// a client may pipeline any number of frames before reading replies, which
+// come back in request order.
+//   request  frame: u32 bodyLen | u32 seq | u16 opCount | op...
+//   op:             u8 code | code-specific fixed fields (see kOpSize)
+//   response frame: u32 bodyLen | u32 seq | u16 resultCount | result...
+//   result:         u8 code | u8 status | u64 value (order id, or total as f64 bits)
+// Decoding reads fields straight out of the receive buffer through RpcReader;
+// nothing is copied into intermediate request objects. A frame with a bad
+// length, or an opCount its body cannot hold, closes the connection.
+enum class RpcOp : uint8_t { AddProduct = 1, RemoveProduct, CartTotal, Checkout, Pay, Ship, Cancel };
+enum class RpcStatus : uint8_t { Ok = 0, NotFound = 1, BadRequest = 2, Empty = 3 };
+
+struct RpcResult {
+    RpcOp op;
+    RpcStatus status;
+    uint64_t value;
+    double total() const { double d; memcpy(&d, &value, sizeof d); return d; }
+};
+
+namespace rpc {
+constexpr size_t kHeader = 10;       // u32 len + u32 seq + u16 count
+constexpr size_t kResultSize = 10;
+constexpr size_t kMinOp = 9;         // u8 code + the smallest payload
+constexpr uint32_t kMaxFrame = 1u << 20;
+
+// payload bytes after the op code
+inline size_t opSize(uint8_t code) {
+    switch (RpcOp(code)) {
+        case RpcOp::AddProduct:
+        case RpcOp::RemoveProduct: return 20;  // u64 cart, u64 product, u32 qty
+        case RpcOp::CartTotal:
+        case RpcOp::Checkout:
+        case RpcOp::Pay:
+        case RpcOp::Ship:
+        case RpcOp::Cancel: return 8;          // u64 cart or order id
+    }
+    return SIZE_MAX;
+}
+
+template<typename T>
+void put(string& out, T v) { out.append(reinterpret_cast<const char*>(&v), sizeof v); }
+
+// Bounds-checked view over bytes already in a receive buffer.
+class RpcReader {
+    const char* p;
+    const char* end;
+public:
+    explicit RpcReader(string_view bytes) : p(bytes.data()), end(bytes.data() + bytes.size()) {}
+    bool has(size_t n) const { return size_t(end - p) >= n; }
+    // Callers check has() first; reading past the end throws rather than overruns.
+    template<typename T>
+    T get() {
+        if (!has(sizeof(T))) throw runtime_error("rpc: truncated frame");
+        T v;
+        memcpy(&v, p, sizeof v);
+        p += sizeof v;
+        return v;
+    }
+};
+} // namespace rpc
+
+class RpcFrontend {
+    CommerceService& service;
+
+    RpcResult execute(uint8_t code, rpc::RpcReader& r) {
+        RpcResult res{RpcOp(code), RpcStatus::Ok, 0};
+        switch (RpcOp(code)) {
+            case RpcOp::AddProduct: {
+                auto cart = r.get<uint64_t>(), product = r.get<uint64_t>();
+                auto qty = r.get<uint32_t>();
+                try {
+                    if (!service.addToCart(cart, product, qty)) res.status = RpcStatus::NotFound;
+                } catch (const invalid_argument&) {
+                    res.status = RpcStatus::BadRequest;
+                }
+                break;
+            }
+            case RpcOp::RemoveProduct: {
+                auto cart = r.get<uint64_t>(), product = r.get<uint64_t>();
+                service.removeFromCart(cart, product, r.get<uint32_t>());
+                break;
+            }
+            case RpcOp::CartTotal: {
+                double total = service.cartTotal(r.get<uint64_t>());
+                memcpy(&res.value, &total, sizeof total);
+                break;
+            }
+            case RpcOp::Checkout: {
+                auto order = service.checkout(r.get<uint64_t>());
+                if (order) res.value = order->getId();
+                else res.status = RpcStatus::Empty;
+                break;
+            }
+            case RpcOp::Pay:
+            case RpcOp::Ship:
+            case RpcOp::Cancel: {
+                uint64_t id = r.get<uint64_t>();
+                bool found = RpcOp(code) == RpcOp::Pay ? service.pay(id) : RpcOp(code) == RpcOp::Ship ? service.ship(id) : service.cancel(id);
+                res.value = id;
+                if (!found) res.status = RpcStatus::NotFound;
+                break;
+            }
+        }
+        return res;
+    }
+
+public:
+    explicit RpcFrontend(CommerceService& service) : service(service) {}
+
+    size_t operator()(Reactor::Connection& c, string_view data) {
+        size_t consumed = 0;
+        string reply;
+        while (data.size() - consumed >= rpc::kHeader && c.outBytes + reply.size() < Reactor::Connection::kMaxQueuedOut) {
+            rpc::RpcReader head(data.substr(consumed));
+            uint32_t bodyLen = head.get<uint32_t>();
+            if (bodyLen < rpc::kHeader - 4 || bodyLen > rpc::kMaxFrame) {
+                c.closeAfterFlush = true;
+                break;
+            }
+            if (data.size() - consumed < 4 + size_t(bodyLen)) break;
+            uint32_t seq = head.get<uint32_t>();
+            uint16_t count = head.get<uint16_t>();
+            if (size_t(count) * rpc::kMinOp > bodyLen - (rpc::kHeader - 4)) {
+                // more ops than the body can hold; refuse it rather than answer
+                // every phantom op with a result
+                c.closeAfterFlush = true;
+                break;
+            }
+            rpc::RpcReader body(data.substr(consumed + rpc::kHeader, bodyLen - (rpc::kHeader - 4)));
+
+            size_t start = reply.size();
+            rpc::put<uint32_t>(reply, 0);
+            rpc::put<uint32_t>(reply, seq);
+            rpc::put<uint16_t>(reply, count);
+            for (uint16_t i = 0; i < count; ++i) {
+                RpcResult res{RpcOp(0), RpcStatus::BadRequest, 0};
+                if (body.has(1)) {
+                    uint8_t code = body.get<uint8_t>();
+                    res.op = RpcOp(code);
+                    if (size_t need = rpc::opSize(code); need != SIZE_MAX && body.has(need)) res = execute(code, body);
+                    else body = rpc::RpcReader(string_view());  // malformed: fail the rest of the batch
+                }
+                rpc::put<uint8_t>(reply, uint8_t(res.op));
+                rpc::put<uint8_t>(reply, uint8_t(res.status));
+                rpc::put<uint64_t>(reply, res.value);
+            }
+            uint32_t replyLen = uint32_t(reply.size() - start - 4);
+            memcpy(&reply[start], &replyLen, sizeof replyLen);
+            consumed += 4 + bodyLen;
+        }
+        c.queue(move(reply));  // one chunk for every frame decoded in this read
+        return consumed;
+    }
+};
+static_assert(4 + size_t(rpc::kMaxFrame) <= Reactor::Connection::kMaxBufferedIn,
+              "the reactor must buffer the largest frame RpcFrontend accepts");
+
+// Blocking client; queue ops into a batch, send() it as one frame, and read
+// replies with receive(). Several frames may be sent before receiving.
+class RpcClient {
+    int fd = -1;
+    uint32_t nextSeq = 1;
+    string batch;
+    uint16_t batchOps = 0;
+    string inbox;
+
+    void writeAll(const string& bytes) {
+        size_t off = 0;
+        while (off < bytes.size()) {
+            ssize_t n = ::send(fd, bytes.data() + off, bytes.size() - off, MSG_NOSIGNAL);
+            if (n <= 0) throw runtime_error("rpc send failed");
+            off += size_t(n);
+        }
+    }
+
+    void fill(size_t need) {
+        char buf[64 * 1024];
+        while (inbox.size() < need) {
+            ssize_t n = ::recv(fd, buf, sizeof buf, 0);
+            if (n <= 0) throw runtime_error("rpc connection closed");
+            inbox.append(buf, size_t(n));
+        }
+    }
+
+    explicit RpcClient(int fd) : fd(fd) {}
+
+public:
+    static RpcClient connectTcp(const char* host, uint16_t port) {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        inet_pton(AF_INET, host, &addr.sin_addr);
+        if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof addr) != 0) throw runtime_error("rpc connect failed");
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+        return RpcClient(fd);
+    }
+
+    static RpcClient connectUnix(const string& path) {
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path.c_str(), sizeof addr.sun_path - 1);
+        if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof addr) != 0) throw runtime_error("rpc connect failed");
+        return RpcClient(fd);
+    }
+
+    RpcClient(RpcClient&& o) noexcept : fd(exchange(o.fd, -1)), nextSeq(o.nextSeq), batch(move(o.batch)), batchOps(o.batchOps), inbox(move(o.inbox)) {}
+    RpcClient(const RpcClient&) = delete;
+    ~RpcClient() { if (fd >= 0) close(fd); }
+
+    RpcClient& addProduct(uint64_t cart, uid64_t product, uint32_t qty = 1) {
+        rpc::put(batch, uint8_t(RpcOp::AddProduct)); rpc::put(batch, cart); rpc::put<uint64_t>(batch, product); rpc::put(batch, qty);
+        ++batchOps;
+        return *this;
+    }
+    RpcClient& removeProduct(uint64_t cart, uid64_t product, uint32_t qty = 1) {
+        rpc::put(batch, uint8_t(RpcOp::RemoveProduct)); rpc::put(batch, cart); rpc::put<uint64_t>(batch, product); rpc::put(batch, qty);
+        ++batchOps;
+        return *this;
+    }
+    RpcClient& op(RpcOp code, uint64_t id) {  // CartTotal/Checkout take a cart id, Pay/Ship/Cancel an order id
+        rpc::put(batch, uint8_t(code)); rpc::put(batch, id);
+        ++batchOps;
+        return *this;
+    }
+
+    // Sends the queued ops as one frame; returns its sequence number.
+    uint32_t send() {
+        string frame;
+        frame.reserve(rpc::kHeader + batch.size());
+        rpc::put<uint32_t>(frame, uint32_t(rpc::kHeader - 4 + batch.size()));
+        uint32_t seq = nextSeq++;
+        rpc::put(frame, seq);
+        rpc::put(frame, batchOps);
+        frame += batch;
+        writeAll(frame);
+        batch.clear();
+        batchOps = 0;
+        return seq;
+    }
+
+    // Reads the next reply frame (replies arrive in send order). Throws on a
+    // frame too short for its header or longer than kMaxFrame.
+    vector<RpcResult> receive(uint32_t* seqOut = nullptr) {
+        fill(4);
+        uint32_t bodyLen;
+        memcpy(&bodyLen, inbox.data(), 4);
+        if (bodyLen < rpc::kHeader - 4 || bodyLen > rpc::kMaxFrame) throw runtime_error("rpc: bad reply frame length " + to_string(bodyLen));
+        fill(4 + size_t(bodyLen));
+        rpc::RpcReader r(string_view(inbox).substr(4, bodyLen));
+        if (!r.has(rpc::kHeader - 4)) throw runtime_error("rpc: truncated reply header");
+        uint32_t seq = r.get<uint32_t>();
+        uint16_t count = r.get<uint16_t>();
+        if (seqOut) *seqOut = seq;
+        vector<RpcResult> results;
+        results.reserve(count);
+        for (uint16_t i = 0; i < count && r.has(rpc::kResultSize); ++i) {
+            RpcResult res;
+            res.op = RpcOp(r.get<uint8_t>());
+            res.status = RpcStatus(r.get<uint8_t>());
+            res.value = r.get<uint64_t>();
+            results.push_back(res);
+        }
+        inbox.erase(0, 4 + size_t(bodyLen));
+        return results;
+    }
+};
+
+// ecommerce_system --publish-catalog NAME [--catalog-size N]
+// Loader: writes a new shared catalog version and exits (the segment stays).
+int publishCatalog(int argc, char** argv) {
+    size_t catalogSize = 100000;
+    for (int i = 3; i + 1 < argc; i += 2)
+        if (string(argv[i]) == "--catalog-size") catalogSize = size_t(strtoull(argv[i + 1], nullptr, 10));
+    GenericCatalog<Product> catalog;
+    fillCatalog(catalog, catalogSize, TypeMix{});
+    uint64_t version = SharedCatalogPublisher(argv[2]).publish(catalog);
+    cerr << "Published " << catalog.size() << " products as " << argv[2] << " version " << version << "\n";
+    return 0;
+}
+
+// ecommerce_system --serve PORT [--threads N] [--catalog-size N | --shared-catalog NAME]
+//                  [--rpc-port P] [--rpc-socket PATH] [--snapshot PATH [--snapshot-every-s S]]
+//                  [--order-store DIR]
+// With --snapshot, state is restored from PATH when it exists, written every
+// S seconds in the background, and once more on shutdown. With --order-store,
+// every order and status change is also written to an OrderStore in DIR.
+int runServer(int argc, char** argv) {
+    // block before any thread starts so every thread inherits the mask
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
+    uint16_t port = uint16_t(atoi(argv[2]));
+    unsigned threads = max(1u, thread::hardware_concurrency());
+    size_t catalogSize = 100000;
+    uint16_t rpcPort = 0;
+    string rpcSocket, sharedName, snapshotPath, storeDir;
+    long snapshotEvery = 0;
+    for (int i = 3; i + 1 < argc; i += 2) {
+        string flag = argv[i];
+        if (flag == "--threads") threads = unsigned(max(1, atoi(argv[i + 1])));
+        else if (flag == "--catalog-size") catalogSize = size_t(strtoull(argv[i + 1], nullptr, 10));
+        else if (flag == "--shared-catalog") sharedName = argv[i + 1];
+        else if (flag == "--rpc-port") rpcPort = uint16_t(atoi(argv[i + 1]));
+        else if (flag == "--rpc-socket") rpcSocket = argv[i + 1];
+        else if (flag == "--snapshot") snapshotPath = argv[i + 1];
+        else if (flag == "--snapshot-every-s") snapshotEvery = max(0, atoi(argv[i + 1]));
+        else if (flag == "--order-store") storeDir = argv[i + 1];
+    }
+    GenericCatalog<Product> catalog;
+    optional<SharedCatalog> shared;
+    optional<CommerceService> serviceSlot;
+    bool restore = !snapshotPath.empty() && access(snapshotPath.c_str(), R_OK) == 0;
+    if (sharedName.empty()) {
+        if (!restore) fillCatalog(catalog, catalogSize, TypeMix{});
+        serviceSlot.emplace(catalog);
+    } else {
+        shared.emplace(sharedName);
+        serviceSlot.emplace(*shared);
+    }
+    CommerceService &service = *serviceSlot;
+    if (restore) {
+        try {
+            auto st = restoreSnapshot(snapshotPath, catalog, service, threads);
+            cerr << "Restored " << st.products << " products, " << st.carts << " carts, " << st.orders << " orders from "
+                 << snapshotPath << " in " << st.seconds << "s\n";
+        } catch (const exception& e) {
+            // a half-restored state must not be served, nor overwrite the file later
+            cerr << "Cannot restore " << snapshotPath << ": " << e.what() << "\n";
+            return 1;
+        }
+    }
+    catalogSize = shared ? shared->current()->size() : catalog.size();
+    optional<OrderStore> store;
+    optional<OrderStoreWriter> storeWriter;  // reactors must not wait on the store
+    if (!storeDir.empty()) {
+        store.emplace(storeDir);
+        storeWriter.emplace(*store);
+        service.onOrderChanged([&storeWriter](const Order& o) { storeWriter->put(o); });
+    }
+    Reactor reactor(HttpFrontend(service), threads);
+    reactor.listenTcp(port);
+    reactor.start();
+    cerr << "Serving " << catalogSize << (shared ? " shared" : "") << " products on :" << port << " with " << threads << " reactor(s)\n";
+    optional<Reactor> rpcReactor;
+    if (rpcPort || !rpcSocket.empty()) {
+        rpcReactor.emplace(RpcFrontend(service), threads);
+        if (rpcPort) rpcReactor->listenTcp(rpcPort);
+        if (!rpcSocket.empty()) rpcReactor->listenUnix(rpcSocket);
+        rpcReactor->start();
+    }
+
+    SnapshotWriter snapshots;
+    auto report = [&] {
+        snapshots.wait();
+        string error;
+        auto st = snapshots.last(&error);
+        if (!error.empty()) cerr << "Snapshot failed: " << error << "\n";
+        else cerr << "Snapshot: " << st.orders << " orders, " << st.carts << " carts, " << st.bytes << " bytes in " << st.seconds << "s\n";
+    };
+    // New orders feed the "also bought" index, folded in every 10 s; snapshots
+    // go out every --snapshot-every-s seconds.
+    CoPurchaseIndex& alsoBought = CoPurchaseIndex::global();
+    alsoBought.setRecording(true);
+    const timespec tick{1, 0};
+    bool storeFailureReported = false;
+    for (long seconds = 1;; ++seconds) {
+        if (sigtimedwait(&signals, nullptr, &tick) >= 0) break;
+        if (errno != EAGAIN) continue;
+        if (storeWriter && !storeFailureReported) {
+            string error = storeWriter->error();
+            if (!error.empty()) cerr << "Order store failed, orders are no longer persisted: " << error << "\n";
+            storeFailureReported = !error.empty();
+        }
+        if (seconds % 10 == 0 && alsoBought.pendingEdges()) alsoBought.rebuild();
+        if (!snapshotPath.empty() && snapshotEvery && seconds % snapshotEvery == 0) snapshots.start(snapshotPath, catalog, service);
+    }
+    if (rpcReactor) rpcReactor->stop();
+    reactor.stop();
+    if (!snapshotPath.empty()) {
+        snapshots.wait();
+        snapshots.start(snapshotPath, catalog, service);
+        report();
+    }
+    return 0;
+}
+#endif // __linux__
+
+#ifdef ECOMMERCE_BENCH
+// -------------------------
+// Benchmark suite (build with -DECOMMERCE_BENCH)
+// -------------------------
+// Usage: ecommerce_bench [--sizes 1000,100000] [--mix 40:40:20] [--filter name]
+//                        [--min-time-ms 200] [--out results.json]
+// --mix is the Electronics:Clothing:Grocery ratio of the synthetic catalog.
+// Results are printed as JSON (and optionally written to --out).
+
+namespace bench {
+
+// Heap allocations on every thread, so work a benchmark hands to pool threads
+// counts toward its allocs_per_op. Striped by thread so concurrent allocators
+// do not share a cache line.
+struct alignas(64) AllocationStripe {
+    atomic<uint64_t> count{0};
+};
+inline AllocationStripe allocationStripes[64];
+inline atomic<size_t> nextAllocationStripe{0};
+
+inline void countAllocation() {
+    static thread_local size_t stripe = nextAllocationStripe.fetch_add(1, memory_order_relaxed) % size(allocationStripes);
+    allocationStripes[stripe].count.fetch_add(1, memory_order_relaxed);
+}
+
+inline uint64_t allocations() {
+    uint64_t total = 0;
+    for (const auto &s : allocationStripes) total += s.count.load(memory_order_relaxed);
+    return total;
+}
+
+template<typename T>
+inline void keep(const T& value) { asm volatile("" : : "g"(&value) : "memory"); }
+
+struct Result {
+    string name;
+    size_t size;
+    string mix;
+    uint64_t ops;
+    double seconds, allocsPerOp, p50, p90, p99;
+};
+
+// Runs `batch` (which performs `opsPerBatch` operations) until minTime has
+// elapsed; percentiles are over per-batch ns/op samples.
+template<typename F>
+Result run(const string& name, size_t size, const string& mix, uint64_t opsPerBatch, chrono::milliseconds minTime, F batch) {
+    batch();  // warm-up
+    vector<double> samples;
+    uint64_t ops = 0, allocs = 0;
+    auto begin = chrono::steady_clock::now();
+    chrono::steady_clock::duration elapsed{};
+    while (elapsed < minTime || samples.size() < 5) {
+        uint64_t a0 = allocations();
+        auto t0 = chrono::steady_clock::now();
+        batch();
+        auto t1 = chrono::steady_clock::now();
+        allocs += allocations() - a0;
+        ops += opsPerBatch;
+        samples.push_back(chrono::duration<double, nano>(t1 - t0).count() / double(opsPerBatch));
+        elapsed = t1 - begin;
+    }
+    double busy = 0;
+    for (double s : samples) busy += s * double(opsPerBatch);
+    sort(samples.begin(), samples.end());
+    auto pct = [&](double q) { return samples[min(samples.size() - 1, size_t(q * double(samples.size())))]; };
+    return {name, size, mix, ops, busy / 1e9, double(allocs) / double(ops), pct(0.50), pct(0.90), pct(0.99)};
+}
+
+string toJson(const vector<Result>& results) {
+    ostringstream oss;
+    oss << fixed << setprecision(3) << "{\n  \"suite\": \"ecommerce\",\n  \"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const auto &r = results[i];
+        oss << (i ? ",\n" : "\n") << "    {\"name\": \"" << r.name << "\", \"size\": " << r.size
+            << ", \"mix\": \"" << r.mix << "\", \"ops\": " << r.ops
+            << ", \"ns_per_op\": " << r.seconds * 1e9 / double(r.ops)
+            << ", \"ops_per_sec\": " << double(r.ops) / r.seconds
+            << ", \"allocs_per_op\": " << r.allocsPerOp
+            << ", \"p50_ns\": " << r.p50 << ", \"p90_ns\": " << r.p90 << ", \"p99_ns\": " << r.p99 << "}";
+    }
+    oss << "\n  ]\n}\n";
+    return oss.str();
+}
+
+// Synthetic traffic: ecommerce_bench load [--threads 4] [--duration-s 5]
+//     [--mode closed|open] [--rate 20000] [--products 100000] [--zipf 0.99]
+//     [--adds 4] [--remove-pct 20] [--checkout-pct 30] [--mix 40:40:20]
+// Each session builds a cart (Zipf-distributed products, geometric number of
+// adds, some removals), totals it and converts to a paid Order with the
+// checkout probability. Closed loop runs sessions back to back per thread; open
+// loop schedules Poisson arrivals at --rate and measures the session from its
+// intended start, so queueing delay is not hidden (no coordinated omission).
+
+// Zipf(s) over 1..n by rejection-inversion (Hormann & Derflinger), O(1) memory.
+class ZipfGenerator {
+    double s, hIntegralX1, hIntegralN, sConst;
+    uint64_t n;
+    double h(double x) const { return exp(-s * log(x)); }
+    double hIntegral(double x) const { double lx = log(x); return helper2((1 - s) * lx) * lx; }
+    double hIntegralInverse(double x) const {
+        double t = max(-1.0, x * (1 - s));
+        return exp(helper1(t) * x);
+    }
+    static double helper1(double x) { return abs(x) > 1e-8 ? log1p(x) / x : 1 - x * (0.5 - x * (1.0 / 3 - 0.25 * x)); }
+    static double helper2(double x) { return abs(x) > 1e-8 ? expm1(x) / x : 1 + x * 0.5 * (1 + x * (1.0 / 3) * (1 + 0.25 * x)); }
+public:
+    ZipfGenerator(uint64_t n, double s) : s(s), n(n) {
+        hIntegralX1 = hIntegral(1.5) - 1;
+        hIntegralN = hIntegral(double(n) + 0.5);
+        sConst = 2 - hIntegralInverse(hIntegral(2.5) - h(2));
+    }
+    template<typename Rng>
+    uint64_t operator()(Rng& rng) const {
+        uniform_real_distribution<double> uni(0.0, 1.0);
+        while (true) {
+            double u = hIntegralN + uni(rng) * (hIntegralX1 - hIntegralN);
+            double x = hIntegralInverse(u);
+            uint64_t k = uint64_t(clamp(x + 0.5, 1.0, double(n)));
+            if (double(k) - x <= sConst || u >= hIntegral(double(k) + 0.5) - h(double(k))) return k;
+        }
+    }
+};
+
+struct LoadProfile {
+    unsigned threads = 4;
+    double durationSeconds = 5;
+    bool openLoop = false;
+    double sessionsPerSecond = 20000;
+    size_t products = 100000;
+    double zipf = 0.99;
+    double meanAdds = 4;
+    unsigned removePct = 20, checkoutPct = 30;
+    TypeMix mix;
+};
+
+enum LoadOp { OpAdd, OpRemove, OpTotal, OpCheckout, OpSession, OpCount };
+static const char* loadOpNames[OpCount] = {"cart_add", "cart_remove", "cart_total", "checkout", "session"};
+
+int runLoad(const LoadProfile& profile) {
+    auto catalog = makeCatalog(profile.products, profile.mix);
+    const auto &items = catalog.getItems();
+    ZipfGenerator zipf(items.size(), profile.zipf);
+    struct PerThread { KllSketch latency[OpCount]; uint64_t sessions = 0; };
+    vector<PerThread> perThread(profile.threads);
+
+    auto start = chrono::steady_clock::now();
+    auto deadline = start + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(profile.durationSeconds));
+    auto worker = [&](unsigned t) {
+        mt19937_64 rng(1000 + t);
+        geometric_distribution<int> extraAdds(1.0 / max(1.0, profile.meanAdds));
+        exponential_distribution<double> gap(profile.sessionsPerSecond / profile.threads);
+        uniform_int_distribution<unsigned> pct(0, 99);
+        PerThread &me = perThread[t];
+        auto timed = [&](LoadOp op, auto&& fn) {
+            auto t0 = chrono::steady_clock::now();
+            fn();
+            me.latency[op].add(chrono::duration<double, nano>(chrono::steady_clock::now() - t0).count());
+        };
+        auto intended = start;
+        while (true) {
+            if (profile.openLoop) {
+                intended += chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(gap(rng)));
+                if (intended >= deadline) break;
+                while (chrono::steady_clock::now() < intended) this_thread::yield();
+            } else {
+                intended = chrono::steady_clock::now();
+                if (intended >= deadline) break;
+            }
+            ShoppingCart cart;
+            int adds = 1 + extraAdds(rng);
+            for (int i = 0; i < adds; ++i) {
+                const auto &p = items[zipf(rng) - 1];
+                timed(OpAdd, [&] { cart.addProduct(p); });
+                if (pct(rng) < profile.removePct) timed(OpRemove, [&] { cart.removeProduct(p->getId()); });
+            }
+            double total = 0;
+            timed(OpTotal, [&] { total = cart.total(); });
+            keep(total);
+            if (!cart.empty() && pct(rng) < profile.checkoutPct)
+                timed(OpCheckout, [&] { Order order(cart); order.pay(); keep(order); });
+            me.latency[OpSession].add(chrono::duration<double, nano>(chrono::steady_clock::now() - intended).count());
+            ++me.sessions;
+        }
+    };
+    vector<thread> pool;
+    for (unsigned t = 0; t < profile.threads; ++t) pool.emplace_back(worker, t);
+    for (auto &th : pool) th.join();
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    KllSketch merged[OpCount];
+    uint64_t sessions = 0;
+    for (auto &pt : perThread) {
+        sessions += pt.sessions;
+        for (int op = 0; op < OpCount; ++op) merged[op].merge(pt.latency[op]);
+    }
+    cout << fixed << setprecision(3) << "{\n  \"suite\": \"ecommerce-load\",\n  \"mode\": \""
+         << (profile.openLoop ? "open" : "closed") << "\", \"threads\": " << profile.threads
+         << ", \"seconds\": " << elapsed << ", \"sessions\": " << sessions
+         << ", \"sessions_per_sec\": " << double(sessions) / elapsed << ",\n  \"operations\": [";
+    for (int op = 0; op < OpCount; ++op) {
+        const auto &k = merged[op];
+        cout << (op ? ",\n" : "\n") << "    {\"name\": \"" << loadOpNames[op] << "\", \"count\": " << k.count()
+             << ", \"ops_per_sec\": " << double(k.count()) / elapsed
+             << ", \"p50_ns\": " << k.quantile(0.5) << ", \"p99_ns\": " << k.quantile(0.99)
+             << ", \"p999_ns\": " << k.quantile(0.999) << ", \"max_ns\": " << k.maxValue() << "}";
+    }
+    cout << "\n  ]\n}\n";
+    return 0;
+}
+
+int loadMain(int argc, char** argv) {
+    LoadProfile profile;
+    for (int i = 0; i + 1 < argc; i += 2) {
+        string flag = argv[i], value = argv[i + 1];
+        try {
+            if (flag == "--threads") profile.threads = max(1, stoi(value));
+            else if (flag == "--duration-s") profile.durationSeconds = stod(value);
+            else if (flag == "--mode") {
+                if (value != "open" && value != "closed") {
+                    cerr << "bad --mode, expected open or closed\n";
+                    return 2;
+                }
+                profile.openLoop = value == "open";
+            } else if (flag == "--rate") profile.sessionsPerSecond = stod(value);
+            else if (flag == "--products") profile.products = max<size_t>(1, stoull(value));
+            else if (flag == "--zipf") profile.zipf = stod(value);
+            else if (flag == "--adds") profile.meanAdds = stod(value);
+            else if (flag == "--remove-pct") profile.removePct = unsigned(stoul(value));
+            else if (flag == "--checkout-pct") profile.checkoutPct = unsigned(stoul(value));
+            else if (flag == "--mix") {
+                if (sscanf(value.c_str(), "%u:%u:%u", &profile.mix.electronics, &profile.mix.clothing, &profile.mix.grocery) != 3) {
+                    cerr << "bad --mix, expected E:C:G\n";
+                    return 2;
+                }
+            } else {
+                cerr << "unknown flag " << flag << "\n";
+                return 2;
+            }
+        } catch (const logic_error&) {  // stoi/stod: not a number, or out of range
+            cerr << "bad value for " << flag << ": " << value << "\n";
+            return 2;
+        }
+    }
+    if (profile.openLoop && !(profile.sessionsPerSecond > 0)) {
+        cerr << "--rate must be > 0 in open mode\n";
+        return 2;
+    }
+    return runLoad(profile);
+}
+
+// ecommerce_bench similar [--products N] [--dim D] [--queries Q] [--k K]
+//     [--lists L] [--probes P] [--spread S]
+// Top-K "similar items" over clustered synthetic embeddings (products are
+// topic centers plus noise of standard deviation S; larger is less
+// clustered): build time, query latency with and without a getType()
+// filter, and recall@K against an exhaustive scan on a subset of the
+// queries. Recall is also reported for random queries that lie near no
+// product, where the probed lists are the weakest guess.
+int similarMain(int argc, char** argv) {
+    size_t products = 1000000, dim = 64, queries = 2000, k = 10;
+    float spread = 0.4f;
+    SimilarityOptions options;
+    for (int i = 0; i + 1 < argc; i += 2) {
+        string flag = argv[i], value = argv[i + 1];
+        if (flag == "--products") products = max<size_t>(1, stoull(value));
+        else if (flag == "--dim") dim = max<size_t>(1, stoull(value));
+        else if (flag == "--queries") queries = max<size_t>(1, stoull(value));
+        else if (flag == "--k") k = max<size_t>(1, stoull(value));
+        else if (flag == "--lists") options.lists = stoull(value);
+        else if (flag == "--probes") options.probes = max<size_t>(1, stoull(value));
+        else if (flag == "--spread") spread = max(0.0f, stof(value));
+        else {
+            cerr << "unknown flag " << flag << "\n";
+            return 2;
+        }
+    }
+    auto catalog = makeCatalog(products, TypeMix{});
+    mt19937_64 rng(11);
+    normal_distribution<float> gauss;
+    const size_t topics = 1000;
+    vector<float> centers(topics * dim);
+    for (auto &c : centers) c = gauss(rng);
+    EmbeddingSet set(dim);
+    vector<float> v(dim);
+    for (const auto &p : catalog.getItems()) {
+        const float* center = centers.data() + (rng() % topics) * dim;
+        for (size_t d = 0; d < dim; ++d) v[d] = center[d] + spread * gauss(rng);
+        set.add(p->getId(), v.data());
+    }
+    auto t0 = chrono::steady_clock::now();
+    SimilarityIndex index(set, catalog, SimilarityIndex::Metric::L2, options);
+    double buildSeconds = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+
+    // queries: perturbed copies of random products, and points drawn like
+    // the topic centers, which no product is close to
+    vector<vector<float>> asked(queries, vector<float>(dim)), random(min<size_t>(queries, 100), vector<float>(dim));
+    for (auto &q : asked) {
+        const float* base = set.at(rng() % set.size());
+        for (size_t d = 0; d < dim; ++d) q[d] = base[d] + 0.1f * gauss(rng);
+    }
+    for (auto &q : random)
+        for (auto &x : q) x = gauss(rng);
+    // recall on the first 100 queries; run apart from the timed ones, whose
+    // cache the exhaustive scans would evict
+    auto recallOf = [&](const vector<vector<float>>& qs, string_view type) {
+        size_t hits = 0, expected = 0;
+        for (size_t i = 0; i < min<size_t>(qs.size(), 100); ++i) {
+            auto got = index.search(qs[i].data(), k, type);
+            auto exact = index.exhaustive(qs[i].data(), k, type);
+            unordered_set<uid64_t> want;
+            for (const auto &nb : exact) want.insert(nb.id);
+            for (const auto &nb : got) hits += want.count(nb.id);
+            expected += exact.size();
+        }
+        return expected ? double(hits) / double(expected) : 1.0;
+    };
+    auto measure = [&](string_view type, double& recall) {
+        KllSketch latency;
+        for (size_t i = 0; i < queries; ++i) {
+            auto s0 = chrono::steady_clock::now();
+            keep(index.search(asked[i].data(), k, type));
+            latency.add(chrono::duration<double, micro>(chrono::steady_clock::now() - s0).count());
+        }
+        recall = recallOf(asked, type);
+        return latency;
+    };
+    double recallAny = 0, recallGrocery = 0;
+    auto any = measure("", recallAny);
+    auto grocery = measure("Grocery", recallGrocery);
+    double recallRandom = recallOf(random, "");
+    cout << fixed << setprecision(3) << "{\n  \"suite\": \"ecommerce-similar\", \"products\": " << index.size() << ", \"dim\": " << dim
+         << ", \"spread\": " << spread << ", \"lists\": " << index.listCount() << ", \"probes\": " << options.probes << ", \"k\": " << k
+         << ", \"simd\": \"" << (vec::haveAvx2() ? "avx2" : "portable") << "\", \"build_s\": " << buildSeconds << ",\n"
+         << "  \"p50_us\": " << any.quantile(0.5) << ", \"p99_us\": " << any.quantile(0.99) << ", \"recall\": " << recallAny
+         << ", \"random_query_recall\": " << recallRandom << ",\n"
+         << "  \"grocery_p50_us\": " << grocery.quantile(0.5) << ", \"grocery_p99_us\": " << grocery.quantile(0.99) << ", \"grocery_recall\": " << recallGrocery << "\n}\n";
+    return 0;
+}
+
+#ifdef __linux__
+// ecommerce_bench compress [--products N] [--block BYTES]
+// Block codec on product records (as in snapshot Products chunks) and on
+// order records (as in order-store runs): ratio and single-core compression,
+// decompression and checksum throughput, with and without a dictionary.
+int compressMain(int argc, char** argv) {
+    size_t products = 200000, blockBytes = 4096;
+    for (int i = 0; i + 1 < argc; i += 2) {
+        string flag = argv[i], value = argv[i + 1];
+        if (flag == "--products") products = max<size_t>(1, stoull(value));
+        else if (flag == "--block") blockBytes = max<size_t>(64, stoull(value));
+        else {
+            cerr << "unknown flag " << flag << "\n";
+            return 2;
+        }
+    }
+    auto catalog = makeCatalog(products, TypeMix{});
+    string productData, orderData;
+    vector<size_t> recordEnds;
+    snap::Writer pw{productData}, ow{orderData};
+    for (const auto &p : catalog.getItems()) {
+        snap::putProduct(pw, *p);
+        recordEnds.push_back(productData.size());
+    }
+    mt19937_64 rng(9);
+    for (size_t i = 1; i <= products; ++i) {
+        StoredOrder o;
+        o.id = i;
+        o.createdAt = int64_t(1700000000 + i / 100);
+        for (int lines = 1 + int(rng() % 4); lines > 0; --lines) o.lines.push_back({1 + rng() % products, uint32_t(1 + rng() % 3), double(rng() % 10000) / 100});
+        string value;
+        o.encode(value);
+        ow.put(uint64_t(o.id));
+        ow.put(o.createdAt);
+        ow.put(uint32_t(value.size()));
+        orderData += value;
+    }
+    vector<string_view> samples;
+    for (size_t i = 0, stride = max<size_t>(1, products / 20000); i < recordEnds.size(); i += stride) {
+        size_t from = i ? recordEnds[i - 1] : 0;
+        samples.push_back(string_view(productData).substr(from, recordEnds[i] - from));
+    }
+    auto t0 = chrono::steady_clock::now();
+    auto dict = lz::Dictionary::train(samples);
+    double trainSeconds = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+
+    bool ok = true;
+    auto run = [&](const char* name, const string& data, const lz::Dictionary* d) {
+        vector<string> blocks;
+        uint64_t stored = 0;
+        auto c0 = chrono::steady_clock::now();
+        for (size_t at = 0; at < data.size(); at += blockBytes) {
+            string block;
+            lz::encodeBlock(string_view(data).substr(at, blockBytes), block, d);
+            stored += block.size();
+            blocks.push_back(move(block));
+        }
+        double compressSeconds = chrono::duration<double>(chrono::steady_clock::now() - c0).count();
+        string out;
+        for (size_t i = 0; i < blocks.size(); ++i) {
+            lz::decodeBlock(blocks[i].data(), blocks[i].size(), out, d);
+            ok = ok && string_view(out) == string_view(data).substr(i * blockBytes, blockBytes);
+        }
+        size_t passes = 0;
+        auto d0 = chrono::steady_clock::now();
+        double decompressSeconds = 0;
+        for (; decompressSeconds < 0.5; ++passes) {
+            for (const auto &b : blocks) lz::decodeBlock(b.data(), b.size(), out, d);
+            decompressSeconds = chrono::duration<double>(chrono::steady_clock::now() - d0).count();
+        }
+        cout << "  \"" << name << "\": {\"raw_bytes\": " << data.size() << ", \"stored_bytes\": " << stored
+             << ", \"ratio\": " << double(data.size()) / double(stored) << ", \"compress_mb_s\": " << double(data.size()) / compressSeconds / 1e6
+             << ", \"decompress_mb_s\": " << double(data.size()) * double(passes) / decompressSeconds / 1e6 << "},\n";
+    };
+    cout << fixed << setprecision(3) << "{\n  \"suite\": \"ecommerce-compress\", \"block_bytes\": " << blockBytes
+         << ", \"dictionary_bytes\": " << dict.size() << ", \"train_s\": " << trainSeconds << ",\n";
+    run("products", productData, nullptr);
+    run("products_dict", productData, &dict);
+    run("orders", orderData, nullptr);
+    size_t passes = 0;
+    uint32_t crc = 0;
+    auto c0 = chrono::steady_clock::now();
+    double crcSeconds = 0;
+    for (; crcSeconds < 0.2; ++passes) {
+        crc ^= lz::crc32c(productData.data(), productData.size());
+        crcSeconds = chrono::duration<double>(chrono::steady_clock::now() - c0).count();
+    }
+    keep(crc);
+    cout << "  \"crc32c_mb_s\": " << double(productData.size()) * double(passes) / crcSeconds / 1e6
+         << ", \"roundtrip\": " << (ok ? "true" : "false") << "\n}\n";
+    return ok ? 0 : 1;
+}
+
+// ecommerce_bench rpc [--requests N] [--batch B] [--pipeline P] [--products N]
+// Drives the same add-to-cart + cart-total stream through the HTTP front-end
+// and the binary RPC front-end (TCP and unix socket) of an in-process server,
+// then checks that the largest request each accepts is answered.
+struct RpcProfile {
+    size_t requests = 200000;   // cart operations per transport
+    unsigned batch = 16;        // RPC ops per frame
+    unsigned pipeline = 8;      // frames (or HTTP requests) in flight
+    size_t products = 100000;
+};
+
+struct WireOp {
+    uint64_t cart;
+    uid64_t product;  // 0 means "cart total"
+};
+
+double runHttp(uint16_t port, const vector<WireOp>& ops, unsigned inFlight) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof addr) != 0) throw runtime_error("http connect failed");
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+    string inbox;
+    char buf[64 * 1024];
+    // Reads one response; bodies are small, so header parsing is all we need.
+    auto readResponse = [&] {
+        while (true) {
+            size_t end = inbox.find("\r\n\r\n");
+            if (end != string::npos) {
+                size_t at = inbox.find("Content-Length: ");
+                size_t len = at < end ? stoul(inbox.substr(at + 16)) : 0;
+                if (inbox.size() >= end + 4 + len) {
+                    inbox.erase(0, end + 4 + len);
+                    return;
+                }
+            }
+            ssize_t n = recv(fd, buf, sizeof buf, 0);
+            if (n <= 0) throw runtime_error("http connection closed");
+            inbox.append(buf, size_t(n));
+        }
+    };
+    auto start = chrono::steady_clock::now();
+    size_t sent = 0, received = 0;
+    while (received < ops.size()) {
+        string out;
+        while (sent < ops.size() && sent - received < inFlight) {
+            const auto &op = ops[sent++];
+            if (op.product)
+                out += "POST /carts/" + to_string(op.cart) + "/items/" + to_string(op.product) + "?qty=1 HTTP/1.1\r\nHost: bench\r\n\r\n";
+            else
+                out += "GET /carts/" + to_string(op.cart) + "/total HTTP/1.1\r\nHost: bench\r\n\r\n";
+        }
+        for (size_t off = 0; off < out.size();) {
+            ssize_t n = ::send(fd, out.data() + off, out.size() - off, MSG_NOSIGNAL);
+            if (n <= 0) throw runtime_error("http send failed");
+            off += size_t(n);
+        }
+        readResponse();
+        ++received;
+    }
+    close(fd);
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+double runRpc(RpcClient client, const vector<WireOp>& ops, unsigned batch, unsigned inFlight) {
+    auto start = chrono::steady_clock::now();
+    size_t next = 0, frames = 0, received = 0;
+    while (next < ops.size() || received < frames) {
+        while (next < ops.size() && frames - received < inFlight) {
+            for (unsigned i = 0; i < batch && next < ops.size(); ++i, ++next) {
+                const auto &op = ops[next];
+                if (op.product) client.addProduct(op.cart, op.product);
+                else client.op(RpcOp::CartTotal, op.cart);
+            }
+            client.send();
+            ++frames;
+        }
+        keep(client.receive());
+        ++received;
+    }
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// The largest HTTP request and RPC frame the front-ends accept, each sent as
+// its first MiB and then the rest, must be answered: the reactor has to
+// buffer a whole one before it stops reading.
+bool largestFramesAnswered(uint16_t httpPort, uint16_t rpcPort) {
+    auto exchange = [](uint16_t port, const string& request, auto&& complete) {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+        if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof addr) != 0) throw runtime_error("connect failed");
+        timeval timeout{5, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+        auto sendAll = [&](string_view bytes) {
+            for (size_t off = 0; off < bytes.size();) {
+                ssize_t n = ::send(fd, bytes.data() + off, bytes.size() - off, MSG_NOSIGNAL);
+                if (n <= 0) return false;
+                off += size_t(n);
+            }
+            return true;
+        };
+        const size_t split = min<size_t>(request.size(), 1 << 20);
+        bool ok = sendAll(string_view(request).substr(0, split));
+        this_thread::sleep_for(chrono::milliseconds(100));
+        ok = ok && sendAll(string_view(request).substr(split));
+        string reply;
+        char buf[64 * 1024];
+        while (ok && !complete(reply)) {
+            ssize_t n = recv(fd, buf, sizeof buf, 0);
+            ok = n > 0;
+            if (ok) reply.append(buf, size_t(n));
+        }
+        close(fd);
+        return ok;
+    };
+
+    string http = "GET /carts/1/total HTTP/1.1\r\nHost: bench\r\nContent-Length: " + to_string(HttpFrontend::kMaxBody) + "\r\n\r\n";
+    http.append(HttpFrontend::kMaxBody, 'x');
+    bool httpOk = exchange(httpPort, http, [](const string& r) { return r.find("\r\n\r\n") != string::npos; });
+
+    // as many CartTotal ops as a frame counts, padded out to kMaxFrame
+    string frame;
+    rpc::put<uint32_t>(frame, rpc::kMaxFrame);
+    rpc::put<uint32_t>(frame, 1);
+    rpc::put<uint16_t>(frame, UINT16_MAX);
+    for (uint32_t i = 0; i < UINT16_MAX; ++i) {
+        rpc::put(frame, uint8_t(RpcOp::CartTotal));
+        rpc::put<uint64_t>(frame, 1);
+    }
+    frame.resize(4 + size_t(rpc::kMaxFrame), '\0');
+    bool rpcOk = exchange(rpcPort, frame, [](const string& r) {
+        uint32_t len = 0;
+        if (r.size() >= 4) memcpy(&len, r.data(), 4);
+        return r.size() >= 4 && r.size() >= 4 + size_t(len);
+    });
+    return httpOk && rpcOk;
+}
+
+int rpcMain(int argc, char** argv) {
+    RpcProfile profile;
+    for (int i = 0; i + 1 < argc; i += 2) {
+        string flag = argv[i], value = argv[i + 1];
+        if (flag == "--requests") profile.requests = max<size_t>(1, stoull(value));
+        else if (flag == "--batch") profile.batch = unsigned(clamp(stoi(value), 1, 65535));
+        else if (flag == "--pipeline") profile.pipeline = unsigned(max(1, stoi(value)));
+        else if (flag == "--products") profile.products = max<size_t>(1, stoull(value));
+        else {
+            cerr << "unknown flag " << flag << "\n";
+            return 2;
+        }
+    }
+    auto catalog = makeCatalog(profile.products, TypeMix{});
+    CommerceService service(catalog);
+    Reactor http(HttpFrontend(service), 1), binary(RpcFrontend(service), 1);
+    uint16_t httpPort = uint16_t(20000 + getpid() % 20000), rpcPort = uint16_t(httpPort + 1);
+    string unixPath = "/tmp/ecommerce_bench_" + to_string(getpid()) + ".sock";
+    http.listenTcp(httpPort, "127.0.0.1");
+    binary.listenTcp(rpcPort, "127.0.0.1");
+    binary.listenUnix(unixPath);
+    http.start();
+    binary.start();
+
+    // Every fourth op reads the cart total; carts rotate so none grows without bound.
+    vector<WireOp> ops(profile.requests);
+    mt19937_64 rng(7);
+    const auto &items = catalog.getItems();
+    for (size_t i = 0; i < ops.size(); ++i)
+        ops[i] = {i / 64 % 1024 + 1, i % 4 == 3 ? uid64_t(0) : items[rng() % items.size()]->getId()};
+
+    struct Row { string name; double seconds; };
+    vector<Row> rows;
+    rows.push_back({"http_tcp", runHttp(httpPort, ops, profile.pipeline)});
+    rows.push_back({"rpc_tcp", runRpc(RpcClient::connectTcp("127.0.0.1", rpcPort), ops, profile.batch, profile.pipeline)});
+    rows.push_back({"rpc_unix", runRpc(RpcClient::connectUnix(unixPath), ops, profile.batch, profile.pipeline)});
+    const bool largest = largestFramesAnswered(httpPort, rpcPort);
+    binary.stop();
+    http.stop();
+
+    cout << fixed << setprecision(3) << "{\n  \"suite\": \"ecommerce-rpc\", \"requests\": " << profile.requests
+         << ", \"batch\": " << profile.batch << ", \"pipeline\": " << profile.pipeline << ",\n  \"transports\": [";
+    for (size_t i = 0; i < rows.size(); ++i)
+        cout << (i ? ",\n" : "\n") << "    {\"name\": \"" << rows[i].name << "\", \"seconds\": " << rows[i].seconds
+             << ", \"ops_per_sec\": " << double(profile.requests) / rows[i].seconds
+             << ", \"speedup_vs_http\": " << rows[0].seconds / rows[i].seconds << "}";
+    cout << "\n  ],\n  \"largest_frames_answered\": " << (largest ? "true" : "false") << "\n}\n";
+    return largest ? 0 : 1;
+}
+
+// ecommerce_bench snapshot [--orders N] [--carts N] [--products N] [--threads T] [--path FILE]
+// Times the capture pause, the background write and a parallel restore.
+int snapshotMain(int argc, char** argv) {
+    size_t orders = 1000000, carts = 100000, products = 100000;
+    unsigned threads = max(1u, thread::hardware_concurrency());
+    string path = "/tmp/ecommerce_bench.snap";
+    for (int i = 0; i + 1 < argc; i += 2) {
+        string flag = argv[i], value = argv[i + 1];
+        if (flag == "--orders") orders = stoull(value);
+        else if (flag == "--carts") carts = stoull(value);
+        else if (flag == "--products") products = max<size_t>(1, stoull(value));
+        else if (flag == "--threads") threads = unsigned(max(1, stoi(value)));
+        else if (flag == "--path") path = value;
+        else {
+            cerr << "unknown flag " << flag << "\n";
+            return 2;
+        }
+    }
+    auto catalog = makeCatalog(products, TypeMix{});
+    CommerceService service(catalog);
+    mt19937_64 rng(11);
+    auto fill = [&](uint64_t cart) {
+        for (int lines = 1 + int(rng() % 4); lines > 0; --lines) service.addToCart(cart, 1 + rng() % products, 1 + rng() % 3);
+    };
+    for (size_t i = 0; i < orders; ++i) {
+        fill(0);
+        auto order = service.checkout(0);
+        if (i % 2) service.pay(order->getId());
+    }
+    for (size_t c = 1; c <= carts; ++c) fill(c);
+
+    auto t0 = chrono::steady_clock::now();
+    auto state = service.capture();
+    double pause = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    auto images = snap::captureProducts(catalog.getItems(), state);
+    auto written = writeSnapshot(path, images, state);
+
+    GenericCatalog<Product> restoredCatalog;
+    CommerceService restored(restoredCatalog);
+    auto loaded = restoreSnapshot(path, restoredCatalog, restored, threads);
+    remove(path.c_str());
+    bool match = loaded.orders == written.orders && loaded.carts == written.carts && loaded.products == written.products;
+
+    cout << fixed << setprecision(3) << "{\n  \"suite\": \"ecommerce-snapshot\", \"orders\": " << written.orders
+         << ", \"carts\": " << written.carts << ", \"products\": " << written.products << ", \"bytes\": " << written.bytes
+         << ", \"raw_bytes\": " << written.rawBytes << ", \"threads\": " << threads << ",\n  \"capture_pause_ms\": " << pause * 1e3
+         << ", \"write_s\": " << written.seconds << ", \"restore_s\": " << loaded.seconds
+         << ", \"restore_orders_per_sec\": " << double(loaded.orders) / loaded.seconds
+         << ", \"match\": " << (match ? "true" : "false") << "\n}\n";
+    return match ? 0 : 1;
+}
+
+// ecommerce_bench lsm [--orders N] [--lookups N] [--dir DIR]
+// Write rate, point-lookup latency and range scans of the OrderStore.
+int lsmMain(int argc, char** argv) {
+    size_t orders = 1000000, lookups = 100000;
+    string dir = "/tmp/ecommerce_bench_lsm";
+    for (int i = 0; i + 1 < argc; i += 2) {
+        string flag = argv[i], value = argv[i + 1];
+        if (flag == "--orders") orders = max<size_t>(1, stoull(value));
+        else if (flag == "--lookups") lookups = stoull(value);
+        else if (flag == "--dir") dir = value;
+        else {
+            cerr << "unknown flag " << flag << "\n";
+            return 2;
+        }
+    }
+    auto wipe = [&] {
+        if (DIR* d = opendir(dir.c_str())) {
+            while (dirent* e = readdir(d))
+                if (e->d_name[0] != '.') unlink((dir + "/" + e->d_name).c_str());
+            closedir(d);
+        }
+        rmdir(dir.c_str());
+    };
+    wipe();
+    mt19937_64 rng(5);
+    double putSeconds, lookupSeconds, idScanSeconds, timeScanSeconds;
+    size_t idScanned = 0, timeScanned = 0, found = 0;
+    KllSketch latency;
+    string layout;
+    {
+        OrderStore store(dir);
+        auto t0 = chrono::steady_clock::now();
+        for (size_t i = 1; i <= orders; ++i) {
+            StoredOrder o;
+            o.id = i;
+            o.createdAt = int64_t(1700000000 + i / 100);  // ~100 orders per second
+            for (int lines = 1 + int(rng() % 4); lines > 0; --lines) o.lines.push_back({1 + rng() % 100000, uint32_t(1 + rng() % 3), double(rng() % 10000) / 100});
+            o.total = o.lines.size();
+            store.put(o);
+        }
+        putSeconds = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+        store.flush();
+        layout = store.stats();
+
+        t0 = chrono::steady_clock::now();
+        for (size_t i = 0; i < lookups; ++i) {
+            auto s0 = chrono::steady_clock::now();
+            found += store.get(1 + rng() % orders).has_value();
+            latency.add(chrono::duration<double, micro>(chrono::steady_clock::now() - s0).count());
+        }
+        lookupSeconds = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+
+        uint64_t from = orders / 2;
+        t0 = chrono::steady_clock::now();
+        store.scan(from, from + 99999, [&](const StoredOrder& o) { keep(o.total); ++idScanned; });
+        idScanSeconds = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+        time_t start = time_t(1700000000 + orders / 200);
+        t0 = chrono::steady_clock::now();
+        store.scanTime(start, start + 999, [&](const StoredOrder& o) { keep(o.total); ++timeScanned; });
+        timeScanSeconds = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    }
+    wipe();
+    cout << fixed << setprecision(3) << "{\n  \"suite\": \"ecommerce-lsm\", \"orders\": " << orders << ", \"layout\": \"" << layout << "\",\n"
+         << "  \"puts_per_sec\": " << double(orders) / putSeconds << ",\n"
+         << "  \"lookups\": " << lookups << ", \"found\": " << found << ", \"lookup_p50_us\": " << latency.quantile(0.5)
+         << ", \"lookup_p99_us\": " << latency.quantile(0.99) << ", \"lookups_per_sec\": " << double(lookups) / lookupSeconds << ",\n"
+         << "  \"id_scan_rows\": " << idScanned << ", \"id_scan_rows_per_sec\": " << double(idScanned) / idScanSeconds << ",\n"
+         << "  \"time_scan_rows\": " << timeScanned << ", \"time_scan_rows_per_sec\": " << double(timeScanned) / timeScanSeconds << "\n}\n";
+    return found == lookups ? 0 : 1;
+}
+
+// ecommerce_bench btree [--products N] [--lookups N] [--pages P] [--path FILE]
+// Point lookups through a ProductIndexFile whose buffer pool holds P pages,
+// by id and by SKU, with a hot in-memory catalog falling through to it.
+int btreeMain(int argc, char** argv) {
+    size_t products = 1000000, lookups = 200000, pages = 256;
+    string path = "/tmp/ecommerce_bench.pidx";
+    for (int i = 0; i + 1 < argc; i += 2) {
+        string flag = argv[i], value = argv[i + 1];
+        if (flag == "--products") products = max<size_t>(1, stoull(value));
+        else if (flag == "--lookups") lookups = stoull(value);
+        else if (flag == "--pages") pages = max<size_t>(4, stoull(value));
+        else if (flag == "--path") path = value;
+        else {
+            cerr << "unknown flag " << flag << "\n";
+            return 2;
+        }
+    }
+    auto full = makeCatalog(products, TypeMix{});
+    auto t0 = chrono::steady_clock::now();
+    ProductIndexFile::build(path, full.getItems());
+    double buildSeconds = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    auto index = make_shared<ProductIndexFile>(path, pages);
+    // the hot set: 1% of products stay in memory
+    GenericCatalog<Product> hot;
+    for (size_t i = 0; i < full.size(); i += 100) hot.add(full.getItems()[i]);
+    hot.setFallback(index);
+
+    mt19937_64 rng(3);
+    size_t found = 0;
+    KllSketch byId, bySku;
+    for (size_t i = 0; i < lookups; ++i) {
+        const auto &want = full.getItems()[rng() % products];
+        auto s0 = chrono::steady_clock::now();
+        auto got = hot.find(want->getId());
+        auto s1 = chrono::steady_clock::now();
+        auto viaSku = hot.findBySku(want->getSku());
+        auto s2 = chrono::steady_clock::now();
+        found += got && viaSku && got->getId() == want->getId() && viaSku->getId() == want->getId();
+        byId.add(chrono::duration<double, micro>(s1 - s0).count());
+        bySku.add(chrono::duration<double, micro>(s2 - s1).count());
+    }
+    unlink(path.c_str());
+    cout << fixed << setprecision(3) << "{\n  \"suite\": \"ecommerce-btree\", \"products\": " << products << ", \"index_pages\": " << index->pages()
+         << ", \"pool_pages\": " << pages << ", \"build_s\": " << buildSeconds << ",\n"
+         << "  \"lookups\": " << lookups << ", \"found\": " << found << ", \"pool\": \"" << index->cacheStats() << "\",\n"
+         << "  \"by_id_p50_us\": " << byId.quantile(0.5) << ", \"by_id_p99_us\": " << byId.quantile(0.99)
+         << ", \"by_sku_p50_us\": " << bySku.quantile(0.5) << ", \"by_sku_p99_us\": " << bySku.quantile(0.99) << "\n}\n";
+    return found == lookups ? 0 : 1;
+}
+#endif
+
+int main(int argc, char** argv) {
+    // every mode takes "--flag value" pairs after its optional mode word
+    if ((argc - (argc > 1 && argv[1][0] != '-' ? 2 : 1)) % 2) {
+        cerr << "missing value for " << argv[argc - 1] << "\n";
+        return 2;
+    }
+    if (argc > 1 && string(argv[1]) == "load") return loadMain(argc - 2, argv + 2);
+    if (argc > 1 && string(argv[1]) == "similar") return similarMain(argc - 2, argv + 2);
+#ifdef __linux__
+    if (argc > 1 && string(argv[1]) == "rpc") return rpcMain(argc - 2, argv + 2);
+    if (argc > 1 && string(argv[1]) == "snapshot") return snapshotMain(argc - 2, argv + 2);
+    if (argc > 1 && string(argv[1]) == "lsm") return lsmMain(argc - 2, argv + 2);
+    if (argc > 1 && string(argv[1]) == "btree") return btreeMain(argc - 2, argv + 2);
+    if (argc > 1 && string(argv[1]) == "compress") return compressMain(argc - 2, argv + 2);
+#endif
+    vector<size_t> sizes = {1000, 100000};
+    TypeMix mix;
+    string filter, out;
+    chrono::milliseconds minTime(200);
+    for (int i = 1; i + 1 < argc; i += 2) {
+        string flag = argv[i], value = argv[i + 1];
+        if (flag == "--sizes") {
+            sizes.clear();
+            stringstream ss(value);
+            for (string tok; getline(ss, tok, ',');) {
+                size_t n = 0;
+                auto res = from_chars(tok.data(), tok.data() + tok.size(), n);
+                if (res.ec != errc() || res.ptr != tok.data() + tok.size() || n == 0) {
+                    sizes.clear();
+                    break;
+                }
+                sizes.push_back(n);
+            }
+            if (sizes.empty()) {
+                cerr << "bad --sizes, expected N[,N...] with N > 0\n";
+                return 2;
+            }
+        } else if (flag == "--mix") {
+            if (sscanf(value.c_str(), "%u:%u:%u", &mix.electronics, &mix.clothing, &mix.grocery) != 3) {
+                cerr << "bad --mix, expected E:C:G\n";
+                return 2;
+            }
+        } else if (flag == "--filter") filter = value;
+        else if (flag == "--min-time-ms") {
+            long long ms = -1;
+            auto res = from_chars(value.data(), value.data() + value.size(), ms);
+            if (res.ec != errc() || res.ptr != value.data() + value.size() || ms < 0) {
+                cerr << "bad --min-time-ms, expected a non-negative integer\n";
+                return 2;
+            }
+            minTime = chrono::milliseconds(ms);
+        } else if (flag == "--out") out = value;
+        else {
+            cerr << "unknown flag " << flag << "\n";
+            return 2;
+        }
+    }
+    string mixName = to_string(mix.electronics) + ":" + to_string(mix.clothing) + ":" + to_string(mix.grocery);
+    auto wanted = [&](const string& name) { return filter.empty() || name.find(filter) != string::npos; };
+
+    vector<Result> results;
+    for (size_t size : sizes) {
+        auto catalog = makeCatalog(size, mix);
+        const auto &items = catalog.getItems();
+        const size_t cartLines = min<size_t>(size, 16);
+
+        if (wanted("catalog_scan"))
+            results.push_back(run("catalog_scan", size, mixName, size, minTime, [&] {
+                double sum = 0;
+                for (const auto &p : items) sum += p->finalPrice();
+                keep(sum);
+            }));
+        if (wanted("cart_add"))
+            results.push_back(run("cart_add", size, mixName, cartLines * 4, minTime, [&] {
+                ShoppingCart cart;
+                for (size_t round = 0; round < 4; ++round)
+                    for (size_t i = 0; i < cartLines; ++i) cart.addProduct(items[(i * 7919) % size]);
+                keep(cart);
+            }));
+        ShoppingCart cart;
+        for (size_t i = 0; i < cartLines; ++i) cart.addProduct(items[(i * 7919) % size], 1 + i % 3);
+        if (wanted("cart_total"))
+            results.push_back(run("cart_total", size, mixName, 1000, minTime, [&] {
+                for (int i = 0; i < 1000; ++i) keep(cart.total());
+            }));
+        if (wanted("order_construct"))
+            results.push_back(run("order_construct", size, mixName, 100, minTime, [&] {
+                for (int i = 0; i < 100; ++i) { Order o(cart); keep(o); }
+            }));
+        Order order(cart);
+        if (wanted("product_to_string"))
+            results.push_back(run("product_to_string", size, mixName, 1000, minTime, [&] {
+                for (size_t i = 0; i < 1000; ++i) keep(items[i % size]->toString());
+            }));
+        if (wanted("order_to_string"))
+            results.push_back(run("order_to_string", size, mixName, 100, minTime, [&] {
+                for (int i = 0; i < 100; ++i) keep(order.toString());
+            }));
+
+        // request-scoped cart + order: global allocator vs one monotonic arena
+        if (wanted("request_checkout"))
+            results.push_back(run("request_checkout", size, mixName, 100, minTime, [&] {
+                for (int r = 0; r < 100; ++r) {
+                    ShoppingCart c;
+                    for (size_t i = 0; i < cartLines; ++i) c.addProduct(items[(i * 7919 + size_t(r)) % size]);
+                    Order o(c);
+                    keep(o);
+                }
+            }));
+        if (wanted("request_checkout_monotonic"))
+            results.push_back(run("request_checkout_monotonic", size, mixName, 100, minTime, [&] {
+                alignas(max_align_t) static thread_local byte buffer[16 * 1024];
+                for (int r = 0; r < 100; ++r) {
+                    pmr::monotonic_buffer_resource arena(buffer, sizeof buffer, &AllocationTracker::resource(Subsystem::Cart));
+                    ShoppingCart c(&arena);
+                    for (size_t i = 0; i < cartLines; ++i) c.addProduct(items[(i * 7919 + size_t(r)) % size]);
+                    Order o(c, &arena);
+                    keep(o);
+                }
+            }));
+
+        // full checkout incl. receipt: global heap + streams vs CheckoutContext
+        if (wanted("checkout_receipt"))
+            results.push_back(run("checkout_receipt", size, mixName, 100, minTime, [&] {
+                for (int r = 0; r < 100; ++r) {
+                    ShoppingCart c;
+                    for (size_t i = 0; i < cartLines; ++i) c.addProduct(items[(i * 7919 + size_t(r)) % size]);
+                    Order o(c);
+                    keep(o.toString());
+                }
+            }));
+        if (wanted("checkout_receipt_context"))
+            results.push_back(run("checkout_receipt_context", size, mixName, 100, minTime, [&] {
+                for (int r = 0; r < 100; ++r) {
+                    CheckoutContext ctx;
+                    for (size_t i = 0; i < cartLines; ++i) ctx.cart().addProduct(items[(i * 7919 + size_t(r)) % size]);
+                    ctx.placeOrder();
+                    keep(ctx.receipt());
+                }
+            }));
+
+        // pay -> reserve -> ship with ~1us of simulated work per stage
+        set<unsigned> threadCounts = {1u, max(1u, thread::hardware_concurrency())};
+        for (unsigned threads : threadCounts) {
+            string name = "order_pipeline_t" + to_string(threads);
+            if (!wanted(name)) continue;
+            auto busy = [] { auto until = chrono::steady_clock::now() + chrono::microseconds(1); while (chrono::steady_clock::now() < until) {} };
+            WorkStealingPool pool(threads);
+            OrderPipeline pipeline(pool);
+            pipeline.then("pay", [&](Order& o) { busy(); o.pay(); return true; })
+                    .then("reserve", [&](Order&) { busy(); return true; })
+                    .then("ship", [&](Order& o) { busy(); o.ship(); return true; });
+            auto prototype = make_shared<Order>(cart);
+            results.push_back(run(name, size, mixName, 1000, minTime, [&] {
+                for (int i = 0; i < 1000; ++i) pipeline.submit(make_shared<Order>(*prototype));
+                pipeline.wait();
+            }));
+        }
+
+        // order events through a broadcast ring: publish 512, then drain in batches
+        auto ringBatch = [](auto& ring) {
+            for (uint64_t i = 0; i < 512; ++i) ring.tryPublish({i, OrderEventType::Paid, 0, 0.0, 0});
+            while (ring.poll(0, [](const OrderEvent* e, size_t n) { keep(e[n - 1].orderId); })) {}
+        };
+        if (wanted("event_ring_mpsc")) {
+            EventRing<OrderEvent> ring(1024);
+            ring.addConsumer("bench");
+            results.push_back(run("event_ring_mpsc", size, mixName, 512, minTime, [&] { ringBatch(ring); }));
+        }
+        if (wanted("event_ring_spsc")) {
+            EventRing<OrderEvent, false> ring(1024);
+            ring.addConsumer("bench");
+            results.push_back(run("event_ring_spsc", size, mixName, 512, minTime, [&] { ringBatch(ring); }));
+        }
+
+        // display-currency prices: a 64-product page from the warm cache, and
+        // 1000 order totals right after a rate change (every lookup a miss)
+        if (wanted("fx_page_convert") || wanted("fx_order_totals")) {
+            ExchangeRates rates;
+            array<double, kCurrencyCount> perUsd{};
+            perUsd[size_t(Currency::EUR)] = 0.92;
+            rates.publish(perUsd);
+            PriceConverter converter(rates);
+            vector<const Product*> page(min<size_t>(size, 64));
+            for (size_t i = 0; i < page.size(); ++i) page[i] = items[(i * 7919) % size].get();
+            vector<double> prices(page.size());
+            if (wanted("fx_page_convert"))
+                results.push_back(run("fx_page_convert", size, mixName, page.size(), minTime, [&] {
+                    keep(converter.convert(page.data(), page.size(), Currency::EUR, prices.data()));
+                }));
+            vector<Order> orders;
+            for (size_t r = 0; r < 1000; ++r) {
+                ShoppingCart c;
+                for (size_t i = 0; i < 4; ++i) c.addProduct(items[(r * 31 + i * 7919) % size], 1 + i % 3);
+                orders.emplace_back(c);
+            }
+            vector<const LineItems*> lineSets;
+            for (const auto &o : orders) lineSets.push_back(&o.getItems());
+            vector<double> totals;
+            double rate = 0.92;
+            if (wanted("fx_order_totals"))
+                results.push_back(run("fx_order_totals", size, mixName, orders.size(), minTime, [&] {
+                    rates.set(Currency::EUR, rate += 1e-6);
+                    converter.totals(lineSets, Currency::EUR, totals);
+                    keep(totals);
+                }));
+        }
+
+        // batch invoicing: 1000 four-line orders split over two tax regions
+        if (wanted("tax_invoice_batch")) {
+            TaxRules rules;
+            RegionId de = rules.addRegion("DE", 0.19);
+            rules.setRate(de, ProductKind::Grocery, 0.07);
+            RegionId ny = rules.addRegion("US-NY", 0.08875);
+            rules.setRate(ny, ProductKind::Grocery, 0).setRate(ny, ProductKind::Clothing, 0.045);
+            TaxTable table = rules.compile();
+            Invoicer invoicer(table);
+            vector<Order> orders;
+            for (size_t r = 0; r < 1000; ++r) {
+                ShoppingCart c;
+                for (size_t i = 0; i < 4; ++i) c.addProduct(items[(r * 31 + i * 7919) % size], 1 + i % 3);
+                orders.emplace_back(c);
+            }
+            vector<const Order*> batch;
+            vector<RegionId> regions;
+            for (const auto &o : orders) {
+                batch.push_back(&o);
+                regions.push_back(batch.size() % 2 ? de : ny);
+            }
+            vector<InvoiceTotals> totals;
+            results.push_back(run("tax_invoice_batch", size, mixName, orders.size(), minTime, [&] {
+                invoicer.totals(batch, regions, totals);
+                keep(totals);
+            }));
+        }
+
+        // shipping options for 1000 four-line carts, every service per cart
+        if (wanted("ship_quote_batch")) {
+            ShippingRules rules;
+            ZoneId near = rules.addZone("near"), far = rules.addZone("far");
+            size_t standard = rules.addService("Standard"), express = rules.addService("Express");
+            rules.setRates(standard, near, {{1, 4.99}, {5, 8.99}, {30, 15.99}})
+                 .setRates(standard, far, {{2, 12.50}, {30, 24.00}})
+                 .setRates(express, near, {{1, 12.99}, {10, 19.99}});
+            ShippingTable table = rules.compile();
+            vector<ShoppingCart> carts(1000);
+            vector<const LineItems*> cartLines;
+            vector<ZoneId> zones;
+            for (size_t r = 0; r < carts.size(); ++r) {
+                for (size_t i = 0; i < 4; ++i) {
+                    auto &p = items[(r * 31 + i * 7919) % size];
+                    p->setParcel({float(0.1 + double((r + i) % 20) * 0.1), 20, 15, 10});
+                    carts[r].addProduct(p, 1 + i % 3);
+                }
+                cartLines.push_back(&carts[r].getItems());
+                zones.push_back(r % 2 ? near : far);
+            }
+            vector<double> quotes;
+            results.push_back(run("ship_quote_batch", size, mixName, carts.size(), minTime, [&] {
+                table.quote(cartLines, zones, quotes);
+                keep(quotes);
+            }));
+        }
+
+        // repricing every product: +10% / -10% on alternate runs, all changed
+        if (wanted("reprice_catalog")) {
+            WorkStealingPool pool(max(1u, thread::hardware_concurrency()));
+            vector<Product*> all;
+            for (const auto &p : items) all.push_back(p.get());
+            bool up = true;
+            results.push_back(run("reprice_catalog", size, mixName, size, minTime, [&] {
+                Repricer repricer(pool);
+                double factor = up ? 1.1 : 1 / 1.1;
+                repricer.add({"step", {}, [factor](const Product&, double price) { return price * factor; }});
+                up = !up;
+                keep(repricer.run(all.data(), all.size()).changed);
+            }));
+        }
+
+        // price history: hourly points for 1000 products, then 30-point range queries
+        if (wanted("price_history_record") || wanted("price_history_range")) {
+            PriceHistory history(false);
+            const int64_t start = 1700000000;
+            int64_t hour = 0;
+            auto recordHour = [&] {
+                for (uid64_t id = 0; id < 1000; ++id) history.record(id, start + hour * 3600, double((id + uint64_t(hour) / 24) % 50) + 9.99);
+                ++hour;
+            };
+            if (wanted("price_history_record"))
+                results.push_back(run("price_history_record", size, mixName, 1000, minTime, recordHour));
+            while (hour < 24 * 30) recordHour();
+            size_t q = 0;
+            if (wanted("price_history_range"))
+                results.push_back(run("price_history_range", size, mixName, 1, minTime, [&] {
+                    int64_t from = start + int64_t(q * 7919 % size_t(hour - 30)) * 3600;
+                    keep(history.range(q++ % 1000, from, from + 29 * 3600).size());
+                }));
+        }
+
+        // a merchandising filter: parsed, planned and run vs the hand-written loop
+        if (wanted("catalog_query") || wanted("catalog_query_loop")) {
+            CatalogQueryEngine engine(catalog);
+            const string query = "Clothing, size M, clearance, price < 50, sort by price";
+            if (wanted("catalog_query"))
+                results.push_back(run("catalog_query", size, mixName, 1, minTime, [&] { keep(engine.run(query)); }));
+            if (wanted("catalog_query_loop"))
+                results.push_back(run("catalog_query_loop", size, mixName, 1, minTime, [&] {
+                    vector<pair<double, shared_ptr<Product>>> found;
+                    for (const auto &p : items)
+                        if (auto c = dynamic_cast<const Clothing*>(p.get()); c && c->getSize() == "M" && c->isOnClearance()) {
+                            double price = c->finalPrice();
+                            if (price < 50) found.emplace_back(price, p);
+                        }
+                    sort(found.begin(), found.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+                    keep(found);
+                }));
+        }
+
+        // long-lived catalog: tracked new/delete vs a pool resource on top of it
+        const size_t buildSize = min<size_t>(size, 10000);
+        if (wanted("catalog_build"))
+            results.push_back(run("catalog_build", buildSize, mixName, buildSize, minTime, [&] {
+                GenericCatalog<Product> c;
+                fillCatalog(c, buildSize, mix);
+                keep(c);
+            }));
+        if (wanted("catalog_build_pool"))
+            results.push_back(run("catalog_build_pool", buildSize, mixName, buildSize, minTime, [&] {
+                pmr::unsynchronized_pool_resource pool(&AllocationTracker::resource(Subsystem::Catalog));
+                GenericCatalog<Product> c(&pool);
+                fillCatalog(c, buildSize, mix);
+                keep(c);
+            }));
+    }
+
+    string json = toJson(results);
+    cout << json;
+    if (!out.empty()) ofstream(out) << json;
+    return 0;
+}
+
+} // namespace bench
+
+// Counting replacements; pmr::new_delete_resource() goes through the aligned forms.
+[[gnu::noinline]] void* operator new(size_t n) {
+    bench::countAllocation();
+    if (void* p = malloc(n ? n : 1)) return p;
+    throw bad_alloc();
+}
+[[gnu::noinline]] void* operator new(size_t n, align_val_t align) {
+    bench::countAllocation();
+    size_t a = max(size_t(align), sizeof(void*));
+    if (void* p = aligned_alloc(a, (max<size_t>(n, 1) + a - 1) / a * a)) return p;
+    throw bad_alloc();
+}
+[[gnu::noinline]] void operator delete(void* p) noexcept { free(p); }
+[[gnu::noinline]] void operator delete(void* p, size_t) noexcept { free(p); }
+[[gnu::noinline]] void operator delete(void* p, align_val_t) noexcept { free(p); }
+[[gnu::noinline]] void operator delete(void* p, size_t, align_val_t) noexcept { free(p); }
+
+int main(int argc, char** argv) { return bench::main(argc, argv); }
+#else
+
+// -------------------------
+// Demo / Tests (main)
+// -------------------------
+int main(int argc, char** argv) {
+#ifdef __linux__
+    if (argc > 2 && string(argv[1]) == "--serve") return runServer(argc, argv);
+    if (argc > 2 && string(argv[1]) == "--publish-catalog") return publishCatalog(argc, argv);
+#else
+    (void)argc;
+    (void)argv;
+#endif
+
+    // --- 1. Creating objects ---
+    auto e1 = make_shared<Electronics>(1, "Smartphone", 699.99, "ELEC-100", 12);
+    auto c1 = make_shared<Clothing>(2, "Leather Jacket", 250.00, "CLOTH-200", "L", false);
+    auto g1 = make_shared<Grocery>(3, "Organic Milk", 3.49, "GROC-300", "2025-12-01");
+
+    cout << *e1 << "\n";
+    cout << *c1 << "\n";
+    cout << *g1 << "\n\n";
+
+    // --- 2. Inheritance / Overridden methods ---
+    cout << "Base price of Smartphone: " << e1->getBasePrice()
+         << " | Final price (after discount): " << e1->finalPrice() << "\n";
+    cout << "Base price of Jacket: " << c1->getBasePrice()
+         << " | Final price (after discount): " << c1->finalPrice() << "\n\n";
+
+    // --- 3. Operator overloading (+= and +) ---
+    ShoppingCart cart;
+    cart += e1;   // using operator+=
+    cart = cart + c1; // using operator+
+    cart += g1;
+    cout << cart << "\n\n";
+
+    // --- 4. Interface & polymorphism ---
+    vector<shared_ptr<Product>> products = {e1, c1, g1};
+    for (auto &p : products) {
+        cout << p->getName() << " -> Final Price: ";
+        if (auto d = dynamic_cast<IDiscount*>(p.get())) {
+            cout << d->applyDiscount(p->getBasePrice());
+        } else {
+            cout << p->getBasePrice();
+        }
+        cout << "\n";
+    }
+    cout << "\n";
+
+    // --- 5. Template Class (GenericCatalog) ---
+    GenericCatalog<Product> catalog;
+    catalog.add(e1);
+    catalog.add(c1);
+    catalog.add(g1);
+    cout << "Catalog contains " << catalog.size() << " items:\n";
+    for (auto &it : catalog.getItems()) {
+        cout << "  " << *it << "\n";
+    }
+    cout << "\n";
+
+    // --- 6. Operations (cart, order, errors) ---
+    cout << "Cart total: " << cart.total() << "\n";
+
+    // Create an order from cart
+    Order order(cart);
+    cout << "Order created:\n" << order << "\n";
+
+    order.pay();
+    cout << "After payment:\n" << order << "\n";
+
+    // Remove items from cart
+    cout << "Removing product ID=2 (Jacket) from cart...\n";
+    cart.removeProduct(2, 1);
+    cout << cart << "\n";
+
+    // Try invalid operation
+    cout << "Attempting to remove invalid product ID=999...\n";
+    cart.removeProduct(999, 1); // should handle gracefully
+    cout << "Cart still contains:\n" << cart << "\n";
+
+    // Clear cart
+    cart.clear();
+    cout << "Cart cleared. Empty? " << boolalpha << cart.empty() << "\n\n";
+
+    // --- 7. Frequently bought together ---
+    CoPurchaseIndex alsoBought(3);
+    alsoBought.record(order.getItems());
+    ShoppingCart basket;
+    basket += e1;
+    basket += g1;
+    alsoBought.record(Order(basket).getItems());
+    alsoBought.rebuild();
+    cout << "Customers who bought " << e1->getName() << " also bought:\n";
+    for (const auto &n : alsoBought.alsoBought(e1->getId(), 3)) {
+        cout << "  product #" << n.id << " (" << n.count << " orders)\n";
+    }
+    cout << "\n";
+
+    // --- 8. Order value / checkout latency quantiles ---
+    auto &quantiles = OrderQuantiles::global();
+    for (int i = 0; i < 1000; ++i) {
+        ShoppingCart c;
+        c.addProduct(i % 3 == 0 ? shared_ptr<Product>(e1) : i % 3 == 1 ? shared_ptr<Product>(c1) : shared_ptr<Product>(g1), 1 + i % 4);
+        auto start = chrono::steady_clock::now();
+        Order o(c);
+        quantiles.recordCheckoutLatency(time(nullptr), chrono::duration<double, micro>(chrono::steady_clock::now() - start).count());
+    }
+    quantiles.flushThisThread();
+    int64_t now = quantiles.windowOf(time(nullptr));
+    for (const string type : {"", "Clothing"}) {
+        auto s = quantiles.summary(OrderMetric::OrderValue, type, now - 1, now);
+        cout << "Order value" << (type.empty() ? "" : " (" + type + ")") << ": n=" << s.count
+             << " p50=" << s.p50 << " p95=" << s.p95 << " p99=" << s.p99 << "\n";
+    }
+    auto lat = quantiles.summary(OrderMetric::CheckoutLatencyMicros, "", now - 1, now);
+    cout << "Checkout latency: n=" << lat.count << " p99 under " << (lat.p99 < 1000 ? "1ms" : "1s") << "\n\n";
+
+    // --- 9. Metrics snapshot (scrape format) ---
+    cout << Metrics::snapshot() << "\n";
+
+    // --- 10. Allocation accounting ---
+    cout << AllocationTracker::report() << "\n";
+
+    // --- 11. Post-checkout pipeline on a work-stealing pool ---
+    {
+        WorkStealingPool pool(4);
+        OrderPipeline pipeline(pool);
+        atomic<int> stock{900};
+        pipeline.then("pay", [](Order& o) { o.pay(); return true; })
+                .then("reserve", [&](Order&) {
+                    if (stock.fetch_sub(1) <= 0) throw runtime_error("out of stock");
+                    return true;
+                })
+                .then("ship", [](Order& o) { o.ship(); return true; });
+        ShoppingCart oneItem;
+        oneItem += g1;
+        for (int i = 0; i < 1000; ++i) pipeline.submit(make_shared<Order>(oneItem));
+        pipeline.wait();
+        cout << "Pipeline: " << pipeline.summary() << "\n";
+    }
+
+    // --- 12. Order event bus: analytics, inventory and log consumers ---
+    {
+        OrderEventBus bus;
+        double revenue = 0;
+        size_t shippedUnits = 0, logged = 0;
+        bus.subscribe("analytics", [&](const OrderEvent* e, size_t n) {
+            for (size_t i = 0; i < n; ++i)
+                if (e[i].type == OrderEventType::Created) revenue += e[i].total;
+        });
+        bus.subscribe("inventory", [&](const OrderEvent* e, size_t n) {
+            for (size_t i = 0; i < n; ++i) shippedUnits += e[i].type == OrderEventType::Shipped;
+        });
+        bus.subscribe("log", [&](const OrderEvent*, size_t n) { logged += n; });
+        bus.start();
+        OrderEventBus::install(&bus);
+        ShoppingCart oneItem;
+        oneItem += c1;
+        for (int i = 0; i < 1000; ++i) {
+            Order o(oneItem);
+            o.pay();
+            if (i % 10) o.ship();
+            else o.cancel();
+        }
+        bus.stop();  // uninstalls, drains and joins the consumers
+        cout << "Event bus: " << bus.stats() << "\n"
+             << "  revenue " << fixed << setprecision(2) << revenue << ", shipped " << shippedUnits << ", logged " << logged << "\n";
+    }
+
+    // --- 13. Prices in other currencies ---
+    {
+        ExchangeRates rates;
+        array<double, kCurrencyCount> perUsd{};
+        perUsd[size_t(Currency::EUR)] = 0.92;
+        perUsd[size_t(Currency::GBP)] = 0.79;
+        perUsd[size_t(Currency::JPY)] = 151.37;
+        rates.publish(perUsd);
+        PriceConverter converter(rates);
+        auto imported = make_shared<Grocery>(4, "Swiss Chocolate", 4.20, "GROC-400", "2026-06-30", Currency::CHF);
+        ShoppingCart mixed;
+        mixed.addProduct(e1);
+        mixed.addProduct(c1);
+        mixed.addProduct(g1, 2);
+        for (Currency to : {Currency::EUR, Currency::JPY})
+            cout << e1->getName() << " in " << currencyInfo(to).code << ": " << converter.price(*e1, to) << "\n";
+        cout << "Cart total: " << converter.cartTotal(mixed, Currency::EUR) << " / " << converter.cartTotal(mixed, Currency::JPY) << "\n";
+        try {
+            mixed.addProduct(imported);
+        } catch (const invalid_argument& e) {
+            cout << "Cart refused: " << e.what() << "\n";
+        }
+        try {
+            converter.price(*imported, Currency::EUR);
+        } catch (const domain_error& e) {
+            cout << imported->getName() << ": " << e.what() << "\n";
+        }
+        rates.set(Currency::CHF, 0.88);
+        rates.set(Currency::EUR, 0.95);
+        cout << imported->getName() << " at rates v" << rates.version() << ": " << converter.price(*imported, Currency::EUR)
+             << ", " << e1->getName() << ": " << converter.price(*e1, Currency::EUR) << "\n"
+             << "Converter: " << converter.stats() << "\n";
+    }
+
+    // --- 14. Sales tax by region and product type ---
+    {
+        TaxRules rules;
+        RegionId de = rules.addRegion("DE", 0.19);
+        rules.setRate(de, ProductKind::Grocery, 0.07);
+        RegionId ny = rules.addRegion("US-NY", 0.08875);
+        rules.setRate(ny, ProductKind::Grocery, 0).setRate(ny, ProductKind::Clothing, 0.045);
+        TaxTable table = rules.compile();
+        Invoicer invoicer(table);
+        ShoppingCart basket;
+        basket.addProduct(e1);
+        basket.addProduct(c1);
+        basket.addProduct(g1, 3);
+        Order order(basket);
+        for (RegionId region : {de, ny}) {
+            Invoice inv = invoicer.invoice(order, region);
+            cout << "Invoice for order #" << inv.orderId << " in " << table.name(region) << ":\n";
+            for (const auto &line : inv.lines)
+                cout << "  product #" << line.productId << " x" << line.quantity << "  net " << line.net
+                     << "  tax " << line.tax << " (" << line.rate * 100 << "%)\n";
+            cout << "  net " << inv.totals.net << " + tax " << inv.totals.tax << " = " << inv.totals.gross << " "
+                 << currencyInfo(inv.currency).code << "\n";
+        }
+    }
+
+    // --- 15. Shipping quotes by zone and service ---
+    {
+        e1->setParcel({0.4f, 18, 10, 6});
+        c1->setParcel({1.2f, 40, 30, 10});
+        g1->setParcel({1.05f, 8, 8, 25});
+        ShippingRules rules;
+        ZoneId domestic = rules.addZone("domestic"), europe = rules.addZone("Europe");
+        size_t standard = rules.addService("Standard"), express = rules.addService("Express");
+        rules.setRates(standard, domestic, {{1, 4.99}, {5, 8.99}, {20, 15.99}})
+             .setRates(standard, europe, {{2, 12.50}, {10, 24.00}})
+             .setRates(express, domestic, {{1, 12.99}, {5, 19.99}});
+        ShippingTable table = rules.compile();
+        ShoppingCart parcelCart;
+        parcelCart.addProduct(e1);
+        parcelCart.addProduct(c1);
+        parcelCart.addProduct(g1, 2);
+        cout << "Shipping " << table.billableKg(parcelCart.getItems()) << " kg billable:\n";
+        for (ZoneId zone : {domestic, europe}) {
+            auto costs = table.quote(parcelCart.getItems(), zone);
+            cout << "  " << table.zone(zone) << ":";
+            for (size_t s = 0; s < costs.size(); ++s) {
+                cout << "  " << table.service(s) << " ";
+                if (costs[s] == ShippingTable::kUnavailable) cout << "n/a";
+                else cout << costs[s];
+            }
+            cout << "\n";
+        }
+    }
+
+    // --- 16. Repricing the catalog ---
+    {
+        GenericCatalog<Product> shelf;
+        for (const auto &p : {shared_ptr<Product>(e1), shared_ptr<Product>(c1), shared_ptr<Product>(g1)}) shelf.add(p);
+        ShoppingCart watched;
+        watched.addProduct(e1);
+        watched.addProduct(g1, 2);
+        cout << "Cart before repricing: " << watched.total() << "\n";
+        Order placed(watched);
+        ExchangeRates rates;
+        array<double, kCurrencyCount> perUsd{};
+        perUsd[size_t(Currency::EUR)] = 0.92;
+        rates.publish(perUsd);
+        PriceConverter converter(rates);
+        size_t notified = 0;
+        PricePublisher::subscribe("demo", [&](const PriceChange*, size_t n, uint64_t) { notified += n; });
+        unordered_map<uid64_t, double> demand = {{e1->getId(), 1.3}, {g1->getId(), 0.8}};
+        WorkStealingPool pool(2);
+        Repricer repricer(pool);
+        repricer.add(PriceRule::scale("clothing markdown", ProductKind::Clothing, 0.85))
+                .add({"demand", [&](const Product& p) { return demand.count(p.getId()) > 0; },
+                      [&](const Product& p, double price) { return min(price * demand.at(p.getId()), p.getBasePrice() * 1.2); }});
+        RepriceStats st = repricer.run(shelf);
+        cout << "Repriced " << st.changed << " of " << st.products << " products in epoch " << st.epoch << "\n";
+        for (const auto &p : shelf.getItems()) cout << "  " << *p << "\n";
+        cout << "Cart after repricing: " << watched.total() << "\n"
+             << "In EUR: cart " << converter.cartTotal(watched, Currency::EUR) << ", order placed before "
+             << converter.orderTotal(placed, Currency::EUR) << " (" << placed.total() << " USD)\n";
+        g1->setPrice(3.49);
+        cout << "Milk back to " << g1->getBasePrice() << "; " << notified << " price changes published\n";
+        // A setPrice queued on the same pool while run() holds the writer
+        // lock waits its turn instead of stalling the run.
+        GenericCatalog<Product> gifts;
+        auto gift = make_shared<Product>(90, "Gift Card", 25.0, "GIFT-90");
+        gifts.add(gift);
+        atomic<bool> started{false};
+        pool.submit([&] {
+            started = true;
+            this_thread::sleep_for(chrono::milliseconds(5));
+            gift->setPrice(30.0);
+        });
+        while (!started) this_thread::yield();
+        Repricer halfOff(pool);
+        halfOff.add({"half off", {}, [](const Product&, double price) { return price / 2; }});
+        halfOff.run(gifts);
+        pool.waitIdle();
+        cout << gift->getName() << " halved to 12.50 then set to " << gift->getBasePrice() << "\n";
+        PricePublisher::unsubscribe("demo");
+    }
+
+    // --- 17. Price history ---
+    {
+        PriceHistory history;  // records live changes from here on
+        int64_t now = int64_t(time(nullptr)), day = 86400;
+        for (int d = 30; d >= 1; --d)  // backfill a month of daily prices
+            history.record(e1->getId(), now - d * day, d > 10 ? 699.99 : d > 3 ? 649.99 : 679.99);
+        e1->setPrice(629.99);
+        e1->setPrice(699.99);
+        auto week = history.range(e1->getId(), now - 7 * day, now);
+        cout << e1->getName() << " price history, last 7 days (" << week.size() << " points):";
+        for (const auto &point : week) cout << " " << point.value;
+        cout << "\n  lowest in 30 days " << history.lowest(e1->getId(), now - 30 * day, now).value_or(0)
+             << ", price 20 days ago " << history.priceAt(e1->getId(), now - 20 * day).value_or(0) << "\n"
+             << "  " << history.stats() << "\n";
+    }
+
+    // --- 18. Similar items from product embeddings ---
+    {
+        GenericCatalog<Product> shop;
+        shop.add(e1);
+        shop.add(c1);
+        shop.add(g1);
+        shop.emplace<Electronics>(5, "Tablet", 449.00, "ELEC-500", 12);
+        shop.emplace<Electronics>(6, "Smartwatch", 199.00, "ELEC-600", 12);
+        shop.emplace<Clothing>(7, "Wool Coat", 180.00, "CLOTH-700", "M");
+        shop.emplace<Grocery>(8, "Oat Milk", 2.99, "GROC-800", "2026-03-01");
+        // dims: gadget, outerwear, dairy, premium (as if computed offline)
+        EmbeddingSet vectors(4);
+        const map<uid64_t, array<float, 4>> raw = {
+            {1, {0.9f, 0.0f, 0.0f, 0.8f}}, {2, {0.0f, 0.9f, 0.0f, 0.7f}}, {3, {0.0f, 0.0f, 0.9f, 0.1f}},
+            {5, {0.8f, 0.0f, 0.0f, 0.6f}}, {6, {0.7f, 0.1f, 0.0f, 0.5f}}, {7, {0.1f, 0.8f, 0.0f, 0.5f}},
+            {8, {0.0f, 0.0f, 0.8f, 0.2f}}};
+        for (const auto &kv : raw) vectors.add(kv.first, kv.second.data());
+        SimilarityIndex similar(vectors, shop);
+        for (const string type : {"", "Clothing"}) {
+            cout << "Similar to " << e1->getName() << (type.empty() ? "" : " (" + type + " only)") << ":";
+            for (const auto &nb : similar.similarTo(e1->getId(), 2, type)) cout << " " << shop.find(nb.id)->getName();
+            cout << "\n";
+        }
+    }
+
+    // --- 19. Catalog queries with EXPLAIN ---
+    {
+        GenericCatalog<Product> shop;
+        shop.add(e1);
+        shop.add(c1);
+        shop.add(g1);
+        shop.emplace<Clothing>(9, "Linen Shirt", 45.00, "CLOTH-900", "M", true);
+        shop.emplace<Clothing>(10, "Denim Jacket", 60.00, "CLOTH-1000", "M", true);
+        shop.emplace<Clothing>(11, "Rain Jacket", 40.00, "CLOTH-1100", "L", true);
+        shop.emplace<Electronics>(12, "Noise Cancelling Headphones", 249.00, "ELEC-1200", 24);
+        CatalogQueryEngine queries(shop);
+        for (const char* q : {"Clothing, size M, clearance, price < 50, sort by price", "name ~ jacket order by price desc limit 1"}) {
+            cout << "Query: " << q << "\n" << queries.explain(q);
+            for (const auto &p : queries.run(q)) cout << "  " << *p << "\n";
+        }
+        try {
+            queries.run("Clothing, colour = red");
+        } catch (const invalid_argument& e) {
+            cout << "Rejected: " << e.what() << "\n";
+        }
+    }
+
+#ifdef __cpp_impl_coroutine
+    // --- 20. Coroutine order workflow on one thread ---
+    {
+        EventLoop loop;
+        StubPaymentService payment(loop, chrono::milliseconds(5), 10);
+        StubShippingService shipping(loop, chrono::milliseconds(5));
+        ShoppingCart oneItem;
+        oneItem += e1;
+        vector<shared_ptr<Order>> orders;
+        for (int i = 0; i < 20000; ++i) {
+            orders.push_back(make_shared<Order>(oneItem));
+            loop.spawn(orderWorkflow(payment, shipping, orders.back()));
+        }
+        auto start = chrono::steady_clock::now();
+        loop.run();
+        auto ms = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+        size_t shipped = count_if(orders.begin(), orders.end(), [](const auto& o) { return o->statusString() == "Shipped"; });
+        cout << "Async workflow: " << shipped << " of " << orders.size() << " orders shipped"
+             << (ms < 1000 ? " in under a second" : "") << "\n";
+    }
+#endif
+
+    return 0;
+}
+#endif // ECOMMERCE_BENCH